@@ -37,9 +37,6 @@
 #include "tapdisk-server.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
-#include "hashtable.h"
-#include "hashtable_itr.h"
-#include "hashtable_utility.h"
 
 #include <errno.h>
 #include <inttypes.h>
@@ -59,7 +56,9 @@
 
 /* timeout for reads and writes in ms */
 #define HEARTBEAT_MS 1000
-#define RAMDISK_HASHSIZE 128
+
+/* size of a journal log chunk, and the largest write issued by a flush */
+#define RAMDISK_CHUNK_SIZE (1 << 20)
 
 /* connect retry timeout (seconds) */
 #define REMUS_CONNRETRY_TIMEOUT 10
@@ -98,17 +97,59 @@ td_vbd_t *device_vbd = NULL;
 td_image_t *remus_image = NULL;
 struct tap_disk tapdisk_remus;
 
+/* The ramdisk keeps the writes of an epoch in a journal: their data is
+ * appended to a log of large chunks, and indexed by a tree of extents,
+ * sorted by sector and never overlapping. A write which extends the last
+ * one, both on disk and in the log, just grows its extent, so sequential
+ * writes arrive already merged, and a write which falls within an extent
+ * overwrites it in place. Otherwise the range is cut out of the extents it
+ * overlaps, whose data becomes dead space in the log, and gets an extent
+ * of its own. The tree is a treap, balanced by random priorities.
+ */
+struct ramdisk_extent {
+	uint64_t sector;
+	uint32_t count;		/* sectors */
+	uint32_t prio;
+	char* data;		/* count * sector_size bytes */
+	struct ramdisk_extent* left;
+	struct ramdisk_extent* right;
+};
+
+struct ramdisk_chunk {
+	struct ramdisk_chunk* next;
+	size_t used;
+	char* data;		/* RAMDISK_CHUNK_SIZE bytes, page aligned */
+};
+
+/* extents are allocated in slabs, and recycled through a free list */
+#define RAMDISK_SLAB_EXTENTS 256
+struct ramdisk_slab {
+	struct ramdisk_slab* next;
+	struct ramdisk_extent extents[RAMDISK_SLAB_EXTENTS];
+};
+
+struct ramdisk_journal {
+	size_t sector_size;
+	struct ramdisk_extent* root;
+	struct ramdisk_chunk* chunks;	/* the current one first */
+	struct ramdisk_extent* free;
+	struct ramdisk_slab* slabs;
+	uint32_t seed;
+	/* the owner's, plus one per write in flight out of this log */
+	unsigned int refs;
+};
+
 struct ramdisk {
 	size_t sector_size;
-	struct hashtable* h;
-	/* when a ramdisk is flushed, h is given a new empty hash for writes
+	struct ramdisk_journal* h;
+	/* when a ramdisk is flushed, h is given a new empty journal for writes
 	 * while the old ramdisk (prev) is drained asynchronously.
 	 */
-	struct hashtable* prev;
+	struct ramdisk_journal* prev;
 	/* count of outstanding requests to the base driver */
 	size_t inflight;
-	/* prev holds the requests to be flushed, while inprogress holds
-	 * requests being flushed. When requests complete, they are removed
+	/* prev holds the extents to be flushed, while inprogress holds
+	 * the ranges being flushed. When requests complete, they are removed
 	 * from inprogress.
 	 * Whenever a new flush is merged with ongoing flush (i.e, prev),
 	 * we have to make sure that none of the new requests overlap with
@@ -117,9 +158,13 @@ struct ramdisk {
 	 * we might end up with two "overlapping" requests in the disk's queue and
 	 * the disk may not offer any guarantee on which one is written first.
 	 * IOW, make sure we dont create a write-after-write time ordering constraint.
-	 * 
+	 * inprogress has no log of its own: its extents point into prev, or
+	 * into the buffer of a merged request.
 	 */
-	struct hashtable* inprogress;
+	struct ramdisk_journal* inprogress;
+	/* a completed write could not be retired from inprogress, whose
+	 * reads now cannot be trusted: fail every checkpoint from here on */
+	int failed;
 };
 
 /* the ramdisk intercepts the original callback for reads and writes.
@@ -138,7 +183,8 @@ struct ramdisk_cbdata {
 
 struct ramdisk_write_cbdata {
 	struct tdremus_state* state;
-	char* buf;
+	char* buf;			/* merged copy, if any */
+	struct ramdisk_journal* journal;	/* which buf points into otherwise */
 };
 
 typedef void (*queue_rw_t) (td_driver_t *driver, td_request_t treq);
@@ -192,6 +238,7 @@ typedef struct tdremus_wire {
 #define TDREMUS_COMMIT "creq"
 #define TDREMUS_DONE "done"
 #define TDREMUS_FAIL "fail"
+#define TDREMUS_SENT "sent"
 
 /* primary read/write functions */
 static void primary_queue_read(td_driver_t *driver, td_request_t treq);
@@ -230,16 +277,19 @@ static inline int ring_isfull(struct req_ring* ring)
 }
 /* Prototype declarations */
 static int ramdisk_flush(td_driver_t *driver, struct tdremus_state* s);
+static void journal_put(struct ramdisk_journal* j);
+static int journal_cut(struct ramdisk_journal* j, uint64_t sector,
+		       uint64_t end);
 
 /* functions to create and sumbit treq's */
 
 static void
 replicated_write_callback(td_request_t treq, int err)
 {
-	struct tdremus_state *s = (struct tdremus_state *) treq.cb_data;
+	struct ramdisk_write_cbdata *cbdata =
+		(struct ramdisk_write_cbdata *) treq.cb_data;
+	struct tdremus_state *s = cbdata->state;
 	td_vbd_request_t *vreq;
-	int i;
-	uint64_t start;
 	vreq = (td_vbd_request_t *) treq.private;
 
 	/* the write failed for now, lets panic. this is very bad */
@@ -254,12 +304,18 @@ replicated_write_callback(td_request_t treq, int err)
 	free(vreq);
 
 	s->ramdisk.inflight--;
-	start = treq.sec;
-	for (i = 0; i < treq.secs; i++) {
-		hashtable_remove(s->ramdisk.inprogress, &start);
-		start++;
+	if (journal_cut(s->ramdisk.inprogress, treq.sec, treq.sec + treq.secs)) {
+		/* reads of the range may still be served from the buffer, so
+		 * it has to stay */
+		RPRINTF("ramdisk write completed, but could not be retired\n");
+		s->ramdisk.failed = 1;
+		free(cbdata);
+		return;
 	}
-	free(treq.buf);
+	free(cbdata->buf);
+	if (cbdata->journal)
+		journal_put(cbdata->journal);
+	free(cbdata);
 
 	if (!s->ramdisk.inflight && !s->ramdisk.prev) {
 		/* TODO: the ramdisk has been flushed */
@@ -267,7 +323,8 @@ replicated_write_callback(td_request_t treq, int err)
 }
 
 static inline int
-create_write_request(struct tdremus_state *state, td_sector_t sec, int secs, char *buf)
+create_write_request(struct ramdisk_write_cbdata *cbdata, td_sector_t sec,
+		     int secs, char *buf)
 {
 	td_request_t treq;
 	td_vbd_request_t *vreq;
@@ -278,7 +335,7 @@ create_write_request(struct tdremus_state *state, td_sector_t sec, int secs, cha
 	treq.secs    = secs;
 	treq.image   = remus_image;
 	treq.cb      = replicated_write_callback;
-	treq.cb_data = state;
+	treq.cb_data = cbdata;
 	treq.id      = 0;
 	treq.sidx    = 0;
 
@@ -302,199 +359,333 @@ create_write_request(struct tdremus_state *state, td_sector_t sec, int secs, cha
 }
 
 
-/* http://www.concentric.net/~Ttwang/tech/inthash.htm */
-static unsigned int uint64_hash(void* k)
+/* ramdisk journal */
+
+static struct ramdisk_journal* journal_create(size_t sector_size)
 {
-	uint64_t key = *(uint64_t*)k;
+	struct ramdisk_journal* j;
 
-	key = (~key) + (key << 18);
-	key = key ^ (key >> 31);
-	key = key * 21;
-	key = key ^ (key >> 11);
-	key = key + (key << 6);
-	key = key ^ (key >> 22);
+	if (!(j = calloc(1, sizeof(*j)))) {
+		DPRINTF("journal_create: allocation failed\n");
+		return NULL;
+	}
+	j->sector_size = sector_size;
+	j->seed = 2463534242U;
+	j->refs = 1;
 
-	return (unsigned int)key;
+	return j;
 }
 
-static int rd_hash_equal(void* k1, void* k2)
+static void journal_put(struct ramdisk_journal* j)
 {
-	uint64_t key1, key2;
+	struct ramdisk_chunk* chunk;
+	struct ramdisk_slab* slab;
 
-	key1 = *(uint64_t*)k1;
-	key2 = *(uint64_t*)k2;
+	if (--j->refs)
+		return;
 
-	return key1 == key2;
+	while ((chunk = j->chunks)) {
+		j->chunks = chunk->next;
+		free(chunk->data);
+		free(chunk);
+	}
+	while ((slab = j->slabs)) {
+		j->slabs = slab->next;
+		free(slab);
+	}
+	free(j);
 }
 
-static int ramdisk_read(struct ramdisk* ramdisk, uint64_t sector,
-			int nb_sectors, char* buf)
+/* xorshift32, for treap priorities */
+static uint32_t journal_prio(struct ramdisk_journal* j)
+{
+	j->seed ^= j->seed << 13;
+	j->seed ^= j->seed >> 17;
+	j->seed ^= j->seed << 5;
+
+	return j->seed;
+}
+
+static struct ramdisk_extent* extent_alloc(struct ramdisk_journal* j,
+					   uint64_t sector, uint32_t count,
+					   char* data)
 {
+	struct ramdisk_extent* e;
+	struct ramdisk_slab* slab;
 	int i;
-	char* v;
-	uint64_t key;
 
-	for (i = 0; i < nb_sectors; i++) {
-		key = sector + i;
-		/* check whether it is queued in a previous flush request */
-		if (!(ramdisk->prev && (v = hashtable_search(ramdisk->prev, &key)))) {
-			/* check whether it is an ongoing flush */
-			if (!(ramdisk->inprogress && (v = hashtable_search(ramdisk->inprogress, &key))))
-				return -1;
+	if (!j->free) {
+		if (!(slab = malloc(sizeof(*slab)))) {
+			DPRINTF("extent_alloc: allocation failed\n");
+			return NULL;
+		}
+		slab->next = j->slabs;
+		j->slabs = slab;
+		for (i = 0; i < RAMDISK_SLAB_EXTENTS; i++) {
+			slab->extents[i].right = j->free;
+			j->free = &slab->extents[i];
 		}
-		memcpy(buf + i * ramdisk->sector_size, v, ramdisk->sector_size);
 	}
 
-	return 0;
+	e = j->free;
+	j->free = e->right;
+	e->sector = sector;
+	e->count = count;
+	e->prio = journal_prio(j);
+	e->data = data;
+	e->left = e->right = NULL;
+
+	return e;
 }
 
-static int ramdisk_write_hash(struct hashtable* h, uint64_t sector, char* buf,
-			      size_t len)
+/* return a whole subtree to the free list */
+static void extent_free_tree(struct ramdisk_journal* j,
+			     struct ramdisk_extent* e)
 {
-	char* v;
-	uint64_t* key;
+	if (!e)
+		return;
 
-	if ((v = hashtable_search(h, &sector))) {
-		memcpy(v, buf, len);
-		return 0;
+	extent_free_tree(j, e->left);
+	extent_free_tree(j, e->right);
+	e->right = j->free;
+	j->free = e;
+}
+
+/* split t into the extents starting before sector (l) and the rest (r) */
+static void extent_split(struct ramdisk_extent* t, uint64_t sector,
+			 struct ramdisk_extent** l, struct ramdisk_extent** r)
+{
+	if (!t) {
+		*l = *r = NULL;
+	} else if (t->sector < sector) {
+		extent_split(t->right, sector, &t->right, r);
+		*l = t;
+	} else {
+		extent_split(t->left, sector, l, &t->left);
+		*r = t;
 	}
+}
 
-	if (!(v = malloc(len))) {
-		DPRINTF("ramdisk_write_hash: malloc failed\n");
-		return -1;
+/* join two trees, all of l lying before all of r */
+static struct ramdisk_extent* extent_join(struct ramdisk_extent* l,
+					  struct ramdisk_extent* r)
+{
+	if (!l)
+		return r;
+	if (!r)
+		return l;
+
+	if (l->prio > r->prio) {
+		l->right = extent_join(l->right, r);
+		return l;
 	}
-	memcpy(v, buf, len);
-	if (!(key = malloc(sizeof(*key)))) {
-		DPRINTF("ramdisk_write_hash: error allocating key\n");
-		free(v);
-		return -1;
+	r->left = extent_join(l, r->left);
+	return r;
+}
+
+/* the extent starting last at or before sector */
+static struct ramdisk_extent* extent_floor(struct ramdisk_extent* t,
+					   uint64_t sector)
+{
+	struct ramdisk_extent* best = NULL;
+
+	while (t) {
+		if (t->sector <= sector) {
+			best = t;
+			t = t->right;
+		} else
+			t = t->left;
 	}
-	*key = sector;
-	if (!hashtable_insert(h, key, v)) {
-		DPRINTF("ramdisk_write_hash failed on sector %" PRIu64 "\n", sector);
-		free(key);
-		free(v);
-		return -1;
+
+	return best;
+}
+
+/* the extent starting first at or after sector */
+static struct ramdisk_extent* extent_ceil(struct ramdisk_extent* t,
+					  uint64_t sector)
+{
+	struct ramdisk_extent* best = NULL;
+
+	while (t) {
+		if (t->sector >= sector) {
+			best = t;
+			t = t->left;
+		} else
+			t = t->right;
 	}
 
-	return 0;
+	return best;
 }
 
-static inline int ramdisk_write(struct ramdisk* ramdisk, uint64_t sector,
-				int nb_sectors, char* buf)
+static struct ramdisk_extent* extent_last(struct ramdisk_extent* t)
 {
-	int i, rc;
+	while (t && t->right)
+		t = t->right;
 
-	for (i = 0; i < nb_sectors; i++) {
-		rc = ramdisk_write_hash(ramdisk->h, sector + i,
-					buf + i * ramdisk->sector_size,
-					ramdisk->sector_size);
-		if (rc)
-			return rc;
+	return t;
+}
+
+/* the extent holding sector, if any */
+static struct ramdisk_extent* journal_lookup(struct ramdisk_journal* j,
+					     uint64_t sector)
+{
+	struct ramdisk_extent* e = extent_floor(j->root, sector);
+
+	return e && sector < e->sector + e->count ? e : NULL;
+}
+
+static void journal_insert(struct ramdisk_journal* j, struct ramdisk_extent* e)
+{
+	struct ramdisk_extent *l, *r;
+
+	extent_split(j->root, e->sector, &l, &r);
+	j->root = extent_join(extent_join(l, e), r);
+}
+
+/* cut [sector, end) out of the extents of j; their data stays in the log */
+static int journal_cut(struct ramdisk_journal* j, uint64_t sector,
+		       uint64_t end)
+{
+	struct ramdisk_extent *l, *m, *r, *e, *tail;
+
+	extent_split(j->root, sector, &l, &r);
+	extent_split(r, end, &m, &r);
+
+	/* an extent starting before the range may run into it, or past it */
+	e = extent_last(l);
+	if (e && e->sector + e->count > sector) {
+		if (e->sector + e->count > end) {
+			tail = extent_alloc(j, end, e->sector + e->count - end,
+					    e->data + (end - e->sector) * j->sector_size);
+			if (!tail)
+				goto fail;
+			r = extent_join(tail, r);
+		}
+		e->count = sector - e->sector;
 	}
 
+	/* the last one starting within it may run past it */
+	e = extent_last(m);
+	if (e && e->sector + e->count > end) {
+		tail = extent_alloc(j, end, e->sector + e->count - end,
+				    e->data + (end - e->sector) * j->sector_size);
+		if (!tail)
+			goto fail;
+		r = extent_join(tail, r);
+	}
+
+	extent_free_tree(j, m);
+	j->root = extent_join(l, r);
 	return 0;
+
+ fail:
+	j->root = extent_join(extent_join(l, m), r);
+	return -1;
 }
 
-static int uint64_compare(const void* k1, const void* k2)
+/* room for len bytes at the end of the log, without taking it */
+static char* journal_reserve(struct ramdisk_journal* j, size_t len)
 {
-	uint64_t u1 = *(uint64_t*)k1;
-	uint64_t u2 = *(uint64_t*)k2;
+	struct ramdisk_chunk* chunk = j->chunks;
+
+	if (chunk && chunk->used + len <= RAMDISK_CHUNK_SIZE)
+		return chunk->data + chunk->used;
 
-	/* u1 - u2 is unsigned */
-	return u1 < u2 ? -1 : u1 > u2 ? 1 : 0;
+	if (!(chunk = malloc(sizeof(*chunk)))) {
+		DPRINTF("journal_reserve: allocation failed\n");
+		return NULL;
+	}
+	if (posix_memalign((void **)&chunk->data, getpagesize(),
+			   RAMDISK_CHUNK_SIZE)) {
+		DPRINTF("journal_reserve: allocation failed\n");
+		free(chunk);
+		return NULL;
+	}
+	chunk->used = 0;
+	chunk->next = j->chunks;
+	j->chunks = chunk;
+
+	return chunk->data;
 }
 
-/* set psectors to an array of the sector numbers in the hash, returning
- * the number of entries (or -1 on error) */
-static int ramdisk_get_sectors(struct hashtable* h, uint64_t** psectors)
+static int journal_write(struct ramdisk_journal* j, uint64_t sector,
+			 uint32_t count, const char* buf)
 {
-	struct hashtable_itr* itr;
-	uint64_t* sectors;
-	int count;
-
-	if (!(count = hashtable_count(h)))
+	const size_t len = count * j->sector_size;
+	struct ramdisk_extent *e, *l, *r;
+	char* data;
+
+	/* a rewrite within one extent goes in place */
+	e = journal_lookup(j, sector);
+	if (e && sector + count <= e->sector + e->count) {
+		memcpy(e->data + (sector - e->sector) * j->sector_size, buf, len);
 		return 0;
-
-	if (!(*psectors = malloc(count * sizeof(uint64_t)))) {
-		DPRINTF("ramdisk_get_sectors: error allocating sector map\n");
-		return -1;
 	}
-	sectors = *psectors;
 
-	itr = hashtable_iterator(h);
-	count = 0;
-	do {
-		sectors[count++] = *(uint64_t*)hashtable_iterator_key(itr);
-	} while (hashtable_iterator_advance(itr));
-	free(itr);
+	if (!(data = journal_reserve(j, len)))
+		return -1;
+	if (journal_cut(j, sector, sector + count))
+		return -1;
+	memcpy(data, buf, len);
+
+	/* a write continuing the previous extent, on disk and in the log,
+	 * extends it */
+	extent_split(j->root, sector, &l, &r);
+	e = extent_last(l);
+	if (e && e->sector + e->count == sector &&
+	    e->data + e->count * j->sector_size == data)
+		e->count += count;
+	else if ((e = extent_alloc(j, sector, count, data)))
+		l = extent_join(l, e);
+	j->root = extent_join(l, r);
+	if (!e)
+		return -1;
 
-	return count;
+	j->chunks->used += len;
+	return 0;
 }
 
-/*
-  return -1 for OOM
-  return -2 for merge lookup failure
-  return -3 for WAW race
-  return 0 on success.
-*/
-static int merge_requests(struct ramdisk* ramdisk, uint64_t start,
-			size_t count, char **mergedbuf)
+/* write all extents of t into j */
+static int journal_merge(struct ramdisk_journal* j, struct ramdisk_extent* t)
 {
-	char* buf;
-	char* sector;
-	int i;
-	uint64_t *key;
-	int rc = 0;
+	if (!t)
+		return 0;
 
-	if (!(buf = valloc(count * ramdisk->sector_size))) {
-		DPRINTF("merge_request: allocation failed\n");
+	if (journal_merge(j, t->left) ||
+	    journal_write(j, t->sector, t->count, t->data) ||
+	    journal_merge(j, t->right))
 		return -1;
-	}
 
-	for (i = 0; i < count; i++) {
-		if (!(sector = hashtable_search(ramdisk->prev, &start))) {
-			DPRINTF("merge_request: lookup failed on %"PRIu64"\n", start);
-			free(buf);
-			rc = -2;
-			goto fail;
-		}
+	return 0;
+}
 
-		/* Check inprogress requests to avoid waw non-determinism */
-		if (hashtable_search(ramdisk->inprogress, &start)) {
-			DPRINTF("merge_request: WAR RACE on %"PRIu64"\n", start);
-			free(buf);
-			rc = -3;
-			goto fail;
-		}
-		/* Insert req into inprogress (brief period of duplication of hash entries until
-		 * they are removed from prev. Read tracking would not be reading wrong entries)
-		 */
-		if (!(key = malloc(sizeof(*key)))) {
-			DPRINTF("%s: error allocating key\n", __FUNCTION__);
-			free(buf);			
-			rc = -1;
-			goto fail;
-		}
-		*key = start;
-		if (!hashtable_insert(ramdisk->inprogress, key, NULL)) {
-			DPRINTF("%s failed to insert sector %" PRIu64 " into inprogress hash\n", 
-				__FUNCTION__, start);
-			free(key);
-			free(buf);
-			rc = -1;
-			goto fail;
+static int ramdisk_read(struct ramdisk* ramdisk, uint64_t sector,
+			int nb_sectors, char* buf)
+{
+	int i;
+	struct ramdisk_extent* e;
+	uint64_t key;
+
+	for (i = 0; i < nb_sectors; i++) {
+		key = sector + i;
+		/* check whether it is queued in a previous flush request */
+		if (!(ramdisk->prev && (e = journal_lookup(ramdisk->prev, key)))) {
+			/* check whether it is an ongoing flush */
+			if (!(ramdisk->inprogress && (e = journal_lookup(ramdisk->inprogress, key))))
+				return -1;
 		}
-		memcpy(buf + i * ramdisk->sector_size, sector, ramdisk->sector_size);
-		start++;
+		memcpy(buf + i * ramdisk->sector_size,
+		       e->data + (key - e->sector) * ramdisk->sector_size,
+		       ramdisk->sector_size);
 	}
 
-	*mergedbuf = buf;
 	return 0;
-fail:
-	for (start--; i >0; i--, start--)
-		hashtable_remove(ramdisk->inprogress, &start);
-	return rc;
+}
+
+static inline int ramdisk_write(struct ramdisk* ramdisk, uint64_t sector,
+				int nb_sectors, char* buf)
+{
+	return journal_write(ramdisk->h, sector, nb_sectors, buf);
 }
 
 /* The underlying driver may not handle having the whole ramdisk queued at
@@ -503,112 +694,146 @@ fail:
  * the underlying driver */
 static int ramdisk_flush(td_driver_t *driver, struct tdremus_state* s)
 {
-	uint64_t* sectors;
-	char* buf = NULL;
-	uint64_t base, batchlen;
-	int i, j, count = 0;
+	struct ramdisk* ramdisk = &s->ramdisk;
+	struct ramdisk_journal* prev = ramdisk->prev;
+	const size_t ss = ramdisk->sector_size;
+	struct ramdisk_write_cbdata* cbdata;
+	struct ramdisk_extent *e, *first, *next, *busy;
+	uint64_t base, end, pos = 0;
+	int contiguous;
+	char* buf;
 
 	// RPRINTF("ramdisk flush\n");
 
-	if ((count = ramdisk_get_sectors(s->ramdisk.prev, &sectors)) <= 0)
-		return count;
+	if (!prev)
+		return 0;
 
-	/* Create the inprogress table if empty */
-	if (!s->ramdisk.inprogress)
-		s->ramdisk.inprogress = create_hashtable(RAMDISK_HASHSIZE,
-							uint64_hash,
-							rd_hash_equal);
-	
-	/*
-	  RPRINTF("ramdisk: flushing %d sectors\n", count);
-	*/
+	/* Create the inprogress journal if empty */
+	if (!ramdisk->inprogress &&
+	    !(ramdisk->inprogress = journal_create(ss)))
+		return -1;
 
-	/* sort and merge sectors to improve disk performance */
-	qsort(sectors, count, sizeof(*sectors), uint64_compare);
-
-	for (i = 0; i < count;) {
-		base = sectors[i++];
-		while (i < count && sectors[i] == sectors[i-1] + 1)
-			i++;
-		batchlen = sectors[i-1] - base + 1;
-
-		j = merge_requests(&s->ramdisk, base, batchlen, &buf);
-			
-		if (j) {
-			RPRINTF("ramdisk_flush: merge_requests failed:%s\n",
-				j == -1? "OOM": (j==-2? "missing sector" : "WAW race"));
-			if (j == -3) continue;
-			free(sectors);
-			return -1;
+	/* the extents are sorted already: merge runs of adjacent ones into
+	 * one request each, without copying if they are adjacent in the log
+	 * as well */
+	while ((first = extent_ceil(prev->root, pos))) {
+		e = first;
+		base = e->sector;
+		end = e->sector + e->count;
+		contiguous = 1;
+		while ((next = extent_ceil(prev->root, end)) &&
+		       next->sector == end &&
+		       (end - base + next->count) * ss <= RAMDISK_CHUNK_SIZE) {
+			if (next->data != e->data + e->count * ss)
+				contiguous = 0;
+			e = next;
+			end += e->count;
 		}
+		pos = end;
 
-		/* NOTE: create_write_request() creates a treq AND forwards it down
-		 * the driver chain */
-		// RPRINTF("forwarding write request at %" PRIu64 ", length: %" PRIu64 "\n", base, batchlen);
-		create_write_request(s, base, batchlen, buf);
-		//RPRINTF("write request at %" PRIu64 ", length: %" PRIu64 " forwarded\n", base, batchlen);
+		/* Check inprogress requests to avoid waw non-determinism */
+		busy = extent_floor(ramdisk->inprogress->root, end - 1);
+		if (busy && busy->sector + busy->count > base) {
+			DPRINTF("ramdisk_flush: WAW race on %"PRIu64"\n", base);
+			continue;
+		}
 
-		s->ramdisk.inflight++;
+		if (!(cbdata = calloc(1, sizeof(*cbdata))))
+			goto oom;
+		cbdata->state = s;
+
+		if (contiguous) {
+			buf = first->data;
+			cbdata->journal = prev;
+			prev->refs++;
+		} else {
+			if (!(buf = valloc((end - base) * ss))) {
+				free(cbdata);
+				goto oom;
+			}
+			for (e = first; e && e->sector < end;
+			     e = extent_ceil(prev->root, e->sector + e->count))
+				memcpy(buf + (e->sector - base) * ss, e->data,
+				       e->count * ss);
+			cbdata->buf = buf;
+		}
 
-		for (j = 0; j < batchlen; j++) {
-			buf = hashtable_search(s->ramdisk.prev, &base);
-			free(buf);
-			hashtable_remove(s->ramdisk.prev, &base);
-			base++;
+		/* reads are served from inprogress until the write completes */
+		if (!(busy = extent_alloc(ramdisk->inprogress, base, end - base,
+					  buf))) {
+			free(cbdata->buf);
+			if (cbdata->journal)
+				journal_put(cbdata->journal);
+			free(cbdata);
+			goto oom;
+		}
+		/* a failed cut leaves prev as it was, to be flushed again */
+		if (journal_cut(prev, base, end)) {
+			extent_free_tree(ramdisk->inprogress, busy);
+			free(cbdata->buf);
+			if (cbdata->journal)
+				journal_put(cbdata->journal);
+			free(cbdata);
+			goto oom;
 		}
+		journal_insert(ramdisk->inprogress, busy);
+
+		/* NOTE: create_write_request() creates a treq AND forwards it down
+		 * the driver chain */
+		// RPRINTF("forwarding write request at %" PRIu64 ", length: %" PRIu64 "\n", base, end - base);
+		create_write_request(cbdata, base, end - base, buf);
+
+		ramdisk->inflight++;
 	}
 
-	if (!hashtable_count(s->ramdisk.prev)) {
+	if (!prev->root) {
 		/* everything is in flight */
-		hashtable_destroy(s->ramdisk.prev, 0);
-		s->ramdisk.prev = NULL;
+		ramdisk->prev = NULL;
+		journal_put(prev);
 	}
 
-	free(sectors);
-
 	// RPRINTF("ramdisk flush done\n");
 	return 0;
+
+ oom:
+	RPRINTF("ramdisk_flush: allocation failed\n");
+	return -1;
 }
 
 /* flush ramdisk contents to disk */
 static int ramdisk_start_flush(td_driver_t *driver)
 {
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
-	uint64_t* key;
-	char* buf;
-	int rc = 0;
-	int i, j, count, batchlen;
-	uint64_t* sectors;
+	struct ramdisk_journal* h;
+
+	if (s->ramdisk.failed)
+		return -1;
 
-	if (!hashtable_count(s->ramdisk.h)) {
+	if (!s->ramdisk.h->root) {
 		/*
 		  RPRINTF("Nothing to flush\n");
 		*/
 		return 0;
 	}
 
+	/* We create a new journal so that new writes can be performed before
+	 * the old one is completely drained. */
+	if (!(h = journal_create(s->ramdisk.sector_size)))
+		return -1;
+
 	if (s->ramdisk.prev) {
 		/* a flush request issued while a previous flush is still in progress
 		 * will merge with the previous request. If you want the previous
 		 * request to be consistent, wait for it to complete. */
-		if ((count = ramdisk_get_sectors(s->ramdisk.h, &sectors)) < 0)
-			return count;
-
-		for (i = 0; i < count; i++) {
-			buf = hashtable_search(s->ramdisk.h, sectors + i);
-			ramdisk_write_hash(s->ramdisk.prev, sectors[i], buf,
-					   s->ramdisk.sector_size);
+		if (journal_merge(s->ramdisk.prev, s->ramdisk.h->root) < 0) {
+			journal_put(h);
+			return -1;
 		}
-		free(sectors);
-
-		hashtable_destroy (s->ramdisk.h, 0);
+		journal_put(s->ramdisk.h);
 	} else
 		s->ramdisk.prev = s->ramdisk.h;
 
-	/* We create a new hashtable so that new writes can be performed before
-	 * the old hashtable is completely drained. */
-	s->ramdisk.h = create_hashtable(RAMDISK_HASHSIZE, uint64_hash,
-					rd_hash_equal);
+	s->ramdisk.h = h;
 
 	return ramdisk_flush(driver, s);
 }
@@ -624,8 +849,8 @@ static int ramdisk_start(td_driver_t *driver)
 	}
 
 	s->ramdisk.sector_size = driver->info.sector_size;
-	s->ramdisk.h = create_hashtable(RAMDISK_HASHSIZE, uint64_hash,
-					rd_hash_equal);
+	if (!(s->ramdisk.h = journal_create(s->ramdisk.sector_size)))
+		return -1;
 
 	DPRINTF("Ramdisk started, %zu bytes/sector\n", s->ramdisk.sector_size);
 
@@ -899,6 +1124,21 @@ static int client_flush(td_driver_t *driver)
 	return 0;
 }
 
+/* close the current epoch on the backup without waiting for it to commit */
+static int client_epoch(td_driver_t *driver)
+{
+	struct tdremus_state *s = (struct tdremus_state *)driver->data;
+
+	/* the backup must see a marker for every epoch, even an idle one */
+	if (s->stream_fd.fd == -1 && primary_blocking_connect(s))
+		return -1;
+
+	if (s->stream_fd.fd < 0)
+		return -1;
+
+	return client_flush(driver);
+}
+
 static int server_flush(td_driver_t *driver)
 {
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
@@ -1254,7 +1494,12 @@ static int server_do_creq(td_driver_t *driver)
 
 	// RPRINTF("committing buffer\n");
 
-	ramdisk_start_flush(driver);
+	/* without a DONE the primary fails the checkpoint */
+	if (ramdisk_start_flush(driver) < 0) {
+		RPRINTF("error committing buffer\n");
+		close_stream_fd(s);
+		return -1;
+	}
 
 	/* XXX this message should not be sent until flush completes! */
 	if (write(s->stream_fd.fd, TDREMUS_DONE, strlen(TDREMUS_DONE)) != 4)
@@ -1513,6 +1758,17 @@ static void ctl_request(event_id_t id, char mode, void *private)
 				RPRINTF("error passing flush request to backup");
 				ctl_respond(s, TDREMUS_FAIL);
 			}
+	} else if (!strncmp(msg, "epoch", 5)) {
+		/*
+		 * Remus without DRBD: the backup commits the epoch along with
+		 * the memory checkpoint, so the caller only needs to know that
+		 * the marker is on its way.
+		 */
+		if (s->mode != mode_primary || client_epoch(driver)) {
+			RPRINTF("error closing epoch on backup\n");
+			ctl_respond(s, TDREMUS_FAIL);
+		} else
+			ctl_respond(s, TDREMUS_SENT);
 	} else {
 		RPRINTF("unknown command: %s\n", msg);
 	}
@@ -1689,7 +1945,7 @@ static int tdremus_close(td_driver_t *driver)
 
 	RPRINTF("closing\n");
 	if (s->ramdisk.inprogress)
-		hashtable_destroy(s->ramdisk.inprogress, 0);
+		journal_put(s->ramdisk.inprogress);
 	
 	if (s->driver_data) {
 		free(s->driver_data);
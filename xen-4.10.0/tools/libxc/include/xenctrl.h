@@ -1009,6 +1009,10 @@ int xc_sched_fp_domain_get(xc_interface *xch,
                                uint32_t domid,
                                struct xen_domctl_sched_fp *sdom);
 
+int xc_sched_fp_domain_boost(xc_interface *xch,
+                             uint32_t domid,
+                             uint32_t us);
+
 int xc_sched_fp_schedule_set(xc_interface *xch, uint32_t poolid,
 				struct xen_sysctl_fp_schedule *schedule);
 
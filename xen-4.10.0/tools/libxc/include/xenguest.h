@@ -96,7 +96,10 @@ struct save_callbacks {
      * returns:
      * 0: terminate checkpointing gracefully
      * 1: take another checkpoint
+     * 2: (Remus only) send the pages dirtied so far while the guest keeps
+     *    running, then call precopy_done
      */
+#define XGS_CHECKPOINT_PRECOPY 2
     int (*checkpoint)(void* data);
 
     /*
@@ -108,6 +111,21 @@ struct save_callbacks {
      */
     int (*wait_checkpoint)(void* data);
 
+    /*
+     * Optional.  Called once a checkpoint's memory has been sent, with the
+     * number of pages in it, the bytes written to the stream since the last
+     * call, and the time in microseconds which fetching the dirty bitmap and
+     * sending the pages took while the guest was suspended.
+     */
+    void (*checkpoint_stats)(uint32_t pages, uint64_t bytes,
+                             uint32_t bitmap_us, uint32_t send_us, void *data);
+
+    /*
+     * Remus only, needed if checkpoint may return XGS_CHECKPOINT_PRECOPY.
+     * Called after a background pre-copy pass, and returns like checkpoint.
+     */
+    int (*precopy_done)(void* data);
+
     /* Enable qemu-dm logging dirty pages to xen */
     int (*switch_qemu_logdirty)(uint32_t domid, unsigned enable, void *data); /* HVM only */
 
@@ -129,12 +147,20 @@ typedef enum {
  * @parm dom the id of the domain
  * @param stream_type XC_MIG_STREAM_NONE if the far end of the stream
  *        doesn't use checkpointing
+ * @param skip_pfn Remus only: PFN of the guest's struct cpsremus_skip
+ *        page, or INVALID_MFN to replicate all memory
+ * @param stripe_fds Remus only: further connections to the restorer, over
+ *        which the memory of every checkpoint after the first is spread
+ *        by PFN range; the restorer must be given the same number
+ * @param nr_stripe_fds number of stripe_fds, 0 for none
  * @return 0 on success, -1 on failure
  */
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
                    uint32_t flags /* XCFLAGS_xxx */,
                    struct save_callbacks* callbacks, int hvm,
-                   xc_migration_stream_t stream_type, int recv_fd);
+                   xc_migration_stream_t stream_type, int recv_fd,
+                   xen_pfn_t skip_pfn, const int *stripe_fds,
+                   unsigned int nr_stripe_fds);
 
 /* callbacks provided by xc_domain_restore */
 struct restore_callbacks {
@@ -172,6 +198,22 @@ struct restore_callbacks {
     void (*restore_results)(xen_pfn_t store_gfn, xen_pfn_t console_gfn,
                             void *data);
 
+    /*
+     * Remus only, optional.  Called on failover when the last 'available'
+     * checkpoints in the history (see xc_domain_restore) may be undone.
+     * Returns how many to undo, 0 to fail over to the last checkpoint as
+     * usual, or negative on error.
+     */
+    int (*rollback)(uint32_t available, void *data);
+
+    /*
+     * Remus only, optional.  Called, in order, once each checkpoint which
+     * the checkpoint callback accepted has been applied to the domain, so
+     * that it is only acknowledged to the primary then.  May be called from
+     * another thread than the other callbacks, but never at the same time.
+     */
+    void (*checkpoint_applied)(void *data);
+
     /* to be provided as the last argument to each callback function */
     void* data;
 };
@@ -191,6 +233,15 @@ struct restore_callbacks {
  * @parm stream_type non-zero if the far end of the stream is using checkpointing
  * @parm callbacks non-NULL to receive a callback to restore toolstack
  *       specific data
+ * @parm liveness_timeout_ms with Remus, fail over to the last checkpoint
+ *       once nothing has been received for this long; 0 to wait forever
+ * @parm stripe_fds with Remus, the restore ends of the saver's stripe_fds,
+ *       in any order; each is read by a thread of its own
+ * @parm nr_stripe_fds number of stripe_fds, 0 for none
+ * @parm history_epochs with Remus, keep undo logs of up to this many
+ *       checkpoints, for failover to go back to (see callbacks->rollback);
+ *       0 for none
+ * @parm history_mb the most memory those may take, in MiB; 0 for no limit
  * @return 0 on success, -1 on failure
  */
 int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
@@ -199,7 +250,56 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned long *console_mfn, uint32_t console_domid,
                       unsigned int hvm, unsigned int pae,
                       xc_migration_stream_t stream_type,
-                      struct restore_callbacks *callbacks, int send_back_fd);
+                      struct restore_callbacks *callbacks, int send_back_fd,
+                      unsigned int liveness_timeout_ms,
+                      const int *stripe_fds, unsigned int nr_stripe_fds,
+                      unsigned int history_epochs, unsigned int history_mb);
+
+/**
+ * Format a liveness record for a checkpointed migration stream.
+ *
+ * While a Remus stream is idle between checkpoints, i.e. once the
+ * checkpoint callback has written all its own data, the sender may write
+ * such records to the stream at any time.  The restorer ignores them, but
+ * they keep its liveness timeout from expiring.
+ *
+ * @parm buf buffer of at least XC_STREAM_LIVENESS_RECORD_SIZE bytes
+ * @parm len size of buf
+ * @return the number of bytes to write, or -1 on failure
+ */
+#define XC_STREAM_LIVENESS_RECORD_SIZE 16
+int xc_stream_liveness_record(void *buf, size_t len);
+
+/**
+ * Encode a blob of state as its changes since the previous checkpoint.
+ *
+ * Checkpointed streams carry some state, such as the HVM context and the
+ * device model's, in full at every checkpoint although little of it changes
+ * from one to the next.  The delta lists the runs of 8-byte words which
+ * differ, each as an offset and length followed by the new bytes, padded to
+ * 8 bytes (see docs/specs/libxc-migration-stream.pandoc).
+ *
+ * @parm prev the blob as of the previous checkpoint
+ * @parm cur the blob now, of the same size
+ * @parm size size of both blobs
+ * @parm delta buffer for the delta
+ * @parm max_len size of delta; a delta which would not fit is abandoned
+ * @return the length of the delta, or -1 (errno E2BIG) if over max_len
+ */
+int xc_stream_delta_encode(const void *prev, const void *cur, uint32_t size,
+                           void *delta, uint32_t max_len);
+
+/**
+ * Apply a delta from xc_stream_delta_encode() to the previous blob.
+ *
+ * @parm buf the blob as of the previous checkpoint, updated in place
+ * @parm size size of buf
+ * @parm delta the delta
+ * @parm len length of the delta
+ * @return 0 on success, or -1 (errno EINVAL) if the delta is malformed
+ */
+int xc_stream_delta_apply(void *buf, uint32_t size, const void *delta,
+                          uint32_t len);
 
 /**
  * This function will create a domain for a paravirtualized Linux
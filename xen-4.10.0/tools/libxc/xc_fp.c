@@ -40,6 +40,35 @@ xc_sched_fp_domain_set(
     return do_domctl(xch, &domctl);
 }
 
+/*
+ * Let the domain's vcpus use their whole period rather than their slice for
+ * the next us microseconds, or end that early with
+ * XEN_DOMCTL_SCHEDFP_BOOST_END.
+ */
+int
+xc_sched_fp_domain_boost(
+    xc_interface *xch,
+    uint32_t domid,
+    uint32_t us)
+{
+    DECLARE_DOMCTL;
+
+    if ( !us )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    domctl.cmd = XEN_DOMCTL_scheduler_op;
+    domctl.domain = (domid_t) domid;
+    domctl.u.scheduler_op.sched_id = XEN_SCHEDULER_FP;
+    domctl.u.scheduler_op.cmd = XEN_DOMCTL_SCHEDOP_putinfo;
+    memset(&domctl.u.scheduler_op.u.fp, 0, sizeof(domctl.u.scheduler_op.u.fp));
+    domctl.u.scheduler_op.u.fp.boost = us;
+
+    return do_domctl(xch, &domctl);
+}
+
 int
 xc_sched_fp_domain_get(
     xc_interface *xch,
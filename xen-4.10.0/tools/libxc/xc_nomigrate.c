@@ -22,7 +22,9 @@
 
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t flags,
                    struct save_callbacks* callbacks, int hvm,
-                   xc_migration_stream_t stream_type, int recv_fd)
+                   xc_migration_stream_t stream_type, int recv_fd,
+                   xen_pfn_t skip_pfn, const int *stripe_fds,
+                   unsigned int nr_stripe_fds)
 {
     errno = ENOSYS;
     return -1;
@@ -34,7 +36,30 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned long *console_mfn, uint32_t console_domid,
                       unsigned int hvm, unsigned int pae,
                       xc_migration_stream_t stream_type,
-                      struct restore_callbacks *callbacks, int send_back_fd)
+                      struct restore_callbacks *callbacks, int send_back_fd,
+                      unsigned int liveness_timeout_ms,
+                      const int *stripe_fds, unsigned int nr_stripe_fds,
+                      unsigned int history_epochs, unsigned int history_mb)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int xc_stream_liveness_record(void *buf, size_t len)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int xc_stream_delta_encode(const void *prev, const void *cur, uint32_t size,
+                           void *delta, uint32_t max_len)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int xc_stream_delta_apply(void *buf, uint32_t size, const void *delta,
+                          uint32_t len)
 {
     errno = ENOSYS;
     return -1;
@@ -1,8 +1,11 @@
 #include <assert.h>
+#include <poll.h>
+#include <time.h>
 
 #include "xc_sr_common.h"
 
 #include <xen-tools/libs.h>
+#include <xen/io/cpsremus.h>
 
 static const char *dhdr_types[] =
 {
@@ -38,6 +41,8 @@ static const char *mandatory_rec_types[] =
     [REC_TYPE_VERIFY]                       = "Verify",
     [REC_TYPE_CHECKPOINT]                   = "Checkpoint",
     [REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST]    = "Checkpoint dirty pfn list",
+    [REC_TYPE_CHECKPOINT_SKIP_PFNS]         = "Checkpoint skip pfns",
+    [REC_TYPE_HVM_CONTEXT_DELTA]            = "HVM context delta",
 };
 
 const char *rec_type_to_str(uint32_t type)
@@ -48,6 +53,8 @@ const char *rec_type_to_str(uint32_t type)
              (mandatory_rec_types[type]) )
             return mandatory_rec_types[type];
     }
+    else if ( type == REC_TYPE_LIVENESS )
+        return "Liveness";
 
     return "Reserved";
 }
@@ -84,6 +91,8 @@ int write_split_record(struct xc_sr_context *ctx, struct xc_sr_record *rec,
     if ( writev_exact(ctx->fd, parts, ARRAY_SIZE(parts)) )
         goto err;
 
+    ctx->save.stream_bytes += sizeof(rec->type) + sizeof(combined_length) +
+        record_length;
     return 0;
 
  err:
@@ -91,13 +100,56 @@ int write_split_record(struct xc_sr_context *ctx, struct xc_sr_record *rec,
     return -1;
 }
 
-int read_record(struct xc_sr_context *ctx, int fd, struct xc_sr_record *rec)
+/*
+ * As read_exact(), but fail with ETIMEDOUT if the stream stays silent for
+ * timeout_ms at any point.  A timeout of 0 waits forever.
+ */
+static int read_exact_timeout(xc_interface *xch, int fd, void *data,
+                              size_t size, unsigned int timeout_ms)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    size_t offset = 0;
+    ssize_t len;
+    int r;
+
+    if ( !timeout_ms )
+        return read_exact(fd, data, size);
+
+    while ( offset < size )
+    {
+        r = poll(&pfd, 1, timeout_ms);
+        if ( r < 0 && errno == EINTR )
+            continue;
+        if ( r < 0 )
+            return -1;
+        if ( r == 0 )
+        {
+            ERROR("Nothing received from the stream for %u ms", timeout_ms);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        len = read(fd, data + offset, size - offset);
+        if ( len == -1 && errno == EINTR )
+            continue;
+        if ( len == 0 )
+            errno = 0;
+        if ( len <= 0 )
+            return -1;
+        offset += len;
+    }
+
+    return 0;
+}
+
+int read_record_timeout(struct xc_sr_context *ctx, int fd,
+                        struct xc_sr_record *rec, unsigned int timeout_ms)
 {
     xc_interface *xch = ctx->xch;
     struct xc_sr_rhdr rhdr;
     size_t datasz;
 
-    if ( read_exact(fd, &rhdr, sizeof(rhdr)) )
+    if ( read_exact_timeout(xch, fd, &rhdr, sizeof(rhdr), timeout_ms) )
     {
         PERROR("Failed to read Record Header from stream");
         return -1;
@@ -122,7 +174,7 @@ int read_record(struct xc_sr_context *ctx, int fd, struct xc_sr_record *rec)
             return -1;
         }
 
-        if ( read_exact(fd, rec->data, datasz) )
+        if ( read_exact_timeout(xch, fd, rec->data, datasz, timeout_ms) )
         {
             free(rec->data);
             rec->data = NULL;
@@ -140,6 +192,237 @@ int read_record(struct xc_sr_context *ctx, int fd, struct xc_sr_record *rec)
     return 0;
 };
 
+int check_skip_ranges(struct xc_sr_context *ctx,
+                      const struct xc_sr_rec_checkpoint_skip_pfns *skip,
+                      xen_pfn_t limit)
+{
+    xc_interface *xch = ctx->xch;
+    const struct xc_sr_rec_skip_pfns_range *a, *b;
+    unsigned int i, j;
+
+    if ( skip->count > CPSREMUS_SKIP_MAX_RANGES )
+    {
+        ERROR("Skip list has %u ranges, at most %u allowed",
+              skip->count, CPSREMUS_SKIP_MAX_RANGES);
+        return -1;
+    }
+
+    for ( i = 0; i < skip->count; ++i )
+    {
+        a = &skip->range[i];
+        if ( a->pfn >= limit || a->count > limit - a->pfn )
+        {
+            ERROR("Skip range %#"PRIx64"+%#"PRIx64" beyond pfn %#"PRIpfn,
+                  a->pfn, a->count, limit);
+            return -1;
+        }
+
+        /* At most 255 ranges, so pairwise is cheap enough. */
+        for ( j = 0; j < i; ++j )
+        {
+            b = &skip->range[j];
+            if ( a->pfn < b->pfn + b->count && b->pfn < a->pfn + a->count )
+            {
+                ERROR("Skip ranges %#"PRIx64"+%#"PRIx64" and %#"PRIx64
+                      "+%#"PRIx64" overlap",
+                      b->pfn, b->count, a->pfn, a->count);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int xc_stream_liveness_record(void *buf, size_t len)
+{
+    struct {
+        struct xc_sr_rhdr rhdr;
+        struct xc_sr_rec_liveness liveness;
+    } rec;
+    struct timespec ts;
+
+    BUILD_BUG_ON(sizeof(rec) != XC_STREAM_LIVENESS_RECORD_SIZE);
+    BUILD_BUG_ON(sizeof(rec.liveness) % (1U << REC_ALIGN_ORDER));
+
+    if ( len < sizeof(rec) )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    rec.rhdr.type = REC_TYPE_LIVENESS;
+    rec.rhdr.length = sizeof(rec.liveness);
+    rec.liveness.timestamp = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    memcpy(buf, &rec, sizeof(rec));
+
+    return sizeof(rec);
+}
+
+/*
+ * Deltas compare 8-byte words.  A single unchanged word between two changed
+ * ones costs no more to send than the header of a new run, so runs carry on
+ * over it.
+ */
+#define DELTA_WORD (1U << REC_ALIGN_ORDER)
+
+static bool delta_word_differs(const uint8_t *a, const uint8_t *b,
+                               uint32_t off, uint32_t size)
+{
+    if ( off >= size )
+        return false;
+
+    return memcmp(a + off, b + off, min_t(uint32_t, DELTA_WORD, size - off));
+}
+
+int xc_stream_delta_encode(const void *prev, const void *cur, uint32_t size,
+                           void *delta, uint32_t max_len)
+{
+    const uint8_t *p = prev, *c = cur;
+    uint8_t *out = delta;
+    struct xc_sr_delta_run run;
+    uint32_t off, end, datasz, len = 0;
+
+    for ( off = 0; off < size; off = end )
+    {
+        end = off + DELTA_WORD;
+        if ( !delta_word_differs(p, c, off, size) )
+            continue;
+
+        while ( delta_word_differs(p, c, end, size) ||
+                delta_word_differs(p, c, end + DELTA_WORD, size) )
+            end += DELTA_WORD;
+        end = min(end, size);
+
+        run.offset = off;
+        run.length = end - off;
+        datasz = ROUNDUP(run.length, REC_ALIGN_ORDER);
+
+        if ( (uint64_t)len + sizeof(run) + datasz > max_len )
+        {
+            errno = E2BIG;
+            return -1;
+        }
+
+        memcpy(out + len, &run, sizeof(run));
+        len += sizeof(run);
+        memcpy(out + len, c + off, run.length);
+        memset(out + len + run.length, 0, datasz - run.length);
+        len += datasz;
+    }
+
+    return len;
+}
+
+int xc_stream_delta_apply(void *buf, uint32_t size, const void *delta,
+                          uint32_t len)
+{
+    const uint8_t *in = delta;
+    struct xc_sr_delta_run run;
+    uint32_t pos = 0;
+
+    while ( pos < len )
+    {
+        if ( len - pos < sizeof(run) )
+            goto bad;
+
+        memcpy(&run, in + pos, sizeof(run));
+        pos += sizeof(run);
+
+        if ( run.offset > size || run.length > size - run.offset ||
+             ROUNDUP(run.length, REC_ALIGN_ORDER) > len - pos )
+            goto bad;
+
+        memcpy((uint8_t *)buf + run.offset, in + pos, run.length);
+        pos += ROUNDUP(run.length, REC_ALIGN_ORDER);
+    }
+
+    return 0;
+
+ bad:
+    errno = EINVAL;
+    return -1;
+}
+
+struct xc_sr_arena_chunk
+{
+    struct xc_sr_arena_chunk *next;
+    size_t size, used;
+    uint8_t *data;
+};
+
+void *arena_alloc(struct xc_sr_arena *arena, size_t size)
+{
+    struct xc_sr_arena_chunk *c = arena->cur;
+    void *ptr;
+
+    /* Move along the existing chunks (kept from earlier use) first. */
+    while ( c && (c->size - c->used) < size )
+    {
+        c = c->next;
+        if ( c )
+            arena->cur = c;
+    }
+
+    if ( !c )
+    {
+        size_t chunk_size = max(arena->chunk_size, size);
+
+        c = malloc(sizeof(*c));
+        if ( !c )
+            return NULL;
+
+        if ( posix_memalign((void **)&c->data, PAGE_SIZE, chunk_size) )
+        {
+            free(c);
+            return NULL;
+        }
+
+        c->size = chunk_size;
+        c->used = 0;
+        c->next = NULL;
+
+        if ( arena->cur )
+            arena->cur->next = c;
+        else
+            arena->head = c;
+        arena->cur = c;
+        arena->allocated += chunk_size;
+    }
+
+    ptr = c->data + c->used;
+    c->used += size;
+
+    return ptr;
+}
+
+void arena_reset(struct xc_sr_arena *arena)
+{
+    struct xc_sr_arena_chunk *c;
+
+    for ( c = arena->head; c; c = c->next )
+        c->used = 0;
+
+    arena->cur = arena->head;
+}
+
+void arena_destroy(struct xc_sr_arena *arena)
+{
+    struct xc_sr_arena_chunk *c, *next;
+
+    for ( c = arena->head; c; c = next )
+    {
+        next = c->next;
+        free(c->data);
+        free(c);
+    }
+
+    arena->head = arena->cur = NULL;
+    arena->allocated = 0;
+}
+
 static void __attribute__((unused)) build_assertions(void)
 {
     BUILD_BUG_ON(sizeof(struct xc_sr_ihdr) != 24);
@@ -153,6 +436,8 @@ static void __attribute__((unused)) build_assertions(void)
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_tsc_info)          != 24);
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_hvm_params_entry)  != 16);
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_hvm_params)        != 8);
+    BUILD_BUG_ON(sizeof(struct xc_sr_rec_skip_pfns_range)   != 16);
+    BUILD_BUG_ON(sizeof(struct xc_sr_rec_checkpoint_skip_pfns) != 16);
 }
 
 /*
@@ -2,6 +2,8 @@
 #define __COMMON__H
 
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "xg_private.h"
 #include "xg_save_restore.h"
@@ -120,6 +122,9 @@ struct xc_sr_restore_ops
     void (*set_page_type)(struct xc_sr_context *ctx, xen_pfn_t pfn,
                           xen_pfn_t type);
 
+    /* Get the type of a PFN, as last set. */
+    uint32_t (*get_page_type)(const struct xc_sr_context *ctx, xen_pfn_t pfn);
+
     /**
      * Optionally transform the contents of a page from being generic in the
      * stream, to being specific to the restoring environment.
@@ -152,6 +157,14 @@ struct xc_sr_restore_ops
 #define BROKEN_CHANNEL 2
     int (*process_record)(struct xc_sr_context *ctx, struct xc_sr_record *rec);
 
+    /**
+     * Called by the applier after each committed checkpoint of a pipelined
+     * (Remus) stream has been applied.  Bring forward whatever work from
+     * stream_complete() can safely be done while further checkpoints may
+     * still arrive, so that a failover only has to finish the remainder.
+     */
+    int (*checkpoint_applied)(struct xc_sr_context *ctx);
+
     /**
      * Perform any actions required after the stream has been finished. Called
      * after the END record has been received.
@@ -165,6 +178,186 @@ struct xc_sr_restore_ops
     int (*cleanup)(struct xc_sr_context *ctx);
 };
 
+/*
+ * Bump-pointer arena.  Memory is handed out from a list of large chunks and
+ * released all at once by arena_reset().  Chunks are retained across resets,
+ * so repeated fill/reset cycles (e.g. one Remus epoch after another) do not
+ * hit the allocator once the arena has grown to its working size.
+ */
+struct xc_sr_arena_chunk;
+struct xc_sr_arena
+{
+    struct xc_sr_arena_chunk *head, *cur;
+    /* Minimum size of each chunk.  Must be set before first use. */
+    size_t chunk_size;
+    /* Total bytes of chunk memory held. */
+    size_t allocated;
+};
+
+/* Returns NULL on allocation failure. */
+void *arena_alloc(struct xc_sr_arena *arena, size_t size);
+void arena_reset(struct xc_sr_arena *arena);
+void arena_destroy(struct xc_sr_arena *arena);
+
+/* A page received during a checkpoint, pending application to the guest. */
+struct xc_sr_staged_page
+{
+    xen_pfn_t pfn;
+    uint32_t type;
+    /* Page contents in the staging arena, or NULL if the type has none. */
+    void *data;
+};
+
+/*
+ * Records and pages received during one Remus/COLO epoch, held back until
+ * the epoch is committed by a CHECKPOINT record.
+ *
+ * PAGE_DATA records are not buffered whole.  Their pages are staged in a
+ * PFN-indexed table which keeps only the newest copy of each page, with the
+ * contents held in an arena which is reset once the epoch has been applied.
+ * The staged pages are applied in place of the first PAGE_DATA record of the
+ * epoch (staged_rec_pos).
+ */
+struct xc_sr_restore_epoch
+{
+    struct xc_sr_record *buffered_records;
+    unsigned allocated_rec_num;
+    unsigned buffered_rec_num;
+
+    struct xc_sr_staged_page *staged_pages;
+    unsigned nr_staged_pages, allocated_staged_pages;
+    unsigned staged_rec_pos;
+    /* Index into staged_pages plus one, or 0 if pfn not staged. */
+    unsigned *staged_index;
+    xen_pfn_t max_staged_pfn;
+    struct xc_sr_arena page_arena;
+    /* Pages received in this epoch, including duplicates. */
+    unsigned long nr_received_pages;
+};
+
+/*
+ * Remus: a connection carrying page data besides the main stream, see
+ * xc_domain_restore().  Its reader thread stages the pages of each epoch
+ * in the stripe's own epoch buffers, in step with the main stream's.
+ */
+struct xc_sr_restore_stripe
+{
+    struct xc_sr_context *ctx;
+    int fd;
+    pthread_t reader;
+    bool running;
+
+    struct xc_sr_restore_epoch epochs[2];
+    struct xc_sr_restore_epoch *recv_epoch;
+
+    /* Epochs received completely, and whether the reader has stopped. */
+    uint64_t completed;
+    bool failed;
+};
+
+/*
+ * Remus: one epoch of the checkpoint history.  pages is an undo log of
+ * everything applying the epoch wrote to the guest: each page's type and
+ * contents as they were before, in the order written.  records are copies
+ * of the state records (vcpus, HVM context and params, TSC, skip list) the
+ * epoch carried.  Going back from the state after epoch N to the state
+ * after N - 1 means writing N's pages back in reverse order and processing
+ * N - 1's records again.
+ */
+struct xc_sr_history_page
+{
+    xen_pfn_t pfn;
+    uint32_t type;
+    /* Whether the epoch wrote the contents, or only set the type. */
+    bool written;
+    /* Old contents in the entry's arena, or NULL for a page of zeroes. */
+    void *data;
+};
+
+struct xc_sr_history_entry
+{
+    struct xc_sr_history_page *pages;
+    unsigned nr_pages, allocated_pages;
+    struct xc_sr_arena page_arena;
+
+    struct xc_sr_record *records;
+    unsigned nr_records, allocated_records;
+    size_t record_bytes;
+};
+
+/*
+ * Remus: a ring of the last max_epochs + 1 epochs applied, oldest first
+ * from head.  The oldest only serves for its records, so at most nr - 1
+ * epochs can be undone.  Epochs are dropped from the old end as well while
+ * the ring holds more than max_bytes.  open is the epoch being applied, if
+ * any; pages are only logged for it when log_pages is set, as the first
+ * epoch (the whole initial image) is never undone.
+ *
+ * Only the thread applying checkpoints uses the history, and it is handed
+ * over with the epochs themselves.
+ */
+struct xc_sr_history
+{
+    unsigned int max_epochs;
+    size_t max_bytes;
+    struct xc_sr_history_entry *ring;
+    unsigned int head, nr;
+    struct xc_sr_history_entry *open;
+    bool log_pages;
+};
+
+/*
+ * Zero-copy send (Linux MSG_ZEROCOPY) of page data from the mappings of the
+ * guest.  The kernel reads the pages when it transmits them, so a batch's
+ * mappings are only released once the kernel has reported that it is done
+ * with them, and no more than XC_SR_ZC_MAX_PENDING batches are held.
+ */
+#define XC_SR_ZC_MAX_PENDING 64
+
+struct xc_sr_zc_fd
+{
+    int fd;
+    bool enabled;
+    /* Zero-copy sends made on fd, and how many the kernel has completed. */
+    uint32_t issued, completed;
+};
+
+struct xc_sr_zc_batch
+{
+    struct xc_sr_zc_fd *zc;
+    /* Released once zc->completed has reached seq. */
+    uint32_t seq;
+    void *mapping;
+    unsigned int nr_mapped;
+    void **local_pages;
+    unsigned int nr_local;
+};
+
+/*
+ * Remus: guest memory kept mapped on the restore side for the whole stream,
+ * in chunks of RESTORE_MAP_CHUNK_PAGES pfns, so that applying a checkpoint
+ * is a copy into existing mappings.
+ */
+#define RESTORE_MAP_CHUNK_ORDER 9
+#define RESTORE_MAP_CHUNK_PAGES (1U << RESTORE_MAP_CHUNK_ORDER)
+
+struct xc_sr_restore_map_chunk
+{
+    /* NULL if the chunk is not mapped. */
+    void *mapping;
+    /* Pages of the chunk which were not populated when it was mapped. */
+    unsigned long missing[RESTORE_MAP_CHUNK_PAGES / (sizeof(unsigned long) * 8)];
+};
+
+struct xc_sr_restore_map
+{
+    bool enabled;
+    struct xc_sr_restore_map_chunk *chunks;
+    unsigned long nr_chunks;
+    /* Chunks mapped, and mapped again for pages populated since. */
+    unsigned long maps, remaps;
+};
+
 /* x86 PV per-vcpu storage structure for blobs heading Xen-wards. */
 struct xc_sr_x86_pv_restore_vcpu
 {
@@ -207,6 +400,49 @@ struct xc_sr_context
             unsigned long *deferred_pages;
             unsigned long nr_deferred_pages;
             xc_hypercall_buffer_t dirty_bitmap_hbuf;
+
+            /*
+             * Pages sent for the last checkpoint, including background
+             * pre-copy, and how long fetching the dirty bitmap and sending
+             * them kept the guest suspended.
+             */
+            unsigned long checkpoint_pages;
+            uint64_t checkpoint_bitmap_us, checkpoint_send_us;
+            /* Bytes written to the stream, and as of the last checkpoint. */
+            uint64_t stream_bytes, checkpoint_bytes_mark;
+            /* Pages sent by background pre-copy since the last checkpoint. */
+            unsigned long precopy_pages;
+
+            /*
+             * Remus: memory which the guest does not want replicated, see
+             * xen/io/cpsremus.h.  skip_rec is the list as last read,
+             * skipped_pages the pages it covered, and skip_scratch room for
+             * the next one.  skip_pfn is INVALID_MFN if there is no list.
+             */
+            xen_pfn_t skip_pfn;
+            struct xc_sr_rec_checkpoint_skip_pfns *skip_rec;
+            unsigned long *skipped_pages, *skip_scratch;
+
+            /*
+             * Remus: connections for page data besides ctx->fd.  Once the
+             * first checkpoint has been sent, the pages of every epoch go
+             * to the stripes by PFN range, and each stripe ends the epoch
+             * with a CHECKPOINT record of its own ahead of the one on
+             * ctx->fd.
+             */
+            const int *stripe_fds;
+            unsigned int nr_stripes;
+            bool stripes_active;
+            /* Where the pages in batch_pfns are to be written. */
+            int batch_fd;
+
+            /*
+             * Zero-copy state of ctx->fd and the stripes, in that order,
+             * and the batches the kernel may still be reading from.
+             */
+            struct xc_sr_zc_fd *zc_fds;
+            struct xc_sr_zc_batch zc_pending[XC_SR_ZC_MAX_PENDING];
+            unsigned int zc_head, nr_zc_pending;
         } save;
 
         struct /* Restore data. */
@@ -231,6 +467,12 @@ struct xc_sr_context
             /* Currently buffering records between a checkpoint */
             bool buffer_all_records;
 
+            /*
+             * Remus: fail over if the stream is silent for this long once
+             * the first checkpoint has arrived; 0 for never.
+             */
+            unsigned int liveness_timeout_ms;
+
 /*
  * With Remus/COLO, we buffer the records sent by the primary at checkpoint,
  * in case the primary will fail, we can recover from the last
@@ -239,9 +481,38 @@ struct xc_sr_context
  * dirty pages at checkpoint.
  */
 #define DEFAULT_BUF_RECORDS 1024
-            struct xc_sr_record *buffered_records;
-            unsigned allocated_rec_num;
-            unsigned buffered_rec_num;
+            struct xc_sr_restore_epoch epochs[2];
+            /* The epoch currently being received from the stream. */
+            struct xc_sr_restore_epoch *recv_epoch;
+
+            /*
+             * Remus restores are pipelined: the main thread keeps reading
+             * and staging the next epoch while a second thread applies the
+             * last committed one to the guest.  apply_epoch is the epoch
+             * handed to the applier, or NULL when it is idle.
+             */
+            bool pipelined;
+            bool applier_running, applier_exit;
+            pthread_t applier;
+            pthread_mutex_t apply_lock;
+            pthread_cond_t apply_cond;
+            struct xc_sr_restore_epoch *apply_epoch;
+            int apply_rc;
+
+            /*
+             * Remus: page data connections besides ctx->fd.  Buffered epoch
+             * N is only committed once every stripe has completed N + 1
+             * epochs, and the applier applies the stripes' pages of an
+             * epoch ahead of its records.  The counters, and the stripes'
+             * completed and failed, are protected by apply_lock.
+             */
+            const int *stripe_fds;
+            unsigned int nr_stripes;
+            struct xc_sr_restore_stripe *stripes;
+            uint64_t epochs_committed, epochs_applied;
+            /* Records received on the stripes, for the liveness timeout. */
+            uint64_t stripe_records;
+            bool stripes_exit;
 
             /*
              * Xenstore and Console parameters.
@@ -258,6 +529,15 @@ struct xc_sr_context
 
             /* Sender has invoked verify mode on the stream. */
             bool verify;
+
+            /* Remus: memory not replicated as of the last checkpoint. */
+            struct xc_sr_rec_checkpoint_skip_pfns *skip_pfns;
+
+            /* Remus: earlier checkpoints for failover to go back to. */
+            struct xc_sr_history history;
+
+            /* Remus: persistent mapping of the guest's memory. */
+            struct xc_sr_restore_map map;
         } restore;
     };
 
@@ -306,6 +586,17 @@ struct xc_sr_context
                     /* Types for each page (bounded by max_pfn). */
                     uint32_t *pfn_types;
 
+                    /*
+                     * Guest's p2m frames have been written in full since
+                     * the frame list last changed.  Since then, the frames
+                     * whose local p2m entries or guest contents changed are
+                     * set in dirty_p2m_frames, found through p2m_frame_pfns,
+                     * the pfns holding frames (bounded by max_pfn).
+                     */
+                    bool guest_p2m_current;
+                    unsigned long *dirty_p2m_frames, *p2m_frame_pfns;
+                    unsigned nr_dirty_p2m_frames;
+
                     /* Vcpu context blobs. */
                     struct xc_sr_x86_pv_restore_vcpu *vcpus;
                     unsigned nr_vcpus;
@@ -322,6 +613,10 @@ struct xc_sr_context
                     /* Whether qemu enabled logdirty mode, and we should
                      * disable on cleanup. */
                     bool qemu_enabled_logdirty;
+
+                    /* HVM context sent at the previous checkpoint. */
+                    void *context;
+                    uint32_t contextsz;
                 } save;
 
                 struct
@@ -376,7 +671,9 @@ static inline int write_record(struct xc_sr_context *ctx,
 }
 
 /*
- * Reads a record from the stream, and fills in the record structure.
+ * Reads a record from the stream, and fills in the record structure.  Fails
+ * with errno ETIMEDOUT if the stream is silent for timeout_ms at any point,
+ * unless timeout_ms is 0.
  *
  * Returns 0 on success and non-0 on failure.
  *
@@ -387,7 +684,36 @@ static inline int write_record(struct xc_sr_context *ctx,
  *
  * On failure, the contents of the record structure are undefined.
  */
-int read_record(struct xc_sr_context *ctx, int fd, struct xc_sr_record *rec);
+int read_record_timeout(struct xc_sr_context *ctx, int fd,
+                        struct xc_sr_record *rec, unsigned int timeout_ms);
+
+/*
+ * As read_record_timeout(), waiting as long as it takes.
+ */
+static inline int read_record(struct xc_sr_context *ctx, int fd,
+                              struct xc_sr_record *rec)
+{
+    return read_record_timeout(ctx, fd, rec, 0);
+}
+
+/*
+ * Check a CHECKPOINT_SKIP_PFNS list: at most CPSREMUS_SKIP_MAX_RANGES
+ * ranges, each below limit and none overlapping another, which bounds the
+ * pages they cover by limit.  Returns 0 if the list is acceptable.
+ */
+int check_skip_ranges(struct xc_sr_context *ctx,
+                      const struct xc_sr_rec_checkpoint_skip_pfns *skip,
+                      xen_pfn_t limit);
+
+/* Monotonic time in microseconds, for timing parts of the stream. */
+static inline uint64_t monotonic_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
 
 /*
  * This would ideally be private in restore.c, but is needed by
@@ -1,10 +1,12 @@
 #include <arpa/inet.h>
+#include <sys/socket.h>
 
 #include <assert.h>
 
-#include <sys/time.h>
 #include "xc_sr_common.h"
 
+#include <xen/io/cpsremus.h>
+
 /*
  * Read and validate the Image and Domain headers.
  */
@@ -196,18 +198,428 @@ int populate_pfns(struct xc_sr_context *ctx, unsigned count,
 }
 
 /*
- * Given a list of pfns, their types, and a block of page data from the
- * stream, populate and record their types, map the relevant subset and copy
- * the data into the guest.
+ * Remus checkpoint history.  Entries are reused round the ring, keeping
+ * their arrays, but their page arenas are freed as they are dropped so that
+ * max_bytes really bounds the memory held.
+ */
+#define HISTORY_CHUNK_PAGES 64
+#define HISTORY_RECORDS 16
+
+static struct xc_sr_history_entry *history_entry(struct xc_sr_history *h,
+                                                 unsigned int i)
+{
+    return &h->ring[(h->head + i) % (h->max_epochs + 1)];
+}
+
+static size_t history_entry_bytes(const struct xc_sr_history_entry *he)
+{
+    return he->page_arena.allocated + he->record_bytes +
+        he->nr_pages * sizeof(*he->pages) +
+        he->nr_records * sizeof(*he->records);
+}
+
+static void history_drop_pages(struct xc_sr_history_entry *he)
+{
+    he->nr_pages = 0;
+    arena_destroy(&he->page_arena);
+}
+
+static void history_drop_entry(struct xc_sr_history_entry *he)
+{
+    unsigned int i;
+
+    for ( i = 0; i < he->nr_records; i++ )
+        free(he->records[i].data);
+    he->nr_records = 0;
+    he->record_bytes = 0;
+    history_drop_pages(he);
+}
+
+static int history_init(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_history *h = &ctx->restore.history;
+    unsigned int i;
+
+    h->ring = calloc(h->max_epochs + 1, sizeof(*h->ring));
+    if ( !h->ring )
+    {
+        ERROR("Unable to allocate checkpoint history of %u epochs",
+              h->max_epochs);
+        return -1;
+    }
+
+    for ( i = 0; i <= h->max_epochs; i++ )
+        h->ring[i].page_arena.chunk_size = HISTORY_CHUNK_PAGES * PAGE_SIZE;
+
+    return 0;
+}
+
+static void history_cleanup(struct xc_sr_context *ctx)
+{
+    struct xc_sr_history *h = &ctx->restore.history;
+    unsigned int i;
+
+    if ( !h->ring )
+        return;
+
+    for ( i = 0; i <= h->max_epochs; i++ )
+    {
+        history_drop_entry(&h->ring[i]);
+        free(h->ring[i].pages);
+        free(h->ring[i].records);
+    }
+
+    free(h->ring);
+    h->ring = NULL;
+}
+
+/* Start recording the epoch about to be applied. */
+static void history_open(struct xc_sr_context *ctx, bool log_pages)
+{
+    struct xc_sr_history *h = &ctx->restore.history;
+
+    if ( h->nr == h->max_epochs + 1 )
+    {
+        history_drop_entry(history_entry(h, 0));
+        h->head = (h->head + 1) % (h->max_epochs + 1);
+        h->nr--;
+        history_drop_pages(history_entry(h, 0));
+    }
+
+    h->open = history_entry(h, h->nr);
+    h->log_pages = log_pages;
+}
+
+/*
+ * Finish recording the epoch, keeping it if it was applied in full, and
+ * drop old epochs to stay within max_bytes.  Whenever an epoch becomes the
+ * oldest, its pages are of no more use.
+ */
+static void history_close(struct xc_sr_context *ctx, bool keep)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_history *h = &ctx->restore.history;
+    struct xc_sr_history_entry *he = h->open;
+    size_t bytes = 0;
+    unsigned int i, logged = he->nr_pages;
+
+    h->open = NULL;
+    if ( !keep )
+    {
+        history_drop_entry(he);
+        return;
+    }
+    h->nr++;
+
+    for ( i = 0; i < h->nr; i++ )
+        bytes += history_entry_bytes(history_entry(h, i));
+
+    while ( h->nr > 1 && bytes > h->max_bytes )
+    {
+        bytes -= history_entry_bytes(history_entry(h, 0));
+        history_drop_entry(history_entry(h, 0));
+        h->head = (h->head + 1) % (h->max_epochs + 1);
+        h->nr--;
+
+        bytes -= history_entry_bytes(history_entry(h, 0));
+        history_drop_pages(history_entry(h, 0));
+        bytes += history_entry_bytes(history_entry(h, 0));
+    }
+
+    DPRINTF("Checkpoint history: %u pages logged by the last epoch,"
+            " %u epochs to go back, %zu bytes",
+            logged, h->nr - 1, bytes);
+}
+
+/*
+ * Reserve undo log entries for a batch of count pages about to be applied,
+ * or return NULL if pages are not being logged (or on allocation failure,
+ * with *rc set).
+ */
+static struct xc_sr_history_page *history_log_pages(struct xc_sr_context *ctx,
+                                                    unsigned int count,
+                                                    int *rc)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_history *h = &ctx->restore.history;
+    struct xc_sr_history_entry *he = h->open;
+    struct xc_sr_history_page *p;
+    unsigned int nr;
+
+    *rc = 0;
+    if ( !he || !h->log_pages )
+        return NULL;
+
+    if ( he->nr_pages + count > he->allocated_pages )
+    {
+        nr = max(he->allocated_pages * 2, he->nr_pages + count);
+        p = realloc(he->pages, nr * sizeof(*p));
+        if ( !p )
+        {
+            ERROR("Unable to allocate checkpoint history for %u pages", nr);
+            *rc = -1;
+            return NULL;
+        }
+        he->pages = p;
+        he->allocated_pages = nr;
+    }
+
+    p = &he->pages[he->nr_pages];
+    he->nr_pages += count;
+
+    return p;
+}
+
+/*
+ * Keep the old contents of a page about to be overwritten.  Pages of
+ * zeroes, such as those the epoch newly populated, take no room.
+ */
+static int history_save_page(struct xc_sr_context *ctx,
+                             struct xc_sr_history_page *hp,
+                             const void *page)
+{
+    xc_interface *xch = ctx->xch;
+    const uint64_t *word = page;
+    unsigned int i;
+
+    hp->written = true;
+    hp->data = NULL;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*word); i++ )
+        if ( word[i] )
+            break;
+    if ( i == PAGE_SIZE / sizeof(*word) )
+        return 0;
+
+    hp->data = arena_alloc(&ctx->restore.history.open->page_arena,
+                           PAGE_SIZE);
+    if ( !hp->data )
+    {
+        ERROR("Unable to allocate checkpoint history for pfn %#"PRIpfn,
+              hp->pfn);
+        return -1;
+    }
+    memcpy(hp->data, page, PAGE_SIZE);
+
+    return 0;
+}
+
+/*
+ * Whether a record is part of the guest's state as of its epoch, and must
+ * be processed again to go back to that epoch.
+ */
+static bool history_keeps_record(uint32_t type)
+{
+    switch ( type )
+    {
+    case REC_TYPE_END:
+    case REC_TYPE_PAGE_DATA:
+    case REC_TYPE_X86_PV_INFO:
+    case REC_TYPE_X86_PV_P2M_FRAMES:
+    case REC_TYPE_VERIFY:
+    case REC_TYPE_CHECKPOINT:
+    case REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST:
+    case REC_TYPE_LIVENESS:
+        return false;
+
+    default:
+        return true;
+    }
+}
+
+static int history_keep_record(struct xc_sr_context *ctx,
+                               const struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_history_entry *he = ctx->restore.history.open;
+    struct xc_sr_record *p;
+    void *data = NULL;
+    unsigned int nr;
+
+    if ( he->nr_records == he->allocated_records )
+    {
+        nr = he->allocated_records + HISTORY_RECORDS;
+        p = realloc(he->records, nr * sizeof(*p));
+        if ( !p )
+        {
+            ERROR("Unable to allocate checkpoint history for %u records", nr);
+            return -1;
+        }
+        he->records = p;
+        he->allocated_records = nr;
+    }
+
+    if ( rec->length )
+    {
+        data = malloc(rec->length);
+        if ( !data )
+        {
+            ERROR("Unable to allocate checkpoint history for %s record",
+                  rec_type_to_str(rec->type));
+            return -1;
+        }
+        memcpy(data, rec->data, rec->length);
+    }
+
+    p = &he->records[he->nr_records++];
+    p->type = rec->type;
+    p->length = rec->length;
+    p->data = data;
+    he->record_bytes += rec->length;
+
+    return 0;
+}
+
+/*
+ * Remus: the guest's memory is mapped a chunk at a time as pages are first
+ * written, and stays mapped for the rest of the stream.  A chunk with pfns
+ * which were not populated when it was mapped is mapped again when one of
+ * those is wanted.  Everything is unmapped before stream_complete(), as PV
+ * pagetables cannot be pinned while there are writable mappings of them.
+ */
+static void *map_guest_page(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_map *map = &ctx->restore.map;
+    struct xc_sr_restore_map_chunk *mc;
+    unsigned long c = pfn >> RESTORE_MAP_CHUNK_ORDER, new_nr;
+    unsigned int off = pfn & (RESTORE_MAP_CHUNK_PAGES - 1), i;
+    xen_pfn_t base = pfn - off, gfns[RESTORE_MAP_CHUNK_PAGES];
+    int errs[RESTORE_MAP_CHUNK_PAGES];
+
+    if ( c >= map->nr_chunks )
+    {
+        new_nr = (c | 63) + 1;
+        mc = realloc(map->chunks, new_nr * sizeof(*mc));
+        if ( !mc )
+        {
+            ERROR("Failed to realloc mapping chunks for pfn %#"PRIpfn, pfn);
+            return NULL;
+        }
+
+        memset(mc + map->nr_chunks, 0,
+               (new_nr - map->nr_chunks) * sizeof(*mc));
+        map->chunks = mc;
+        map->nr_chunks = new_nr;
+    }
+
+    mc = &map->chunks[c];
+    if ( mc->mapping )
+    {
+        if ( !test_bit(off, mc->missing) )
+            return mc->mapping + off * PAGE_SIZE;
+
+        xenforeignmemory_unmap(xch->fmem, mc->mapping,
+                               RESTORE_MAP_CHUNK_PAGES);
+        mc->mapping = NULL;
+        map->remaps++;
+    }
+
+    for ( i = 0; i < RESTORE_MAP_CHUNK_PAGES; ++i )
+    {
+        if ( ctx->restore.ops.pfn_is_valid(ctx, base + i) &&
+             pfn_is_populated(ctx, base + i) )
+            gfns[i] = ctx->restore.ops.pfn_to_gfn(ctx, base + i);
+        else
+            gfns[i] = INVALID_MFN;
+    }
+
+    mc->mapping = xenforeignmemory_map(xch->fmem, ctx->domid,
+                                       PROT_READ | PROT_WRITE,
+                                       RESTORE_MAP_CHUNK_PAGES, gfns, errs);
+    if ( !mc->mapping )
+    {
+        PERROR("Unable to map pfns %#"PRIpfn"-%#"PRIpfn, base,
+               base + RESTORE_MAP_CHUNK_PAGES - 1);
+        return NULL;
+    }
+    map->maps++;
+
+    for ( i = 0; i < RESTORE_MAP_CHUNK_PAGES; ++i )
+    {
+        if ( errs[i] )
+            set_bit(i, mc->missing);
+        else
+            clear_bit(i, mc->missing);
+    }
+
+    if ( errs[off] )
+    {
+        ERROR("Mapping pfn %#"PRIpfn" (gfn %#"PRIpfn") failed with %d",
+              pfn, gfns[off], errs[off]);
+        return NULL;
+    }
+
+    return mc->mapping + off * PAGE_SIZE;
+}
+
+static void release_guest_map(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_map *map = &ctx->restore.map;
+    unsigned long c;
+
+    if ( !map->chunks )
+        return;
+
+    for ( c = 0; c < map->nr_chunks; ++c )
+        if ( map->chunks[c].mapping )
+            xenforeignmemory_unmap(xch->fmem, map->chunks[c].mapping,
+                                   RESTORE_MAP_CHUNK_PAGES);
+
+    DPRINTF("Released guest mapping: %lu chunks mapped, %lu again",
+            map->maps, map->remaps);
+
+    free(map->chunks);
+    map->chunks = NULL;
+    map->nr_chunks = 0;
+}
+
+/*
+ * Check that a set of pfns are within the domain, and populate the ones
+ * which are not yet.
+ */
+static int prepare_pfns(struct xc_sr_context *ctx, unsigned count,
+                        const xen_pfn_t *pfns, const uint32_t *types)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned i;
+    int rc;
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfns[i]) )
+        {
+            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum",
+                  pfns[i], i);
+            return -1;
+        }
+    }
+
+    rc = populate_pfns(ctx, count, pfns, types);
+    if ( rc )
+        ERROR("Failed to populate pfns for batch of %u pages", count);
+
+    return rc;
+}
+
+/*
+ * Given a list of pfns, their types, and pointers to their page data (NULL
+ * for types without data), which have been through prepare_pfns(), record
+ * their types, map the relevant subset and copy the data into the guest.
  */
 static int process_page_data(struct xc_sr_context *ctx, unsigned count,
-                             xen_pfn_t *pfns, uint32_t *types, void *page_data)
+                             xen_pfn_t *pfns, uint32_t *types,
+                             void **page_data)
 {
     xc_interface *xch = ctx->xch;
+    bool persistent = ctx->restore.map.enabled;
     xen_pfn_t *mfns = malloc(count * sizeof(*mfns));
     int *map_errs = malloc(count * sizeof(*map_errs));
     int rc;
     void *mapping = NULL, *guest_page = NULL;
+    struct xc_sr_history_page *undo;
     unsigned i,    /* i indexes the pfns from the record. */
         j,         /* j indexes the subset of pfns we decide to map. */
         nr_pages = 0;
@@ -220,15 +632,19 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
         goto err;
     }
 
-    rc = populate_pfns(ctx, count, pfns, types);
+    undo = history_log_pages(ctx, count, &rc);
     if ( rc )
-    {
-        ERROR("Failed to populate pfns for batch of %u pages", count);
         goto err;
-    }
 
     for ( i = 0; i < count; ++i )
     {
+        if ( undo )
+        {
+            undo[i].pfn = pfns[i];
+            undo[i].type = ctx->restore.ops.get_page_type(ctx, pfns[i]);
+            undo[i].written = false;
+        }
+
         ctx->restore.ops.set_page_type(ctx, pfns[i], types[i]);
 
         switch ( types[i] )
@@ -247,7 +663,9 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
         case XEN_DOMCTL_PFINFO_L4TAB:
         case XEN_DOMCTL_PFINFO_L4TAB | XEN_DOMCTL_PFINFO_LPINTAB:
 
-            mfns[nr_pages++] = ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]);
+            if ( !persistent )
+                mfns[nr_pages] = ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]);
+            nr_pages++;
             break;
         }
     }
@@ -256,15 +674,18 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
     if ( nr_pages == 0 )
         goto done;
 
-    mapping = guest_page = xenforeignmemory_map(xch->fmem,
-        ctx->domid, PROT_READ | PROT_WRITE,
-        nr_pages, mfns, map_errs);
-    if ( !mapping )
+    if ( !persistent )
     {
-        rc = -1;
-        PERROR("Unable to map %u mfns for %u pages of data",
-               nr_pages, count);
-        goto err;
+        mapping = guest_page = xenforeignmemory_map(xch->fmem,
+            ctx->domid, PROT_READ | PROT_WRITE,
+            nr_pages, mfns, map_errs);
+        if ( !mapping )
+        {
+            rc = -1;
+            PERROR("Unable to map %u mfns for %u pages of data",
+                   nr_pages, count);
+            goto err;
+        }
     }
 
     for ( i = 0, j = 0; i < count; ++i )
@@ -278,7 +699,16 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
             continue;
         }
 
-        if ( map_errs[j] )
+        if ( persistent )
+        {
+            guest_page = map_guest_page(ctx, pfns[i]);
+            if ( !guest_page )
+            {
+                rc = -1;
+                goto err;
+            }
+        }
+        else if ( map_errs[j] )
         {
             rc = -1;
             ERROR("Mapping pfn %#"PRIpfn" (mfn %#"PRIpfn", type %#"PRIx32") failed with %d",
@@ -287,7 +717,7 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
         }
 
         /* Undo page normalisation done by the saver. */
-        rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
+        rc = ctx->restore.ops.localise_page(ctx, types[i], page_data[i]);
         if ( rc )
         {
             ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
@@ -298,19 +728,24 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
         if ( ctx->restore.verify )
         {
             /* Verify mode - compare incoming data to what we already have. */
-            if ( memcmp(guest_page, page_data, PAGE_SIZE) )
+            if ( memcmp(guest_page, page_data[i], PAGE_SIZE) )
                 ERROR("verify pfn %#"PRIpfn" failed (type %#"PRIx32")",
                       pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
         }
         else
         {
             /* Regular mode - copy incoming data into place. */
-            memcpy(guest_page, page_data, PAGE_SIZE);
+            if ( undo )
+            {
+                rc = history_save_page(ctx, &undo[i], guest_page);
+                if ( rc )
+                    goto err;
+            }
+            memcpy(guest_page, page_data[i], PAGE_SIZE);
         }
 
         ++j;
         guest_page += PAGE_SIZE;
-        page_data += PAGE_SIZE;
     }
 
  done:
@@ -327,67 +762,296 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
 }
 
 /*
- * Validate a PAGE_DATA record from the stream, and pass the results to
- * process_page_data() to actually perform the legwork.
+ * The highest pfn which may be staged: one within the guest's p2m, or, as
+ * the p2m size is taken before the guest is populated, one which its
+ * maximum memory could reach with the hole below 4GiB on top.  This bounds
+ * the staging index however wild the pfns in the stream are.
+ */
+static xen_pfn_t staged_pfn_limit(const struct xc_sr_context *ctx)
+{
+    xen_pfn_t limit = (ctx->dominfo.max_memkb >> (PAGE_SHIFT - 10)) +
+        (1UL << (32 - PAGE_SHIFT));
+
+    return max_t(xen_pfn_t, limit, ctx->restore.p2m_size);
+}
+
+/*
+ * Make sure the staging index covers pfn, expanding it to the nearest power
+ * of two (as for the populated bitmap) if needed.  The pfn comes straight
+ * from the stream, so it is bounded by staged_pfn_limit() first; whether it
+ * is valid for the guest is left to prepare_pfns() when the epoch is
+ * applied, as records staged alongside it may grow the guest's p2m.
  */
-static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+static int staged_index_cover(struct xc_sr_context *ctx,
+                              struct xc_sr_restore_epoch *ep, xen_pfn_t pfn)
 {
     xc_interface *xch = ctx->xch;
-    struct xc_sr_rec_page_data_header *pages = rec->data;
-    unsigned i, pages_of_data = 0;
-    int rc = -1;
+    xen_pfn_t new_max;
+    unsigned *p;
 
-    xen_pfn_t *pfns = NULL, pfn;
-    uint32_t *types = NULL, type;
+    if ( ep->staged_index && pfn <= ep->max_staged_pfn )
+        return 0;
 
-    if ( rec->length < sizeof(*pages) )
-    {
-        ERROR("PAGE_DATA record truncated: length %u, min %zu",
-              rec->length, sizeof(*pages));
-        goto err;
-    }
-    else if ( pages->count < 1 )
+    if ( pfn >= staged_pfn_limit(ctx) )
     {
-        ERROR("Expected at least 1 pfn in PAGE_DATA record");
-        goto err;
+        ERROR("pfn %#"PRIpfn" outside domain maximum", pfn);
+        errno = EINVAL;
+        return -1;
     }
-    else if ( rec->length < sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
+
+    new_max = pfn;
+    new_max |= new_max >> 1;
+    new_max |= new_max >> 2;
+    new_max |= new_max >> 4;
+    new_max |= new_max >> 8;
+    new_max |= new_max >> 16;
+#ifdef __x86_64__
+    new_max |= new_max >> 32;
+#endif
+
+    if ( new_max >= SIZE_MAX / sizeof(*p) )
     {
-        ERROR("PAGE_DATA record (length %u) too short to contain %u"
-              " pfns worth of information", rec->length, pages->count);
-        goto err;
+        ERROR("Staging index for pfn %#"PRIpfn" too large", pfn);
+        errno = ENOMEM;
+        return -1;
     }
 
-    pfns = malloc(pages->count * sizeof(*pfns));
-    types = malloc(pages->count * sizeof(*types));
-    if ( !pfns || !types )
+    p = realloc(ep->staged_index, (new_max + 1) * sizeof(*p));
+    if ( !p )
     {
-        ERROR("Unable to allocate enough memory for %u pfns",
-              pages->count);
-        goto err;
+        ERROR("Failed to realloc staging index for pfn %#"PRIpfn, pfn);
+        errno = ENOMEM;
+        return -1;
     }
 
-    for ( i = 0; i < pages->count; ++i )
-    {
-        pfn = pages->pfn[i] & PAGE_DATA_PFN_MASK;
-        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) )
-        {
-            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
-            goto err;
-        }
+    if ( ep->staged_index )
+        memset(p + ep->max_staged_pfn + 1, 0,
+               (new_max - ep->max_staged_pfn) * sizeof(*p));
+    else
+        memset(p, 0, (new_max + 1) * sizeof(*p));
 
-        type = (pages->pfn[i] & PAGE_DATA_TYPE_MASK) >> 32;
-        if ( ((type >> XEN_DOMCTL_PFINFO_LTAB_SHIFT) >= 5) &&
-             ((type >> XEN_DOMCTL_PFINFO_LTAB_SHIFT) <= 8) )
-        {
-            ERROR("Invalid type %#"PRIx32" for pfn %#"PRIpfn" (index %u)",
-                  type, pfn, i);
-            goto err;
-        }
+    ep->staged_index = p;
+    ep->max_staged_pfn = new_max;
+
+    return 0;
+}
+
+/*
+ * Stage a set of pages received between two checkpoints.  A pfn which is
+ * already staged has its type and contents replaced in place, so each page is
+ * held (and later applied) only once per epoch however often it was sent.
+ */
+static int stage_page_data(struct xc_sr_context *ctx,
+                           struct xc_sr_restore_epoch *ep, unsigned count,
+                           xen_pfn_t *pfns, uint32_t *types, void **page_data)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_staged_page *sp;
+    unsigned i, idx;
+
+    if ( ep->nr_staged_pages == 0 )
+        ep->staged_rec_pos = ep->buffered_rec_num;
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( staged_index_cover(ctx, ep, pfns[i]) )
+            return -1;
+
+        idx = ep->staged_index[pfns[i]];
+        if ( idx )
+            sp = &ep->staged_pages[idx - 1];
+        else
+        {
+            if ( ep->nr_staged_pages >=
+                 ep->allocated_staged_pages )
+            {
+                unsigned new_num = ep->allocated_staged_pages +
+                    MAX_BATCH_SIZE;
+
+                sp = realloc(ep->staged_pages,
+                             new_num * sizeof(*sp));
+                if ( !sp )
+                {
+                    ERROR("Failed to realloc memory for staged pages");
+                    return -1;
+                }
+
+                ep->staged_pages = sp;
+                ep->allocated_staged_pages = new_num;
+            }
+
+            sp = &ep->staged_pages[ep->nr_staged_pages++];
+            ep->staged_index[pfns[i]] = ep->nr_staged_pages;
+            sp->pfn = pfns[i];
+            sp->data = NULL;
+        }
+
+        sp->type = types[i];
+
+        if ( !page_data[i] )
+            continue;
+
+        /* Keep an arena slot once allocated; it is reused by later copies. */
+        if ( !sp->data )
+        {
+            sp->data = arena_alloc(&ep->page_arena, PAGE_SIZE);
+            if ( !sp->data )
+            {
+                ERROR("Unable to allocate staging memory for pfn %#"PRIpfn,
+                      pfns[i]);
+                return -1;
+            }
+        }
+
+        memcpy(sp->data, page_data[i], PAGE_SIZE);
+        ep->nr_received_pages++;
+    }
+
+    return 0;
+}
+
+/*
+ * Apply all pages staged during an epoch which has been committed, and reset
+ * its staging area for reuse.  The pages which are new to the guest are
+ * populated for the whole epoch at once, rather than record by record.
+ */
+static int apply_staged_pages(struct xc_sr_context *ctx,
+                              struct xc_sr_restore_epoch *ep)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_staged_page *sp;
+    xen_pfn_t pfns[MAX_BATCH_SIZE], *all_pfns = NULL;
+    uint32_t types[MAX_BATCH_SIZE], *all_types = NULL;
+    void *data[MAX_BATCH_SIZE];
+    unsigned i, n, nr = ep->nr_staged_pages;
+    int rc = 0;
+
+    /* An epoch may have dirtied no pages at all. */
+    if ( !nr )
+        goto out;
+
+    all_pfns = malloc(nr * sizeof(*all_pfns));
+    all_types = malloc(nr * sizeof(*all_types));
+    if ( !all_pfns || !all_types )
+    {
+        ERROR("Failed to allocate %zu bytes to populate %u staged pages",
+              nr * (sizeof(*all_pfns) + sizeof(*all_types)), nr);
+        rc = -1;
+        goto out;
+    }
+
+    for ( i = 0; i < nr; ++i )
+    {
+        all_pfns[i] = ep->staged_pages[i].pfn;
+        all_types[i] = ep->staged_pages[i].type;
+    }
+
+    rc = prepare_pfns(ctx, nr, all_pfns, all_types);
+
+    for ( i = 0; !rc && i < nr; i += n )
+    {
+        for ( n = 0; n < MAX_BATCH_SIZE && i + n < nr; ++n )
+        {
+            sp = &ep->staged_pages[i + n];
+            pfns[n] = sp->pfn;
+            types[n] = sp->type;
+            data[n] = sp->data;
+        }
+
+        rc = process_page_data(ctx, n, pfns, types, data);
+    }
+
+ out:
+    free(all_types);
+    free(all_pfns);
+
+    DPRINTF("Applied %u unique of %lu received pages (%zu bytes staged)",
+            nr, ep->nr_received_pages,
+            ep->page_arena.allocated);
+
+    for ( i = 0; i < nr; ++i )
+        ep->staged_index[ep->staged_pages[i].pfn] = 0;
+
+    ep->nr_staged_pages = 0;
+    ep->nr_received_pages = 0;
+    arena_reset(&ep->page_arena);
+
+    return rc;
+}
+
+/*
+ * Validate a PAGE_DATA record from the stream, and pass the results to
+ * process_page_data() to actually perform the legwork, or to
+ * stage_page_data() to stage them in ep if records are being buffered
+ * between checkpoints.
+ */
+static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec,
+                            struct xc_sr_restore_epoch *ep)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_data_header *pages = rec->data;
+    unsigned i, pages_of_data = 0;
+    int rc = -1;
+
+    xen_pfn_t *pfns = NULL, pfn;
+    uint32_t *types = NULL, type;
+    void **data = NULL, *page;
+
+    if ( rec->length < sizeof(*pages) )
+    {
+        ERROR("PAGE_DATA record truncated: length %u, min %zu",
+              rec->length, sizeof(*pages));
+        goto err;
+    }
+    else if ( pages->count < 1 )
+    {
+        ERROR("Expected at least 1 pfn in PAGE_DATA record");
+        goto err;
+    }
+    else if ( rec->length < sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
+    {
+        ERROR("PAGE_DATA record (length %u) too short to contain %u"
+              " pfns worth of information", rec->length, pages->count);
+        goto err;
+    }
+
+    pfns = malloc(pages->count * sizeof(*pfns));
+    types = malloc(pages->count * sizeof(*types));
+    data = malloc(pages->count * sizeof(*data));
+    if ( !pfns || !types || !data )
+    {
+        ERROR("Unable to allocate enough memory for %u pfns",
+              pages->count);
+        goto err;
+    }
+
+    page = &pages->pfn[pages->count];
+
+    /*
+     * The pfns are checked against the domain maximum by prepare_pfns(),
+     * which for staged pages happens when the epoch is applied, as the
+     * epoch may also carry records which extend it.
+     */
+    for ( i = 0; i < pages->count; ++i )
+    {
+        pfn = pages->pfn[i] & PAGE_DATA_PFN_MASK;
+        type = (pages->pfn[i] & PAGE_DATA_TYPE_MASK) >> 32;
+        if ( ((type >> XEN_DOMCTL_PFINFO_LTAB_SHIFT) >= 5) &&
+             ((type >> XEN_DOMCTL_PFINFO_LTAB_SHIFT) <= 8) )
+        {
+            ERROR("Invalid type %#"PRIx32" for pfn %#"PRIpfn" (index %u)",
+                  type, pfn, i);
+            goto err;
+        }
         else if ( type < XEN_DOMCTL_PFINFO_BROKEN )
+        {
             /* NOTAB and all L1 through L4 tables (including pinned) should
              * have a page worth of data in the record. */
+            data[i] = page + (PAGE_SIZE * pages_of_data);
             pages_of_data++;
+        }
+        else
+            data[i] = NULL;
 
         pfns[i] = pfn;
         types[i] = type;
@@ -403,9 +1067,16 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         goto err;
     }
 
-    rc = process_page_data(ctx, pages->count, pfns, types,
-                           &pages->pfn[pages->count]);
+    if ( ep )
+        rc = stage_page_data(ctx, ep, pages->count, pfns, types, data);
+    else
+    {
+        rc = prepare_pfns(ctx, pages->count, pfns, types);
+        if ( !rc )
+            rc = process_page_data(ctx, pages->count, pfns, types, data);
+    }
  err:
+    free(data);
     free(types);
     free(pfns);
 
@@ -430,82 +1101,539 @@ static int send_checkpoint_dirty_pfn_list(struct xc_sr_context *ctx)
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->restore.dirty_bitmap_hbuf);
 
-    if ( xc_shadow_control(
-             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
-             HYPERCALL_BUFFER(dirty_bitmap), ctx->restore.p2m_size,
-             NULL, 0, &stats) != ctx->restore.p2m_size )
-    {
-        PERROR("Failed to retrieve logdirty bitmap");
-        goto err;
-    }
+    if ( xc_shadow_control(
+             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+             HYPERCALL_BUFFER(dirty_bitmap), ctx->restore.p2m_size,
+             NULL, 0, &stats) != ctx->restore.p2m_size )
+    {
+        PERROR("Failed to retrieve logdirty bitmap");
+        goto err;
+    }
+
+    for ( i = 0, count = 0; i < ctx->restore.p2m_size; i++ )
+    {
+        if ( test_bit(i, dirty_bitmap) )
+            count++;
+    }
+
+
+    pfns = malloc(count * sizeof(*pfns));
+    if ( !pfns )
+    {
+        ERROR("Unable to allocate %zu bytes of memory for dirty pfn list",
+              count * sizeof(*pfns));
+        goto err;
+    }
+
+    for ( i = 0, written = 0; i < ctx->restore.p2m_size; ++i )
+    {
+        if ( !test_bit(i, dirty_bitmap) )
+            continue;
+
+        if ( written > count )
+        {
+            ERROR("Dirty pfn list exceed");
+            goto err;
+        }
+
+        pfns[written++] = i;
+    }
+
+    /* iovec[] for writev(). */
+    iov = malloc(3 * sizeof(*iov));
+    if ( !iov )
+    {
+        ERROR("Unable to allocate memory for sending dirty bitmap");
+        goto err;
+    }
+
+    rec.length = count * sizeof(*pfns);
+
+    iov[0].iov_base = &rec.type;
+    iov[0].iov_len = sizeof(rec.type);
+
+    iov[1].iov_base = &rec.length;
+    iov[1].iov_len = sizeof(rec.length);
+
+    iov[2].iov_base = pfns;
+    iov[2].iov_len = count * sizeof(*pfns);
+
+    if ( writev_exact(ctx->restore.send_back_fd, iov, 3) )
+    {
+        PERROR("Failed to write dirty bitmap to stream");
+        goto err;
+    }
+
+    rc = 0;
+ err:
+    free(pfns);
+    free(iov);
+    return rc;
+}
+
+static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec);
+
+/*
+ * Where among the buffered records of an epoch its pages are applied: where
+ * the first PAGE_DATA record was on the main stream, or, if the pages all came
+ * on the stripes, after the records describing the guest's p2m which lead
+ * the epoch, as the pages may lie in the part of the p2m they add.
+ */
+static unsigned epoch_pages_pos(const struct xc_sr_restore_epoch *ep)
+{
+    unsigned i;
+
+    if ( ep->nr_staged_pages )
+        return ep->staged_rec_pos;
+
+    for ( i = 0; i < ep->buffered_rec_num; i++ )
+    {
+        if ( ep->buffered_records[i].type != REC_TYPE_X86_PV_INFO &&
+             ep->buffered_records[i].type != REC_TYPE_X86_PV_P2M_FRAMES )
+            break;
+    }
+
+    return i;
+}
+
+/*
+ * Apply the pages of an epoch, both those which came on the stripes and those
+ * staged from the main stream.
+ */
+static int apply_epoch_pages(struct xc_sr_context *ctx,
+                             struct xc_sr_restore_epoch *ep)
+{
+    struct xc_sr_restore_epoch *sep;
+    unsigned s;
+    int rc;
+
+    /* The stripes' epochs are in step with the main stream's. */
+    for ( s = 0; s < ctx->restore.nr_stripes; s++ )
+    {
+        sep = &ctx->restore.stripes[s].epochs[ep - ctx->restore.epochs];
+        if ( sep->nr_staged_pages )
+        {
+            rc = apply_staged_pages(ctx, sep);
+            if ( rc )
+                return rc;
+        }
+    }
+
+    if ( ep->nr_staged_pages )
+        return apply_staged_pages(ctx, ep);
+
+    return 0;
+}
+
+/*
+ * Replay a committed epoch: the buffered records in stream order, with the
+ * pages applied at epoch_pages_pos().
+ */
+static int apply_epoch(struct xc_sr_context *ctx,
+                       struct xc_sr_restore_epoch *ep)
+{
+    unsigned i = 0, pos = epoch_pages_pos(ep);
+    int rc = 0;
+
+    if ( ctx->restore.history.ring )
+        history_open(ctx, true);
+
+    for ( ; i <= ep->buffered_rec_num; i++ )
+    {
+        if ( i == pos )
+        {
+            rc = apply_epoch_pages(ctx, ep);
+            if ( rc )
+                goto err;
+        }
+
+        if ( i == ep->buffered_rec_num )
+            break;
+
+        rc = process_record(ctx, &ep->buffered_records[i]);
+        if ( rc )
+            goto err;
+    }
+
+ err:
+    for ( ; i < ep->buffered_rec_num; i++ )
+        free(ep->buffered_records[i].data);
+    ep->buffered_rec_num = 0;
+
+    if ( ctx->restore.history.open )
+        history_close(ctx, !rc);
+
+    return rc;
+}
+
+static int epoch_init(struct xc_sr_context *ctx,
+                      struct xc_sr_restore_epoch *ep)
+{
+    xc_interface *xch = ctx->xch;
+
+    ep->buffered_records = malloc(
+        DEFAULT_BUF_RECORDS * sizeof(struct xc_sr_record));
+    if ( !ep->buffered_records )
+    {
+        ERROR("Unable to allocate memory for buffered records");
+        return -1;
+    }
+    ep->allocated_rec_num = DEFAULT_BUF_RECORDS;
+    ep->page_arena.chunk_size = MAX_BATCH_SIZE * PAGE_SIZE;
+
+    return 0;
+}
+
+static void epoch_cleanup(struct xc_sr_restore_epoch *ep)
+{
+    unsigned i;
+
+    for ( i = 0; i < ep->buffered_rec_num; i++ )
+        free(ep->buffered_records[i].data);
+
+    free(ep->buffered_records);
+    free(ep->staged_pages);
+    free(ep->staged_index);
+    arena_destroy(&ep->page_arena);
+}
+
+/*
+ * Applier thread for pipelined (Remus) restore.  The main thread keeps
+ * reading the stream and hands each committed epoch over via apply_epoch;
+ * the applier replays it into the domain while the next epoch is received.
+ */
+static void *applier_thread(void *arg)
+{
+    struct xc_sr_context *ctx = arg;
+    struct xc_sr_restore_epoch *ep;
+    int rc;
+
+    pthread_mutex_lock(&ctx->restore.apply_lock);
+    for ( ;; )
+    {
+        while ( !ctx->restore.apply_epoch && !ctx->restore.applier_exit )
+            pthread_cond_wait(&ctx->restore.apply_cond,
+                              &ctx->restore.apply_lock);
+
+        ep = ctx->restore.apply_epoch;
+        if ( !ep )
+            break;
+
+        pthread_mutex_unlock(&ctx->restore.apply_lock);
+        rc = apply_epoch(ctx, ep);
+        if ( !rc )
+            rc = ctx->restore.ops.checkpoint_applied(ctx);
+        /* The main thread makes no callbacks until this epoch is done. */
+        if ( !rc && ctx->restore.callbacks->checkpoint_applied )
+            ctx->restore.callbacks->checkpoint_applied(
+                ctx->restore.callbacks->data);
+        pthread_mutex_lock(&ctx->restore.apply_lock);
+
+        if ( rc && !ctx->restore.apply_rc )
+            ctx->restore.apply_rc = rc;
+        ctx->restore.apply_epoch = NULL;
+        ctx->restore.epochs_applied++;
+        pthread_cond_broadcast(&ctx->restore.apply_cond);
+    }
+    pthread_mutex_unlock(&ctx->restore.apply_lock);
+
+    return NULL;
+}
+
+/*
+ * Wait until the applier has finished the epoch it was handed, and return
+ * its result.
+ */
+static int wait_applier_idle(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    int rc;
+
+    if ( !ctx->restore.applier_running )
+        return 0;
+
+    pthread_mutex_lock(&ctx->restore.apply_lock);
+    while ( ctx->restore.apply_epoch )
+        pthread_cond_wait(&ctx->restore.apply_cond, &ctx->restore.apply_lock);
+    rc = ctx->restore.apply_rc;
+    pthread_mutex_unlock(&ctx->restore.apply_lock);
+
+    if ( rc )
+        ERROR("Failed to apply checkpoint: %d", rc);
+
+    return rc;
+}
+
+static int start_applier(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    int rc;
+
+    pthread_mutex_init(&ctx->restore.apply_lock, NULL);
+    pthread_cond_init(&ctx->restore.apply_cond, NULL);
+
+    rc = pthread_create(&ctx->restore.applier, NULL, applier_thread, ctx);
+    if ( rc )
+    {
+        errno = rc;
+        PERROR("Unable to start checkpoint applier thread");
+        pthread_cond_destroy(&ctx->restore.apply_cond);
+        pthread_mutex_destroy(&ctx->restore.apply_lock);
+        return -1;
+    }
+    ctx->restore.applier_running = true;
+
+    return 0;
+}
+
+static void stop_applier(struct xc_sr_context *ctx)
+{
+    if ( !ctx->restore.applier_running )
+        return;
+
+    pthread_mutex_lock(&ctx->restore.apply_lock);
+    ctx->restore.applier_exit = true;
+    pthread_cond_broadcast(&ctx->restore.apply_cond);
+    pthread_mutex_unlock(&ctx->restore.apply_lock);
+
+    pthread_join(ctx->restore.applier, NULL);
+    ctx->restore.applier_running = false;
+
+    pthread_cond_destroy(&ctx->restore.apply_cond);
+    pthread_mutex_destroy(&ctx->restore.apply_lock);
+}
+
+/*
+ * A stripe has received all the pages of an epoch.  Its next epoch goes
+ * into the buffer of the one before, which must have been applied first.
+ */
+static int stripe_epoch_complete(struct xc_sr_context *ctx,
+                                 struct xc_sr_restore_stripe *st)
+{
+    bool exiting;
+
+    pthread_mutex_lock(&ctx->restore.apply_lock);
+    st->completed++;
+    pthread_cond_broadcast(&ctx->restore.apply_cond);
+    while ( ctx->restore.epochs_applied + 1 < st->completed &&
+            !ctx->restore.stripes_exit )
+        pthread_cond_wait(&ctx->restore.apply_cond, &ctx->restore.apply_lock);
+    exiting = ctx->restore.stripes_exit;
+    pthread_mutex_unlock(&ctx->restore.apply_lock);
+
+    st->recv_epoch = &st->epochs[st->completed % 2];
+
+    return exiting ? -1 : 0;
+}
+
+/*
+ * Reader thread of a stripe.  Stripes only carry the PAGE_DATA records of
+ * buffered epochs, each epoch ended by a CHECKPOINT record.
+ */
+static void *stripe_reader(void *arg)
+{
+    struct xc_sr_restore_stripe *st = arg;
+    struct xc_sr_context *ctx = st->ctx;
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec;
+    int rc;
+
+    for ( ;; )
+    {
+        rc = read_record(ctx, st->fd, &rec);
+        if ( rc )
+            break;
+
+        switch ( rec.type )
+        {
+        case REC_TYPE_PAGE_DATA:
+            rc = handle_page_data(ctx, &rec, st->recv_epoch);
+            break;
+
+        case REC_TYPE_CHECKPOINT:
+            rc = stripe_epoch_complete(ctx, st);
+            break;
+
+        case REC_TYPE_LIVENESS:
+            break;
+
+        default:
+            ERROR("Unexpected record %#x (%s) on stripe fd %d",
+                  rec.type, rec_type_to_str(rec.type), st->fd);
+            rc = -1;
+            break;
+        }
+
+        free(rec.data);
+        if ( rc )
+            break;
+
+        pthread_mutex_lock(&ctx->restore.apply_lock);
+        ctx->restore.stripe_records++;
+        pthread_mutex_unlock(&ctx->restore.apply_lock);
+    }
+
+    pthread_mutex_lock(&ctx->restore.apply_lock);
+    st->failed = true;
+    pthread_cond_broadcast(&ctx->restore.apply_cond);
+    pthread_mutex_unlock(&ctx->restore.apply_lock);
+
+    return NULL;
+}
+
+/*
+ * Wait until every stripe has received the epoch being committed.  With a
+ * liveness timeout, give up once the stripes have been silent for that
+ * long.
+ */
+static int wait_stripes(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned int timeout_ms = ctx->restore.liveness_timeout_ms;
+    uint64_t want = ctx->restore.epochs_committed + 1, seen;
+    struct xc_sr_restore_stripe *st;
+    struct timespec deadline;
+    unsigned int s, done;
+    int rc = 0;
+
+    pthread_mutex_lock(&ctx->restore.apply_lock);
+    seen = ctx->restore.stripe_records;
+    for ( ;; )
+    {
+        for ( s = 0, done = 0; s < ctx->restore.nr_stripes; s++ )
+        {
+            st = &ctx->restore.stripes[s];
+            if ( st->completed >= want )
+                done++;
+            else if ( st->failed )
+            {
+                ERROR("Stripe fd %d lost in epoch %"PRIu64, st->fd, want);
+                rc = -1;
+                goto out;
+            }
+        }
+        if ( done == ctx->restore.nr_stripes )
+            break;
+
+        if ( !timeout_ms )
+        {
+            pthread_cond_wait(&ctx->restore.apply_cond,
+                              &ctx->restore.apply_lock);
+            continue;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if ( deadline.tv_nsec >= 1000000000L )
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
 
-    for ( i = 0, count = 0; i < ctx->restore.p2m_size; i++ )
-    {
-        if ( test_bit(i, dirty_bitmap) )
-            count++;
+        if ( pthread_cond_timedwait(&ctx->restore.apply_cond,
+                                    &ctx->restore.apply_lock,
+                                    &deadline) == ETIMEDOUT )
+        {
+            if ( ctx->restore.stripe_records == seen )
+            {
+                ERROR("Nothing received on the stripes for %u ms",
+                      timeout_ms);
+                rc = -1;
+                goto out;
+            }
+            seen = ctx->restore.stripe_records;
+        }
     }
 
+ out:
+    pthread_mutex_unlock(&ctx->restore.apply_lock);
+    return rc;
+}
 
-    pfns = malloc(count * sizeof(*pfns));
-    if ( !pfns )
+static int start_stripes(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_stripe *st;
+    unsigned int s;
+    int rc;
+
+    ctx->restore.stripes = calloc(ctx->restore.nr_stripes,
+                                  sizeof(*ctx->restore.stripes));
+    if ( !ctx->restore.stripes )
     {
-        ERROR("Unable to allocate %zu bytes of memory for dirty pfn list",
-              count * sizeof(*pfns));
-        goto err;
+        ERROR("Unable to allocate memory for %u stripes",
+              ctx->restore.nr_stripes);
+        return -1;
     }
 
-    for ( i = 0, written = 0; i < ctx->restore.p2m_size; ++i )
+    for ( s = 0; s < ctx->restore.nr_stripes; s++ )
     {
-        if ( !test_bit(i, dirty_bitmap) )
-            continue;
+        st = &ctx->restore.stripes[s];
+        st->ctx = ctx;
+        st->fd = ctx->restore.stripe_fds[s];
 
-        if ( written > count )
+        rc = epoch_init(ctx, &st->epochs[0]);
+        if ( !rc )
+            rc = epoch_init(ctx, &st->epochs[1]);
+        if ( rc )
+            return rc;
+        st->recv_epoch = &st->epochs[0];
+
+        rc = pthread_create(&st->reader, NULL, stripe_reader, st);
+        if ( rc )
         {
-            ERROR("Dirty pfn list exceed");
-            goto err;
+            errno = rc;
+            PERROR("Unable to start reader thread for stripe fd %d", st->fd);
+            return -1;
         }
-
-        pfns[written++] = i;
+        st->running = true;
     }
 
-    /* iovec[] for writev(). */
-    iov = malloc(3 * sizeof(*iov));
-    if ( !iov )
-    {
-        ERROR("Unable to allocate memory for sending dirty bitmap");
-        goto err;
-    }
+    return 0;
+}
 
-    rec.length = count * sizeof(*pfns);
+/*
+ * Readers may be blocked on their connections, which are of no further
+ * use, or waiting for an epoch to be applied.
+ */
+static void stop_stripes(struct xc_sr_context *ctx)
+{
+    struct xc_sr_restore_stripe *st;
+    unsigned int s;
 
-    iov[0].iov_base = &rec.type;
-    iov[0].iov_len = sizeof(rec.type);
+    if ( !ctx->restore.stripes )
+        return;
 
-    iov[1].iov_base = &rec.length;
-    iov[1].iov_len = sizeof(rec.length);
+    pthread_mutex_lock(&ctx->restore.apply_lock);
+    ctx->restore.stripes_exit = true;
+    pthread_cond_broadcast(&ctx->restore.apply_cond);
+    pthread_mutex_unlock(&ctx->restore.apply_lock);
 
-    iov[2].iov_base = pfns;
-    iov[2].iov_len = count * sizeof(*pfns);
+    for ( s = 0; s < ctx->restore.nr_stripes; s++ )
+    {
+        st = &ctx->restore.stripes[s];
+        if ( !st->running )
+            continue;
 
-    if ( writev_exact(ctx->restore.send_back_fd, iov, 3) )
+        shutdown(st->fd, SHUT_RD);
+        pthread_join(st->reader, NULL);
+    }
+
+    for ( s = 0; s < ctx->restore.nr_stripes; s++ )
     {
-        PERROR("Failed to write dirty bitmap to stream");
-        goto err;
+        epoch_cleanup(&ctx->restore.stripes[s].epochs[0]);
+        epoch_cleanup(&ctx->restore.stripes[s].epochs[1]);
     }
 
-    rc = 0;
- err:
-    free(pfns);
-    free(iov);
-    return rc;
+    free(ctx->restore.stripes);
+    ctx->restore.stripes = NULL;
 }
 
-static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec);
 static int handle_checkpoint(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
     int rc = 0, ret;
-    unsigned i;
 
     if ( !ctx->restore.checkpointed )
     {
@@ -514,6 +1642,27 @@ static int handle_checkpoint(struct xc_sr_context *ctx)
         goto err;
     }
 
+    /* Without all of its pages the epoch is lost, like a broken stream. */
+    if ( ctx->restore.buffer_all_records && ctx->restore.nr_stripes &&
+         wait_stripes(ctx) )
+    {
+        rc = BROKEN_CHANNEL;
+        goto err;
+    }
+
+    /*
+     * The previous epoch must have been applied before this one is
+     * accepted: a failure to apply it ends the restore here, rather than
+     * after the primary has been told that this one arrived.  This also
+     * keeps the applier's callback apart from ours.
+     */
+    if ( ctx->restore.buffer_all_records && ctx->restore.pipelined )
+    {
+        rc = wait_applier_idle(ctx);
+        if ( rc )
+            goto err;
+    }
+
     ret = ctx->restore.callbacks->checkpoint(ctx->restore.callbacks->data);
     switch ( ret )
     {
@@ -537,18 +1686,49 @@ static int handle_checkpoint(struct xc_sr_context *ctx)
     {
         IPRINTF("All records buffered");
 
-        for ( i = 0; i < ctx->restore.buffered_rec_num; i++ )
+        if ( ctx->restore.pipelined )
+        {
+            /*
+             * Hand the committed epoch to the applier and carry on reading
+             * the next one into the other buffer, which the applier has
+             * finished with, see above.
+             */
+            pthread_mutex_lock(&ctx->restore.apply_lock);
+            ctx->restore.apply_epoch = ctx->restore.recv_epoch;
+            ctx->restore.epochs_committed++;
+            pthread_cond_broadcast(&ctx->restore.apply_cond);
+            pthread_mutex_unlock(&ctx->restore.apply_lock);
+
+            ctx->restore.recv_epoch =
+                ctx->restore.recv_epoch == &ctx->restore.epochs[0] ?
+                &ctx->restore.epochs[1] : &ctx->restore.epochs[0];
+        }
+        else
         {
-            rc = process_record(ctx, &ctx->restore.buffered_records[i]);
+            rc = apply_epoch(ctx, ctx->restore.recv_epoch);
             if ( rc )
                 goto err;
+            IPRINTF("All records processed");
+
+            if ( ctx->restore.callbacks->checkpoint_applied )
+                ctx->restore.callbacks->checkpoint_applied(
+                    ctx->restore.callbacks->data);
         }
-        ctx->restore.buffered_rec_num = 0;
-        IPRINTF("All records processed");
     }
     else
+    {
         ctx->restore.buffer_all_records = true;
 
+        /* The initial image is the first epoch of the history. */
+        if ( ctx->restore.history.open )
+            history_close(ctx, true);
+
+        /* It has been processed as it arrived. */
+        if ( ctx->restore.callbacks->checkpoint_applied )
+            ctx->restore.callbacks->checkpoint_applied(
+                ctx->restore.callbacks->data);
+    }
+
     if ( ctx->restore.checkpointed == XC_MIG_STREAM_COLO )
     {
 #define HANDLE_CALLBACK_RETURN_VALUE(ret)                   \
@@ -603,13 +1783,14 @@ static int handle_checkpoint(struct xc_sr_context *ctx)
 static int buffer_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
 {
     xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_epoch *ep = ctx->restore.recv_epoch;
     unsigned new_alloc_num;
     struct xc_sr_record *p;
 
-    if ( ctx->restore.buffered_rec_num >= ctx->restore.allocated_rec_num )
+    if ( ep->buffered_rec_num >= ep->allocated_rec_num )
     {
-        new_alloc_num = ctx->restore.allocated_rec_num + DEFAULT_BUF_RECORDS;
-        p = realloc(ctx->restore.buffered_records,
+        new_alloc_num = ep->allocated_rec_num + DEFAULT_BUF_RECORDS;
+        p = realloc(ep->buffered_records,
                     new_alloc_num * sizeof(struct xc_sr_record));
         if ( !p )
         {
@@ -617,12 +1798,44 @@ static int buffer_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
             return -1;
         }
 
-        ctx->restore.buffered_records = p;
-        ctx->restore.allocated_rec_num = new_alloc_num;
+        ep->buffered_records = p;
+        ep->allocated_rec_num = new_alloc_num;
+    }
+
+    memcpy(&ep->buffered_records[ep->buffered_rec_num++], rec, sizeof(*rec));
+
+    return 0;
+}
+
+/*
+ * Remus: keep the skip list of the checkpoint being applied, for
+ * zero_skipped_pages() to use on failover.
+ */
+static int handle_skip_pfns(struct xc_sr_context *ctx,
+                            struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_checkpoint_skip_pfns *skip = rec->data;
+
+    if ( rec->length < sizeof(*skip) ||
+         rec->length != sizeof(*skip) +
+                        (size_t)skip->count * sizeof(skip->range[0]) )
+    {
+        ERROR("%s record wrong size: length %u",
+              rec_type_to_str(rec->type), rec->length);
+        return -1;
     }
 
-    memcpy(&ctx->restore.buffered_records[ctx->restore.buffered_rec_num++],
-           rec, sizeof(*rec));
+    if ( check_skip_ranges(ctx, skip, staged_pfn_limit(ctx)) )
+        return -1;
+
+    /* The data is taken over below, so the history has to copy it now. */
+    if ( ctx->restore.history.open && history_keep_record(ctx, rec) )
+        return -1;
+
+    free(ctx->restore.skip_pfns);
+    ctx->restore.skip_pfns = skip;
+    rec->data = NULL;
 
     return 0;
 }
@@ -638,7 +1851,8 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         break;
 
     case REC_TYPE_PAGE_DATA:
-        rc = handle_page_data(ctx, rec);
+        rc = handle_page_data(ctx, rec, ctx->restore.buffer_all_records ?
+                              ctx->restore.recv_epoch : NULL);
         break;
 
     case REC_TYPE_VERIFY:
@@ -650,11 +1864,29 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_checkpoint(ctx);
         break;
 
+    case REC_TYPE_CHECKPOINT_SKIP_PFNS:
+        rc = handle_skip_pfns(ctx, rec);
+        break;
+
+    case REC_TYPE_LIVENESS:
+        /* Having arrived is all it had to do. */
+        break;
+
     default:
         rc = ctx->restore.ops.process_record(ctx, rec);
         break;
     }
 
+    /*
+     * Records kept in the history only reach here from the thread applying
+     * checkpoints, so the type is checked first.  They are kept as processed:
+     * a delta has by now been turned into the whole record it stands for.
+     * A handler which took the data over has kept the record itself.
+     */
+    if ( !rc && history_keeps_record(rec->type) && ctx->restore.history.open &&
+         (rec->data || !rec->length) )
+        rc = history_keep_record(ctx, rec);
+
     free(rec->data);
     rec->data = NULL;
 
@@ -695,15 +1927,30 @@ static int setup(struct xc_sr_context *ctx)
         goto err;
     }
 
-    ctx->restore.buffered_records = malloc(
-        DEFAULT_BUF_RECORDS * sizeof(struct xc_sr_record));
-    if ( !ctx->restore.buffered_records )
-    {
-        ERROR("Unable to allocate memory for buffered records");
-        rc = -1;
+    rc = epoch_init(ctx, &ctx->restore.epochs[0]);
+    if ( !rc )
+        rc = epoch_init(ctx, &ctx->restore.epochs[1]);
+    if ( rc )
         goto err;
+    ctx->restore.recv_epoch = &ctx->restore.epochs[0];
+
+    if ( ctx->restore.history.max_epochs )
+    {
+        rc = history_init(ctx);
+        if ( rc )
+            goto err;
+        history_open(ctx, false);
+    }
+
+    if ( ctx->restore.pipelined )
+    {
+        rc = start_applier(ctx);
+        if ( rc )
+            goto err;
     }
-    ctx->restore.allocated_rec_num = DEFAULT_BUF_RECORDS;
+
+    if ( ctx->restore.nr_stripes )
+        rc = start_stripes(ctx);
 
  err:
     return rc;
@@ -712,22 +1959,233 @@ static int setup(struct xc_sr_context *ctx)
 static void cleanup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
-    unsigned i;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->restore.dirty_bitmap_hbuf);
 
-    for ( i = 0; i < ctx->restore.buffered_rec_num; i++ )
-        free(ctx->restore.buffered_records[i].data);
+    stop_stripes(ctx);
+    stop_applier(ctx);
+    epoch_cleanup(&ctx->restore.epochs[0]);
+    epoch_cleanup(&ctx->restore.epochs[1]);
+    history_cleanup(ctx);
+    release_guest_map(ctx);
 
     if ( ctx->restore.checkpointed == XC_MIG_STREAM_COLO )
         xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->restore.p2m_size)));
-    free(ctx->restore.buffered_records);
     free(ctx->restore.populated_pfns);
+    free(ctx->restore.skip_pfns);
     if ( ctx->restore.ops.cleanup(ctx) )
         PERROR("Failed to clean up");
 }
 
+static int zero_pages(struct xc_sr_context *ctx, xen_pfn_t *gfns,
+                      unsigned int nr)
+{
+    xc_interface *xch = ctx->xch;
+    int errs[MAX_BATCH_SIZE];
+    void *mapping;
+    unsigned int i;
+
+    mapping = xenforeignmemory_map(xch->fmem, ctx->domid,
+                                   PROT_READ | PROT_WRITE, nr, gfns, errs);
+    if ( !mapping )
+    {
+        PERROR("Unable to map %u pages to zero", nr);
+        return -1;
+    }
+
+    for ( i = 0; i < nr; ++i )
+        if ( !errs[i] )
+            memset(mapping + i * PAGE_SIZE, 0, PAGE_SIZE);
+
+    xenforeignmemory_unmap(xch->fmem, mapping, nr);
+    return 0;
+}
+
+/*
+ * Remus failover: the memory which the guest asked not to replicate holds
+ * whatever the backup last received for it.  Zero it, and tell the guest
+ * through its skip page.
+ */
+static int zero_skipped_pages(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_checkpoint_skip_pfns *skip = ctx->restore.skip_pfns;
+    struct cpsremus_skip *page;
+    xen_pfn_t gfns[MAX_BATCH_SIZE], pfn, end, gfn;
+    unsigned long zeroed = 0;
+    unsigned int i, nr = 0;
+    int rc;
+
+    if ( !skip )
+        return 0;
+
+    for ( i = 0; i < skip->count; ++i )
+    {
+        pfn = skip->range[i].pfn;
+        if ( pfn >= ctx->restore.p2m_size )
+            continue;
+
+        end = pfn + min_t(uint64_t, skip->range[i].count,
+                          ctx->restore.p2m_size - pfn);
+        for ( ; pfn < end; ++pfn )
+        {
+            if ( !pfn_is_populated(ctx, pfn) )
+                continue;
+
+            gfns[nr++] = ctx->restore.ops.pfn_to_gfn(ctx, pfn);
+            ++zeroed;
+            if ( nr == MAX_BATCH_SIZE )
+            {
+                rc = zero_pages(ctx, gfns, nr);
+                if ( rc )
+                    return rc;
+                nr = 0;
+            }
+        }
+    }
+
+    if ( nr )
+    {
+        rc = zero_pages(ctx, gfns, nr);
+        if ( rc )
+            return rc;
+    }
+
+    if ( skip->skip_pfn != INVALID_MFN &&
+         pfn_is_populated(ctx, skip->skip_pfn) )
+    {
+        gfn = ctx->restore.ops.pfn_to_gfn(ctx, skip->skip_pfn);
+        page = xenforeignmemory_map(xch->fmem, ctx->domid,
+                                    PROT_READ | PROT_WRITE, 1, &gfn, NULL);
+        if ( !page )
+        {
+            PERROR("Unable to map skip page %#"PRIpfn, skip->skip_pfn);
+            return -1;
+        }
+        page->lost++;
+        xenforeignmemory_unmap(xch->fmem, page, 1);
+    }
+
+    IPRINTF("Remus failover: zeroed %lu non-replicated pages", zeroed);
+    return 0;
+}
+
+/*
+ * Remus: write an epoch's undo log back to the guest, newest first, so that
+ * each page ends up as it was before the epoch.
+ */
+static int history_undo_pages(struct xc_sr_context *ctx,
+                              const struct xc_sr_history_entry *he)
+{
+    xc_interface *xch = ctx->xch;
+    const struct xc_sr_history_page *hp, *batch[MAX_BATCH_SIZE];
+    xen_pfn_t gfns[MAX_BATCH_SIZE];
+    int errs[MAX_BATCH_SIZE];
+    unsigned int i = he->nr_pages, j, n;
+    void *mapping;
+
+    while ( i )
+    {
+        for ( n = 0; n < MAX_BATCH_SIZE && i; )
+        {
+            hp = &he->pages[--i];
+            ctx->restore.ops.set_page_type(ctx, hp->pfn, hp->type);
+            if ( hp->written )
+            {
+                batch[n] = hp;
+                gfns[n++] = ctx->restore.ops.pfn_to_gfn(ctx, hp->pfn);
+            }
+        }
+
+        if ( !n )
+            continue;
+
+        mapping = xenforeignmemory_map(xch->fmem, ctx->domid,
+                                       PROT_READ | PROT_WRITE, n, gfns, errs);
+        if ( !mapping )
+        {
+            PERROR("Unable to map %u pages to roll back", n);
+            return -1;
+        }
+
+        for ( j = 0; j < n; j++ )
+        {
+            if ( errs[j] )
+            {
+                ERROR("Mapping pfn %#"PRIpfn" to roll back failed with %d",
+                      batch[j]->pfn, errs[j]);
+                xenforeignmemory_unmap(xch->fmem, mapping, n);
+                return -1;
+            }
+
+            if ( batch[j]->data )
+                memcpy(mapping + j * PAGE_SIZE, batch[j]->data, PAGE_SIZE);
+            else
+                memset(mapping + j * PAGE_SIZE, 0, PAGE_SIZE);
+        }
+
+        xenforeignmemory_unmap(xch->fmem, mapping, n);
+    }
+
+    return 0;
+}
+
+/*
+ * Remus failover: ask how many of the epochs in the history to go back, undo
+ * their pages and process the records of the epoch before them again.
+ */
+static int history_rollback(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_history *h = &ctx->restore.history;
+    struct xc_sr_history_entry *he;
+    unsigned int available, back, i;
+    unsigned long pages = 0;
+    int rc;
+
+    if ( !h->nr || !ctx->restore.callbacks->rollback )
+        return 0;
+
+    available = h->nr - 1;
+    rc = ctx->restore.callbacks->rollback(available,
+                                          ctx->restore.callbacks->data);
+    if ( rc < 0 )
+    {
+        ERROR("Failed to choose the checkpoint to fail over to");
+        return -1;
+    }
+
+    back = min_t(unsigned int, rc, available);
+    if ( !back )
+        return 0;
+
+    for ( i = 0; i < back; i++ )
+    {
+        he = history_entry(h, h->nr - 1 - i);
+        rc = history_undo_pages(ctx, he);
+        if ( rc )
+            return rc;
+        pages += he->nr_pages;
+    }
+
+    he = history_entry(h, h->nr - 1 - back);
+    for ( i = 0; i < he->nr_records; i++ )
+    {
+        rc = process_record(ctx, &he->records[i]);
+        if ( rc && rc != RECORD_NOT_PROCESSED )
+        {
+            ERROR("Failed to restore %s record of an earlier checkpoint",
+                  rec_type_to_str(he->records[i].type));
+            return -1;
+        }
+    }
+
+    IPRINTF("Remus failover: rolled back %u of %u checkpoints"
+            " (%lu pages restored)", back, available, pages);
+    return 0;
+}
+
 /*
  * Restore a domain.
  */
@@ -736,8 +2194,7 @@ static int restore(struct xc_sr_context *ctx)
     xc_interface *xch = ctx->xch;
     struct xc_sr_record rec;
     int rc, saved_rc = 0, saved_errno = 0;
-    FILE *cpsr_log;
-    struct timeval tv;
+    uint64_t failover_start, drained;
 
     IPRINTF("Restoring domain");
 
@@ -747,7 +2204,14 @@ static int restore(struct xc_sr_context *ctx)
 
     do
     {
-        rc = read_record(ctx, ctx->fd, &rec);
+        /*
+         * Once there is a checkpoint to fall back on, any record proves the
+         * primary is alive, and it sends liveness records whenever it has
+         * nothing else to send.  Silence means it is gone.
+         */
+        rc = read_record_timeout(ctx, ctx->fd, &rec,
+                                 ctx->restore.buffer_all_records ?
+                                 ctx->restore.liveness_timeout_ms : 0);
         if ( rc )
         {
             if ( ctx->restore.buffer_all_records )
@@ -758,7 +2222,9 @@ static int restore(struct xc_sr_context *ctx)
 
         if ( ctx->restore.buffer_all_records &&
              rec.type != REC_TYPE_END &&
-             rec.type != REC_TYPE_CHECKPOINT )
+             rec.type != REC_TYPE_CHECKPOINT &&
+             rec.type != REC_TYPE_PAGE_DATA &&
+             rec.type != REC_TYPE_LIVENESS )
         {
             rc = buffer_record(ctx, &rec);
             if ( rc )
@@ -800,17 +2266,46 @@ static int restore(struct xc_sr_context *ctx)
 
     /*
      * With Remus, if we reach here, there must be some error on primary,
-     * failover from the last checkpoint state.
+     * failover from the last checkpoint state.  Committed checkpoints have
+     * already been applied in the background, so all that is left is to let
+     * the applier finish the last one and complete the domain; the epoch
+     * which was still being received is discarded with the buffers.  With
+     * a checkpoint history, the domain may be taken back further first.
      */
-    cpsr_log = fopen("/tmp/remus_trace.log", "a");
-    gettimeofday(&tv, NULL);
-    fprintf(cpsr_log, "Time broken channel is recognized in xc: %lu\n", tv.tv_sec*1000000+tv.tv_usec);
-    fclose(cpsr_log);
+    failover_start = monotonic_us();
+
+    rc = wait_applier_idle(ctx);
+    if ( rc )
+        goto err;
+    drained = monotonic_us();
+
+    if ( ctx->restore.checkpointed == XC_MIG_STREAM_REMUS )
+    {
+        rc = history_rollback(ctx);
+        if ( rc )
+            goto err;
+
+        rc = zero_skipped_pages(ctx);
+        if ( rc )
+            goto err;
+    }
+
+    release_guest_map(ctx);
 
     rc = ctx->restore.ops.stream_complete(ctx);
     if ( rc )
         goto err;
 
+    if ( ctx->restore.checkpointed == XC_MIG_STREAM_REMUS )
+    {
+        uint64_t completed = monotonic_us();
+
+        IPRINTF("Remus failover: domain ready %"PRIu64" us after stream loss"
+                " (applier drain %"PRIu64" us, stream complete %"PRIu64" us)",
+                completed - failover_start, drained - failover_start,
+                completed - drained);
+    }
+
     IPRINTF("Restore successful");
     goto done;
 
@@ -837,7 +2332,10 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned long *console_gfn, uint32_t console_domid,
                       unsigned int hvm, unsigned int pae,
                       xc_migration_stream_t stream_type,
-                      struct restore_callbacks *callbacks, int send_back_fd)
+                      struct restore_callbacks *callbacks, int send_back_fd,
+                      unsigned int liveness_timeout_ms,
+                      const int *stripe_fds, unsigned int nr_stripe_fds,
+                      unsigned int history_epochs, unsigned int history_mb)
 {
     xen_pfn_t nr_pfns;
     struct xc_sr_context ctx =
@@ -852,8 +2350,30 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.restore.xenstore_evtchn = store_evtchn;
     ctx.restore.xenstore_domid = store_domid;
     ctx.restore.checkpointed = stream_type;
+    ctx.restore.pipelined = stream_type == XC_MIG_STREAM_REMUS;
+#ifdef __x86_64__
+    /* Mapping the whole guest wants the address space of a 64-bit tool. */
+    ctx.restore.map.enabled = stream_type == XC_MIG_STREAM_REMUS;
+#endif
     ctx.restore.callbacks = callbacks;
     ctx.restore.send_back_fd = send_back_fd;
+    if ( stream_type == XC_MIG_STREAM_REMUS )
+        ctx.restore.liveness_timeout_ms = liveness_timeout_ms;
+    ctx.restore.stripe_fds = stripe_fds;
+    ctx.restore.nr_stripes = nr_stripe_fds;
+    if ( stream_type == XC_MIG_STREAM_REMUS )
+    {
+        ctx.restore.history.max_epochs = history_epochs;
+        ctx.restore.history.max_bytes =
+            history_mb ? (size_t)history_mb << 20 : SIZE_MAX;
+    }
+
+    if ( nr_stripe_fds && stream_type != XC_MIG_STREAM_REMUS )
+    {
+        ERROR("Only Remus streams can be striped");
+        errno = EINVAL;
+        return -1;
+    }
 
     /* Sanity checks for callbacks. */
     if ( stream_type )
@@ -27,6 +27,59 @@ static int handle_hvm_context(struct xc_sr_context *ctx,
     return 0;
 }
 
+/*
+ * Process an HVM_CONTEXT_DELTA record from the stream.  It is turned into the
+ * HVM_CONTEXT record it stands for, which the checkpoint history keeps.
+ */
+static int handle_hvm_context_delta(struct xc_sr_context *ctx,
+                                    struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_hvm_context_delta *hdr = rec->data;
+    uint32_t size;
+    void *p;
+
+    if ( rec->length < sizeof(*hdr) )
+    {
+        ERROR("HVM_CONTEXT_DELTA record truncated: length %u, header size %zu",
+              rec->length, sizeof(*hdr));
+        return -1;
+    }
+
+    size = hdr->size;
+    if ( !ctx->x86_hvm.restore.context ||
+         size != ctx->x86_hvm.restore.contextsz )
+    {
+        ERROR("HVM_CONTEXT_DELTA record for a %u byte context, have %zu",
+              size, ctx->x86_hvm.restore.context ?
+              ctx->x86_hvm.restore.contextsz : 0);
+        return -1;
+    }
+
+    p = malloc(size);
+    if ( !p )
+    {
+        ERROR("Unable to allocate %u bytes for hvm context", size);
+        return -1;
+    }
+
+    memcpy(p, ctx->x86_hvm.restore.context, size);
+    if ( xc_stream_delta_apply(p, size, hdr->runs,
+                               rec->length - sizeof(*hdr)) )
+    {
+        ERROR("Malformed HVM_CONTEXT_DELTA record");
+        free(p);
+        return -1;
+    }
+
+    free(rec->data);
+    rec->type = REC_TYPE_HVM_CONTEXT;
+    rec->length = size;
+    rec->data = p;
+
+    return handle_hvm_context(ctx, rec);
+}
+
 /*
  * Process an HVM_PARAMS record from the stream.
  */
@@ -121,6 +174,13 @@ static void x86_hvm_set_page_type(struct xc_sr_context *ctx,
     /* no-op */
 }
 
+/* restore_ops function. */
+static uint32_t x86_hvm_get_page_type(const struct xc_sr_context *ctx,
+                                      xen_pfn_t pfn)
+{
+    return XEN_DOMCTL_PFINFO_NOTAB;
+}
+
 /* restore_ops function. */
 static int x86_hvm_localise_page(struct xc_sr_context *ctx,
                                  uint32_t type, void *page)
@@ -175,6 +235,9 @@ static int x86_hvm_process_record(struct xc_sr_context *ctx,
     case REC_TYPE_HVM_CONTEXT:
         return handle_hvm_context(ctx, rec);
 
+    case REC_TYPE_HVM_CONTEXT_DELTA:
+        return handle_hvm_context_delta(ctx, rec);
+
     case REC_TYPE_HVM_PARAMS:
         return handle_hvm_params(ctx, rec);
 
@@ -183,6 +246,15 @@ static int x86_hvm_process_record(struct xc_sr_context *ctx,
     }
 }
 
+/*
+ * restore_ops function.  Nothing in the HVM stream_complete() scales with
+ * guest size, so there is no work to bring forward.
+ */
+static int x86_hvm_checkpoint_applied(struct xc_sr_context *ctx)
+{
+    return 0;
+}
+
 /*
  * restore_ops function.  Sets extra hvm parameters and seeds the grant table.
  */
@@ -243,9 +315,11 @@ struct xc_sr_restore_ops restore_ops_x86_hvm =
     .pfn_to_gfn      = x86_hvm_pfn_to_gfn,
     .set_gfn         = x86_hvm_set_gfn,
     .set_page_type   = x86_hvm_set_page_type,
+    .get_page_type   = x86_hvm_get_page_type,
     .localise_page   = x86_hvm_localise_page,
     .setup           = x86_hvm_setup,
     .process_record  = x86_hvm_process_record,
+    .checkpoint_applied = x86_hvm_checkpoint_applied,
     .stream_complete = x86_hvm_stream_complete,
     .cleanup         = x86_hvm_cleanup,
 };
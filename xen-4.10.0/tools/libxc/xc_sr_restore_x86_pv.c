@@ -28,6 +28,9 @@ static int expand_p2m(struct xc_sr_context *ctx, unsigned long max_pfn)
 
     assert(max_pfn > old_max);
 
+    /* The dirty p2m frame tracking is sized for the old p2m. */
+    ctx->x86_pv.restore.guest_p2m_current = false;
+
     p2msz = (max_pfn + 1) * ctx->x86_pv.width;
     p2m = realloc(ctx->x86_pv.p2m, p2msz);
     if ( !p2m )
@@ -520,63 +523,165 @@ static int update_vcpu_context(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Find the mfn of p2m_frame_list[i], checking that it is a sane frame of the
+ * guest's p2m.
+ */
+static int p2m_frame_mfn(struct xc_sr_context *ctx, unsigned i,
+                         xen_pfn_t *mfn)
+{
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t pfn = ctx->x86_pv.p2m_pfns[i];
+
+    if ( pfn > ctx->x86_pv.max_pfn )
+    {
+        ERROR("pfn (%#lx) for p2m_frame_list[%u] out of range",
+              pfn, i);
+        return -1;
+    }
+    else if ( (ctx->x86_pv.restore.pfn_types[pfn] !=
+               XEN_DOMCTL_PFINFO_NOTAB) )
+    {
+        ERROR("pfn (%#lx) for p2m_frame_list[%u] has bad type %u", pfn, i,
+              (ctx->x86_pv.restore.pfn_types[pfn] >>
+               XEN_DOMCTL_PFINFO_LTAB_SHIFT));
+        return -1;
+    }
+
+    *mfn = pfn_to_mfn(ctx, pfn);
+    if ( !mfn_in_pseudophysmap(ctx, *mfn) )
+    {
+        ERROR("p2m_frame_list[%u] has bad mfn", i);
+        dump_bad_pseudophysmap_entry(ctx, *mfn);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Start tracking which frames of the guest's p2m go out of date, once it has
+ * been written in full.
+ */
+static int track_guest_p2m(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned long *dirty, *frame_pfns;
+    unsigned i;
+
+    dirty = bitmap_alloc(ctx->x86_pv.p2m_frames);
+    frame_pfns = bitmap_alloc(ctx->x86_pv.max_pfn + 1);
+    if ( !dirty || !frame_pfns )
+    {
+        ERROR("Unable to allocate memory to track %u p2m frames",
+              ctx->x86_pv.p2m_frames);
+        free(dirty);
+        free(frame_pfns);
+        return -1;
+    }
+
+    /* update_guest_p2m() has checked the frame list. */
+    for ( i = 0; i < ctx->x86_pv.p2m_frames; ++i )
+        set_bit(ctx->x86_pv.p2m_pfns[i], frame_pfns);
+
+    free(ctx->x86_pv.restore.dirty_p2m_frames);
+    free(ctx->x86_pv.restore.p2m_frame_pfns);
+    ctx->x86_pv.restore.dirty_p2m_frames = dirty;
+    ctx->x86_pv.restore.p2m_frame_pfns = frame_pfns;
+    ctx->x86_pv.restore.nr_dirty_p2m_frames = 0;
+    ctx->x86_pv.restore.guest_p2m_current = true;
+
+    return 0;
+}
+
+/* Note that frame i of the guest's p2m is out of date. */
+static void dirty_guest_p2m_frame(struct xc_sr_context *ctx, unsigned i)
+{
+    if ( !test_bit(i, ctx->x86_pv.restore.dirty_p2m_frames) )
+    {
+        set_bit(i, ctx->x86_pv.restore.dirty_p2m_frames);
+        ctx->x86_pv.restore.nr_dirty_p2m_frames++;
+    }
+}
+
 /*
  * Copy the p2m which has been constructed locally as memory has been
  * allocated, over the p2m in guest, so the guest can find its memory again on
- * resume.
+ * resume.  May be called repeatedly under Remus, so the frame list itself is
+ * left in terms of pfns, and once the whole p2m has been written, only the
+ * frames which have gone out of date since are.
  */
 static int update_guest_p2m(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
-    xen_pfn_t mfn, pfn, *guest_p2m = NULL;
-    unsigned i;
+    bool all = !ctx->x86_pv.restore.guest_p2m_current;
+    size_t p2m_size = (ctx->x86_pv.max_pfn + 1) * ctx->x86_pv.width, len;
+    xen_pfn_t *mfns = NULL;
+    unsigned *frames = NULL;
+    void *guest_p2m = NULL;
+    unsigned i, nr = 0, max;
     int rc = -1;
 
-    for ( i = 0; i < ctx->x86_pv.p2m_frames; ++i )
+    max = all ? ctx->x86_pv.p2m_frames : ctx->x86_pv.restore.nr_dirty_p2m_frames;
+    if ( !max )
+        return 0;
+
+    mfns = malloc(max * sizeof(*mfns));
+    frames = malloc(max * sizeof(*frames));
+    if ( !mfns || !frames )
     {
-        pfn = ctx->x86_pv.p2m_pfns[i];
+        ERROR("Unable to allocate memory for %u p2m frames", max);
+        goto err;
+    }
 
-        if ( pfn > ctx->x86_pv.max_pfn )
-        {
-            ERROR("pfn (%#lx) for p2m_frame_list[%u] out of range",
-                  pfn, i);
-            goto err;
-        }
-        else if ( (ctx->x86_pv.restore.pfn_types[pfn] !=
-                   XEN_DOMCTL_PFINFO_NOTAB) )
-        {
-            ERROR("pfn (%#lx) for p2m_frame_list[%u] has bad type %u", pfn, i,
-                  (ctx->x86_pv.restore.pfn_types[pfn] >>
-                   XEN_DOMCTL_PFINFO_LTAB_SHIFT));
-            goto err;
-        }
+    /* The arrays only have room for max frames, whatever the bitmap says. */
+    for ( i = 0; i < ctx->x86_pv.p2m_frames && nr < max; ++i )
+    {
+        if ( !all && !test_bit(i, ctx->x86_pv.restore.dirty_p2m_frames) )
+            continue;
 
-        mfn = pfn_to_mfn(ctx, pfn);
-        if ( !mfn_in_pseudophysmap(ctx, mfn) )
-        {
-            ERROR("p2m_frame_list[%u] has bad mfn", i);
-            dump_bad_pseudophysmap_entry(ctx, mfn);
+        if ( p2m_frame_mfn(ctx, i, &mfns[nr]) )
             goto err;
-        }
+        frames[nr++] = i;
+    }
 
-        ctx->x86_pv.p2m_pfns[i] = mfn;
+    if ( !nr )
+    {
+        ERROR("No dirty p2m frames found of %u expected", max);
+        goto err;
     }
 
-    guest_p2m = xc_map_foreign_pages(xch, ctx->domid, PROT_WRITE,
-                                     ctx->x86_pv.p2m_pfns,
-                                     ctx->x86_pv.p2m_frames );
+    guest_p2m = xc_map_foreign_pages(xch, ctx->domid, PROT_WRITE, mfns, nr);
     if ( !guest_p2m )
     {
         PERROR("Failed to map p2m frames");
         goto err;
     }
 
-    memcpy(guest_p2m, ctx->x86_pv.p2m,
-           (ctx->x86_pv.max_pfn + 1) * ctx->x86_pv.width);
-    rc = 0;
+    for ( i = 0; i < nr; ++i )
+    {
+        len = min_t(size_t, PAGE_SIZE,
+                    p2m_size - (size_t)frames[i] * PAGE_SIZE);
+        memcpy(guest_p2m + (size_t)i * PAGE_SIZE,
+               (void *)ctx->x86_pv.p2m + (size_t)frames[i] * PAGE_SIZE, len);
+    }
+
+    if ( all )
+        /* Only a checkpointed stream writes it again. */
+        rc = ctx->restore.checkpointed ? track_guest_p2m(ctx) : 0;
+    else
+    {
+        for ( i = 0; i < nr; ++i )
+            clear_bit(frames[i], ctx->x86_pv.restore.dirty_p2m_frames);
+        ctx->x86_pv.restore.nr_dirty_p2m_frames = 0;
+        rc = 0;
+    }
+
  err:
     if ( guest_p2m )
-        munmap(guest_p2m, ctx->x86_pv.p2m_frames * PAGE_SIZE);
+        munmap(guest_p2m, nr * PAGE_SIZE);
+    free(frames);
+    free(mfns);
 
     return rc;
 }
@@ -707,6 +812,7 @@ static int handle_x86_pv_p2m_frames(struct xc_sr_context *ctx,
 
     for ( x = 0; x < (end - start); ++x )
         ctx->x86_pv.p2m_pfns[start + x] = data->p2m_pfns[x];
+    ctx->x86_pv.restore.guest_p2m_current = false;
 
     return 0;
 }
@@ -920,6 +1026,26 @@ static void x86_pv_set_page_type(struct xc_sr_context *ctx, xen_pfn_t pfn,
     assert(pfn <= ctx->x86_pv.max_pfn);
 
     ctx->x86_pv.restore.pfn_types[pfn] = type;
+
+    /* The page may be about to be overwritten with the primary's p2m. */
+    if ( ctx->x86_pv.restore.guest_p2m_current &&
+         test_bit(pfn, ctx->x86_pv.restore.p2m_frame_pfns) )
+    {
+        unsigned i;
+
+        for ( i = 0; i < ctx->x86_pv.p2m_frames; ++i )
+            if ( ctx->x86_pv.p2m_pfns[i] == pfn )
+                dirty_guest_p2m_frame(ctx, i);
+    }
+}
+
+/* restore_ops function. */
+static uint32_t x86_pv_get_page_type(const struct xc_sr_context *ctx,
+                                     xen_pfn_t pfn)
+{
+    assert(pfn <= ctx->x86_pv.max_pfn);
+
+    return ctx->x86_pv.restore.pfn_types[pfn];
 }
 
 /* restore_ops function. */
@@ -928,6 +1054,9 @@ static void x86_pv_set_gfn(struct xc_sr_context *ctx, xen_pfn_t pfn,
 {
     assert(pfn <= ctx->x86_pv.max_pfn);
 
+    if ( ctx->x86_pv.restore.guest_p2m_current )
+        dirty_guest_p2m_frame(ctx, pfn / (PAGE_SIZE / ctx->x86_pv.width));
+
     if ( ctx->x86_pv.width == sizeof(uint64_t) )
         /* 64 bit guest.  Need to expand INVALID_MFN for 32 bit toolstacks. */
         ((uint64_t *)ctx->x86_pv.p2m)[pfn] = mfn == INVALID_MFN ? ~0ULL : mfn;
@@ -1118,6 +1247,21 @@ static int x86_pv_stream_complete(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * restore_ops function.  The guest's copy of the p2m is the part of
+ * stream_complete() which scales with guest size, so refresh it ahead of
+ * any failover: in full the first time, and after that only the frames the
+ * epoch touched.  Pagetables can't be pinned early, as the next checkpoint
+ * must still be able to write them.
+ */
+static int x86_pv_checkpoint_applied(struct xc_sr_context *ctx)
+{
+    if ( !ctx->x86_pv.p2m_frames )
+        return 0;
+
+    return update_guest_p2m(ctx);
+}
+
 /*
  * restore_ops function.
  */
@@ -1145,6 +1289,8 @@ static int x86_pv_cleanup(struct xc_sr_context *ctx)
     }
 
     free(ctx->x86_pv.restore.pfn_types);
+    free(ctx->x86_pv.restore.dirty_p2m_frames);
+    free(ctx->x86_pv.restore.p2m_frame_pfns);
 
     if ( ctx->x86_pv.m2p )
         munmap(ctx->x86_pv.m2p, ctx->x86_pv.nr_m2p_frames * PAGE_SIZE);
@@ -1157,10 +1303,12 @@ struct xc_sr_restore_ops restore_ops_x86_pv =
     .pfn_is_valid    = x86_pv_pfn_is_valid,
     .pfn_to_gfn      = pfn_to_mfn,
     .set_page_type   = x86_pv_set_page_type,
+    .get_page_type   = x86_pv_get_page_type,
     .set_gfn         = x86_pv_set_gfn,
     .localise_page   = x86_pv_localise_page,
     .setup           = x86_pv_setup,
     .process_record  = x86_pv_process_record,
+    .checkpoint_applied = x86_pv_checkpoint_applied,
     .stream_complete = x86_pv_stream_complete,
     .cleanup         = x86_pv_cleanup,
 };
@@ -3,6 +3,19 @@
 
 #include "xc_sr_common.h"
 
+#ifdef __linux__
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define XC_SR_ZEROCOPY
+#endif
+
+#include <xen/io/cpsremus.h>
+
 /*
  * Writes an Image header and Domain header into the stream.
  */
@@ -66,6 +79,319 @@ static int write_checkpoint_record(struct xc_sr_context *ctx)
     return write_record(ctx, &checkpoint);
 }
 
+/*
+ * Remus: end the epoch on every stripe, ahead of the CHECKPOINT record on
+ * the main stream.
+ */
+static int write_stripe_checkpoints(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rhdr rhdr = { REC_TYPE_CHECKPOINT, 0 };
+    unsigned int i;
+
+    for ( i = 0; i < ctx->save.nr_stripes; ++i )
+    {
+        if ( write_exact(ctx->save.stripe_fds[i], &rhdr, sizeof(rhdr)) )
+        {
+            PERROR("Unable to write checkpoint record to stripe %u", i);
+            return -1;
+        }
+        ctx->save.stream_bytes += sizeof(rhdr);
+    }
+
+    return 0;
+}
+
+/*
+ * Zero-copy send of page data.  Where the stream is a socket which accepts
+ * SO_ZEROCOPY, the pages of a batch are sent with MSG_ZEROCOPY straight from
+ * the mappings of the guest, and the kernel reports on the socket's error
+ * queue when it has finished with each send.  A batch is then queued on
+ * zc_pending rather than unmapped, until its sends are complete.  Where the
+ * kernel cannot send from the mappings after all (it cannot pin foreign
+ * pages in a PV dom0, and copies on loopback), the connection goes back to
+ * plain writes.
+ */
+static void zerocopy_setup(struct xc_sr_context *ctx)
+{
+#ifdef XC_SR_ZEROCOPY
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_zc_fd *zc;
+    unsigned int i;
+    int one = 1;
+
+    ctx->save.zc_fds = calloc(ctx->save.nr_stripes + 1,
+                              sizeof(*ctx->save.zc_fds));
+    if ( !ctx->save.zc_fds )
+        return;
+
+    for ( i = 0; i <= ctx->save.nr_stripes; ++i )
+    {
+        zc = &ctx->save.zc_fds[i];
+        zc->fd = i ? ctx->save.stripe_fds[i - 1] : ctx->fd;
+        zc->enabled = !setsockopt(zc->fd, SOL_SOCKET, SO_ZEROCOPY,
+                                  &one, sizeof(one));
+        if ( zc->enabled )
+            DPRINTF("Zero-copy send enabled on fd %d", zc->fd);
+    }
+#endif
+}
+
+static struct xc_sr_zc_fd *zerocopy_fd(struct xc_sr_context *ctx, int fd)
+{
+    unsigned int i;
+
+    for ( i = 0; ctx->save.zc_fds && i <= ctx->save.nr_stripes; ++i )
+        if ( ctx->save.zc_fds[i].fd == fd )
+            return ctx->save.zc_fds[i].enabled ? &ctx->save.zc_fds[i] : NULL;
+
+    return NULL;
+}
+
+#ifdef XC_SR_ZEROCOPY
+static void zerocopy_disable(struct xc_sr_context *ctx,
+                             struct xc_sr_zc_fd *zc, const char *why)
+{
+    xc_interface *xch = ctx->xch;
+
+    if ( !zc->enabled )
+        return;
+
+    DPRINTF("Zero-copy send disabled on fd %d: %s", zc->fd, why);
+    zc->enabled = false;
+}
+
+/*
+ * Take the completions off zc->fd's error queue, waiting up to timeout_ms
+ * (-1 for ever) if there are none.  Returns 1 if some were found, 0 if the
+ * wait timed out, or -1 on error.
+ */
+static int zerocopy_reap(struct xc_sr_context *ctx, struct xc_sr_zc_fd *zc,
+                         int timeout_ms)
+{
+    xc_interface *xch = ctx->xch;
+    struct pollfd pfd = { .fd = zc->fd };
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+    int found = 0;
+
+    for ( ;; )
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if ( recvmsg(zc->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1 )
+        {
+            if ( errno == EINTR )
+                continue;
+            if ( errno != EAGAIN && errno != EWOULDBLOCK )
+            {
+                PERROR("Unable to read zero-copy completions on fd %d",
+                       zc->fd);
+                return -1;
+            }
+            if ( found || timeout_ms == 0 )
+                return found;
+
+            /* Pending error queue entries are signalled as POLLERR. */
+            switch ( poll(&pfd, 1, timeout_ms) )
+            {
+            case -1:
+                if ( errno == EINTR )
+                    continue;
+                PERROR("Unable to wait for zero-copy completions");
+                return -1;
+            case 0:
+                return 0;
+            }
+            continue;
+        }
+
+        for ( cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm) )
+        {
+            if ( !(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                 !(cm->cmsg_level == SOL_IPV6 &&
+                   cm->cmsg_type == IPV6_RECVERR) )
+                continue;
+
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if ( serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno )
+            {
+                ERROR("Unexpected error %u (origin %u) on fd %d",
+                      serr->ee_errno, serr->ee_origin, zc->fd);
+                errno = serr->ee_errno ?: EIO;
+                return -1;
+            }
+
+            /* TCP completes sends in order: [ee_info, ee_data]. */
+            zc->completed = serr->ee_data + 1;
+            found = 1;
+
+            if ( serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED )
+                zerocopy_disable(ctx, zc, "the kernel copied the data");
+        }
+    }
+}
+
+static bool zerocopy_done(const struct xc_sr_zc_batch *b)
+{
+    return (int32_t)(b->zc->completed - b->seq) >= 0;
+}
+#endif
+
+static void zerocopy_free(struct xc_sr_context *ctx, struct xc_sr_zc_batch *b)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned int i;
+
+    if ( b->mapping )
+        xenforeignmemory_unmap(xch->fmem, b->mapping, b->nr_mapped);
+    for ( i = 0; b->local_pages && i < b->nr_local; ++i )
+        free(b->local_pages[i]);
+    free(b->local_pages);
+}
+
+static void zerocopy_pop(struct xc_sr_context *ctx)
+{
+    zerocopy_free(ctx, &ctx->save.zc_pending[ctx->save.zc_head]);
+    ctx->save.zc_head = (ctx->save.zc_head + 1) % XC_SR_ZC_MAX_PENDING;
+    ctx->save.nr_zc_pending--;
+}
+
+/*
+ * Release the batches which the kernel has finished with.  With wait, wait
+ * for all of them, for no longer than timeout_ms (-1 for ever).  Batches
+ * left over on error or at timeout are released regardless.
+ */
+static int zerocopy_release(struct xc_sr_context *ctx, bool wait,
+                            int timeout_ms)
+{
+    int rc = 0;
+
+    while ( ctx->save.nr_zc_pending )
+    {
+#ifdef XC_SR_ZEROCOPY
+        xc_interface *xch = ctx->xch;
+        struct xc_sr_zc_batch *b = &ctx->save.zc_pending[ctx->save.zc_head];
+
+        while ( !rc && !zerocopy_done(b) )
+        {
+            rc = zerocopy_reap(ctx, b->zc, wait ? timeout_ms : 0);
+            if ( rc == 0 )
+            {
+                if ( !wait )
+                    return 0;
+
+                ERROR("Timed out waiting for zero-copy sends on fd %d",
+                      b->zc->fd);
+                rc = -1;
+            }
+            else if ( rc == 1 )
+                rc = 0;
+        }
+#endif
+
+        zerocopy_pop(ctx);
+    }
+
+    return rc;
+}
+
+/*
+ * Send the page data of a batch with MSG_ZEROCOPY.  *used is set if any of
+ * it was, in which case the pages must stay put until the kernel is done.
+ */
+static int zerocopy_writev(struct xc_sr_context *ctx, struct xc_sr_zc_fd *zc,
+                           struct iovec *iov, int iovcnt, bool *used)
+{
+#ifdef XC_SR_ZEROCOPY
+    struct msghdr msg = { 0 };
+    ssize_t len;
+
+    while ( iovcnt && zc->enabled )
+    {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = min(iovcnt, IOV_MAX);
+
+        len = sendmsg(zc->fd, &msg, MSG_ZEROCOPY);
+        if ( len == -1 )
+        {
+            if ( errno == EINTR )
+                continue;
+            /* Out of room for completions: take some and try again. */
+            if ( errno == ENOBUFS && zc->issued != zc->completed &&
+                 zerocopy_reap(ctx, zc, -1) == 1 )
+                continue;
+
+            /* Plain writes of the rest fail too if the socket is broken. */
+            zerocopy_disable(ctx, zc, strerror(errno));
+            break;
+        }
+        else if ( len == 0 )
+            return -1;
+
+        zc->issued++;
+        *used = true;
+
+        while ( len > 0 && iovcnt )
+        {
+            if ( len >= iov->iov_len )
+            {
+                len -= iov->iov_len;
+                ++iov;
+                --iovcnt;
+            }
+            else
+            {
+                iov->iov_base += len;
+                iov->iov_len -= len;
+                len = 0;
+            }
+        }
+    }
+#endif
+
+    return writev_exact(zc->fd, iov, iovcnt);
+}
+
+/*
+ * Queue a batch sent with zerocopy_writev() until the kernel is done with
+ * it, making room by waiting for the oldest if need be.
+ */
+static int zerocopy_retire(struct xc_sr_context *ctx, struct xc_sr_zc_fd *zc,
+                           void *mapping, unsigned int nr_mapped,
+                           void **local_pages, unsigned int nr_local)
+{
+    struct xc_sr_zc_batch *b;
+    int rc = zerocopy_release(ctx, false, 0);
+
+    if ( ctx->save.nr_zc_pending == XC_SR_ZC_MAX_PENDING )
+    {
+#ifdef XC_SR_ZEROCOPY
+        b = &ctx->save.zc_pending[ctx->save.zc_head];
+        while ( !rc && !zerocopy_done(b) )
+            rc = zerocopy_reap(ctx, b->zc, -1) == 1 ? 0 : -1;
+#endif
+        zerocopy_pop(ctx);
+    }
+
+    b = &ctx->save.zc_pending[(ctx->save.zc_head + ctx->save.nr_zc_pending) %
+                              XC_SR_ZC_MAX_PENDING];
+    ctx->save.nr_zc_pending++;
+
+    b->zc = zc;
+    b->seq = zc->issued;
+    b->mapping = mapping;
+    b->nr_mapped = nr_mapped;
+    b->local_pages = local_pages;
+    b->nr_local = nr_local;
+
+    return rc;
+}
+
 /*
  * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
  * is constructed in ctx->save.batch_pfns.
@@ -89,6 +415,8 @@ static int write_batch(struct xc_sr_context *ctx)
     void *page, *orig_page;
     uint64_t *rec_pfns = NULL;
     struct iovec *iov = NULL; int iovcnt = 0;
+    struct xc_sr_zc_fd *zc = zerocopy_fd(ctx, ctx->save.batch_fd);
+    bool zc_used = false;
     struct xc_sr_rec_page_data_header hdr = { 0 };
     struct xc_sr_record rec =
     {
@@ -250,7 +578,23 @@ static int write_batch(struct xc_sr_context *ctx)
         }
     }
 
-    if ( writev_exact(ctx->fd, iov, iovcnt) )
+    for ( i = 0; i < iovcnt; ++i )
+        ctx->save.stream_bytes += iov[i].iov_len;
+
+    /*
+     * Only the pages go zero-copy: the headers are on the stack or freed
+     * below, so are copied by a plain write.
+     */
+    if ( zc && iovcnt > 4 )
+    {
+        if ( writev_exact(ctx->save.batch_fd, iov, 4) ||
+             zerocopy_writev(ctx, zc, &iov[4], iovcnt - 4, &zc_used) )
+        {
+            PERROR("Failed to write page data to stream");
+            goto err;
+        }
+    }
+    else if ( writev_exact(ctx->save.batch_fd, iov, iovcnt) )
     {
         PERROR("Failed to write page data to stream");
         goto err;
@@ -262,6 +606,15 @@ static int write_batch(struct xc_sr_context *ctx)
 
  err:
     free(rec_pfns);
+    if ( zc_used )
+    {
+        /* The kernel may still be reading the pages. */
+        if ( zerocopy_retire(ctx, zc, guest_mapping, nr_pages_mapped,
+                             local_pages, nr_pfns) )
+            rc = -1;
+        guest_mapping = NULL;
+        local_pages = NULL;
+    }
     if ( guest_mapping )
         xenforeignmemory_unmap(xch->fmem, guest_mapping, nr_pages_mapped);
     for ( i = 0; local_pages && i < nr_pfns; ++i )
@@ -299,17 +652,37 @@ static int flush_batch(struct xc_sr_context *ctx)
 }
 
 /*
- * Add a single pfn to the batch, flushing the batch if full.
+ * The connection to send a pfn on.  Striped epochs are spread over the
+ * stripes in runs of MAX_BATCH_SIZE pfns, so that a sweep of the dirty
+ * bitmap keeps all of them busy, and a pfn always goes the same way.
+ */
+static int batch_fd(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    if ( !ctx->save.stripes_active )
+        return ctx->fd;
+
+    return ctx->save.stripe_fds[(pfn / MAX_BATCH_SIZE) %
+                                ctx->save.nr_stripes];
+}
+
+/*
+ * Add a single pfn to the batch, flushing the batch if full, or if the pfn
+ * is for another connection.
  */
 static int add_to_batch(struct xc_sr_context *ctx, xen_pfn_t pfn)
 {
+    int fd = batch_fd(ctx, pfn);
     int rc = 0;
 
-    if ( ctx->save.nr_batch_pfns == MAX_BATCH_SIZE )
+    if ( ctx->save.nr_batch_pfns == MAX_BATCH_SIZE ||
+         (ctx->save.nr_batch_pfns && fd != ctx->save.batch_fd) )
         rc = flush_batch(ctx);
 
     if ( rc == 0 )
+    {
+        ctx->save.batch_fd = fd;
         ctx->save.batch_pfns[ctx->save.nr_batch_pfns++] = pfn;
+    }
 
     return rc;
 }
@@ -620,6 +993,112 @@ static int colo_merge_secondary_dirty_bitmap(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Remus: read the guest's list of memory not to replicate, while it is
+ * suspended.  A list which cannot be read is ignored from then on, and all
+ * memory replicated again.
+ */
+static void read_skip_list(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_checkpoint_skip_pfns *rec = ctx->save.skip_rec;
+    struct cpsremus_skip *skip;
+    xen_pfn_t gfn;
+    unsigned int i;
+
+    rec->skip_pfn = ctx->save.skip_pfn;
+    rec->count = 0;
+
+    if ( ctx->save.skip_pfn == INVALID_MFN )
+        return;
+
+    if ( ctx->save.skip_pfn >= ctx->save.p2m_size ||
+         (gfn = ctx->save.ops.pfn_to_gfn(ctx, ctx->save.skip_pfn)) ==
+         INVALID_MFN )
+    {
+        ERROR("Skip page pfn %#"PRIpfn" out of range, ignoring it",
+              ctx->save.skip_pfn);
+        goto disable;
+    }
+
+    skip = xenforeignmemory_map(xch->fmem, ctx->domid, PROT_READ,
+                                1, &gfn, NULL);
+    if ( !skip )
+    {
+        PERROR("Failed to map skip page %#"PRIpfn", ignoring it",
+               ctx->save.skip_pfn);
+        goto disable;
+    }
+
+    /* rec has room for CPSREMUS_SKIP_MAX_RANGES; more is rejected below. */
+    rec->count = skip->nr_ranges;
+    for ( i = 0; i < min_t(uint32_t, rec->count, CPSREMUS_SKIP_MAX_RANGES);
+          ++i )
+    {
+        rec->range[i].pfn = skip->range[i].pfn;
+        rec->range[i].count = skip->range[i].count;
+    }
+
+    xenforeignmemory_unmap(xch->fmem, skip, 1);
+
+    if ( check_skip_ranges(ctx, rec, ctx->save.p2m_size) )
+    {
+        ERROR("Bad skip list at pfn %#"PRIpfn", ignoring it",
+              ctx->save.skip_pfn);
+        rec->count = 0;
+        goto disable;
+    }
+    return;
+
+ disable:
+    ctx->save.skip_pfn = rec->skip_pfn = INVALID_MFN;
+}
+
+/*
+ * Remus: take the pages on the skip list out of a checkpoint, and send the
+ * ranges which have been dropped from it since the last checkpoint in
+ * full, since the backup only has stale copies of them.  Returns the
+ * number of pages left to send.
+ */
+static unsigned long mask_skipped_pages(struct xc_sr_context *ctx,
+                                        unsigned long *dirty_bitmap)
+{
+    struct xc_sr_rec_checkpoint_skip_pfns *rec = ctx->save.skip_rec;
+    unsigned char *dirty = (unsigned char *)dirty_bitmap;
+    unsigned char *old = (unsigned char *)ctx->save.skipped_pages;
+    unsigned char *new = (unsigned char *)ctx->save.skip_scratch;
+    unsigned long *swap;
+    xen_pfn_t pfn, end;
+    unsigned long entries = 0;
+    unsigned int i;
+    int b;
+
+    /*
+     * read_skip_list() has checked the ranges to be disjoint and within
+     * the p2m, so this sets at most p2m_size bits.
+     */
+    bitmap_clear(new, ctx->save.p2m_size);
+    for ( i = 0; i < rec->count; ++i )
+    {
+        pfn = rec->range[i].pfn;
+        end = pfn + rec->range[i].count;
+        for ( ; pfn < end; ++pfn )
+            set_bit(pfn, new);
+    }
+
+    for ( b = 0; b < bitmap_size(ctx->save.p2m_size); ++b )
+    {
+        dirty[b] = (dirty[b] | old[b]) & ~new[b];
+        entries += __builtin_popcount(dirty[b]);
+    }
+
+    swap = ctx->save.skipped_pages;
+    ctx->save.skipped_pages = ctx->save.skip_scratch;
+    ctx->save.skip_scratch = swap;
+
+    return entries;
+}
+
 /*
  * Suspend the domain and send dirty memory.
  * This is the last iteration of the live migration and the
@@ -630,6 +1109,7 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
     xc_interface *xch = ctx->xch;
     xc_shadow_op_stats_t stats = { 0, ctx->save.p2m_size };
     char *progress_str = NULL;
+    uint64_t start;
     int rc;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
@@ -638,6 +1118,8 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
     if ( rc )
         goto out;
 
+    start = monotonic_us();
+
     if ( xc_shadow_control(
              xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
              HYPERCALL_BUFFER(dirty_bitmap), ctx->save.p2m_size,
@@ -649,6 +1131,9 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
         goto out;
     }
 
+    ctx->save.checkpoint_bitmap_us = monotonic_us() - start;
+    start += ctx->save.checkpoint_bitmap_us;
+
     if ( ctx->save.live )
     {
         rc = update_progress_string(ctx, &progress_str);
@@ -670,10 +1155,36 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
         }
     }
 
-    rc = send_dirty_pages(ctx, stats.dirty_count + ctx->save.nr_deferred_pages);
+    ctx->save.checkpoint_pages = stats.dirty_count +
+        ctx->save.nr_deferred_pages;
+
+    if ( ctx->save.skip_rec )
+    {
+        struct xc_sr_record rec =
+        {
+            .type = REC_TYPE_CHECKPOINT_SKIP_PFNS,
+            .data = ctx->save.skip_rec,
+        };
+
+        read_skip_list(ctx);
+        ctx->save.checkpoint_pages = mask_skipped_pages(ctx, dirty_bitmap);
+
+        rec.length = sizeof(*ctx->save.skip_rec) +
+            ctx->save.skip_rec->count * sizeof(ctx->save.skip_rec->range[0]);
+        rc = write_record(ctx, &rec);
+        if ( rc )
+            goto out;
+    }
+
+    rc = send_dirty_pages(ctx, ctx->save.checkpoint_pages);
     if ( rc )
         goto out;
 
+    ctx->save.checkpoint_pages += ctx->save.precopy_pages;
+    ctx->save.precopy_pages = 0;
+
+    ctx->save.checkpoint_send_us = monotonic_us() - start;
+
     bitmap_clear(ctx->save.deferred_pages, ctx->save.p2m_size);
     ctx->save.nr_deferred_pages = 0;
 
@@ -683,6 +1194,62 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Send the pages dirtied since the last checkpoint or pre-copy pass while
+ * the guest keeps running (Remus only).  The backup buffers them with the
+ * rest of the epoch.  Anything dirtied again after the bitmap has been
+ * cleaned here is sent once more, by the next pass or by
+ * suspend_and_send_dirty(), so the guest is only suspended for the pages
+ * it re-dirties.
+ */
+static int send_precopy_pass(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    xc_shadow_op_stats_t stats = { 0, ctx->save.p2m_size };
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    if ( xc_shadow_control(
+             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+             HYPERCALL_BUFFER(dirty_bitmap), ctx->save.p2m_size,
+             NULL, 0, &stats) != ctx->save.p2m_size )
+    {
+        PERROR("Failed to retrieve logdirty bitmap");
+        return -1;
+    }
+
+    /*
+     * Leave out what the last checkpoint skipped.  Should the guest take it
+     * off its list, the next checkpoint sends all of it anyway.
+     */
+    if ( ctx->save.skip_rec )
+    {
+        unsigned char *dirty = (unsigned char *)dirty_bitmap;
+        const unsigned char *skipped =
+            (const unsigned char *)ctx->save.skipped_pages;
+        int b;
+
+        stats.dirty_count = 0;
+        for ( b = 0; b < bitmap_size(ctx->save.p2m_size); ++b )
+        {
+            dirty[b] &= ~skipped[b];
+            stats.dirty_count += __builtin_popcount(dirty[b]);
+        }
+    }
+
+    if ( stats.dirty_count == 0 )
+        return 0;
+
+    xc_set_progress_prefix(xch, "Background pre-copy");
+    rc = send_dirty_pages(ctx, stats.dirty_count);
+    xc_set_progress_prefix(xch, NULL);
+
+    ctx->save.precopy_pages += stats.dirty_count;
+
+    return rc;
+}
+
 static int verify_frames(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
@@ -809,6 +1376,28 @@ static int setup(struct xc_sr_context *ctx)
         goto err;
     }
 
+    if ( ctx->save.checkpointed == XC_MIG_STREAM_REMUS &&
+         ctx->save.skip_pfn != INVALID_MFN )
+    {
+        ctx->save.skip_rec = malloc(sizeof(*ctx->save.skip_rec) +
+                                    CPSREMUS_SKIP_MAX_RANGES *
+                                    sizeof(ctx->save.skip_rec->range[0]));
+        ctx->save.skipped_pages = bitmap_alloc(ctx->save.p2m_size);
+        ctx->save.skip_scratch = bitmap_alloc(ctx->save.p2m_size);
+
+        if ( !ctx->save.skip_rec || !ctx->save.skipped_pages ||
+             !ctx->save.skip_scratch )
+        {
+            ERROR("Unable to allocate memory for the skip list");
+            rc = -1;
+            errno = ENOMEM;
+            goto err;
+        }
+        memset(ctx->save.skip_rec, 0, sizeof(*ctx->save.skip_rec));
+    }
+
+    zerocopy_setup(ctx);
+
     rc = 0;
 
  err:
@@ -822,6 +1411,10 @@ static void cleanup(struct xc_sr_context *ctx)
                                     &ctx->save.dirty_bitmap_hbuf);
 
 
+    /* Sends which have not completed by now are not going to. */
+    zerocopy_release(ctx, true, 1000);
+    free(ctx->save.zc_fds);
+
     xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_OFF,
                       NULL, 0, NULL, 0, NULL);
 
@@ -832,6 +1425,9 @@ static void cleanup(struct xc_sr_context *ctx)
                                    NRPAGES(bitmap_size(ctx->save.p2m_size)));
     free(ctx->save.deferred_pages);
     free(ctx->save.batch_pfns);
+    free(ctx->save.skip_rec);
+    free(ctx->save.skipped_pages);
+    free(ctx->save.skip_scratch);
 }
 
 /*
@@ -878,6 +1474,15 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
         if ( rc )
             goto err;
 
+        /*
+         * Zero-copy sends read the guest's pages as they go out, so they
+         * must have completed before the guest can run again (or be torn
+         * down), lest later contents end up in the checkpoint.
+         */
+        rc = zerocopy_release(ctx, true, -1);
+        if ( rc )
+            goto err;
+
         if ( !ctx->dominfo.shutdown ||
              (ctx->dominfo.shutdown_reason != SHUTDOWN_suspend) )
         {
@@ -899,10 +1504,30 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
              */
             ctx->save.live = false;
 
+            if ( ctx->save.stripes_active )
+            {
+                rc = write_stripe_checkpoints(ctx);
+                if ( rc )
+                    goto err;
+            }
+
             rc = write_checkpoint_record(ctx);
             if ( rc )
                 goto err;
 
+            /* The receiver buffers from here on, so pages may be striped. */
+            ctx->save.stripes_active = ctx->save.nr_stripes > 0;
+
+            if ( ctx->save.callbacks->checkpoint_stats )
+                ctx->save.callbacks->checkpoint_stats(
+                    ctx->save.checkpoint_pages,
+                    ctx->save.stream_bytes - ctx->save.checkpoint_bytes_mark,
+                    min_t(uint64_t, ctx->save.checkpoint_bitmap_us,
+                          UINT32_MAX),
+                    min_t(uint64_t, ctx->save.checkpoint_send_us, UINT32_MAX),
+                    ctx->save.callbacks->data);
+            ctx->save.checkpoint_bytes_mark = ctx->save.stream_bytes;
+
             if ( ctx->save.checkpointed == XC_MIG_STREAM_COLO )
             {
                 rc = ctx->save.callbacks->checkpoint(ctx->save.callbacks->data);
@@ -927,6 +1552,17 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
             else if ( ctx->save.checkpointed == XC_MIG_STREAM_REMUS )
             {
                 rc = ctx->save.callbacks->checkpoint(ctx->save.callbacks->data);
+                while ( rc == XGS_CHECKPOINT_PRECOPY )
+                {
+                    assert(ctx->save.callbacks->precopy_done);
+
+                    rc = send_precopy_pass(ctx);
+                    if ( rc )
+                        goto err;
+
+                    rc = ctx->save.callbacks->precopy_done(
+                        ctx->save.callbacks->data);
+                }
                 if ( rc <= 0 )
                     goto err;
             }
@@ -967,7 +1603,9 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
 
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
                    uint32_t flags, struct save_callbacks* callbacks,
-                   int hvm, xc_migration_stream_t stream_type, int recv_fd)
+                   int hvm, xc_migration_stream_t stream_type, int recv_fd,
+                   xen_pfn_t skip_pfn, const int *stripe_fds,
+                   unsigned int nr_stripe_fds)
 {
     struct xc_sr_context ctx =
         {
@@ -981,6 +1619,10 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.debug = !!(flags & XCFLAGS_DEBUG);
     ctx.save.checkpointed = stream_type;
     ctx.save.recv_fd = recv_fd;
+    ctx.save.skip_pfn = skip_pfn;
+    ctx.save.stripe_fds = stripe_fds;
+    ctx.save.nr_stripes = nr_stripe_fds;
+    ctx.save.batch_fd = io_fd;
 
     /* If altering migration_stream update this assert too. */
     assert(stream_type == XC_MIG_STREAM_NONE ||
@@ -995,6 +1637,13 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     if ( ctx.save.checkpointed == XC_MIG_STREAM_COLO )
         assert(callbacks->wait_checkpoint);
 
+    if ( nr_stripe_fds && stream_type != XC_MIG_STREAM_REMUS )
+    {
+        ERROR("Only Remus streams can be striped");
+        errno = EINVAL;
+        return -1;
+    }
+
     DPRINTF("fd %d, dom %u, flags %u, hvm %d", io_fd, dom, flags, hvm);
 
     if ( xc_domain_getinfo(xch, dom, 1, &ctx.dominfo) != 1 )
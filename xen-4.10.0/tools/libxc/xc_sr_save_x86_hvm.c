@@ -4,6 +4,50 @@
 
 #include <xen/hvm/params.h>
 
+/*
+ * After the first checkpoint of a Remus stream, write the HVM context as an
+ * HVM_CONTEXT_DELTA record against the one sent at the previous checkpoint,
+ * unless that would save less than half of it.  Returns 1 if the full
+ * context must be sent.
+ */
+static int write_hvm_context_delta(struct xc_sr_context *ctx,
+                                   void *context, uint32_t size)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_hvm_context_delta hdr =
+    {
+        .size = size,
+    };
+    struct xc_sr_record rec =
+    {
+        .type   = REC_TYPE_HVM_CONTEXT_DELTA,
+        .length = sizeof(hdr),
+        .data   = &hdr,
+    };
+    void *delta;
+    int len, rc = 1;
+
+    if ( ctx->save.checkpointed != XC_MIG_STREAM_REMUS ||
+         !ctx->x86_hvm.save.context || ctx->x86_hvm.save.contextsz != size )
+        return 1;
+
+    delta = malloc(size / 2);
+    if ( !delta )
+        return 1;
+
+    len = xc_stream_delta_encode(ctx->x86_hvm.save.context, context, size,
+                                 delta, size / 2);
+    if ( len >= 0 )
+    {
+        rc = write_split_record(ctx, &rec, delta, len);
+        if ( rc )
+            PERROR("error write HVM_CONTEXT_DELTA record");
+    }
+
+    free(delta);
+    return rc;
+}
+
 /*
  * Query for the HVM context and write an HVM_CONTEXT record into the stream.
  */
@@ -42,13 +86,24 @@ static int write_hvm_context(struct xc_sr_context *ctx)
     }
 
     hvm_rec.length = hvm_buf_size;
-    rc = write_record(ctx, &hvm_rec);
+    rc = write_hvm_context_delta(ctx, hvm_rec.data, hvm_rec.length);
+    if ( rc > 0 )
+        rc = write_record(ctx, &hvm_rec);
     if ( rc < 0 )
     {
         PERROR("error write HVM_CONTEXT record");
         goto out;
     }
 
+    /* The next checkpoint's is sent as a delta against this one. */
+    if ( ctx->save.checkpointed == XC_MIG_STREAM_REMUS )
+    {
+        free(ctx->x86_hvm.save.context);
+        ctx->x86_hvm.save.context = hvm_rec.data;
+        ctx->x86_hvm.save.contextsz = hvm_rec.length;
+        hvm_rec.data = NULL;
+    }
+
  out:
     free(hvm_rec.data);
     return rc;
@@ -216,6 +271,9 @@ static int x86_hvm_cleanup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
 
+    free(ctx->x86_hvm.save.context);
+    ctx->x86_hvm.save.context = NULL;
+
     /* If qemu successfully enabled logdirty mode, attempt to disable. */
     if ( ctx->x86_hvm.save.qemu_enabled_logdirty &&
          ctx->save.callbacks->switch_qemu_logdirty(
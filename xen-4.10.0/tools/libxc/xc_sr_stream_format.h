@@ -76,9 +76,13 @@ struct xc_sr_rhdr
 #define REC_TYPE_VERIFY                     0x0000000dU
 #define REC_TYPE_CHECKPOINT                 0x0000000eU
 #define REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST  0x0000000fU
+#define REC_TYPE_CHECKPOINT_SKIP_PFNS       0x00000011U
+#define REC_TYPE_HVM_CONTEXT_DELTA          0x00000012U
 
 #define REC_TYPE_OPTIONAL             0x80000000U
 
+#define REC_TYPE_LIVENESS             (0x00000010U | REC_TYPE_OPTIONAL)
+
 /* PAGE_DATA */
 struct xc_sr_rec_page_data_header
 {
@@ -138,6 +142,42 @@ struct xc_sr_rec_hvm_params
     struct xc_sr_rec_hvm_params_entry param[0];
 };
 
+/* CHECKPOINT_SKIP_PFNS */
+struct xc_sr_rec_skip_pfns_range
+{
+    uint64_t pfn;
+    uint64_t count;
+};
+
+struct xc_sr_rec_checkpoint_skip_pfns
+{
+    uint64_t skip_pfn;
+    uint32_t count;
+    uint32_t _res1;
+    struct xc_sr_rec_skip_pfns_range range[0];
+};
+
+/* HVM_CONTEXT_DELTA */
+struct xc_sr_rec_hvm_context_delta
+{
+    uint32_t size;  /* Of the HVM context it stands for. */
+    uint32_t _res1;
+    uint8_t runs[0];
+};
+
+/* Run of changed bytes in a delta, followed by them, padded to 8 bytes. */
+struct xc_sr_delta_run
+{
+    uint32_t offset;
+    uint32_t length;
+};
+
+/* LIVENESS */
+struct xc_sr_rec_liveness
+{
+    uint64_t timestamp; /* Sender's monotonic clock, in ns. */
+};
+
 #endif
 /*
  * Local variables:
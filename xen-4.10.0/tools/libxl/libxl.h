@@ -939,6 +939,119 @@ typedef struct libxl__ctx libxl_ctx;
  */
 #define LIBXL_HAVE_COLO_USERSPACE_PROXY 1
 
+/*
+ * LIBXL_HAVE_REMUS_HEARTBEAT
+ * If this is defined, then libxl_domain_remus_info has the heartbeat_host,
+ * heartbeat_port and heartbeat_period fields, and
+ * libxl_domain_restore_params has the heartbeat_port, heartbeat_period and
+ * heartbeat_misses fields, with which the Remus primary sends a UDP
+ * heartbeat and the backup fails over when it stops.
+ */
+#define LIBXL_HAVE_REMUS_HEARTBEAT 1
+
+/*
+ * LIBXL_HAVE_REMUS_HEARTBEAT_NONCE
+ * If this is defined, then libxl_domain_remus_info and
+ * libxl_domain_restore_params have the heartbeat_nonce field, and
+ * libxl_domain_restore_params has the heartbeat_peer field, with which the
+ * Remus backup only believes beats from the primary of its own session.
+ */
+#define LIBXL_HAVE_REMUS_HEARTBEAT_NONCE 1
+
+/*
+ * LIBXL_HAVE_REMUS_STREAM_LIVENESS
+ * If this is defined, then libxl_domain_remus_info has the liveness_period
+ * field and libxl_domain_restore_params has the liveness_timeout field,
+ * with which the Remus primary keeps an idle stream alive and the backup
+ * fails over once the stream has been silent for too long.
+ */
+#define LIBXL_HAVE_REMUS_STREAM_LIVENESS 1
+
+/*
+ * LIBXL_HAVE_REMUS_OUTPUT_ACK
+ * If this is defined, then libxl_domain_remus_info has the output_ack field
+ * and libxl_domain_restore_params has the checkpoint_ack field.  With both
+ * set, the backup acknowledges each checkpoint on the back channel and the
+ * primary releases the network output of a checkpoint only once it has been
+ * acknowledged, without waiting for it before carrying on.
+ */
+#define LIBXL_HAVE_REMUS_OUTPUT_ACK 1
+
+/*
+ * LIBXL_HAVE_REMUS_ADAPTIVE_INTERVAL
+ * If this is defined, then libxl_domain_remus_info has the interval_min,
+ * interval_max and max_bandwidth fields, with which the checkpoint interval
+ * adapts to the guest's dirty rate and network output.
+ */
+#define LIBXL_HAVE_REMUS_ADAPTIVE_INTERVAL 1
+
+/*
+ * LIBXL_HAVE_REMUS_BACKGROUND_PRECOPY
+ * If this is defined, then libxl_domain_remus_info has the precopy_period
+ * field, with which dirty pages are sent while the guest runs between
+ * checkpoints, leaving only the pages dirtied again for the checkpoint.
+ */
+#define LIBXL_HAVE_REMUS_BACKGROUND_PRECOPY 1
+
+/*
+ * LIBXL_HAVE_REMUS_FAST_IPC
+ * If this is defined, then libxl_domain_remus_info has the fast_ipc field,
+ * with which the save helper exchanges its per-checkpoint callbacks with
+ * libxl through shared memory rather than through pipes.
+ */
+#define LIBXL_HAVE_REMUS_FAST_IPC 1
+
+/*
+ * LIBXL_HAVE_REMUS_GROUP
+ * If this is defined, then libxl_domain_remus_group_start is available, with
+ * which several domains are checkpointed together and their network output
+ * is released only once all of them have been acknowledged by the backup.
+ */
+#define LIBXL_HAVE_REMUS_GROUP 1
+
+/*
+ * LIBXL_HAVE_REMUS_STATS
+ * If this is defined, then libxl_domain_remus_info has the stats_path field,
+ * to which a line of per-phase timings, page and byte counts is appended for
+ * every checkpoint once the backup has it.
+ */
+#define LIBXL_HAVE_REMUS_STATS 1
+
+/*
+ * LIBXL_HAVE_REMUS_DISK_REPLICATION
+ * If this is defined, then libxl_domain_remus_info has the disk_host and
+ * disk_port fields and libxl_domain_restore_params has the disk_port field,
+ * with which raw images served by tapdisk are replicated to the backup
+ * without DRBD, and committed there along with the memory checkpoints.
+ */
+#define LIBXL_HAVE_REMUS_DISK_REPLICATION 1
+
+/*
+ * LIBXL_HAVE_REMUS_STRIPED_STREAMS
+ * If this is defined, then libxl_domain_remus_info has the stream_host,
+ * stream_port and streams fields and libxl_domain_restore_params has the
+ * stream_port and streams fields, with which the memory of each Remus
+ * checkpoint is spread over several TCP connections to the backup.
+ */
+#define LIBXL_HAVE_REMUS_STRIPED_STREAMS 1
+
+/*
+ * LIBXL_HAVE_REMUS_CHECKPOINT_HISTORY
+ * If this is defined, then libxl_domain_restore_params has the
+ * history_epochs, history_mb and rollback fields, with which a Remus backup
+ * keeps the last few checkpoints and may fail over to an earlier one than
+ * the last.
+ */
+#define LIBXL_HAVE_REMUS_CHECKPOINT_HISTORY 1
+
+/*
+ * LIBXL_HAVE_REMUS_BOOST
+ * If this is defined, then libxl_domain_remus_info has the boost field,
+ * with which the dom0 work of taking a Remus checkpoint runs at a raised
+ * priority until the domain has been resumed.
+ */
+#define LIBXL_HAVE_REMUS_BOOST 1
+
 typedef uint8_t libxl_mac[6];
 #define LIBXL_MAC_FMT "%02hhx:%02hhx:%02hhx:%02hhx:%02hhx:%02hhx"
 #define LIBXL_MAC_FMTLEN ((2*6)+5) /* 6 hex bytes plus 5 colons */
@@ -1469,6 +1582,24 @@ int libxl_domain_remus_start(libxl_ctx *ctx, libxl_domain_remus_info *info,
                              const libxl_asyncop_how *ao_how)
                              LIBXL_EXTERNAL_CALLERS_ONLY;
 
+/*
+ * As libxl_domain_remus_start, for the nr domains in domids, each with its
+ * own stream and back channel.  The domains are suspended for every
+ * checkpoint together, and network output is released for all of them
+ * once the backup has acknowledged the checkpoint of every one, so that
+ * after a failover no domain depends on what another one has lost.
+ * Checkpoint acknowledgements (info->output_ack) are required.  Returns
+ * once replication of any of the domains has stopped, and replication of
+ * all of them has been wound down; the caller should then resume all of
+ * the (primary) domains.
+ */
+int libxl_domain_remus_group_start(libxl_ctx *ctx,
+                                   libxl_domain_remus_info *info,
+                                   const uint32_t *domids,
+                                   const int *send_fds, const int *recv_fds,
+                                   int nr, const libxl_asyncop_how *ao_how)
+                                   LIBXL_EXTERNAL_CALLERS_ONLY;
+
 int libxl_domain_shutdown(libxl_ctx *ctx, uint32_t domid);
 int libxl_domain_reboot(libxl_ctx *ctx, uint32_t domid);
 int libxl_domain_destroy(libxl_ctx *ctx, uint32_t domid,
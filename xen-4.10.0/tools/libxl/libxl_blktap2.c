@@ -16,6 +16,7 @@
 #include "libxl_internal.h"
 
 #include "tap-ctl.h"
+#include "blktaplib.h"
 
 int libxl__blktap_enabled(libxl__gc *gc)
 {
@@ -85,6 +86,76 @@ int libxl__device_destroy_tapdisk(libxl__gc *gc, const char *params)
     return 0;
 }
 
+int libxl__blktap_remus_insert(libxl__gc *gc, const char *params,
+                               const char *name, int *id_r, int *minor_r,
+                               const char **ctl_path_r)
+{
+    char *type, *disk, *ctl_path;
+    tap_list_t tap;
+    int err, i;
+
+    type = libxl__strdup(gc, params);
+    disk = strchr(type, ':');
+    if (!disk) {
+        LOG(ERROR, "Unable to parse params %s", params);
+        return ERROR_INVAL;
+    }
+    *disk++ = '\0';
+
+    err = tap_ctl_find(type, disk, &tap);
+    if (err < 0) {
+        LOGEV(ERROR, -err, "Unable to find type %s disk %s", type, disk);
+        return ERROR_FAIL;
+    }
+
+    err = tap_ctl_pause(tap.id, tap.minor);
+    if (err) {
+        LOGEV(ERROR, err < 0 ? -err : err,
+              "Failed to pause tap device id %d minor %d",
+              tap.id, tap.minor);
+        return ERROR_FAIL;
+    }
+
+    err = tap_ctl_unpause(tap.id, tap.minor,
+                          GCSPRINTF("remus:%s|%s", name, params));
+    if (err) {
+        LOGEV(ERROR, err < 0 ? -err : err,
+              "Failed to stack remus:%s onto %s", name, params);
+        /* don't leave the guest's disk paused */
+        tap_ctl_unpause(tap.id, tap.minor, params);
+        return ERROR_FAIL;
+    }
+
+    /* as block-remus names its FIFOs, see ctl_open() */
+    ctl_path = GCSPRINTF(BLKTAP_CTRL_DIR "/remus_%s", name);
+    for (i = strlen(BLKTAP_CTRL_DIR) + 1; ctl_path[i]; i++)
+        if (ctl_path[i] == ':' || ctl_path[i] == '/')
+            ctl_path[i] = '_';
+
+    *id_r = tap.id;
+    *minor_r = tap.minor;
+    *ctl_path_r = ctl_path;
+    return 0;
+}
+
+int libxl__blktap_remus_remove(libxl__gc *gc, int id, int minor,
+                               const char *params)
+{
+    int err;
+
+    err = tap_ctl_pause(id, minor);
+    if (!err)
+        err = tap_ctl_unpause(id, minor, params);
+    if (err) {
+        LOGEV(ERROR, err < 0 ? -err : err,
+              "Failed to restore %s on tap device id %d minor %d",
+              params, id, minor);
+        return ERROR_FAIL;
+    }
+
+    return 0;
+}
+
 /*
  * Local variables:
  * mode: C
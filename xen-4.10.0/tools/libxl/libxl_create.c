@@ -781,11 +781,18 @@ static void domcreate_rebuild_done(libxl__egc *egc,
                                    libxl__domain_create_state *dcs,
                                    int ret);
 
-static void nic_create_cb(libxl__egc *egc, libxl__multidev *aodevs, int ret) { 
-	/*FILE *log = fopen("/tmp/remus_trace.log","a");
-	fprintf(log, "In %s\n", __func__);
-	fclose(log);*/
-return; }
+static void domcreate_failed(libxl__egc *egc,
+                             libxl__domain_create_state *dcs,
+                             int rc);
+static void domcreate_standby_failed(libxl__egc *egc,
+                                     libxl__domain_create_state *dcs,
+                                     int rc);
+static void domcreate_standby_disks_done(libxl__egc *egc,
+                                         libxl__domain_create_state *dcs,
+                                         int rc);
+static void domcreate_standby_nics_done(libxl__egc *egc,
+                                        libxl__domain_create_state *dcs,
+                                        int rc);
 
 /* Our own function to clean up and call the user's callback.
  * The final call in the sequence. */
@@ -813,6 +820,18 @@ static void initiate_domain_create(libxl__egc *egc,
     libxl__domain_build_state *const state = &dcs->build_state;
     const int restore_fd = dcs->restore_fd;
 
+    libxl__remus_heartbeat_init(&dcs->remus_hb);
+    dcs->remus_failover = false;
+    dcs->remus_disks = NULL;
+    dcs->remus_num_disks = 0;
+    dcs->remus_checkpoints = dcs->remus_committed = 0;
+    dcs->remus_applied = dcs->remus_acked = 0;
+    libxl__remus_stripes_init(&dcs->remus_stripes);
+    dcs->remus_standby_busy = dcs->remus_standby_live = false;
+    dcs->remus_standby_nics = dcs->remus_standby_disks = false;
+    dcs->remus_standby_rc = dcs->remus_standby_failed_rc = 0;
+    dcs->remus_standby_callback = NULL;
+
     domid = dcs->domid_soft_reset;
 
     if (d_config->c_info.ssid_label) {
@@ -988,12 +1007,6 @@ static void initiate_domain_create(libxl__egc *egc,
 
     if (restore_fd >= 0 || dcs->domid_soft_reset != INVALID_DOMID) {
         LOGD(DEBUG, domid, "restoring, not running bootloader");
-        if (d_config->num_nics > 0) {
-            libxl__multidev_begin(ao, &dcs->multidev);
-            dcs->multidev.callback = nic_create_cb;
-            libxl__add_nics(egc, ao, domid, d_config, &dcs->multidev);
-            libxl__multidev_prepared(egc, &dcs->multidev, 0);
-        }
         domcreate_bootloader_done(egc, &dcs->bl, 0);
     } else  {
         LOGD(DEBUG, domid, "running bootloader");
@@ -1133,7 +1146,8 @@ static void domcreate_bootloader_done(libxl__egc *egc,
             libxl__colo_restore_setup(egc, crs);
             break;
         case LIBXL_CHECKPOINTED_STREAM_REMUS:
-            libxl__remus_restore_setup(egc, dcs);
+            rc = libxl__remus_restore_setup(egc, dcs);
+            if (rc) goto out;
             /* fall through */
         case LIBXL_CHECKPOINTED_STREAM_NONE:
             libxl__stream_read_start(egc, &dcs->srs);
@@ -1176,6 +1190,9 @@ static void domcreate_stream_done(libxl__egc *egc,
     libxl__domain_build_state *const state = &dcs->build_state;
     const int fd = dcs->restore_fd;
 
+    /* The stream is over, whichever way it ended. */
+    libxl__remus_restore_stop(egc, dcs);
+
     if (ret)
         goto out;
 
@@ -1262,6 +1279,12 @@ static void domcreate_rebuild_done(libxl__egc *egc,
 
     store_libxl_entry(gc, domid, &d_config->b_info);
 
+    if (dcs->remus_standby_disks) {
+        /* A Remus backup plugged them in while checkpoints arrived. */
+        libxl__remus_standby_wait(egc, dcs, domcreate_standby_disks_done);
+        return;
+    }
+
     libxl__multidev_begin(ao, &dcs->multidev);
     dcs->multidev.callback = domcreate_launch_dm;
     libxl__add_disks(egc, ao, domid, d_config, &dcs->multidev);
@@ -1271,7 +1294,35 @@ static void domcreate_rebuild_done(libxl__egc *egc,
 
  error_out:
     assert(ret);
-    domcreate_complete(egc, dcs, ret);
+    domcreate_failed(egc, dcs, ret);
+}
+
+/*
+ * Every failure once a Remus backup may have started plugging in devices
+ * ahead of failover: they must finish before the domain is destroyed.
+ */
+static void domcreate_failed(libxl__egc *egc,
+                             libxl__domain_create_state *dcs,
+                             int rc)
+{
+    assert(rc);
+    dcs->remus_standby_failed_rc = rc;
+    libxl__remus_standby_wait(egc, dcs, domcreate_standby_failed);
+}
+
+static void domcreate_standby_failed(libxl__egc *egc,
+                                     libxl__domain_create_state *dcs,
+                                     int rc)
+{
+    /* The failure which got us here, not the standby devices' own. */
+    domcreate_complete(egc, dcs, dcs->remus_standby_failed_rc);
+}
+
+static void domcreate_standby_disks_done(libxl__egc *egc,
+                                         libxl__domain_create_state *dcs,
+                                         int rc)
+{
+    domcreate_launch_dm(egc, &dcs->multidev, rc);
 }
 
 static void domcreate_launch_dm(libxl__egc *egc, libxl__multidev *multidev,
@@ -1446,7 +1497,7 @@ static void domcreate_launch_dm(libxl__egc *egc, libxl__multidev *multidev,
 
  error_out:
     assert(ret);
-    domcreate_complete(egc, dcs, ret);
+    domcreate_failed(egc, dcs, ret);
 }
 
 static void libxl__add_dtdevs(libxl__egc *egc, libxl__ao *ao, uint32_t domid,
@@ -1512,8 +1563,11 @@ static void domcreate_attach_devices(libxl__egc *egc,
     dt = device_type_tbl[dcs->device_type_idx];
     if (dt) {
         if (*libxl__device_type_get_num(dt, d_config) > 0 && !dt->skip_attach) {
-            if (dt == &libxl__nic_devtype && dcs->restore_fd >= 0)
-                goto skip_attach;
+            if (dt == &libxl__nic_devtype && dcs->remus_standby_nics) {
+                libxl__remus_standby_wait(egc, dcs,
+                                          domcreate_standby_nics_done);
+                return;
+            }
             /* Attach devices */
             libxl__multidev_begin(ao, &dcs->multidev);
             dcs->multidev.callback = domcreate_attach_devices;
@@ -1522,7 +1576,6 @@ static void domcreate_attach_devices(libxl__egc *egc,
             return;
         }
 
-skip_attach:
         domcreate_attach_devices(egc, &dcs->multidev, 0);
         return;
     }
@@ -1535,7 +1588,14 @@ skip_attach:
 
 error_out:
     assert(ret);
-    domcreate_complete(egc, dcs, ret);
+    domcreate_failed(egc, dcs, ret);
+}
+
+static void domcreate_standby_nics_done(libxl__egc *egc,
+                                        libxl__domain_create_state *dcs,
+                                        int rc)
+{
+    domcreate_attach_devices(egc, &dcs->multidev, rc);
 }
 
 static void domcreate_devmodel_started(libxl__egc *egc,
@@ -1567,7 +1627,7 @@ static void domcreate_devmodel_started(libxl__egc *egc,
 
 error_out:
     assert(ret);
-    domcreate_complete(egc, dcs, ret);
+    domcreate_failed(egc, dcs, ret);
 }
 
 static void domcreate_complete(libxl__egc *egc,
@@ -1689,6 +1749,11 @@ static int do_domain_create(libxl_ctx *ctx, libxl_domain_config *d_config,
         cdcs->dcs.colo_proxy_script = NULL;
         cdcs->dcs.crs.cps.is_userspace_proxy = false;
     }
+    libxl_defbool_setdefault(&cdcs->dcs.restore_params.checkpoint_ack, false);
+    if (cdcs->dcs.restore_params.history_epochs > 0 &&
+        cdcs->dcs.restore_params.history_mb <= 0)
+        cdcs->dcs.restore_params.history_mb =
+            LIBXL__REMUS_DEFAULT_HISTORY_MB;
 
     libxl__ao_progress_gethow(&cdcs->dcs.aop_console_how, aop_console_how);
     cdcs->domid_out = domid;
@@ -361,6 +361,8 @@ void libxl__domain_save(libxl__egc *egc, libxl__domain_save_state *dss)
 
     dsps->ao = ao;
     dsps->domid = domid;
+    dsps->checkpointing =
+        dss->checkpointed_stream == LIBXL_CHECKPOINTED_STREAM_REMUS;
     rc = libxl__domain_suspend_init(egc, dsps, type);
     if (rc) goto out;
 
@@ -44,6 +44,8 @@ int libxl__domain_suspend_init(libxl__egc *egc,
     dsps->guest_evtchn.port = -1;
     dsps->guest_evtchn_lockfd = -1;
     dsps->guest_responded = 0;
+    dsps->guest_evtchn_acks = false;
+    dsps->suspend_us = dsps->resume_us = 0;
     dsps->dm_savefile = libxl__device_model_savefile(gc, domid);
 
     port = xs_suspend_evtchn_port(domid);
@@ -120,6 +122,11 @@ static void domain_suspend_common_done(libxl__egc *egc,
                                        libxl__domain_suspend_state *dsps,
                                        int rc);
 
+static void domain_suspend_checkpoint(libxl__egc *egc,
+                                      libxl__domain_suspend_state *dsps);
+static void domain_suspend_checkpoint_acked(libxl__egc *egc,
+        libxl__ev_evtchn *evev);
+
 static void domain_suspend_callback_common(libxl__egc *egc,
                                            libxl__domain_suspend_state *dsps);
 static void domain_suspend_callback_common_done(libxl__egc *egc,
@@ -149,6 +156,13 @@ static void domain_suspend_callback_common(libxl__egc *egc,
     /* Convenience aliases */
     const uint32_t domid = dsps->domid;
 
+    clock_gettime(CLOCK_MONOTONIC, &dsps->requested);
+
+    if (dsps->checkpointing && dsps->guest_evtchn_acks) {
+        domain_suspend_checkpoint(egc, dsps);
+        return;
+    }
+
     if (dsps->type != LIBXL_DOMAIN_TYPE_PV) {
         xc_hvm_param_get(CTX->xch, domid, HVM_PARAM_CALLBACK_IRQ, &hvm_pvdrv);
         xc_hvm_param_get(CTX->xch, domid, HVM_PARAM_ACPI_S_STATE, &hvm_s_state);
@@ -209,6 +223,72 @@ static void domain_suspend_callback_common(libxl__egc *egc,
     domain_suspend_common_done(egc, dsps, rc);
 }
 
+/*
+ * Checkpointing suspends the same domain every few milliseconds, so the
+ * general path above is cut short once it has shown, by a successful
+ * suspend through the suspend event channel, that Xen notifies that
+ * channel when the guest has suspended.  From then on the notification
+ * is taken as the guest's acknowledgement without asking Xen for the
+ * domain's shutdown state, the HVM parameters are not read again, and
+ * the event channel is polled for a short while so that a guest which
+ * suspends quickly is not waited for through the event loop.  The
+ * suspend timeout is only registered if the guest takes longer.
+ */
+#define CHECKPOINT_SUSPEND_SPIN_US 100
+
+static uint32_t domain_suspend_elapsed_us(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000 +
+        (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+static void domain_suspend_checkpoint(libxl__egc *egc,
+                                      libxl__domain_suspend_state *dsps)
+{
+    STATE_AO_GC(dsps->ao);
+    int ret, rc;
+
+    ret = xenevtchn_notify(CTX->xce, dsps->guest_evtchn.port);
+    if (ret < 0) {
+        LOGD(ERROR, dsps->domid, "xenevtchn_notify failed ret=%d", ret);
+        rc = ERROR_FAIL;
+        goto err;
+    }
+
+    dsps->guest_evtchn.callback = domain_suspend_checkpoint_acked;
+    rc = libxl__ev_evtchn_wait(gc, &dsps->guest_evtchn);
+    if (rc) goto err;
+
+    do {
+        libxl__ev_evtchn_dispatch(egc);
+        if (!libxl__ev_evtchn_iswaiting(&dsps->guest_evtchn))
+            /* acknowledged, and we have been called back */
+            return;
+    } while (domain_suspend_elapsed_us(&dsps->requested) <
+             CHECKPOINT_SUSPEND_SPIN_US);
+
+    rc = libxl__ev_time_register_rel(ao, &dsps->guest_timeout,
+                                     suspend_common_wait_guest_timeout,
+                                     LIBXL_COMMON_SUSPEND_TIMEOUT);
+    if (rc) goto err;
+    return;
+
+ err:
+    domain_suspend_common_done(egc, dsps, rc);
+}
+
+static void domain_suspend_checkpoint_acked(libxl__egc *egc,
+        libxl__ev_evtchn *evev)
+{
+    libxl__domain_suspend_state *dsps = CONTAINER_OF(evev, *dsps, guest_evtchn);
+
+    dsps->guest_responded = 1;
+    domain_suspend_common_guest_suspended(egc, dsps);
+}
+
 static void domain_suspend_common_wait_guest_evtchn(libxl__egc *egc,
         libxl__ev_evtchn *evev)
 {
@@ -351,6 +431,9 @@ static void suspend_common_wait_guest_check(libxl__egc *egc,
     }
 
     LOGD(DEBUG, domid, "guest has suspended");
+    if (libxl__ev_evtchn_iswaiting(&dsps->guest_evtchn))
+        /* only the event channel wakes us on that path */
+        dsps->guest_evtchn_acks = true;
     domain_suspend_common_guest_suspended(egc, dsps);
     return;
 
@@ -380,6 +463,8 @@ static void domain_suspend_common_guest_suspended(libxl__egc *egc,
     libxl__ev_xswatch_deregister(gc, &dsps->guest_watch);
     libxl__ev_time_deregister(gc, &dsps->guest_timeout);
 
+    dsps->suspend_us = domain_suspend_elapsed_us(&dsps->requested);
+
     if (dsps->type == LIBXL_DOMAIN_TYPE_HVM) {
         rc = libxl__domain_suspend_device_model(gc, dsps);
         if (rc) {
@@ -485,6 +570,42 @@ out:
     return rc;
 }
 
+int libxl__domain_resume_checkpoint(libxl__gc *gc,
+                                    libxl__domain_suspend_state *dsps)
+{
+    struct timespec start;
+    int rc;
+
+    /* Convenience aliases */
+    const uint32_t domid = dsps->domid;
+
+    assert(dsps->checkpointing);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (dsps->type == LIBXL_DOMAIN_TYPE_HVM) {
+        rc = libxl__domain_resume_device_model(gc, domid);
+        if (rc) {
+            LOGD(ERROR, domid, "failed to resume device model:%d", rc);
+            return rc;
+        }
+    }
+
+    if (xc_domain_resume(CTX->xch, domid, 1)) {
+        LOGED(ERROR, domid, "xc_domain_resume failed");
+        return ERROR_FAIL;
+    }
+
+    dsps->resume_us = domain_suspend_elapsed_us(&start);
+    return 0;
+}
+
+void libxl__domain_resume_checkpoint_xs(libxl__gc *gc,
+                                        libxl__domain_suspend_state *dsps)
+{
+    if (!xs_resume_domain(CTX->xsh, dsps->domid))
+        LOGED(ERROR, dsps->domid, "xs_resume_domain failed");
+}
+
 /*
  * Local variables:
  * mode: C
@@ -16,6 +16,10 @@
 
 #include "libxl_internal.h"
 
+#include <xen/io/cpsremus.h>
+
+#include <sched.h>
+
 #define PAGE_TO_MEMKB(pages) ((pages) * 4)
 
 int libxl__domain_rename(libxl__gc *gc, uint32_t domid,
@@ -384,26 +388,16 @@ out:
 
 static void remus_failover_cb(libxl__egc *egc,
                               libxl__domain_save_state *dss, int rc);
+static void remus_group_member_done(libxl__egc *egc,
+                                    libxl__domain_save_state *dss, int rc);
 
-int libxl_domain_remus_start(libxl_ctx *ctx, libxl_domain_remus_info *info,
-                             uint32_t domid, int send_fd, int recv_fd,
-                             const libxl_asyncop_how *ao_how)
+static int remus_info_setdefault(libxl__gc *gc, uint32_t domid,
+                                 libxl_domain_remus_info *info)
 {
-    AO_CREATE(ctx, domid, ao_how);
-    libxl__domain_save_state *dss;
-    int rc;
-
-    libxl_domain_type type = libxl__domain_type(gc, domid);
-    if (type == LIBXL_DOMAIN_TYPE_INVALID) {
-        rc = ERROR_FAIL;
-        goto out;
-    }
-
     /* The caller must set this defbool */
     if (libxl_defbool_is_default(info->colo)) {
         LOGD(ERROR, domid, "Colo mode must be enabled/disabled");
-        rc = ERROR_FAIL;
-        goto out;
+        return ERROR_FAIL;
     }
 
     libxl_defbool_setdefault(&info->allow_unsafe, false);
@@ -414,13 +408,14 @@ int libxl_domain_remus_start(libxl_ctx *ctx, libxl_domain_remus_info *info,
     libxl_defbool_setdefault(&info->diskbuf, true);
     libxl_defbool_setdefault(&info->event_driven, false);
     libxl_defbool_setdefault(&info->polling, false);
+    libxl_defbool_setdefault(&info->output_ack, false);
+    libxl_defbool_setdefault(&info->fast_ipc, false);
 
     if (libxl_defbool_val(info->colo) &&
         libxl_defbool_val(info->compression)) {
             LOGD(ERROR, domid, "Cannot use memory checkpoint "
                         "compression in COLO mode");
-            rc = ERROR_FAIL;
-            goto out;
+            return ERROR_FAIL;
     }
 
     if (!libxl_defbool_val(info->allow_unsafe) &&
@@ -429,12 +424,58 @@ int libxl_domain_remus_start(libxl_ctx *ctx, libxl_domain_remus_info *info,
          !libxl_defbool_val(info->diskbuf))) {
         LOGD(ERROR, domid, "Unsafe mode must be enabled to replicate to /dev/null,"
                     "disable network buffering and disk replication");
-        rc = ERROR_FAIL;
-        goto out;
+        return ERROR_FAIL;
+    }
+
+    if (info->interval_max > 0 &&
+        (info->interval_min < 0 || info->interval_min > info->interval ||
+         info->interval > info->interval_max)) {
+        LOGD(ERROR, domid, "Adaptive checkpoint interval needs"
+             " interval_min <= interval <= interval_max");
+        return ERROR_INVAL;
+    }
+
+    if (info->precopy_period < 0 ||
+        (info->precopy_period && libxl_defbool_val(info->colo))) {
+        LOGD(ERROR, domid, "Background pre-copy needs a positive"
+             " precopy_period, and cannot be used with COLO");
+        return ERROR_INVAL;
+    }
+
+    if (info->streams < 0 || info->streams > LIBXL__REMUS_MAX_STREAMS ||
+        (info->streams &&
+         (!info->stream_host || info->stream_port <= 0 ||
+          libxl_defbool_val(info->colo)))) {
+        LOGD(ERROR, domid, "Striped streams need at most %d streams,"
+             " stream_host and stream_port, and cannot be used with COLO",
+             LIBXL__REMUS_MAX_STREAMS);
+        return ERROR_INVAL;
     }
 
+    if (info->boost < 0 || info->boost > sched_get_priority_max(SCHED_FIFO) ||
+        (info->boost && libxl_defbool_val(info->colo))) {
+        LOGD(ERROR, domid, "Checkpoint boost needs a SCHED_FIFO priority"
+             " from 1 to %d, and cannot be used with COLO",
+             sched_get_priority_max(SCHED_FIFO));
+        return ERROR_INVAL;
+    }
+
+    return 0;
+}
+
+static int remus_save_state_new(libxl__ao *ao, libxl_domain_remus_info *info,
+                                uint32_t domid, int send_fd, int recv_fd,
+                                libxl__domain_save_state **dss_r)
+{
+    AO_GC;
+    libxl__domain_save_state *dss;
+
+    libxl_domain_type type = libxl__domain_type(gc, domid);
+    if (type == LIBXL_DOMAIN_TYPE_INVALID)
+        return ERROR_FAIL;
 
     GCNEW(dss);
+    *dss_r = dss;
     dss->ao = ao;
     dss->callback = remus_failover_cb;
     dss->domid = domid;
@@ -445,25 +486,47 @@ int libxl_domain_remus_start(libxl_ctx *ctx, libxl_domain_remus_info *info,
     dss->debug = 0;
     dss->remus = info;
     dss->statepath = NULL;
+    libxl__ev_xswatch_init(&dss->cpsremus_watch);
+    libxl__ev_evtchn_init(&dss->cpsremus_evtchn);
+    dss->cpsremus_evtchn.port = -1;
+    dss->cpsremus_skip_pfn = INVALID_MFN;
+    libxl__remus_heartbeat_init(&dss->rs.hb);
+    libxl__remus_stripes_init(&dss->rs.stripes);
+    libxl__ev_time_init(&dss->rs.checkpoint_timeout);
+    libxl__ev_time_init(&dss->rs.liveness_timeout);
+    libxl__ev_time_init(&dss->rs.precopy_timeout);
+    dss->rs.stats_fd = NULL;
 
     if (libxl_defbool_val(info->event_driven)) {
-        /* Check if DomU has support for event-driven checkpointing */
+        /*
+         * Check if DomU has support for event-driven checkpointing, either
+         * through a checkpoint request event channel or the data/ha key.
+         */
         xs_transaction_t t = 0;
         int trc = 0;
-        
+
+        /* An HVM guest can only ask for checkpoints with PV drivers. */
+        if (type == LIBXL_DOMAIN_TYPE_HVM &&
+            libxl__domain_pvcontrol_available(gc, domid) <= 0) {
+            LOGD(ERROR, domid, "CPS-Remus: event-driven checkpointing of an"
+                 " HVM domain needs PV drivers in it. Aborting.");
+            return ERROR_FAIL;
+        }
+
         trc = libxl__xs_transaction_start(gc, &t);
         char *dompath = libxl__xs_get_dompath(gc, dss->domid);
         char *statepath = libxl__sprintf(gc, "%s/data/ha", dompath);
 
         if (trc) {
             LOG(ERROR, "Remus: Failed to check DomU support");
-            goto out;
+            return ERROR_FAIL;
         }
 
-        if (!libxl__xs_read(gc, t, statepath)) {
+        if (!libxl__xs_read(gc, t, statepath) &&
+            !libxl__xs_read(gc, t, GCSPRINTF("%s/"CPSREMUS_EVTCHN_KEY, dompath))) {
             libxl__xs_transaction_abort(gc, &t);
             LOG(ERROR, "CPS-Remus: Event-driven checkpointing not supported by domain. Aborting.");
-            goto out;
+            return ERROR_FAIL;
         }
         
         libxl__xs_transaction_abort(gc, &t);
@@ -475,6 +538,23 @@ int libxl_domain_remus_start(libxl_ctx *ctx, libxl_domain_remus_info *info,
     else
         dss->checkpointed_stream = LIBXL_CHECKPOINTED_STREAM_REMUS;
 
+    return 0;
+}
+
+int libxl_domain_remus_start(libxl_ctx *ctx, libxl_domain_remus_info *info,
+                             uint32_t domid, int send_fd, int recv_fd,
+                             const libxl_asyncop_how *ao_how)
+{
+    AO_CREATE(ctx, domid, ao_how);
+    libxl__domain_save_state *dss;
+    int rc;
+
+    rc = remus_info_setdefault(gc, domid, info);
+    if (rc) goto out;
+
+    rc = remus_save_state_new(ao, info, domid, send_fd, recv_fd, &dss);
+    if (rc) goto out;
+
     assert(info);
 
     /* Point of no return */
@@ -488,6 +568,68 @@ int libxl_domain_remus_start(libxl_ctx *ctx, libxl_domain_remus_info *info,
     return AO_CREATE_FAIL(rc);
 }
 
+int libxl_domain_remus_group_start(libxl_ctx *ctx,
+                                   libxl_domain_remus_info *info,
+                                   const uint32_t *domids,
+                                   const int *send_fds, const int *recv_fds,
+                                   int nr, const libxl_asyncop_how *ao_how)
+{
+    AO_CREATE(ctx, nr > 0 ? domids[0] : INVALID_DOMID, ao_how);
+    libxl__remus_group *group;
+    libxl__domain_save_state *dss;
+    int i, rc;
+
+    if (nr <= 0) {
+        LOG(ERROR, "Remus: a group needs at least one domain");
+        rc = ERROR_INVAL;
+        goto out;
+    }
+
+    rc = remus_info_setdefault(gc, domids[0], info);
+    if (rc) goto out;
+
+    /*
+     * Output is released for the whole group at once, when every member
+     * has had its checkpoint acknowledged; see libxl_remus.c.
+     */
+    if (libxl_defbool_val(info->colo) ||
+        !libxl_defbool_val(info->output_ack) || info->streams) {
+        LOG(ERROR, "Remus: groups need checkpoint acknowledgements,"
+            " and cannot be used with COLO or striped streams");
+        rc = ERROR_INVAL;
+        goto out;
+    }
+
+    GCNEW(group);
+    group->ao = ao;
+    group->nr = group->nr_running = nr;
+    GCNEW_ARRAY(group->members, nr);
+
+    for (i = 0; i < nr; i++) {
+        if (recv_fds[i] < 0) {
+            LOGD(ERROR, domids[i], "Remus: group member has no back channel");
+            rc = ERROR_INVAL;
+            goto out;
+        }
+
+        rc = remus_save_state_new(ao, info, domids[i], send_fds[i],
+                                  recv_fds[i], &dss);
+        if (rc) goto out;
+
+        dss->callback = remus_group_member_done;
+        dss->group = group;
+        group->members[i] = dss;
+    }
+
+    /* Point of no return */
+    for (i = 0; i < nr; i++)
+        libxl__remus_setup(egc, &group->members[i]->rs);
+    return AO_INPROGRESS;
+
+ out:
+    return AO_CREATE_FAIL(rc);
+}
+
 int libxl_device_nic_send_gratuitous_arp(libxl_ctx *ctx, libxl_device_nic *nic)
 {
     GC_INIT(ctx);
@@ -495,7 +637,13 @@ int libxl_device_nic_send_gratuitous_arp(libxl_ctx *ctx, libxl_device_nic *nic)
     int rc;
     char *cmd;
 
-   sprintf(mac, LIBXL_MAC_FMT, LIBXL_MAC_BYTES(nic->mac)); 
+    sprintf(mac, LIBXL_MAC_FMT, LIBXL_MAC_BYTES(nic->mac));
+    /* Without an address there is nothing to announce it with. */
+    if (!nic->ip || !nic->bridge) {
+        fprintf(stderr, "Not updating arp for mac %s: no ip or bridge\n", mac);
+        GC_FREE;
+        return ERROR_INVAL;
+    }
     cmd = libxl__sprintf(gc, "send_arp %s %s %s ff:ff:ff:ff:ff:ff %s %s ff:ff:ff:ff:ff:ff request", nic->ip, mac, nic->ip, nic->bridge, mac);  
     fprintf(stderr, "Updating arp for ip %s and mac %s on bridge %s\n", nic->ip, mac, nic->bridge);
     rc = system(cmd);
@@ -518,6 +666,21 @@ static void remus_failover_cb(libxl__egc *egc,
     libxl__ao_complete(egc, ao, rc);
 }
 
+static void remus_group_member_done(libxl__egc *egc,
+                                    libxl__domain_save_state *dss, int rc)
+{
+    libxl__remus_group *const group = dss->group;
+    STATE_AO_GC(dss->ao);
+
+    /* Once one member has stopped, the group is no longer consistent. */
+    dss->rs.group_done = true;
+    group->nr_running--;
+    libxl__remus_group_failed(egc, group, rc ?: ERROR_FAIL);
+
+    if (!group->nr_running)
+        libxl__ao_complete(egc, ao, group->rc);
+}
+
 static void domain_suspend_cb(libxl__egc *egc,
                               libxl__domain_save_state *dss, int rc)
 {
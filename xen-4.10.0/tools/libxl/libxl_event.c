@@ -716,14 +716,22 @@ static int evtchn_revents_check(libxl__egc *egc, int revents)
 static void evtchn_fd_callback(libxl__egc *egc, libxl__ev_fd *ev,
                                int fd, short events, short revents)
 {
-    EGC_GC;
-    libxl__ev_evtchn *evev;
     int rc;
-    xenevtchn_port_or_error_t port;
 
     rc = evtchn_revents_check(egc, revents);
     if (rc) return;
 
+    libxl__ev_evtchn_dispatch(egc);
+}
+
+void libxl__ev_evtchn_dispatch(libxl__egc *egc)
+{
+    EGC_GC;
+    libxl__ev_evtchn *evev;
+    int rc, revents;
+    xenevtchn_port_or_error_t port;
+    const int fd = xenevtchn_fd(CTX->xce);
+
     for (;;) {
         /* Check the fd again.  The incoming revent may no longer be
          * true, because the libxl ctx lock has not necessarily been
@@ -992,6 +992,14 @@ static inline int libxl__ev_xswatch_isregistered(const libxl__ev_xswatch *xw)
 _hidden int libxl__ev_evtchn_wait(libxl__gc*, libxl__ev_evtchn *evev);
 _hidden void libxl__ev_evtchn_cancel(libxl__gc *gc, libxl__ev_evtchn *evev);
 
+/*
+ * Makes the callbacks for any events which are already pending, without
+ * waiting for the event loop to notice the evtchn fd.  For callers which
+ * expect an event within microseconds and would rather poll for it.
+ * Only while something is waiting (so that CTX->xce is valid).
+ */
+_hidden void libxl__ev_evtchn_dispatch(libxl__egc *egc);
+
 static inline void libxl__ev_evtchn_init(libxl__ev_evtchn *evev)
                 { evev->waiting = 0; }
 static inline bool libxl__ev_evtchn_iswaiting(const libxl__ev_evtchn *evev)
@@ -1759,6 +1767,24 @@ _hidden char *libxl__blktap_devpath(libxl__gc *gc,
  */
 _hidden int libxl__device_destroy_tapdisk(libxl__gc *gc, const char *params);
 
+/* libxl__blktap_remus_insert:
+ *   Stacks block-remus, replicating to name ("host:port"), on top of the
+ *   tapdisk serving params ("aio:/path") and returns the tapdisk's id and
+ *   minor, and the path of block-remus' control FIFO.  Its message FIFO
+ *   is the same path with ".msg" appended.
+ *   Always logs on failure.
+ */
+_hidden int libxl__blktap_remus_insert(libxl__gc *gc, const char *params,
+                                       const char *name, int *id_r,
+                                       int *minor_r, const char **ctl_path_r);
+
+/* libxl__blktap_remus_remove:
+ *   Takes block-remus off again, leaving params.
+ *   Always logs on failure.
+ */
+_hidden int libxl__blktap_remus_remove(libxl__gc *gc, int id, int minor,
+                                       const char *params);
+
 /* Calls poll() again - useful to check whether a signaled condition
  * is still true.  Cannot fail.  Returns currently-true revents. */
 _hidden short libxl__fd_poll_recheck(libxl__egc *egc, int fd, short events);
@@ -2857,6 +2883,8 @@ typedef struct libxl__save_helper_state {
     int need_results; /* set to 0 or 1 by caller of run_helper;
                        * if set to 1 then the ultimate caller's
                        * results function must set it to 0 */
+    bool use_shm; /* control channel through shared memory,
+                   * see libxl_save_shm.h */
     /* private */
     int rc;
     int completed; /* retval/errnoval valid iff completed */
@@ -2866,6 +2894,7 @@ typedef struct libxl__save_helper_state {
     libxl__ev_fd readable;
     libxl__ev_child child;
     const char *stdin_what, *stdout_what;
+    struct libxl__save_shm *shm; /* mapped iff use_shm took effect */
 
     libxl__egc *egc; /* valid only for duration of each event callback;
                       * is here in this struct for the benefit of the
@@ -3044,12 +3073,264 @@ _hidden void libxl__checkpoint_devices_preresume(libxl__egc *egc,
 _hidden void libxl__checkpoint_devices_commit(libxl__egc *egc,
                                         libxl__checkpoint_devices_state *cds);
 
+/*----- Remus heartbeat -----*/
+
+/*
+ * Liveness heartbeat between the Remus primary and backup, carried in
+ * small UDP datagrams and driven entirely from the libxl event loop.
+ *
+ * The sender transmits a beat to host:port every period_us.  The receiver
+ * listens on port; once the first beat has arrived, it calls callback
+ * with ERROR_TIMEDOUT if no further beat arrives for misses * period_us.
+ * Beats carry nonce, and the receiver ignores those with another, or from
+ * anywhere but host if that is set; see libxl_remus_heartbeat.c for what
+ * that does and does not protect against.
+ * Either side calls callback with another error code if its socket
+ * fails.  After the callback the heartbeat is stopped.
+ *
+ * On Linux the period is kept with a timerfd, so periods below the
+ * millisecond resolution of the libxl timeout machinery are honoured.
+ */
+typedef struct libxl__remus_heartbeat_state libxl__remus_heartbeat_state;
+typedef void libxl__remus_heartbeat_callback(libxl__egc *egc,
+                           libxl__remus_heartbeat_state *hbs, int rc);
+struct libxl__remus_heartbeat_state {
+    /* caller must fill these in, and they must all remain valid */
+    libxl__ao *ao;
+    uint32_t domid;           /* for logging only */
+    const char *host;         /* send: the receiver; receive: numeric address
+                               * of the sender, or NULL for the first one */
+    int port;
+    int period_us;
+    int misses;               /* receive only */
+    uint64_t nonce;
+    libxl__remus_heartbeat_callback *callback;
+    /* filled in by the receiver, for the caller's information */
+    uint64_t beats, rejected;
+    struct timeval last_beat;
+    /* private */
+    int fd;
+    libxl__ev_fd efd;
+    int timerfd;
+    libxl__ev_fd timer_efd;
+    libxl__ev_time timeout;
+    uint32_t seq;
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+};
+
+_hidden void libxl__remus_heartbeat_init(libxl__remus_heartbeat_state *hbs);
+_hidden int libxl__remus_heartbeat_send_start(libxl__gc *gc,
+                                          libxl__remus_heartbeat_state *hbs);
+_hidden int libxl__remus_heartbeat_recv_start(libxl__gc *gc,
+                                          libxl__remus_heartbeat_state *hbs);
+/* Idempotent; safe on an initialised but never started heartbeat. */
+_hidden void libxl__remus_heartbeat_stop(libxl__gc *gc,
+                                         libxl__remus_heartbeat_state *hbs);
+
+/*----- Remus disk replication -----*/
+
+/*
+ * Replication of raw images served by tapdisk, without DRBD.
+ *
+ * On the primary, block-remus is stacked onto the disk's tapdisk while
+ * Remus runs.  It sends every write to the backup before issuing it
+ * locally, and closes the epoch with a marker on postsuspend.  On the
+ * backup a receiver per disk buffers the writes of each epoch, and an
+ * epoch is written to the image only once the memory checkpoint it goes
+ * with is complete.  The checkpoint is acknowledged after that, so disk
+ * and memory are committed together without a barrier of their own.
+ *
+ * Both sides number the domain's disks in order of device number; disk i
+ * is replicated over TCP port disk_port + i.
+ */
+typedef struct libxl__remus_disk_epoch libxl__remus_disk_epoch;
+typedef struct libxl__remus_disk_recv libxl__remus_disk_recv;
+typedef void libxl__remus_disk_recv_callback(libxl__egc *egc,
+                           libxl__remus_disk_recv *rd, int rc);
+struct libxl__remus_disk_recv {
+    /* caller must fill these in, and they must all remain valid */
+    libxl__ao *ao;
+    uint32_t domid;           /* for logging only */
+    const char *path;         /* the backup's copy of the image */
+    int port;
+    void *caller_state;
+    /*
+     * Called with rc 0 whenever the primary has closed an epoch, and
+     * with an error once the stream has failed.  After an error the
+     * receiver stops reading, but keeps the epochs it has.
+     */
+    libxl__remus_disk_recv_callback *callback;
+    /* filled in by the receiver, for the caller's information */
+    uint64_t closed;          /* epochs closed by the primary */
+    uint64_t committed;       /* epochs written to the image */
+    /* private */
+    int listen_fd, fd, image_fd;
+    libxl__ev_fd listen_efd, efd;
+    libxl__remus_disk_epoch *open;                      /* NOGC */
+    LIBXL_STAILQ_HEAD(, libxl__remus_disk_epoch) epochs; /* NOGC, closed */
+};
+
+_hidden void libxl__remus_disk_recv_init(libxl__remus_disk_recv *rd);
+_hidden int libxl__remus_disk_recv_start(libxl__gc *gc,
+                                         libxl__remus_disk_recv *rd);
+/* Writes the oldest closed epoch to the image; ERROR_NOT_READY if none. */
+_hidden int libxl__remus_disk_recv_commit(libxl__gc *gc,
+                                          libxl__remus_disk_recv *rd);
+/*
+ * On failover, once the memory checkpoint is complete: writes the whole
+ * records of the open epoch, whose marker has not arrived.  They are all
+ * there, since block-remus sends a write before completing it.
+ */
+_hidden int libxl__remus_disk_recv_commit_open(libxl__gc *gc,
+                                               libxl__remus_disk_recv *rd);
+/* Idempotent; syncs the image and drops what was not committed. */
+_hidden void libxl__remus_disk_recv_stop(libxl__gc *gc,
+                                         libxl__remus_disk_recv *rd);
+/* The port over which disk is replicated, out of the domain's disks. */
+_hidden int libxl__remus_disk_port(const libxl_device_disk *disks,
+                                   int num_disks,
+                                   const libxl_device_disk *disk, int base);
+
+/*----- Remus striped streams -----*/
+
+/*
+ * Extra TCP connections over which libxc spreads the memory of each Remus
+ * checkpoint, see xc_domain_save.  The backup listens on port before the
+ * stream starts.  The primary connects all nr of them before it writes
+ * anything to the stream, retrying while the backup is not listening yet,
+ * so the backup finds them queued when it gets to the libxc part of the
+ * stream and accepts them there without waiting.  The fds are handed to
+ * the save/restore helper; they stay open until stop.
+ */
+typedef struct libxl__remus_stripes_state libxl__remus_stripes_state;
+typedef void libxl__remus_stripes_callback(libxl__egc *egc,
+                           libxl__remus_stripes_state *ss, int rc);
+struct libxl__remus_stripes_state {
+    /* caller must fill these in, and they must all remain valid */
+    libxl__ao *ao;
+    uint32_t domid;           /* for logging only */
+    const char *host;         /* connect only: address of the backup */
+    int port;
+    int nr;
+    libxl__remus_stripes_callback *callback; /* connect only */
+    /* filled in once connected or accepted */
+    int *fds;
+    /* private */
+    int listen_fd;
+    int connected;            /* fds which are connected */
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    libxl__ev_fd efd;
+    libxl__ev_time retry, timeout;
+};
+
+#define LIBXL__REMUS_MAX_STREAMS 16
+
+_hidden void libxl__remus_stripes_init(libxl__remus_stripes_state *ss);
+/* Calls ss->callback once all are connected, or it has given up. */
+_hidden void libxl__remus_stripes_connect(libxl__egc *egc,
+                                          libxl__remus_stripes_state *ss);
+_hidden int libxl__remus_stripes_listen(libxl__gc *gc,
+                                        libxl__remus_stripes_state *ss);
+/* Fails, rather than waiting, unless all of them are queued. */
+_hidden int libxl__remus_stripes_accept(libxl__gc *gc,
+                                        libxl__remus_stripes_state *ss);
+/* Idempotent; safe on an initialised but never started state. */
+_hidden void libxl__remus_stripes_stop(libxl__gc *gc,
+                                       libxl__remus_stripes_state *ss);
+
 /*----- Remus related state structure -----*/
+/* Domains checkpointed together, see libxl_domain_remus_group_start */
+typedef struct libxl__remus_group libxl__remus_group;
+struct libxl__remus_group {
+    libxl__ao *ao;
+    int nr;
+    struct libxl__domain_save_state **members;
+    int nr_running;  /* members whose dss->callback has not been called */
+    int nr_parked;   /* members waiting to be suspended together */
+    int rc;          /* why the first member stopped */
+    int nr_boosted;  /* members which have boosted dom0 */
+};
+/* Stops the other members once one has stopped (or could not start). */
+_hidden void libxl__remus_group_failed(libxl__egc *egc,
+                                       libxl__remus_group *group, int rc);
+
+/* A dom0 thread run SCHED_FIFO during checkpoints, and how it ran before */
+typedef struct libxl__remus_boost_thread {
+    pid_t pid;
+    int policy;      /* -1 if it has not been raised */
+    int priority;
+} libxl__remus_boost_thread;
+
+/* Where one Remus checkpoint spent its time, see libxl_remus_stats.c */
+typedef struct libxl__remus_epoch_stats {
+    uint64_t epoch;
+    uint32_t trigger_us;     /* checkpoint due -> suspend requested */
+    uint32_t suspend_us;     /* -> guest suspended */
+    uint32_t postsuspend_us; /* device postsuspend */
+    uint32_t bitmap_us;      /* dirty bitmap fetch, from libxc */
+    uint32_t send_us;        /* page send, from libxc */
+    uint32_t resume_us;      /* device preresume and guest resume */
+    uint32_t commit_us;      /* checkpoint record written, devices committed */
+    uint32_t ack_us;         /* -> acknowledged by the backup, with output_ack */
+    uint32_t pages;
+    uint64_t bytes;
+    /* private */
+    struct timespec written;
+    bool committed, acked;
+} libxl__remus_epoch_stats;
+
+#define LIBXL__REMUS_STATS_RING 16 /* epochs; a power of two */
+
 typedef struct libxl__remus_state libxl__remus_state;
 struct libxl__remus_state {
     /* private */
     libxl__ev_time checkpoint_timeout; /* used for Remus checkpoint */
     int interval; /* checkpoint interval */
+    libxl__remus_heartbeat_state hb;
+    /* liveness records while idle between checkpoints */
+    libxl__ev_time liveness_timeout;
+    bool idle;
+    bool liveness_writing;
+    int deferred_ok; /* libxc's answer, if a checkpoint waits on a write */
+    /* acknowledgements from the backup, see dss->remus_ack_srs */
+    bool output_ack;
+    uint64_t epochs_acked;  /* compare with dss->cpsremus_epoch */
+    uint64_t epochs_released; /* output released, once the group has acks */
+    bool suspend_waiting;   /* the next checkpoint waits for an ack */
+    int ack_rc;             /* the back channel has failed */
+    /* adaptive checkpoint interval */
+    bool adaptive;
+    int next_interval;           /* ms */
+    struct timeval interval_start, deadline; /* of the idle period */
+    struct timeval last_suspend;
+    uint32_t epoch_ms;           /* between the last two suspends */
+    uint32_t pages, send_us;     /* of the last checkpoint, from libxc */
+    uint64_t dirty_rate;         /* running average, pages/s */
+    /* background pre-copy while idle */
+    libxl__ev_time precopy_timeout;
+    bool precopying;             /* libxc is sending a pre-copy pass */
+    bool checkpoint_due;         /* and the next checkpoint waits for it */
+    int precopy_ok;              /* libxc's answer then */
+    /* group checkpointing, see dss->group */
+    bool group_parked;           /* waiting to suspend with the others */
+    bool group_done;             /* dss->callback has been called */
+    /* per-checkpoint statistics, indexed by epoch */
+    libxl__remus_epoch_stats stats[LIBXL__REMUS_STATS_RING];
+    uint64_t stats_cons;         /* next epoch to report */
+    uint64_t stats_dropped;      /* epochs which could not be reported */
+    struct timespec stats_mark;  /* start of the phase being timed */
+    uint32_t stats_trigger_us, stats_suspend_us; /* before the epoch starts */
+    libxl__carefd *stats_fd;
+    /* memory striped over extra connections, see libxl__remus_stripes_state */
+    libxl__remus_stripes_state stripes;
+    /* checkpoint priority boost, see libxl_remus.c */
+    bool boosted;                /* a checkpoint is being taken */
+    bool boost_dom0;             /* dom0 is on sched_fp */
+    bool boost_warned;
+    int nr_boost_threads;
+    libxl__remus_boost_thread *boost_threads; /* [0] is the save helper */
 
     /*----- private for concrete (device-specific) layer only -----*/
     /* private for nic device subkind ops */
@@ -3061,6 +3342,13 @@ struct libxl__remus_state {
     char *drbd_probe_script;
 };
 _hidden int libxl__netbuffer_enabled(libxl__gc *gc);
+/* release the oldest buffered epoch of every nic, outside of any op */
+_hidden int libxl__netbuffer_release(libxl__gc *gc,
+                                     libxl__checkpoint_devices_state *cds);
+/* number of packets buffered by all nics */
+_hidden int libxl__netbuffer_backlog(libxl__gc *gc,
+                                     libxl__checkpoint_devices_state *cds,
+                                     uint64_t *packets_r);
 
 /*----- Legacy conversion helper -----*/
 typedef struct libxl__conversion_helper_state libxl__conversion_helper_state;
@@ -3140,6 +3428,10 @@ struct libxl__stream_read_state {
     /* Both only used when processing an EMULATOR record. */
     libxl__datacopier_state emu_dc;
     libxl__carefd *emu_carefd;
+
+    /* Remus: the last emulator context, which a delta is applied to. */
+    void *emu_base;
+    uint32_t emu_base_len;
 };
 
 _hidden void libxl__stream_read_init(libxl__stream_read_state *stream);
@@ -3151,6 +3443,9 @@ _hidden void libxl__stream_read_checkpoint_state(libxl__egc *egc,
                                                  libxl__stream_read_state *stream);
 _hidden void libxl__stream_read_abort(libxl__egc *egc,
                                       libxl__stream_read_state *stream, int rc);
+/* Remus: the primary is gone, complete from the last checkpoint. */
+_hidden void libxl__stream_read_failover(libxl__egc *egc,
+                                         libxl__stream_read_state *stream);
 static inline bool
 libxl__stream_read_inuse(const libxl__stream_read_state *stream)
 {
@@ -3192,12 +3487,17 @@ struct libxl__stream_write_state {
     void (*checkpoint_callback)(libxl__egc *egc,
                                 libxl__stream_write_state *sws,
                                 int rc);
+    /* Only needed for libxl__stream_write_liveness() */
+    void (*liveness_callback)(libxl__egc *egc,
+                              libxl__stream_write_state *sws,
+                              int rc);
     /* Private */
     int rc;
     bool running;
     bool in_checkpoint;
     bool sync_teardown;  /* Only used to coordinate shutdown on error path. */
     bool in_checkpoint_state;
+    bool in_liveness;
     libxl__save_helper_state shs;
 
     /* Main stream-writing data. */
@@ -3213,6 +3513,15 @@ struct libxl__stream_write_state {
     libxl__sr_rec_hdr emu_rec_hdr;
     libxl__sr_emulator_hdr emu_sub_hdr;
     void *emu_body;
+    uint32_t emu_body_len;
+    void *emu_delta;
+
+    /* Remus: the emulator context sent at the previous checkpoint. */
+    void *emu_prev;
+    uint32_t emu_prev_len;
+
+    /* Only used when writing a libxc LIVENESS record. */
+    uint8_t liveness_rec[XC_STREAM_LIVENESS_RECORD_SIZE];
 };
 
 _hidden void libxl__stream_write_init(libxl__stream_write_state *stream);
@@ -3225,6 +3534,12 @@ _hidden void
 libxl__stream_write_checkpoint_state(libxl__egc *egc,
                                      libxl__stream_write_state *stream,
                                      libxl_sr_checkpoint_state *srcs);
+/*
+ * Remus: write a libxc LIVENESS record while the stream is idle between
+ * checkpoints, then call liveness_callback.
+ */
+_hidden void libxl__stream_write_liveness(libxl__egc *egc,
+                                          libxl__stream_write_state *stream);
 _hidden void libxl__stream_write_abort(libxl__egc *egc,
                                        libxl__stream_write_state *stream,
                                        int rc);
@@ -3253,6 +3568,11 @@ struct libxl__domain_suspend_state {
     /* set by caller of libxl__domain_suspend_init */
     libxl__ao *ao;
     uint32_t domid;
+    bool checkpointing; /* suspended over and over, see libxl_dom_suspend.c */
+
+    /* results, for callback_common_done and checkpointing callers */
+    uint32_t suspend_us; /* from the suspend request to the guest's ack */
+    uint32_t resume_us;  /* of libxl__domain_resume_checkpoint */
 
     /* private */
     libxl_domain_type type;
@@ -3260,6 +3580,8 @@ struct libxl__domain_suspend_state {
     libxl__ev_evtchn guest_evtchn;
     int guest_evtchn_lockfd;
     int guest_responded;
+    bool guest_evtchn_acks; /* the event channel is known to ack suspends */
+    struct timespec requested;
 
     libxl__xswait_state pvcontrol;
     libxl__ev_xswatch guest_watch;
@@ -3273,6 +3595,15 @@ struct libxl__domain_suspend_state {
 int libxl__domain_suspend_init(libxl__egc *egc,
                                libxl__domain_suspend_state *dsps,
                                libxl_domain_type type);
+/* Resumes a domain suspended with dsps->checkpointing set, with suspend
+ * cancellation.  Does everything libxl__domain_resume does except telling
+ * xenstored, which is left to _resume_checkpoint_xs, so that the caller
+ * can do that after it has let the domain run again.  A failure of the
+ * latter is only logged: it matters to watchers of @releaseDomain. */
+_hidden int libxl__domain_resume_checkpoint(libxl__gc *gc,
+                                            libxl__domain_suspend_state *dsps);
+_hidden void libxl__domain_resume_checkpoint_xs(libxl__gc *gc,
+                                            libxl__domain_suspend_state *dsps);
 
 struct libxl__domain_save_state {
     /* set by caller of libxl__domain_save */
@@ -3290,7 +3621,17 @@ struct libxl__domain_save_state {
     int checkpointed_stream;
     const libxl_domain_remus_info *remus;
     libxl__ev_xswatch guest_watch;
+    /* CPS-Remus checkpoint trigger: event channel, or watch on statepath */
     libxl__ev_xswatch cpsremus_watch;
+    libxl__ev_evtchn cpsremus_evtchn;
+    bool cpsremus_armed;     /* waiting for the guest's next request */
+    bool cpsremus_requested; /* request arrived during a checkpoint */
+    /* CPS-Remus progress reported back to the guest, if it asked */
+    struct cpsremus_page *cpsremus_page;
+    uint64_t cpsremus_epoch;
+    /* memory the guest does not want replicated, see xen/io/cpsremus.h */
+    xen_pfn_t cpsremus_skip_pfn; /* INVALID_MFN if none */
+    libxl__remus_group *group; /* NULL unless checkpointed with others */
     /* private */
     int rc;
     int hvm;
@@ -3304,9 +3645,26 @@ struct libxl__domain_save_state {
     };
     libxl__checkpoint_devices_state cds;
     libxl__stream_write_state sws;
+    /* Remus: checkpoint acknowledgements from the backup */
+    libxl__stream_read_state remus_ack_srs;
     libxl__logdirty_switch logdirty;
 };
 
+/* Remus checkpoint statistics, see libxl_remus_stats.c */
+_hidden int libxl__remus_stats_setup(libxl__gc *gc,
+                                     libxl__domain_save_state *dss);
+_hidden void libxl__remus_stats_teardown(libxl__domain_save_state *dss);
+_hidden uint32_t libxl__remus_stats_between(const struct timespec *from,
+                                            const struct timespec *to);
+/* Microseconds since *since, which is moved on to now. */
+_hidden uint32_t libxl__remus_stats_lap(struct timespec *since);
+/* The slot of epoch, or NULL if it has been reused already. */
+_hidden libxl__remus_epoch_stats *libxl__remus_stats_epoch(
+                                    libxl__remus_state *rs, uint64_t epoch);
+/* Reports every checkpoint up to dss->cpsremus_epoch which is complete. */
+_hidden void libxl__remus_stats_report(libxl__gc *gc,
+                                       libxl__domain_save_state *dss);
+
 
 /*----- openpty -----*/
 
@@ -3741,6 +4099,10 @@ _hidden int libxl__destroy_qdisk_backend(libxl__gc *gc, uint32_t domid);
 
 /*----- Domain creation -----*/
 
+typedef void libxl__remus_standby_callback(libxl__egc *egc,
+                                           libxl__domain_create_state *dcs,
+                                           int rc);
+
 
 struct libxl__domain_create_state {
     /* filled in by user */
@@ -3766,6 +4128,29 @@ struct libxl__domain_create_state {
         /* If we're not doing stubdom, we use only dmss.dm,
          * for the non-stubdom device model. */
     libxl__stream_read_state srs;
+    /* Remus: heartbeat from the primary, and whether it has been lost */
+    libxl__remus_heartbeat_state remus_hb;
+    bool remus_failover;
+    /* Remus: checkpoint acknowledgements on the back channel */
+    libxl__stream_write_state remus_ack_sws;
+    unsigned int remus_acks;  /* acks still to be written */
+    /* Remus: disks replicated without DRBD, see libxl__remus_disk_recv */
+    libxl__remus_disk_recv *remus_disks;
+    int remus_num_disks;
+    uint64_t remus_checkpoints; /* memory checkpoints complete */
+    uint64_t remus_committed;   /* of which the disks have been written */
+    uint64_t remus_applied;     /* of which libxc has applied the memory */
+    uint64_t remus_acked;       /* acks queued, committed and applied */
+    /* Remus: memory striped over extra connections */
+    libxl__remus_stripes_state remus_stripes;
+    /* Remus: devices plugged in ahead of failover, see libxl_remus.c */
+    libxl__multidev remus_standby;
+    bool remus_standby_busy;
+    bool remus_standby_nics, remus_standby_disks;
+    bool remus_standby_live;    /* failed over; the vifs are to be up */
+    int remus_standby_rc;
+    int remus_standby_failed_rc; /* creation's own, while waiting for them */
+    libxl__remus_standby_callback *remus_standby_callback;
     /* necessary if the domain creation failed and we have to destroy it */
     libxl__domain_destroy_state dds;
     libxl__multidev multidev;
@@ -3825,6 +4210,9 @@ _hidden void libxl__xc_domain_restore_done(libxl__egc *egc, void *dcs_void,
 _hidden void libxl__save_helper_init(libxl__save_helper_state *shs);
 _hidden void libxl__save_helper_abort(libxl__egc *egc,
                                       libxl__save_helper_state *shs);
+/* Make a restore helper give up reading the stream and fail over. */
+_hidden void libxl__save_helper_failover(libxl__egc *egc,
+                                         libxl__save_helper_state *shs);
 
 static inline bool libxl__save_helper_inuse(const libxl__save_helper_state *shs)
 {
@@ -3849,8 +4237,30 @@ _hidden void libxl__remus_setup(libxl__egc *egc,
 _hidden void libxl__remus_teardown(libxl__egc *egc,
                                    libxl__remus_state *rs,
                                    int rc);
-_hidden void libxl__remus_restore_setup(libxl__egc *egc,
-                                        libxl__domain_create_state *dcs);
+_hidden int libxl__remus_restore_setup(libxl__egc *egc,
+                                       libxl__domain_create_state *dcs);
+/*
+ * Stops the heartbeat and acknowledgements once the stream is over, and
+ * leaves the replicated disks as of the last complete checkpoint.
+ */
+_hidden void libxl__remus_restore_stop(libxl__egc *egc,
+                                       libxl__domain_create_state *dcs);
+/*
+ * With a checkpoint history, moves the device model state of earlier
+ * checkpoints along before path is overwritten with the next one's.
+ */
+/*
+ * Calls callback once the devices plugged in ahead of failover are ready,
+ * with the result, or right away if they already are.
+ */
+_hidden void libxl__remus_standby_wait(libxl__egc *egc,
+                                       libxl__domain_create_state *dcs,
+                                       libxl__remus_standby_callback *cb);
+_hidden void libxl__remus_restore_keep_emulator(libxl__gc *gc,
+                                        libxl__domain_create_state *dcs,
+                                        const char *path);
+
+#define LIBXL__REMUS_DEFAULT_HISTORY_MB 256
 
 
 /*
@@ -30,6 +30,7 @@ typedef struct libxl__remus_device_nic {
 
     const char *vif;
     const char *ifb;
+    int ifindex;
     struct rtnl_qdisc *qdisc;
 } libxl__remus_device_nic;
 
@@ -205,6 +206,7 @@ static int init_qdisc(libxl__checkpoint_devices_state *cds,
             goto out;
         }
         remus_nic->qdisc = qdisc;
+        remus_nic->ifindex = ifindex;
     } else {
         LOGD(ERROR, cds->domid,
              "Cannot get qdisc handle from ifb %s", remus_nic->ifb);
@@ -502,17 +504,84 @@ static void nic_postsuspend(libxl__egc *egc, libxl__checkpoint_device *dev)
 
 static void nic_commit(libxl__egc *egc, libxl__checkpoint_device *dev)
 {
-    int rc;
+    int rc = 0;
     libxl__remus_device_nic *remus_nic = dev->concrete_data;
+    libxl__remus_state *rs = dev->cds->concrete_data;
 
     STATE_AO_GC(dev->cds->ao);
 
-    rc = remus_netbuf_op(remus_nic, dev->cds, tc_buffer_release);
+    /*
+     * With acknowledged output commit the epoch is released by
+     * libxl__netbuffer_release() once the backup has the checkpoint.
+     */
+    if (!rs->output_ack)
+        rc = remus_netbuf_op(remus_nic, dev->cds, tc_buffer_release);
 
     dev->aodev.rc = rc;
     dev->aodev.callback(egc, &dev->aodev);
 }
 
+/*
+ * The plug qdisc keeps count of one closed epoch besides the one being
+ * captured, so every release must come between two postsuspends.
+ */
+int libxl__netbuffer_release(libxl__gc *gc,
+                             libxl__checkpoint_devices_state *cds)
+{
+    int i, rc;
+    libxl__checkpoint_device *dev;
+
+    for (i = 0; i < cds->num_devices; i++) {
+        dev = cds->devs[i];
+        if (!dev || !dev->matched || dev->kind != LIBXL__DEVICE_KIND_VIF)
+            continue;
+
+        rc = remus_netbuf_op(dev->concrete_data, cds, tc_buffer_release);
+        if (rc)
+            return rc;
+    }
+
+    return 0;
+}
+
+/* Packets held back by the plug qdiscs, in all epochs. */
+int libxl__netbuffer_backlog(libxl__gc *gc,
+                             libxl__checkpoint_devices_state *cds,
+                             uint64_t *packets_r)
+{
+    int i, ret;
+    libxl__checkpoint_device *dev;
+    libxl__remus_device_nic *remus_nic;
+    struct rtnl_qdisc *qdisc;
+    libxl__remus_state *rs = cds->concrete_data;
+
+    /* The cached objects only carry the statistics of the last refill. */
+    ret = nl_cache_refill(rs->nlsock, rs->qdisc_cache);
+    if (ret) {
+        LOGD(ERROR, cds->domid,
+             "cannot refill qdisc cache: %s", nl_geterror(ret));
+        return ERROR_FAIL;
+    }
+
+    *packets_r = 0;
+    for (i = 0; i < cds->num_devices; i++) {
+        dev = cds->devs[i];
+        if (!dev || !dev->matched || dev->kind != LIBXL__DEVICE_KIND_VIF)
+            continue;
+
+        remus_nic = dev->concrete_data;
+        qdisc = rtnl_qdisc_get_by_parent(rs->qdisc_cache, remus_nic->ifindex,
+                                         TC_H_ROOT);
+        if (!qdisc)
+            continue;
+
+        *packets_r += rtnl_tc_get_stat(TC_CAST(qdisc), RTNL_TC_QLEN);
+        rtnl_qdisc_put(qdisc);
+    }
+
+    return 0;
+}
+
 const libxl__checkpoint_device_instance_ops remus_device_nic = {
     .kind = LIBXL__DEVICE_KIND_VIF,
     .setup = nic_setup,
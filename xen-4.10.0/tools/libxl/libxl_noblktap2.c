@@ -33,6 +33,19 @@ int libxl__device_destroy_tapdisk(libxl__gc *gc, const char *params)
     return 0;
 }
 
+int libxl__blktap_remus_insert(libxl__gc *gc, const char *params,
+                               const char *name, int *id_r, int *minor_r,
+                               const char **ctl_path_r)
+{
+    return ERROR_FAIL;
+}
+
+int libxl__blktap_remus_remove(libxl__gc *gc, int id, int minor,
+                               const char *params)
+{
+    return ERROR_FAIL;
+}
+
 /*
  * Local variables:
  * mode: C
@@ -32,6 +32,20 @@ void cleanup_subkind_nic(libxl__checkpoint_devices_state *cds)
     return;
 }
 
+int libxl__netbuffer_release(libxl__gc *gc,
+                             libxl__checkpoint_devices_state *cds)
+{
+    return 0;
+}
+
+int libxl__netbuffer_backlog(libxl__gc *gc,
+                             libxl__checkpoint_devices_state *cds,
+                             uint64_t *packets_r)
+{
+    *packets_r = 0;
+    return 0;
+}
+
 static void nic_setup(libxl__egc *egc, libxl__checkpoint_device *dev)
 {
     STATE_AO_GC(dev->cds->ao);
@@ -17,11 +17,20 @@
 #include "libxl_osdeps.h" /* must come before any other headers */
 
 #include "libxl_internal.h"
+#include "libxl_sr_stream_format.h"
+
+#include <xen/io/cpsremus.h>
+
+#include <net/if.h>
+#include <sched.h>
+#include <sys/ioctl.h>
 
 extern const libxl__checkpoint_device_instance_ops remus_device_nic;
+extern const libxl__checkpoint_device_instance_ops remus_device_tap_disk;
 extern const libxl__checkpoint_device_instance_ops remus_device_drbd_disk;
 static const libxl__checkpoint_device_instance_ops *remus_ops[] = {
     &remus_device_nic,
+    &remus_device_tap_disk,
     &remus_device_drbd_disk,
     NULL,
 };
@@ -69,9 +78,29 @@ static void remus_checkpoint_stream_written(
 static void libxl__remus_domain_suspend_callback(void *data);
 static void libxl__remus_domain_resume_callback(void *data);
 static void libxl__remus_domain_save_checkpoint_callback(void *data);
-static void cpsremus_next_checkpoint(libxl__egc *egc, libxl__ev_xswatch *ev, 
-                                     const char *watch_path,
-                                     const char *event_path);
+static int cpsremus_trigger_setup(libxl__gc *gc,
+                                  libxl__domain_save_state *dss);
+static void cpsremus_trigger_teardown(libxl__gc *gc,
+                                      libxl__domain_save_state *dss);
+static void remus_heartbeat_send_failed(libxl__egc *egc,
+                                        libxl__remus_heartbeat_state *hbs,
+                                        int rc);
+static void remus_liveness_written(libxl__egc *egc,
+                                   libxl__stream_write_state *sws, int rc);
+static int cpsremus_skip_setup(libxl__gc *gc, libxl__domain_save_state *dss);
+static void remus_ack_start(libxl__egc *egc, libxl__domain_save_state *dss);
+static void remus_ack_stop(libxl__egc *egc, libxl__domain_save_state *dss);
+static void remus_checkpoint_stats(uint32_t pages, uint64_t bytes,
+                                   uint32_t bitmap_us, uint32_t send_us,
+                                   void *data);
+static void remus_precopy_done_callback(void *data);
+static void remus_suspend(libxl__egc *egc, libxl__domain_save_state *dss);
+static void remus_group_kick(libxl__egc *egc, libxl__domain_save_state *dss);
+static void remus_stripes_connected(libxl__egc *egc,
+                                    libxl__remus_stripes_state *ss, int rc);
+static int remus_boost_setup(libxl__gc *gc, libxl__domain_save_state *dss);
+static void remus_boost_raise(libxl__gc *gc, libxl__domain_save_state *dss);
+static void remus_boost_lower(libxl__gc *gc, libxl__domain_save_state *dss);
 
 void libxl__remus_setup(libxl__egc *egc, libxl__remus_state *rs)
 {
@@ -104,22 +133,75 @@ void libxl__remus_setup(libxl__egc *egc, libxl__remus_state *rs)
     cds->concrete_data = rs;
     rs->interval = info->interval;
 
+    if (libxl__remus_stats_setup(gc, dss))
+        goto out;
+
+    if (remus_boost_setup(gc, dss))
+        goto out;
+
     if (init_device_subkind(cds)) {
         LOGD(ERROR, dss->domid,
              "Remus: failed to init device subkind");
         goto out;
     }
 
+    if (cpsremus_skip_setup(gc, dss)) {
+        cleanup_device_subkind(cds);
+        goto out;
+    }
+
+    if (libxl_defbool_val(info->event_driven) &&
+        cpsremus_trigger_setup(gc, dss)) {
+        cleanup_device_subkind(cds);
+        goto out;
+    }
+
+    if (info->heartbeat_port && info->heartbeat_host) {
+        rs->hb.ao = ao;
+        rs->hb.domid = dss->domid;
+        rs->hb.host = info->heartbeat_host;
+        rs->hb.port = info->heartbeat_port;
+        rs->hb.period_us = info->heartbeat_period;
+        rs->hb.nonce = info->heartbeat_nonce;
+        rs->hb.callback = remus_heartbeat_send_failed;
+        if (libxl__remus_heartbeat_send_start(gc, &rs->hb)) {
+            cpsremus_trigger_teardown(gc, dss);
+            cleanup_device_subkind(cds);
+            goto out;
+        }
+    }
+
     dss->sws.checkpoint_callback = remus_checkpoint_stream_written;
+    dss->sws.liveness_callback = remus_liveness_written;
+    rs->idle = false;
+    rs->liveness_writing = false;
+    rs->output_ack = libxl_defbool_val(info->output_ack) && dss->recv_fd >= 0;
+    rs->epochs_acked = dss->cpsremus_epoch;
+    rs->epochs_released = dss->cpsremus_epoch;
+    rs->suspend_waiting = false;
+    rs->group_parked = false;
+    rs->group_done = false;
+    rs->ack_rc = 0;
+    rs->adaptive = info->interval_max > 0;
+    rs->next_interval = info->interval;
+    timerclear(&rs->last_suspend);
+    rs->epoch_ms = 0;
+    rs->dirty_rate = 0;
+    rs->precopying = false;
+    rs->checkpoint_due = false;
 
     callbacks->suspend = libxl__remus_domain_suspend_callback;
     callbacks->postcopy = libxl__remus_domain_resume_callback;
     callbacks->checkpoint = libxl__remus_domain_save_checkpoint_callback;
+    callbacks->checkpoint_stats = remus_checkpoint_stats;
+    if (info->precopy_period > 0)
+        callbacks->precopy_done = remus_precopy_done_callback;
 
     libxl__checkpoint_devices_setup(egc, cds);
     return;
 
 out:
+    libxl__remus_stats_teardown(dss);
     dss->callback(egc, dss, ERROR_FAIL);
 }
 
@@ -129,16 +211,51 @@ static void remus_setup_done(libxl__egc *egc,
     libxl__domain_save_state *dss = CONTAINER_OF(cds, *dss, cds);
     STATE_AO_GC(dss->ao);
 
-    if (!rc) {
-        libxl__domain_save(egc, dss);
+    if (rc) {
+        LOGD(ERROR, dss->domid, "Remus: failed to setup device, rc %d", rc);
+        goto out;
+    }
+
+    /* before the stream starts, see libxl__remus_stripes_state */
+    if (dss->remus->streams > 0) {
+        libxl__remus_stripes_state *const ss = &dss->rs.stripes;
+
+        ss->ao = ao;
+        ss->domid = dss->domid;
+        ss->host = dss->remus->stream_host;
+        ss->port = dss->remus->stream_port;
+        ss->nr = dss->remus->streams;
+        ss->callback = remus_stripes_connected;
+        libxl__remus_stripes_connect(egc, ss);
         return;
     }
 
-    LOGD(ERROR, dss->domid, "Remus: failed to setup device, rc %d", rc);
+    remus_stripes_connected(egc, &dss->rs.stripes, 0);
+    return;
+
+out:
     cds->callback = remus_setup_failed;
     libxl__checkpoint_devices_teardown(egc, cds);
 }
 
+static void remus_stripes_connected(libxl__egc *egc,
+                                    libxl__remus_stripes_state *ss, int rc)
+{
+    libxl__remus_state *rs = CONTAINER_OF(ss, *rs, stripes);
+    libxl__domain_save_state *dss = CONTAINER_OF(rs, *dss, rs);
+    libxl__checkpoint_devices_state *const cds = &dss->cds;
+
+    if (rc) {
+        cds->callback = remus_setup_failed;
+        libxl__checkpoint_devices_teardown(egc, cds);
+        return;
+    }
+
+    if (dss->rs.output_ack)
+        remus_ack_start(egc, dss);
+    libxl__domain_save(egc, dss);
+}
+
 static void remus_setup_failed(libxl__egc *egc,
                                libxl__checkpoint_devices_state *cds, int rc)
 {
@@ -149,7 +266,11 @@ static void remus_setup_failed(libxl__egc *egc,
         LOGD(ERROR, dss->domid,
              "Remus: failed to teardown device after setup failed, rc %d", rc);
 
+    libxl__remus_heartbeat_stop(gc, &dss->rs.hb);
+    libxl__remus_stripes_stop(gc, &dss->rs.stripes);
+    cpsremus_trigger_teardown(gc, dss);
     cleanup_device_subkind(cds);
+    libxl__remus_stats_teardown(dss);
 
     dss->callback(egc, dss, rc);
 }
@@ -170,6 +291,12 @@ void libxl__remus_teardown(libxl__egc *egc,
 
     LOGD(WARN, dss->domid, "Remus: Domain suspend terminated with rc %d,"
          " teardown Remus devices...", rc);
+    libxl__ev_time_deregister(gc, &rs->liveness_timeout);
+    libxl__ev_time_deregister(gc, &rs->precopy_timeout);
+    libxl__remus_heartbeat_stop(gc, &rs->hb);
+    remus_ack_stop(egc, dss);
+    cpsremus_trigger_teardown(gc, dss);
+    remus_boost_lower(gc, dss);
     cds->callback = remus_teardown_done;
     libxl__checkpoint_devices_teardown(egc, cds);
 }
@@ -185,11 +312,28 @@ static void remus_teardown_done(libxl__egc *egc,
         LOGD(ERROR, dss->domid, "Remus: failed to teardown device,"
             " rc %d", rc);
 
+    libxl__remus_stripes_stop(gc, &dss->rs.stripes);
     cleanup_device_subkind(cds);
+    libxl__remus_stats_teardown(dss);
 
     dss->callback(egc, dss, rc);
 }
 
+static void remus_heartbeat_send_failed(libxl__egc *egc,
+                                        libxl__remus_heartbeat_state *hbs,
+                                        int rc)
+{
+    libxl__remus_state *rs = CONTAINER_OF(hbs, *rs, hb);
+    libxl__domain_save_state *dss = CONTAINER_OF(rs, *dss, rs);
+    STATE_AO_GC(dss->ao);
+
+    /*
+     * Nothing to tear down: the backup will notice the silence and fail
+     * over, and the stream will fail soon after.
+     */
+    LOGD(ERROR, dss->domid, "Remus: heartbeat failed, rc %d", rc);
+}
+
 /*---------------------- remus callbacks (save) -----------------------*/
 
 static void remus_domain_suspend_callback_common_done(libxl__egc *egc,
@@ -207,19 +351,43 @@ static void libxl__remus_domain_suspend_callback(void *data)
     libxl__egc *egc = shs->egc;
     libxl__domain_save_state *dss = shs->caller_state;
     libxl__domain_suspend_state *dsps = &dss->dsps;
+    libxl__remus_state *const rs = &dss->rs;
 
     dsps->callback_common_done = remus_domain_suspend_callback_common_done;
-    libxl__domain_suspend(egc, dsps);
+
+    if (rs->ack_rc || (dss->group && dss->group->rc)) {
+        dss->rc = rs->ack_rc ?: dss->group->rc;
+        libxl__xc_domain_saverestore_async_callback_done(egc, shs, 0);
+        return;
+    }
+
+    /* The first checkpoint is due as soon as it is asked for. */
+    if (!rs->stats_mark.tv_sec && !rs->stats_mark.tv_nsec)
+        clock_gettime(CLOCK_MONOTONIC, &rs->stats_mark);
+
+    if (rs->output_ack && rs->epochs_released != dss->cpsremus_epoch) {
+        /* remus_release() suspends the guest once the ack is in. */
+        rs->suspend_waiting = true;
+        return;
+    }
+
+    remus_suspend(egc, dss);
 }
 
 static void remus_domain_suspend_callback_common_done(libxl__egc *egc,
                                 libxl__domain_suspend_state *dsps, int rc)
 {
     libxl__domain_save_state *dss = CONTAINER_OF(dsps, *dss, dsps);
+    libxl__remus_state *const rs = &dss->rs;
 
     if (rc)
         goto out;
 
+    rs->stats_trigger_us = libxl__remus_stats_between(&rs->stats_mark,
+                                                      &dsps->requested);
+    rs->stats_suspend_us = dsps->suspend_us;
+    libxl__remus_stats_lap(&rs->stats_mark);
+
     libxl__checkpoint_devices_state *const cds = &dss->cds;
     cds->callback = remus_devices_postsuspend_cb;
     libxl__checkpoint_devices_postsuspend(egc, cds);
@@ -230,15 +398,36 @@ out:
     libxl__xc_domain_saverestore_async_callback_done(egc, &dss->sws.shs, !rc);
 }
 
+static void remus_epoch_ended(libxl__gc *gc, libxl__domain_save_state *dss);
+
 static void remus_devices_postsuspend_cb(libxl__egc *egc,
                                          libxl__checkpoint_devices_state *cds,
                                          int rc)
 {
     libxl__domain_save_state *dss = CONTAINER_OF(cds, *dss, cds);
+    libxl__remus_state *const rs = &dss->rs;
+    libxl__remus_epoch_stats *stats;
+
+    EGC_GC;
 
     if (rc)
         goto out;
 
+    if (rs->adaptive)
+        remus_epoch_ended(gc, dss);
+
+    /* The guest is suspended: everything it did so far is in this one. */
+    dss->cpsremus_epoch++;
+    if (dss->cpsremus_page)
+        dss->cpsremus_page->started = dss->cpsremus_epoch;
+
+    stats = &rs->stats[dss->cpsremus_epoch & (LIBXL__REMUS_STATS_RING - 1)];
+    memset(stats, 0, sizeof(*stats));
+    stats->epoch = dss->cpsremus_epoch;
+    stats->trigger_us = rs->stats_trigger_us;
+    stats->suspend_us = rs->stats_suspend_us;
+    stats->postsuspend_us = libxl__remus_stats_lap(&rs->stats_mark);
+
     rc = 0;
 
 out:
@@ -254,6 +443,8 @@ static void libxl__remus_domain_resume_callback(void *data)
     libxl__domain_save_state *dss = shs->caller_state;
     STATE_AO_GC(dss->ao);
 
+    libxl__remus_stats_lap(&dss->rs.stats_mark);
+
     libxl__checkpoint_devices_state *const cds = &dss->cds;
     cds->callback = remus_devices_preresume_cb;
     libxl__checkpoint_devices_preresume(egc, cds);
@@ -264,22 +455,32 @@ static void remus_devices_preresume_cb(libxl__egc *egc,
                                        int rc)
 {
     libxl__domain_save_state *dss = CONTAINER_OF(cds, *dss, cds);
+    libxl__domain_suspend_state *const dsps = &dss->dsps;
+    libxl__remus_state *const rs = &dss->rs;
+    libxl__remus_epoch_stats *stats;
     STATE_AO_GC(dss->ao);
 
     if (rc)
         goto out;
 
     /* Resumes the domain and the device model */
-    rc = libxl__domain_resume(gc, dss->domid, /* Fast Suspend */1);
+    rc = libxl__domain_resume_checkpoint(gc, dsps);
+    remus_boost_lower(gc, dss);
     if (rc)
         goto out;
 
-    rc = 0;
+    stats = libxl__remus_stats_epoch(rs, dss->cpsremus_epoch);
+    if (stats)
+        stats->resume_us = libxl__remus_stats_lap(&rs->stats_mark);
+
+    /* The guest is running again: xenstored can be told afterwards. */
+    libxl__xc_domain_saverestore_async_callback_done(egc, &dss->sws.shs, 1);
+    libxl__domain_resume_checkpoint_xs(gc, dsps);
+    return;
 
 out:
-    if (rc)
-        dss->rc = rc;
-    libxl__xc_domain_saverestore_async_callback_done(egc, &dss->sws.shs, !rc);
+    dss->rc = rc;
+    libxl__xc_domain_saverestore_async_callback_done(egc, &dss->sws.shs, 0);
 }
 
 /*----- remus asynchronous checkpoint callback -----*/
@@ -290,6 +491,15 @@ static void remus_devices_commit_cb(libxl__egc *egc,
 static void remus_next_checkpoint(libxl__egc *egc, libxl__ev_time *ev,
                                   const struct timeval *requested_abs,
                                   int rc);
+static int remus_interval_start(libxl__gc *gc,
+                                libxl__domain_save_state *dss);
+static int remus_adaptive_wait(libxl__gc *gc, libxl__domain_save_state *dss);
+static int cpsremus_arm(libxl__egc *egc, libxl__domain_save_state *dss);
+static void cpsremus_committed(libxl__gc *gc, libxl__domain_save_state *dss,
+                               uint64_t epoch);
+static int remus_idle_start(libxl__gc *gc, libxl__domain_save_state *dss);
+static void remus_idle_end(libxl__egc *egc, libxl__domain_save_state *dss,
+                           int ok);
 
 static void libxl__remus_domain_save_checkpoint_callback(void *data)
 {
@@ -298,6 +508,7 @@ static void libxl__remus_domain_save_checkpoint_callback(void *data)
     libxl__egc *egc = shs->egc;
     STATE_AO_GC(dss->ao);
 
+    libxl__remus_stats_lap(&dss->rs.stats_mark);
     libxl__stream_write_start_checkpoint(egc, &dss->sws);
 }
 
@@ -331,7 +542,8 @@ static void remus_devices_commit_cb(libxl__egc *egc,
                                     int rc)
 {
     libxl__domain_save_state *dss = CONTAINER_OF(cds, *dss, cds);
-    static int count = 0;
+    libxl__remus_state *const rs = &dss->rs;
+    libxl__remus_epoch_stats *stats;
 
     STATE_AO_GC(dss->ao);
 
@@ -341,35 +553,56 @@ static void remus_devices_commit_cb(libxl__egc *egc,
         goto out;
     }
 
+    stats = libxl__remus_stats_epoch(rs, dss->cpsremus_epoch);
+    if (stats) {
+        stats->commit_us = libxl__remus_stats_lap(&rs->stats_mark);
+        stats->written = rs->stats_mark;
+        stats->committed = true;
+        if (!rs->output_ack)
+            stats->acked = true;
+        libxl__remus_stats_report(gc, dss);
+    }
+
     /*
      * At this point, we have successfully checkpointed the guest and
      * committed it at the backup. We'll come back after the checkpoint
-     * interval to checkpoint the guest again. Until then, let the guest
-     * continue execution.
+     * interval, or when the guest asks for one in event-driven mode, to
+     * checkpoint the guest again. Until then, let the guest continue
+     * execution.
      */
-    if (libxl_defbool_val(dss->remus->event_driven)) {
-        LOG(WARN, "Activated CPS-Remus. Statepath for watch is %s\n", dss->statepath);
-        /* Use event-driven checkpointing */
-        LOG(WARN, "Count is: %d", count);
-        if (!count) {
-            LOG(WARN, ">>>>> Registering xswatch on statepath: %s\n", dss->statepath);
-            libxl__ev_xswatch_register(gc, &dss->cpsremus_watch, cpsremus_next_checkpoint, dss->statepath);
-            count++;
+    rc = remus_idle_start(gc, dss);
+    if (rc)
+        goto out;
 
+    if (libxl_defbool_val(dss->remus->event_driven)) {
+        /* Use event-driven checkpointing, bounded by the adaptive timer */
+        if (!dss->rs.output_ack)
+            cpsremus_committed(gc, dss, dss->cpsremus_epoch);
+        if (dss->rs.adaptive) {
+            rc = remus_interval_start(gc, dss);
+            if (rc)
+                goto out;
         }
+        rc = cpsremus_arm(egc, dss);
     } else {
         /* Set checkpoint interval timeout */
-        rc = libxl__ev_time_register_rel(ao, &dss->rs.checkpoint_timeout,
-                                         remus_next_checkpoint,
-                                         dss->rs.interval);
+        rc = remus_interval_start(gc, dss);
     }
 
     if (rc)
         goto out;
 
+    /* The rest of the group may be waiting for us already. */
+    if (dss->group)
+        remus_group_kick(egc, dss);
     return;
 
 out:
+    /* No liveness record can have been started yet */
+    libxl__ev_time_deregister(gc, &dss->rs.liveness_timeout);
+    libxl__ev_time_deregister(gc, &dss->rs.precopy_timeout);
+    libxl__ev_time_deregister(gc, &dss->rs.checkpoint_timeout);
+    dss->rs.idle = false;
     libxl__xc_domain_saverestore_async_callback_done(egc, &dss->sws.shs, 0);
 }
 
@@ -379,12 +612,23 @@ static void remus_next_checkpoint(libxl__egc *egc, libxl__ev_time *ev,
 {
     libxl__domain_save_state *dss =
                             CONTAINER_OF(ev, *dss, rs.checkpoint_timeout);
+    int ms;
 
     STATE_AO_GC(dss->ao);
 
     if (rc == ERROR_TIMEDOUT) /* As intended */
         rc = 0;
 
+    if (!rc && dss->rs.adaptive) {
+        ms = remus_adaptive_wait(gc, dss);
+        if (ms > 0) {
+            rc = libxl__ev_time_register_rel(ao, &dss->rs.checkpoint_timeout,
+                                             remus_next_checkpoint, ms);
+            if (!rc)
+                return;
+        }
+    }
+
     /*
      * Time to checkpoint the guest again. We return 1 to libxc
      * (xc_domain_save.c). in order to continue executing the infinite loop
@@ -400,7 +644,7 @@ static void remus_next_checkpoint(libxl__egc *egc, libxl__ev_time *ev,
             int state = atoi(libxl__xs_read(gc, t, dss->statepath));
             if (state > 0) {
                 //libxl__xs_write(gc, t, dss->statepath, "%d", 0);
-                libxl__xc_domain_saverestore_async_callback_done(egc, &dss->sws.shs, !rc);
+                remus_idle_end(egc, dss, !rc);
             } else {
                 libxl__ev_time_register_rel(ao, &dss->rs.checkpoint_timeout,
                                          remus_next_checkpoint,
@@ -409,61 +653,1598 @@ static void remus_next_checkpoint(libxl__egc *egc, libxl__ev_time *ev,
             libxl__xs_transaction_commit(gc, &t);
         }
     } else
-        libxl__xc_domain_saverestore_async_callback_done(egc, &dss->sws.shs, !rc);
+        remus_idle_end(egc, dss, !rc);
 }
 
-static void cpsremus_next_checkpoint(libxl__egc *egc, libxl__ev_xswatch *ev,
-                                     const char *watch_path,
-                                     const char *event_path)
+/*----- liveness records while idle -----*/
+
+/*
+ * Between the commit of one checkpoint and the start of the next the
+ * stream is idle, and the backup cannot tell an idle primary from a dead
+ * one.  If asked to, keep the stream busy with a libxc LIVENESS record
+ * every liveness_period ms.  A record may still be on its way out when the
+ * next checkpoint is due, in which case the checkpoint waits for it.
+ */
+
+static void remus_liveness_due(libxl__egc *egc, libxl__ev_time *ev,
+                               const struct timeval *requested_abs, int rc);
+static void remus_precopy_due(libxl__egc *egc, libxl__ev_time *ev,
+                              const struct timeval *requested_abs, int rc);
+
+static int remus_idle_start(libxl__gc *gc, libxl__domain_save_state *dss)
+{
+    libxl__remus_state *const rs = &dss->rs;
+    int rc;
+
+    rs->idle = true;
+
+    if (dss->remus->precopy_period > 0) {
+        rc = libxl__ev_time_register_rel(dss->ao, &rs->precopy_timeout,
+                                         remus_precopy_due,
+                                         dss->remus->precopy_period);
+        if (rc)
+            return rc;
+    }
+
+    if (dss->remus->liveness_period <= 0)
+        return 0;
+
+    return libxl__ev_time_register_rel(dss->ao, &rs->liveness_timeout,
+                                       remus_liveness_due,
+                                       dss->remus->liveness_period);
+}
+
+/* ok is the answer for libxc's checkpoint callback */
+static void remus_idle_end(libxl__egc *egc, libxl__domain_save_state *dss,
+                           int ok)
+{
+    libxl__remus_state *const rs = &dss->rs;
+
+    EGC_GC;
+
+    rs->idle = false;
+    clock_gettime(CLOCK_MONOTONIC, &rs->stats_mark);
+    libxl__ev_time_deregister(gc, &rs->liveness_timeout);
+    libxl__ev_time_deregister(gc, &rs->precopy_timeout);
+    /* Whichever of the timer and the guest came first, stop the other. */
+    libxl__ev_time_deregister(gc, &rs->checkpoint_timeout);
+    dss->cpsremus_armed = false;
+
+    if (rs->precopying) {
+        /* libxc is busy with a pre-copy pass; answer once it is done. */
+        rs->checkpoint_due = true;
+        rs->precopy_ok = ok;
+        return;
+    }
+
+    if (rs->liveness_writing) {
+        rs->deferred_ok = ok;
+        return;
+    }
+
+    libxl__xc_domain_saverestore_async_callback_done(egc, &dss->sws.shs, ok);
+}
+
+/* The stream is broken; stop waiting for the next checkpoint. */
+static void remus_idle_failed(libxl__egc *egc, libxl__domain_save_state *dss,
+                              int rc)
+{
+    EGC_GC;
+
+    dss->rc = rc;
+    remus_idle_end(egc, dss, 0);
+}
+
+static void remus_liveness_due(libxl__egc *egc, libxl__ev_time *ev,
+                               const struct timeval *requested_abs, int rc)
 {
     libxl__domain_save_state *dss =
-                            CONTAINER_OF(ev, *dss, cpsremus_watch);
+                            CONTAINER_OF(ev, *dss, rs.liveness_timeout);
+
+    if (rc != ERROR_TIMEDOUT) {
+        remus_idle_failed(egc, dss, rc);
+        return;
+    }
+
+    dss->rs.liveness_writing = true;
+    libxl__stream_write_liveness(egc, &dss->sws);
+}
+
+static void remus_liveness_written(libxl__egc *egc,
+                                   libxl__stream_write_state *sws, int rc)
+{
+    libxl__domain_save_state *dss = CONTAINER_OF(sws, *dss, sws);
+    libxl__remus_state *const rs = &dss->rs;
 
     STATE_AO_GC(dss->ao);
 
-    /*
-     * Time to checkpoint the guest again. We return 1 to libxc
-     * (xc_domain_save.c). in order to continue executing the infinite loop
-     * (suspend, checkpoint, resume) in xc_domain_save().
-     */
+    rs->liveness_writing = false;
+
+    if (rc)
+        LOGD(ERROR, dss->domid, "Remus: failed to send liveness record");
+
+    if (!rs->idle) {
+        /* The next checkpoint is due and has been waiting for us. */
+        if (rc)
+            dss->rc = rc;
+        libxl__xc_domain_saverestore_async_callback_done(egc, &dss->sws.shs,
+                                                rc ? 0 : rs->deferred_ok);
+        return;
+    }
 
-    int rc = 0;
-    dss->rc = 0;
+    if (!rc)
+        rc = libxl__ev_time_register_rel(ao, &rs->liveness_timeout,
+                                         remus_liveness_due,
+                                         dss->remus->liveness_period);
+    if (rc)
+        remus_idle_failed(egc, dss, rc);
+}
 
-    libxl__xc_domain_saverestore_async_callback_done(egc, &dss->sws.shs, !rc);
-} 
-/*---------------------- remus callbacks (restore) -----------------------*/
+/*----- background pre-copy while idle -----*/
 
-/*----- remus asynchronous checkpoint callback -----*/
+/*
+ * With precopy_period set, libxc sends the pages which the guest has
+ * dirtied so far every precopy_period ms while the guest runs, so that the
+ * next checkpoint only has to send what is dirtied again.  The checkpoint
+ * callback is answered with XGS_CHECKPOINT_PRECOPY for a pass, and libxc
+ * comes back through precopy_done when it has finished.  The checkpoint
+ * timer and the guest's trigger stay armed meanwhile; if either fires
+ * during a pass, the checkpoint is taken as soon as the pass is done.
+ * Liveness records are held back, since the stream is busy anyway.
+ */
 
-static void remus_checkpoint_stream_done(
-    libxl__egc *egc, libxl__stream_read_state *srs, int rc);
+static void remus_precopy_due(libxl__egc *egc, libxl__ev_time *ev,
+                              const struct timeval *requested_abs, int rc)
+{
+    libxl__domain_save_state *dss =
+                            CONTAINER_OF(ev, *dss, rs.precopy_timeout);
+    libxl__remus_state *const rs = &dss->rs;
 
-static void libxl__remus_domain_restore_checkpoint_callback(void *data)
+    EGC_GC;
+
+    if (rc != ERROR_TIMEDOUT) {
+        remus_idle_failed(egc, dss, rc);
+        return;
+    }
+
+    rs->idle = false;
+    rs->precopying = true;
+    libxl__ev_time_deregister(gc, &rs->liveness_timeout);
+
+    if (rs->liveness_writing) {
+        rs->deferred_ok = XGS_CHECKPOINT_PRECOPY;
+        return;
+    }
+
+    libxl__xc_domain_saverestore_async_callback_done(egc, &dss->sws.shs,
+                                                XGS_CHECKPOINT_PRECOPY);
+}
+
+static void remus_precopy_done_callback(void *data)
 {
     libxl__save_helper_state *shs = data;
-    libxl__domain_create_state *dcs = shs->caller_state;
     libxl__egc *egc = shs->egc;
-    STATE_AO_GC(dcs->ao);
+    libxl__domain_save_state *dss = shs->caller_state;
+    libxl__remus_state *const rs = &dss->rs;
+    int rc;
 
-    libxl__stream_read_start_checkpoint(egc, &dcs->srs);
+    STATE_AO_GC(dss->ao);
+
+    rs->precopying = false;
+
+    if (rs->checkpoint_due) {
+        rs->checkpoint_due = false;
+        libxl__xc_domain_saverestore_async_callback_done(egc, shs,
+                                                         rs->precopy_ok);
+        return;
+    }
+
+    rc = remus_idle_start(gc, dss);
+    if (rc)
+        remus_idle_failed(egc, dss, rc);
+    else if (dss->group)
+        remus_group_kick(egc, dss);
 }
 
-static void remus_checkpoint_stream_done(
-    libxl__egc *egc, libxl__stream_read_state *stream, int rc)
+/*----- adaptive checkpoint interval -----*/
+
+/*
+ * With interval_max set the checkpoint interval follows the guest: libxc
+ * reports how many pages each checkpoint sent and how long that took, and
+ * an interval which lets the dirty rate or the send time spike is
+ * lengthened by half, while a quiet one decays back towards the configured
+ * interval.  Between checkpoints the output buffer is polled every
+ * interval_min ms, and network output waiting on the checkpoint brings it
+ * forward, since buffered packets are latency the guest's peers see: the
+ * interval is divided by 1 + packets / REMUS_OUTPUT_HALF, but never below
+ * interval_min.  A lone packet thus costs the stream little, while a busy
+ * link is released after interval_min.
+ */
+
+#define REMUS_OUTPUT_HALF 16 /* buffered packets which halve the interval */
+
+static void remus_checkpoint_stats(uint32_t pages, uint64_t bytes,
+                                   uint32_t bitmap_us, uint32_t send_us,
+                                   void *data)
 {
-    libxl__xc_domain_saverestore_async_callback_done(egc, &stream->shs, rc);
+    libxl__save_helper_state *shs = data;
+    libxl__domain_save_state *dss = shs->caller_state;
+    libxl__remus_epoch_stats *stats;
+
+    dss->rs.pages = pages;
+    dss->rs.send_us = bitmap_us + send_us;
+
+    stats = libxl__remus_stats_epoch(&dss->rs, dss->cpsremus_epoch);
+    if (stats) {
+        stats->bitmap_us = bitmap_us;
+        stats->send_us = send_us;
+        stats->pages = pages;
+        stats->bytes = bytes;
+    }
 }
 
-void libxl__remus_restore_setup(libxl__egc *egc,
-                                libxl__domain_create_state *dcs)
+static int remus_interval_min(libxl__domain_save_state *dss)
 {
-    /* Convenience aliases */
-    libxl__srm_restore_autogen_callbacks *const callbacks =
-        &dcs->srs.shs.callbacks.restore.a;
+    const libxl_domain_remus_info *const info = dss->remus;
 
-    callbacks->checkpoint = libxl__remus_domain_restore_checkpoint_callback;
-    dcs->srs.checkpoint_callback = remus_checkpoint_stream_done;
+    if (info->interval_min > 0)
+        return info->interval_min;
+
+    return info->interval / 4 ?: 1;
+}
+
+static void remus_epoch_ended(libxl__gc *gc, libxl__domain_save_state *dss)
+{
+    libxl__remus_state *const rs = &dss->rs;
+    struct timeval now, diff;
+
+    gettimeofday(&now, NULL);
+    if (timerisset(&rs->last_suspend)) {
+        timersub(&now, &rs->last_suspend, &diff);
+        rs->epoch_ms = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+    }
+    rs->last_suspend = now;
+}
+
+static void remus_adapt_interval(libxl__gc *gc, libxl__domain_save_state *dss)
+{
+    libxl__remus_state *const rs = &dss->rs;
+    const libxl_domain_remus_info *const info = dss->remus;
+    int min = remus_interval_min(dss), next = rs->next_interval;
+    uint64_t rate, kib_s;
+    bool spike;
+
+    if (!rs->epoch_ms)
+        return;
+
+    rate = (uint64_t)rs->pages * 1000 / rs->epoch_ms;
+    kib_s = rate * XC_PAGE_SIZE / 1024;
+
+    spike = (rs->dirty_rate && rate > 2 * rs->dirty_rate) ||
+            (info->max_bandwidth > 0 && kib_s > info->max_bandwidth) ||
+            rs->send_us > (uint64_t)next * 1000 / 2;
+
+    rs->dirty_rate = rs->dirty_rate ? (3 * rs->dirty_rate + rate) / 4 : rate;
+
+    if (spike)
+        next += next / 2 ?: 1;
+    else if (next > info->interval)
+        next -= (next - info->interval + 1) / 2;
+
+    if (next < min)
+        next = min;
+    if (next > info->interval_max)
+        next = info->interval_max;
+
+    if (next != rs->next_interval)
+        LOGD(DEBUG, dss->domid, "Remus: checkpoint interval %d -> %d ms"
+             " (%"PRIu64" pages/s, %"PRIu32" us to send)",
+             rs->next_interval, next, rate, rs->send_us);
+    rs->next_interval = next;
+}
+
+static int remus_interval_start(libxl__gc *gc, libxl__domain_save_state *dss)
+{
+    libxl__remus_state *const rs = &dss->rs;
+    struct timeval now, len;
+    libxl__ao *const ao = dss->ao;
+    int ms;
+
+    if (!rs->adaptive)
+        return libxl__ev_time_register_rel(ao, &rs->checkpoint_timeout,
+                                           remus_next_checkpoint,
+                                           rs->interval);
+
+    remus_adapt_interval(gc, dss);
+
+    gettimeofday(&now, NULL);
+    rs->interval_start = now;
+    len.tv_sec = rs->next_interval / 1000;
+    len.tv_usec = (rs->next_interval % 1000) * 1000;
+    timeradd(&now, &len, &rs->deadline);
+
+    ms = min(rs->next_interval, remus_interval_min(dss));
+    return libxl__ev_time_register_rel(ao, &rs->checkpoint_timeout,
+                                       remus_next_checkpoint, ms);
+}
+
+/* How many packets only the next checkpoint can release, if any. */
+static uint64_t remus_output_waiting(libxl__gc *gc,
+                                     libxl__domain_save_state *dss)
+{
+    uint64_t packets;
+
+    if (!(dss->cds.device_kind_flags & (1 << LIBXL__DEVICE_KIND_VIF)))
+        return 0;
+
+    /* Until the last checkpoint is acked a new one would only wait. */
+    if (dss->rs.output_ack && dss->rs.epochs_released != dss->cpsremus_epoch)
+        return 0;
+
+    if (libxl__netbuffer_backlog(gc, &dss->cds, &packets))
+        return 0;
+
+    return packets;
+}
+
+/* How much longer to wait for the next checkpoint, 0 if it is due. */
+static int remus_adaptive_wait(libxl__gc *gc, libxl__domain_save_state *dss)
+{
+    libxl__remus_state *const rs = &dss->rs;
+    struct timeval now, due = rs->deadline, len, left;
+    uint64_t packets, interval;
+    int ms;
+
+    gettimeofday(&now, NULL);
+    if (!timercmp(&now, &due, <))
+        return 0;
+
+    packets = remus_output_waiting(gc, dss);
+    if (packets) {
+        interval = (uint64_t)rs->next_interval * REMUS_OUTPUT_HALF /
+                   (REMUS_OUTPUT_HALF + packets);
+        interval = max(interval, (uint64_t)remus_interval_min(dss));
+        if (interval < rs->next_interval) {
+            len.tv_sec = interval / 1000;
+            len.tv_usec = (interval % 1000) * 1000;
+            timeradd(&rs->interval_start, &len, &due);
+            if (!timercmp(&now, &due, <))
+                return 0;
+        }
+    }
+
+    timersub(&due, &now, &left);
+    ms = left.tv_sec * 1000 + (left.tv_usec + 999) / 1000;
+    return min(ms, remus_interval_min(dss));
+}
+
+/*----- checkpoint acknowledgements -----*/
+
+/*
+ * With output_ack the backup acknowledges every checkpoint on the back
+ * channel once it has received it, and only then is the network output
+ * which the guest produced before that checkpoint released.  Nothing waits
+ * for the ack: the guest runs, and the next epoch's output is buffered,
+ * while it is on its way.  The plug qdisc only holds one closed epoch
+ * besides the one being captured, though, so a checkpoint which falls due
+ * before the previous one has been acknowledged waits for it before
+ * suspending the guest.
+ */
+
+static void remus_ack_read(libxl__egc *egc,
+                           libxl__stream_read_state *srs, int id);
+static void remus_ack_failed(libxl__egc *egc, libxl__domain_save_state *dss,
+                             int rc);
+static void remus_release(libxl__egc *egc, libxl__domain_save_state *dss);
+static void remus_group_release(libxl__egc *egc, libxl__remus_group *group);
+
+static void remus_ack_start(libxl__egc *egc, libxl__domain_save_state *dss)
+{
+    libxl__stream_read_state *const srs = &dss->remus_ack_srs;
+
+    srs->ao = dss->ao;
+    srs->fd = dss->recv_fd;
+    srs->back_channel = true;
+    srs->checkpoint_callback = remus_ack_read;
+
+    libxl__stream_read_start(egc, srs);
+    libxl__stream_read_checkpoint_state(egc, srs);
+}
+
+static void remus_ack_stop(libxl__egc *egc, libxl__domain_save_state *dss)
+{
+    /* libxc has gone, nobody is waiting for an ack any more */
+    dss->rs.suspend_waiting = false;
+
+    if (dss->rs.output_ack)
+        libxl__stream_read_abort(egc, &dss->remus_ack_srs, ERROR_ABORTED);
+}
+
+static void remus_ack_read(libxl__egc *egc,
+                           libxl__stream_read_state *srs, int id)
+{
+    libxl__domain_save_state *dss = CONTAINER_OF(srs, *dss, remus_ack_srs);
+    libxl__remus_state *const rs = &dss->rs;
+    libxl__remus_epoch_stats *stats;
+    int rc;
+
+    STATE_AO_GC(dss->ao);
+
+    if (id < 0) {
+        rc = id;
+        goto out;
+    }
+
+    if (id != CHECKPOINT_REMUS_ACK ||
+        rs->epochs_acked == dss->cpsremus_epoch) {
+        LOGD(ERROR, dss->domid, "Remus: unexpected checkpoint state %d"
+             " from the backup", id);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    rs->epochs_acked++;
+    libxl__stream_read_checkpoint_state(egc, srs);
+
+    stats = libxl__remus_stats_epoch(rs, rs->epochs_acked);
+    if (stats) {
+        /* The ack may overtake the device commit. */
+        if (stats->committed)
+            stats->ack_us = libxl__remus_stats_lap(&stats->written);
+        stats->acked = true;
+        libxl__remus_stats_report(gc, dss);
+    }
+
+    if (dss->group)
+        remus_group_release(egc, dss->group);
+    else
+        remus_release(egc, dss);
+    return;
+
+out:
+    remus_ack_failed(egc, dss, rc);
+}
+
+/* Releases the output of the oldest acknowledged checkpoint. */
+static void remus_release(libxl__egc *egc, libxl__domain_save_state *dss)
+{
+    libxl__remus_state *const rs = &dss->rs;
+    int rc;
+
+    STATE_AO_GC(dss->ao);
+
+    rc = libxl__netbuffer_release(gc, &dss->cds);
+    if (rc) {
+        remus_ack_failed(egc, dss, rc);
+        return;
+    }
+
+    rs->epochs_released++;
+
+    if (libxl_defbool_val(dss->remus->event_driven))
+        cpsremus_committed(gc, dss, rs->epochs_released);
+
+    if (rs->suspend_waiting) {
+        rs->suspend_waiting = false;
+        remus_suspend(egc, dss);
+    }
+}
+
+static void remus_ack_failed(libxl__egc *egc, libxl__domain_save_state *dss,
+                             int rc)
+{
+    libxl__remus_state *const rs = &dss->rs;
+
+    STATE_AO_GC(dss->ao);
+
+    if (rc != ERROR_ABORTED)
+        LOGD(ERROR, dss->domid, "Remus: lost the backup's acknowledgements,"
+             " rc %d", rc);
+
+    /* Buffered output stays put until the netbuf script tears it down. */
+    rs->ack_rc = rc;
+    libxl__stream_read_abort(egc, &dss->remus_ack_srs, rc);
+
+    if (rs->suspend_waiting) {
+        rs->suspend_waiting = false;
+        dss->rc = rc;
+        libxl__xc_domain_saverestore_async_callback_done(egc, &dss->sws.shs,
+                                                         0);
+    }
+
+    if (dss->group)
+        libxl__remus_group_failed(egc, dss->group, rc);
+}
+
+/*----- group checkpointing -----*/
+
+/*
+ * The members of a group (libxl_domain_remus_group_start) each have their
+ * own stream, helper and devices, and checkpoint as usual, except that:
+ *
+ * - A member which is ready to suspend is parked until every member is,
+ *   and then they are all suspended one straight after the other.  The
+ *   first one to arrive cuts the wait for the next checkpoint of the others
+ *   short, so a checkpoint requested by one guest is taken for all of them.
+ *
+ * - The network output of a checkpoint is released for all members when
+ *   the backup has acknowledged it for every one of them.  Since traffic
+ *   between the members goes through the same buffers, no member can have
+ *   seen anything from another which that one could lose on failover,
+ *   whichever acknowledged checkpoint each of them is restored from.
+ *
+ * - When one member stops, for whatever reason, the others are stopped as
+ *   well at their next checkpoint.
+ */
+
+static void remus_suspend(libxl__egc *egc, libxl__domain_save_state *dss)
+{
+    libxl__remus_group *const group = dss->group;
+    libxl__domain_save_state *member;
+    int i;
+
+    EGC_GC;
+
+    remus_boost_raise(gc, dss);
+
+    if (!group) {
+        libxl__domain_suspend(egc, &dss->dsps);
+        return;
+    }
+
+    dss->rs.group_parked = true;
+    if (!group->nr_parked++) {
+        for (i = 0; i < group->nr; i++)
+            if (group->members[i] != dss)
+                remus_group_kick(egc, group->members[i]);
+    }
+
+    if (group->nr_parked < group->nr_running)
+        return;
+
+    group->nr_parked = 0;
+    for (i = 0; i < group->nr; i++) {
+        member = group->members[i];
+        if (!member->rs.group_parked)
+            continue;
+        member->rs.group_parked = false;
+        libxl__domain_suspend(egc, &member->dsps);
+    }
+}
+
+/* Takes the next checkpoint of dss now, if the group is waiting for it. */
+static void remus_group_kick(libxl__egc *egc, libxl__domain_save_state *dss)
+{
+    libxl__remus_state *const rs = &dss->rs;
+
+    if (rs->group_done || (!dss->group->nr_parked && !dss->group->rc))
+        return;
+
+    if (rs->idle || (rs->precopying && !rs->checkpoint_due))
+        remus_idle_end(egc, dss, 1);
+}
+
+static void remus_group_release(libxl__egc *egc, libxl__remus_group *group)
+{
+    libxl__domain_save_state *member;
+    int i;
+
+    for (;;) {
+        if (group->rc)
+            return;
+
+        for (i = 0; i < group->nr; i++) {
+            member = group->members[i];
+            if (!member->rs.group_done &&
+                member->rs.epochs_acked == member->rs.epochs_released)
+                return;
+        }
+
+        for (i = 0; i < group->nr; i++) {
+            member = group->members[i];
+            if (!member->rs.group_done)
+                remus_release(egc, member);
+        }
+    }
+}
+
+void libxl__remus_group_failed(libxl__egc *egc, libxl__remus_group *group,
+                               int rc)
+{
+    libxl__domain_save_state *member;
+    int i;
+
+    if (group->rc)
+        return;
+    group->rc = rc;
+
+    for (i = 0; i < group->nr; i++) {
+        member = group->members[i];
+        if (member->rs.group_done)
+            continue;
+
+        if (member->rs.group_parked || member->rs.suspend_waiting) {
+            /* parked, or waiting for an ack which release won't act on */
+            if (member->rs.group_parked) {
+                member->rs.group_parked = false;
+                group->nr_parked--;
+            }
+            member->rs.suspend_waiting = false;
+            member->rc = rc;
+            libxl__xc_domain_saverestore_async_callback_done(egc,
+                                                    &member->sws.shs, 0);
+        } else {
+            /* it fails at its next suspend */
+            remus_group_kick(egc, member);
+        }
+    }
+}
+
+/*----- checkpoint priority boost -----*/
+
+/*
+ * With boost set, the save helper and the netback threads of the domain's
+ * vifs run SCHED_FIFO at that priority from the suspend of the domain until
+ * it has been resumed, so that the rest of dom0 cannot hold a checkpoint up
+ * while the guest is paused.  Where dom0 is on sched_fp, Xen also lets its
+ * vCPUs use their whole period rather than just their slice meanwhile, for
+ * no longer than LIBXL__REMUS_BOOST_US should the checkpoint take longer.
+ */
+#define LIBXL__REMUS_BOOST_US 500000
+
+static int remus_boost_setup(libxl__gc *gc, libxl__domain_save_state *dss)
+{
+    libxl__remus_state *const rs = &dss->rs;
+    const char *prefix = GCSPRINTF("vif%u.", dss->domid);
+    char comm[32], *end;
+    struct dirent *de;
+    DIR *proc;
+    FILE *f;
+    long pid;
+
+    rs->boosted = false;
+    rs->boost_dom0 = false;
+    rs->boost_warned = false;
+    rs->nr_boost_threads = 0;
+    rs->boost_threads = NULL;
+
+    if (!dss->remus->boost)
+        return 0;
+
+    /* The save helper is only known once it has been started. */
+    GCNEW_ARRAY(rs->boost_threads, 1);
+    rs->boost_threads[0].pid = -1;
+    rs->nr_boost_threads = 1;
+
+    /* The netback threads of vif D.N are named vifD.N-q... */
+    proc = opendir("/proc");
+    if (!proc) {
+        LOGED(WARN, dss->domid, "Remus: cannot look for netback threads");
+    } else {
+        while ((de = readdir(proc))) {
+            pid = strtol(de->d_name, &end, 10);
+            if (*end || pid <= 0)
+                continue;
+
+            f = fopen(GCSPRINTF("/proc/%ld/comm", pid), "r");
+            if (!f)
+                continue;
+            if (fgets(comm, sizeof(comm), f) &&
+                !strncmp(comm, prefix, strlen(prefix))) {
+                GCREALLOC_ARRAY(rs->boost_threads, rs->nr_boost_threads + 1);
+                rs->boost_threads[rs->nr_boost_threads].pid = pid;
+                rs->boost_threads[rs->nr_boost_threads].policy = -1;
+                rs->nr_boost_threads++;
+            }
+            fclose(f);
+        }
+        closedir(proc);
+    }
+
+    rs->boost_dom0 = libxl__domain_scheduler(gc, LIBXL_TOOLSTACK_DOMID) ==
+        LIBXL_SCHEDULER_FP;
+
+    LOGD(DEBUG, dss->domid, "Remus: checkpoints boost the save helper,"
+         " %d netback threads%s", rs->nr_boost_threads - 1,
+         rs->boost_dom0 ? " and dom0's budget" : "");
+    return 0;
+}
+
+static void remus_boost_raise(libxl__gc *gc, libxl__domain_save_state *dss)
+{
+    libxl__remus_state *const rs = &dss->rs;
+    struct sched_param param;
+    libxl__remus_boost_thread *t;
+    int i;
+
+    if (!dss->remus->boost || rs->boosted)
+        return;
+
+    rs->boost_threads[0].pid = dss->sws.shs.child.pid;
+    rs->boost_threads[0].policy = -1;
+
+    for (i = 0; i < rs->nr_boost_threads; i++) {
+        t = &rs->boost_threads[i];
+        if (t->pid <= 0)
+            continue;
+
+        t->policy = sched_getscheduler(t->pid);
+        if (t->policy < 0 || sched_getparam(t->pid, &param))
+            goto fail;
+        t->priority = param.sched_priority;
+
+        param.sched_priority = dss->remus->boost;
+        if (sched_setscheduler(t->pid, SCHED_FIFO, &param))
+            goto fail;
+        continue;
+
+    fail:
+        if (!rs->boost_warned)
+            LOGED(WARN, dss->domid, "Remus: cannot boost pid %d", t->pid);
+        rs->boost_warned = true;
+        t->policy = -1;
+    }
+
+    if (rs->boost_dom0) {
+        if (xc_sched_fp_domain_boost(CTX->xch, LIBXL_TOOLSTACK_DOMID,
+                                     LIBXL__REMUS_BOOST_US)) {
+            if (!rs->boost_warned)
+                LOGED(WARN, dss->domid, "Remus: cannot boost dom0");
+            rs->boost_warned = true;
+        } else if (dss->group) {
+            dss->group->nr_boosted++;
+        }
+    }
+
+    rs->boosted = true;
+}
+
+static void remus_boost_lower(libxl__gc *gc, libxl__domain_save_state *dss)
+{
+    libxl__remus_state *const rs = &dss->rs;
+    struct sched_param param;
+    libxl__remus_boost_thread *t;
+    int i;
+
+    if (!rs->boosted)
+        return;
+
+    /* Threads which have gone in the meantime are no matter. */
+    for (i = 0; i < rs->nr_boost_threads; i++) {
+        t = &rs->boost_threads[i];
+        if (t->policy < 0)
+            continue;
+        param.sched_priority = t->priority;
+        sched_setscheduler(t->pid, t->policy, &param);
+        t->policy = -1;
+    }
+
+    /* Dom0 is boosted until the last of a group has been resumed. */
+    if (rs->boost_dom0 &&
+        (!dss->group || (dss->group->nr_boosted &&
+                         !--dss->group->nr_boosted)))
+        xc_sched_fp_domain_boost(CTX->xch, LIBXL_TOOLSTACK_DOMID,
+                                 XEN_DOMCTL_SCHEDFP_BOOST_END);
+
+    rs->boosted = false;
+}
+
+/*----- CPS-Remus event-driven checkpoint trigger -----*/
+
+/*
+ * The guest asks for a checkpoint either by signalling an event channel it
+ * has published under data/ha-evtchn, or (older guests) by writing to
+ * data/ha.  The event channel is bound once at setup and stays waited on
+ * for the lifetime of Remus, so the request reaches us straight from the
+ * event loop without a round trip through xenstored.
+ *
+ * Requests are only acted upon while armed, i.e. between the commit of one
+ * checkpoint and the start of the next.  A request arriving while a
+ * checkpoint is in progress is remembered and honoured as soon as that
+ * checkpoint has been committed.
+ *
+ * Commits are reported back to the guest by notifying the same event
+ * channel, and through the progress page (see xen/io/cpsremus.h) if the
+ * guest has published one under data/ha-page.
+ */
+
+static void cpsremus_trigger(libxl__egc *egc, libxl__domain_save_state *dss)
+{
+    if (!dss->cpsremus_armed) {
+        dss->cpsremus_requested = true;
+        return;
+    }
+
+    /*
+     * Time to checkpoint the guest again. We return 1 to libxc
+     * (xc_domain_save.c). in order to continue executing the infinite loop
+     * (suspend, checkpoint, resume) in xc_domain_save().
+     */
+    dss->cpsremus_armed = false;
+    dss->cpsremus_requested = false;
+    remus_idle_end(egc, dss, 1);
+}
+
+static void cpsremus_evtchn_fired(libxl__egc *egc, libxl__ev_evtchn *evev)
+{
+    libxl__domain_save_state *dss = CONTAINER_OF(evev, *dss, cpsremus_evtchn);
+    int rc;
+
+    STATE_AO_GC(dss->ao);
+
+    /*
+     * Without the event channel the guest's requests would go unheard, so
+     * fail the save: now if we are idle, or else when cpsremus_arm() next
+     * finds dss->rc set.
+     */
+    rc = libxl__ev_evtchn_wait(gc, &dss->cpsremus_evtchn);
+    if (rc) {
+        LOGD(ERROR, dss->domid,
+             "CPS-Remus: failed to wait on checkpoint request event channel");
+        if (dss->cpsremus_armed)
+            remus_idle_failed(egc, dss, rc);
+        else
+            dss->rc = rc;
+        return;
+    }
+
+    cpsremus_trigger(egc, dss);
+}
+
+static void cpsremus_next_checkpoint(libxl__egc *egc, libxl__ev_xswatch *ev,
+                                     const char *watch_path,
+                                     const char *event_path)
+{
+    libxl__domain_save_state *dss =
+                            CONTAINER_OF(ev, *dss, cpsremus_watch);
+
+    cpsremus_trigger(egc, dss);
+}
+
+static void cpsremus_committed(libxl__gc *gc, libxl__domain_save_state *dss,
+                               uint64_t epoch)
+{
+    if (dss->cpsremus_page) {
+        dss->cpsremus_page->committed = epoch;
+        xen_wmb();
+    }
+
+    if (dss->cpsremus_evtchn.port >= 0 &&
+        xenevtchn_notify(CTX->xce, dss->cpsremus_evtchn.port) < 0)
+        LOGED(WARN, dss->domid,
+              "CPS-Remus: failed to notify guest of committed checkpoint");
+}
+
+static int cpsremus_page_setup(libxl__gc *gc, libxl__domain_save_state *dss,
+                               const char *dompath)
+{
+    const char *path, *val;
+    unsigned long frame;
+    char *end;
+
+    path = GCSPRINTF("%s/"CPSREMUS_PAGE_KEY, dompath);
+    val = libxl__xs_read(gc, XBT_NULL, path);
+    if (!val || !*val)
+        return 0;
+
+    errno = 0;
+    frame = strtoul(val, &end, 0);
+    if (errno || *end) {
+        LOGD(ERROR, dss->domid, "CPS-Remus: bad frame '%s' at %s", val, path);
+        return ERROR_FAIL;
+    }
+
+    dss->cpsremus_page = xc_map_foreign_range(CTX->xch, dss->domid,
+                                              XC_PAGE_SIZE,
+                                              PROT_READ | PROT_WRITE, frame);
+    if (!dss->cpsremus_page) {
+        LOGED(ERROR, dss->domid,
+              "CPS-Remus: failed to map progress page %#lx", frame);
+        return ERROR_FAIL;
+    }
+
+    dss->cpsremus_page->started = dss->cpsremus_epoch;
+    dss->cpsremus_page->committed = dss->cpsremus_epoch;
+
+    return 0;
+}
+
+/*
+ * Memory which the guest does not want replicated.  libxc reads the list
+ * itself at every checkpoint; all we do is find it.
+ */
+static int cpsremus_skip_setup(libxl__gc *gc, libxl__domain_save_state *dss)
+{
+    const char *path, *val;
+    unsigned long pfn;
+    char *end;
+
+    path = GCSPRINTF("%s/"CPSREMUS_SKIP_KEY,
+                     libxl__xs_get_dompath(gc, dss->domid));
+    val = libxl__xs_read(gc, XBT_NULL, path);
+    if (!val || !*val)
+        return 0;
+
+    errno = 0;
+    pfn = strtoul(val, &end, 0);
+    if (errno || *end) {
+        LOGD(ERROR, dss->domid, "CPS-Remus: bad pfn '%s' at %s", val, path);
+        return ERROR_FAIL;
+    }
+
+    LOGD(INFO, dss->domid, "CPS-Remus: guest skip list at pfn %#lx", pfn);
+    dss->cpsremus_skip_pfn = pfn;
+    return 0;
+}
+
+static int cpsremus_trigger_setup(libxl__gc *gc,
+                                  libxl__domain_save_state *dss)
+{
+    const char *dompath, *path, *val;
+    int rc, r, port;
+
+    dompath = libxl__xs_get_dompath(gc, dss->domid);
+
+    rc = cpsremus_page_setup(gc, dss, dompath);
+    if (rc) return rc;
+
+    path = GCSPRINTF("%s/"CPSREMUS_EVTCHN_KEY, dompath);
+    val = libxl__xs_read(gc, XBT_NULL, path);
+    if (!val || !*val) {
+        LOGD(INFO, dss->domid, "CPS-Remus: checkpoint requests via watch on %s",
+             dss->statepath);
+        return 0;
+    }
+
+    port = atoi(val);
+    if (port <= 0) {
+        LOGD(ERROR, dss->domid, "CPS-Remus: bad event channel '%s' at %s",
+             val, path);
+        rc = ERROR_FAIL;
+        goto err;
+    }
+
+    rc = libxl__ctx_evtchn_init(gc);
+    if (rc) goto err;
+
+    r = xenevtchn_bind_interdomain(CTX->xce, dss->domid, port);
+    if (r < 0) {
+        LOGED(ERROR, dss->domid,
+              "CPS-Remus: failed to bind checkpoint request event channel %d",
+              port);
+        rc = ERROR_FAIL;
+        goto err;
+    }
+
+    dss->cpsremus_evtchn.port = r;
+    dss->cpsremus_evtchn.callback = cpsremus_evtchn_fired;
+    rc = libxl__ev_evtchn_wait(gc, &dss->cpsremus_evtchn);
+    if (rc) goto err;
+
+    LOGD(INFO, dss->domid,
+         "CPS-Remus: checkpoint requests via event channel %d", port);
+    return 0;
+
+err:
+    cpsremus_trigger_teardown(gc, dss);
+    return rc;
+}
+
+static int cpsremus_arm(libxl__egc *egc, libxl__domain_save_state *dss)
+{
+    STATE_AO_GC(dss->ao);
+    int rc;
+
+    if (dss->rc)
+        return dss->rc;
+
+    if (dss->cpsremus_evtchn.port < 0 &&
+        !libxl__ev_xswatch_isregistered(&dss->cpsremus_watch)) {
+        rc = libxl__ev_xswatch_register(gc, &dss->cpsremus_watch,
+                                        cpsremus_next_checkpoint,
+                                        dss->statepath);
+        if (rc)
+            return rc;
+    }
+
+    dss->cpsremus_armed = true;
+    if (dss->cpsremus_requested)
+        cpsremus_trigger(egc, dss);
+
+    return 0;
+}
+
+static void cpsremus_trigger_teardown(libxl__gc *gc,
+                                      libxl__domain_save_state *dss)
+{
+    libxl__ev_xswatch_deregister(gc, &dss->cpsremus_watch);
+
+    if (dss->cpsremus_evtchn.port >= 0) {
+        libxl__ev_evtchn_cancel(gc, &dss->cpsremus_evtchn);
+        xenevtchn_unbind(CTX->xce, dss->cpsremus_evtchn.port);
+        dss->cpsremus_evtchn.port = -1;
+    }
+
+    if (dss->cpsremus_page) {
+        munmap(dss->cpsremus_page, XC_PAGE_SIZE);
+        dss->cpsremus_page = NULL;
+    }
+
+    dss->cpsremus_armed = false;
+}
+
+/*---------------------- remus callbacks (restore) -----------------------*/
+
+/*----- remus asynchronous checkpoint callback -----*/
+
+static void remus_checkpoint_stream_done(
+    libxl__egc *egc, libxl__stream_read_state *srs, int rc);
+
+static void libxl__remus_domain_restore_checkpoint_callback(void *data)
+{
+    libxl__save_helper_state *shs = data;
+    libxl__domain_create_state *dcs = shs->caller_state;
+    libxl__egc *egc = shs->egc;
+    STATE_AO_GC(dcs->ao);
+
+    if (dcs->remus_failover) {
+        /*
+         * The primary was declared dead while libxc was between
+         * checkpoints; don't wait for libxl records which will never come.
+         */
+        libxl__xc_domain_saverestore_async_callback_done(egc, shs,
+                                                XGR_CHECKPOINT_FAILOVER);
+        return;
+    }
+
+    libxl__stream_read_start_checkpoint(egc, &dcs->srs);
+}
+
+/*
+ * Acknowledge a checkpoint to the primary once we have all of it.  Acks are
+ * queued here in the unlikely case that the back channel falls behind.
+ */
+static void remus_ack_write(libxl__egc *egc, libxl__domain_create_state *dcs)
+{
+    libxl_sr_checkpoint_state srcs = { .id = CHECKPOINT_REMUS_ACK };
+
+    libxl__stream_write_checkpoint_state(egc, &dcs->remus_ack_sws, &srcs);
+}
+
+static void remus_ack_written(libxl__egc *egc,
+                              libxl__stream_write_state *sws, int rc)
+{
+    libxl__domain_create_state *dcs = CONTAINER_OF(sws, *dcs, remus_ack_sws);
+    STATE_AO_GC(dcs->ao);
+
+    if (rc) {
+        /* The primary will find out from the broken channel. */
+        if (rc != ERROR_ABORTED)
+            LOGD(ERROR, dcs->guest_domid,
+                 "Remus: failed to acknowledge checkpoint, rc %d", rc);
+        dcs->remus_acks = 0;
+        libxl__stream_write_abort(egc, sws, rc);
+        return;
+    }
+
+    if (--dcs->remus_acks)
+        remus_ack_write(egc, dcs);
+}
+
+/*
+ * Acknowledge the checkpoints whose disks have all been written and whose
+ * memory libxc has applied, so that the primary is never told of one which
+ * the backup could not fail over to.
+ */
+static void remus_acks_queue(libxl__egc *egc, libxl__domain_create_state *dcs)
+{
+    while (dcs->remus_acked < dcs->remus_committed &&
+           dcs->remus_acked < dcs->remus_applied) {
+        dcs->remus_acked++;
+        if (libxl__stream_write_inuse(&dcs->remus_ack_sws) &&
+            !dcs->remus_acks++)
+            remus_ack_write(egc, dcs);
+    }
+}
+
+static void remus_checkpoint_applied(void *data)
+{
+    libxl__save_helper_state *shs = data;
+    libxl__domain_create_state *dcs = shs->caller_state;
+
+    dcs->remus_applied++;
+    remus_acks_queue(shs->egc, dcs);
+}
+
+/*
+ * Write each replicated disk's epoch for every complete memory checkpoint,
+ * and acknowledge what can be.  An epoch whose marker is still on its way
+ * holds up the acknowledgement, but not the restore of the next checkpoint.
+ */
+static void remus_disks_commit(libxl__egc *egc,
+                               libxl__domain_create_state *dcs)
+{
+    libxl__remus_disk_recv *rd;
+    int i, rc;
+
+    STATE_AO_GC(dcs->ao);
+
+    while (dcs->remus_committed < dcs->remus_checkpoints) {
+        for (i = 0; i < dcs->remus_num_disks; i++) {
+            rd = &dcs->remus_disks[i];
+            if (rd->committed > dcs->remus_committed)
+                continue;
+
+            rc = libxl__remus_disk_recv_commit(gc, rd);
+            if (rc == ERROR_NOT_READY)
+                goto out;
+            if (rc) {
+                /* The primary will find out from the broken channel. */
+                dcs->remus_acks = 0;
+                libxl__stream_write_abort(egc, &dcs->remus_ack_sws, rc);
+                return;
+            }
+        }
+
+        dcs->remus_committed++;
+    }
+
+ out:
+    remus_acks_queue(egc, dcs);
+}
+
+static void remus_disk_epoch_closed(libxl__egc *egc,
+                                    libxl__remus_disk_recv *rd, int rc)
+{
+    libxl__domain_create_state *dcs = rd->caller_state;
+    STATE_AO_GC(dcs->ao);
+
+    if (rc) {
+        /* Acks stop, and the primary gives up on us or fails over. */
+        LOGD(WARN, dcs->guest_domid, "Remus: lost the writes to %s after"
+             " %"PRIu64" epochs, rc %d", rd->path, rd->closed, rc);
+        return;
+    }
+
+    remus_disks_commit(egc, dcs);
+}
+
+static int remus_disks_recv_start(libxl__gc *gc,
+                                  libxl__domain_create_state *dcs)
+{
+    libxl_domain_config *const d_config = dcs->guest_config;
+    const libxl_domain_restore_params *const params = &dcs->restore_params;
+    libxl__remus_disk_recv *rd;
+    libxl_device_disk disk;
+    int i, rc;
+
+    GCNEW_ARRAY(dcs->remus_disks, d_config->num_disks);
+
+    /* The same disks as the primary's remus_device_tap_disk picks. */
+    for (i = 0; i < d_config->num_disks; i++) {
+        libxl_device_disk_init(&disk);
+        libxl_device_disk_copy(CTX, &disk, &d_config->disks[i]);
+        rc = libxl__device_disk_set_backend(gc, &disk);
+        if (rc || disk.backend != LIBXL_DISK_BACKEND_TAP ||
+            disk.format != LIBXL_DISK_FORMAT_RAW) {
+            libxl_device_disk_dispose(&disk);
+            if (rc) return rc;
+            continue;
+        }
+
+        rd = &dcs->remus_disks[dcs->remus_num_disks++];
+        libxl__remus_disk_recv_init(rd);
+        rd->ao = dcs->ao;
+        rd->domid = dcs->guest_domid;
+        rd->path = libxl__strdup(gc, disk.pdev_path);
+        rd->port = libxl__remus_disk_port(d_config->disks,
+                                          d_config->num_disks,
+                                          &d_config->disks[i],
+                                          params->disk_port);
+        rd->caller_state = dcs;
+        rd->callback = remus_disk_epoch_closed;
+        libxl_device_disk_dispose(&disk);
+
+        rc = libxl__remus_disk_recv_start(gc, rd);
+        if (rc) return rc;
+    }
+
+    return 0;
+}
+
+static void remus_checkpoint_stream_done(
+    libxl__egc *egc, libxl__stream_read_state *stream, int rc)
+{
+    libxl__domain_create_state *dcs = CONTAINER_OF(stream, *dcs, srs);
+
+    if (rc == XGR_CHECKPOINT_SUCCESS) {
+        dcs->remus_checkpoints++;
+        remus_disks_commit(egc, dcs);
+    }
+
+    libxl__xc_domain_saverestore_async_callback_done(egc, &stream->shs, rc);
+}
+
+static void remus_heartbeat_lost(libxl__egc *egc,
+                                 libxl__remus_heartbeat_state *hbs, int rc)
+{
+    libxl__domain_create_state *dcs = CONTAINER_OF(hbs, *dcs, remus_hb);
+    STATE_AO_GC(dcs->ao);
+
+    LOGD(WARN, dcs->guest_domid,
+         "Remus: primary lost (rc %d) after %"PRIu64" heartbeats, failing over",
+         rc, hbs->beats);
+
+    dcs->remus_failover = true;
+    libxl__stream_read_failover(egc, &dcs->srs);
+}
+
+/*----- hot standby devices -----*/
+
+/*
+ * The backup plugs the domain's vifs, and its disks if it can, while the
+ * checkpoints arrive rather than after failover, so that hotplug scripts are
+ * off the failover path.  The vifs are kept down until then, so that the
+ * bridge does not pass them traffic for a guest which is not running.
+ */
+
+static void remus_standby_plugged(libxl__egc *egc,
+                                  libxl__multidev *multidev, int rc);
+
+/*
+ * Disks can only be plugged early if that does not touch what is being
+ * replicated to them: not with hotplug scripts (DRBD's would make the
+ * backup's copy primary), nor with qdisk, which needs the device model.
+ * Either all disks are plugged early or none are.
+ */
+static bool remus_standby_disks_ok(libxl__domain_create_state *dcs)
+{
+    libxl_domain_config *const d_config = dcs->guest_config;
+    const libxl_device_disk *disk;
+    int i;
+
+    for (i = 0; i < d_config->num_disks; i++) {
+        disk = &d_config->disks[i];
+        if (disk->script ||
+            (disk->backend != LIBXL_DISK_BACKEND_PHY &&
+             disk->backend != LIBXL_DISK_BACKEND_TAP))
+            return false;
+    }
+
+    return true;
+}
+
+static void remus_standby_start(libxl__egc *egc,
+                                libxl__domain_create_state *dcs)
+{
+    libxl_domain_config *const d_config = dcs->guest_config;
+    STATE_AO_GC(dcs->ao);
+
+    dcs->remus_standby_nics = d_config->num_nics > 0;
+    dcs->remus_standby_disks = d_config->num_disks > 0 &&
+                               remus_standby_disks_ok(dcs);
+    if (!dcs->remus_standby_nics && !dcs->remus_standby_disks)
+        return;
+
+    dcs->remus_standby_busy = true;
+    libxl__multidev_begin(ao, &dcs->remus_standby);
+    dcs->remus_standby.callback = remus_standby_plugged;
+    if (dcs->remus_standby_nics)
+        libxl__add_nics(egc, ao, dcs->guest_domid, d_config,
+                        &dcs->remus_standby);
+    if (dcs->remus_standby_disks)
+        libxl__add_disks(egc, ao, dcs->guest_domid, d_config,
+                         &dcs->remus_standby);
+    libxl__multidev_prepared(egc, &dcs->remus_standby, 0);
+}
+
+/* Sets the link of each vif up or down, and returns how many it did. */
+static int remus_standby_links(libxl__gc *gc,
+                               libxl__domain_create_state *dcs, bool up)
+{
+    libxl_domain_config *const d_config = dcs->guest_config;
+    struct ifreq ifr;
+    const char *name;
+    int fd, i, done = 0;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        LOGED(ERROR, dcs->guest_domid, "Remus: no socket to set vif links");
+        return 0;
+    }
+
+    for (i = 0; i < d_config->num_nics; i++) {
+        name = libxl__device_nic_devname(gc, dcs->guest_domid,
+                                         d_config->nics[i].devid,
+                                         LIBXL_NIC_TYPE_VIF);
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, name, sizeof(ifr.ifr_name) - 1);
+
+        if (ioctl(fd, SIOCGIFFLAGS, &ifr)) {
+            LOGED(ERROR, dcs->guest_domid, "Remus: cannot get the flags"
+                  " of %s", name);
+            continue;
+        }
+        if (up)
+            ifr.ifr_flags |= IFF_UP;
+        else
+            ifr.ifr_flags &= ~IFF_UP;
+        if (ioctl(fd, SIOCSIFFLAGS, &ifr)) {
+            LOGED(ERROR, dcs->guest_domid, "Remus: cannot set %s %s",
+                  name, up ? "up" : "down");
+            continue;
+        }
+        done++;
+    }
+
+    close(fd);
+    return done;
+}
+
+static void remus_standby_plugged(libxl__egc *egc,
+                                  libxl__multidev *multidev, int rc)
+{
+    libxl__domain_create_state *dcs =
+        CONTAINER_OF(multidev, *dcs, remus_standby);
+    libxl__remus_standby_callback *cb = dcs->remus_standby_callback;
+    STATE_AO_GC(dcs->ao);
+
+    dcs->remus_standby_busy = false;
+    dcs->remus_standby_rc = rc;
+    dcs->remus_standby_callback = NULL;
+
+    if (rc)
+        LOGD(ERROR, dcs->guest_domid, "Remus: failed to plug in devices"
+             " ahead of failover: %d", rc);
+    else if (dcs->remus_standby_nics && !dcs->remus_standby_live)
+        remus_standby_links(gc, dcs, false);
+
+    if (cb)
+        cb(egc, dcs, rc);
+}
+
+void libxl__remus_standby_wait(libxl__egc *egc,
+                               libxl__domain_create_state *dcs,
+                               libxl__remus_standby_callback *cb)
+{
+    if (dcs->remus_standby_busy) {
+        assert(!dcs->remus_standby_callback);
+        dcs->remus_standby_callback = cb;
+        return;
+    }
+
+    cb(egc, dcs, dcs->remus_standby_rc);
+}
+
+/* Failing over: the vifs only have to be brought up. */
+static void remus_standby_failover(libxl__gc *gc,
+                                   libxl__domain_create_state *dcs)
+{
+    struct timespec start, end;
+    int up;
+
+    dcs->remus_standby_live = true;
+    if (!dcs->remus_standby_nics || dcs->remus_standby_busy ||
+        dcs->remus_standby_rc)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    up = remus_standby_links(gc, dcs, true);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    LOGD(INFO, dcs->guest_domid, "Remus: %d of %d vifs up in %ld us", up,
+         dcs->guest_config->num_nics,
+         (long)((end.tv_sec - start.tv_sec) * 1000000L +
+                (end.tv_nsec - start.tv_nsec) / 1000));
+}
+
+/*----- checkpoint history -----*/
+
+static const char *remus_emulator_file(libxl__gc *gc,
+                                       libxl__domain_create_state *dcs,
+                                       int back)
+{
+    const char *path = GCSPRINTF(LIBXL_DEVICE_MODEL_RESTORE_FILE".%u",
+                                 dcs->guest_domid);
+
+    return back ? GCSPRINTF("%s.%d", path, back) : path;
+}
+
+void libxl__remus_restore_keep_emulator(libxl__gc *gc,
+                                        libxl__domain_create_state *dcs,
+                                        const char *path)
+{
+    const char *from, *to;
+    int i;
+
+    /* path.N is the state N checkpoints before the one in path. */
+    for (i = dcs->restore_params.history_epochs; i > 0; i--) {
+        from = i > 1 ? GCSPRINTF("%s.%d", path, i - 1) : path;
+        to = GCSPRINTF("%s.%d", path, i);
+        if (rename(from, to) && errno != ENOENT)
+            LOGED(WARN, dcs->guest_domid, "Remus: failed to keep %s as %s",
+                  from, to);
+    }
+}
+
+/*
+ * libxc is failing over and can undo up to 'available' checkpoints.  Go
+ * back as many as the restore params ask, unless an operator has since
+ * said otherwise in xenstore, e.g. having seen the fault the primary died
+ * of.  Only memory and device state go back, so not if we replicate disks.
+ */
+static void remus_restore_rollback_callback(uint32_t available, void *data)
+{
+    libxl__save_helper_state *shs = data;
+    libxl__domain_create_state *dcs = shs->caller_state;
+    libxl__egc *egc = shs->egc;
+    const char *val, *from, *to;
+    int back = dcs->restore_params.rollback;
+    STATE_AO_GC(dcs->ao);
+
+    val = libxl__xs_read(gc, XBT_NULL,
+                         GCSPRINTF("%s/remus/rollback",
+                                   libxl__xs_libxl_path(gc, dcs->guest_domid)));
+    if (val)
+        back = atoi(val);
+
+    if (back <= 0) {
+        back = 0;
+        goto out;
+    }
+
+    if (dcs->remus_num_disks) {
+        LOGD(WARN, dcs->guest_domid, "Remus: replicated disks cannot be"
+             " rolled back, failing over to the last checkpoint");
+        back = 0;
+        goto out;
+    }
+
+    if (back > available) {
+        LOGD(WARN, dcs->guest_domid, "Remus: only %u earlier checkpoints"
+             " kept, %d asked for", available, back);
+        back = available;
+    }
+
+    if (back && dcs->guest_config->b_info.type == LIBXL_DOMAIN_TYPE_HVM) {
+        from = remus_emulator_file(gc, dcs, back);
+        to = remus_emulator_file(gc, dcs, 0);
+        if (rename(from, to)) {
+            LOGED(ERROR, dcs->guest_domid, "Remus: no device model state"
+                  " in %s, failing over to the last checkpoint", from);
+            back = 0;
+            goto out;
+        }
+    }
+
+    if (back)
+        LOGD(INFO, dcs->guest_domid, "Remus: failing over to %d checkpoints"
+             " before the last", back);
+
+ out:
+    libxl__xc_domain_saverestore_async_callback_done(egc, shs, back);
+}
+
+int libxl__remus_restore_setup(libxl__egc *egc,
+                               libxl__domain_create_state *dcs)
+{
+    /* Convenience aliases */
+    libxl__srm_restore_autogen_callbacks *const callbacks =
+        &dcs->srs.shs.callbacks.restore.a;
+    libxl__remus_heartbeat_state *const hbs = &dcs->remus_hb;
+    const libxl_domain_restore_params *const params = &dcs->restore_params;
+
+    STATE_AO_GC(dcs->ao);
+
+    callbacks->checkpoint = libxl__remus_domain_restore_checkpoint_callback;
+    dcs->srs.checkpoint_callback = remus_checkpoint_stream_done;
+    if (params->history_epochs > 0)
+        callbacks->rollback = remus_restore_rollback_callback;
+
+    remus_standby_start(egc, dcs);
+
+    if (libxl_defbool_val(params->checkpoint_ack) && dcs->send_back_fd >= 0) {
+        libxl__stream_write_state *const sws = &dcs->remus_ack_sws;
+
+        sws->ao = ao;
+        sws->fd = dcs->send_back_fd;
+        sws->back_channel = true;
+        sws->checkpoint_callback = remus_ack_written;
+        dcs->remus_acks = 0;
+        libxl__stream_write_start(egc, sws);
+        callbacks->checkpoint_applied = remus_checkpoint_applied;
+    }
+
+    if (params->disk_port) {
+        int rc = remus_disks_recv_start(gc, dcs);
+        if (rc) {
+            LOGD(ERROR, dcs->guest_domid,
+                 "Remus: cannot receive the primary's disk writes");
+            return rc;
+        }
+    }
+
+    if (params->streams > 0) {
+        libxl__remus_stripes_state *const ss = &dcs->remus_stripes;
+        int rc;
+
+        ss->ao = ao;
+        ss->domid = dcs->guest_domid;
+        ss->port = params->stream_port;
+        ss->nr = params->streams;
+        rc = libxl__remus_stripes_listen(gc, ss);
+        if (rc) {
+            LOGD(ERROR, dcs->guest_domid,
+                 "Remus: cannot receive the primary's striped streams");
+            return rc;
+        }
+    }
+
+    if (!params->heartbeat_port)
+        return 0;
+
+    hbs->ao = ao;
+    hbs->domid = dcs->guest_domid;
+    hbs->port = params->heartbeat_port;
+    hbs->period_us = params->heartbeat_period;
+    hbs->misses = params->heartbeat_misses;
+    hbs->nonce = params->heartbeat_nonce;
+    hbs->host = params->heartbeat_peer;
+    hbs->callback = remus_heartbeat_lost;
+
+    /*
+     * Without a heartbeat we still fail over when the stream breaks, so
+     * carry on regardless; it only takes longer to notice a dead primary.
+     */
+    if (libxl__remus_heartbeat_recv_start(gc, hbs))
+        LOGD(WARN, dcs->guest_domid,
+             "Remus: heartbeat unavailable, relying on the stream alone");
+
+    return 0;
+}
+
+void libxl__remus_restore_stop(libxl__egc *egc,
+                               libxl__domain_create_state *dcs)
+{
+    STATE_AO_GC(dcs->ao);
+
+    libxl__remus_disk_recv *rd;
+    int i, rc;
+
+    libxl__remus_heartbeat_stop(gc, &dcs->remus_hb);
+    libxl__remus_stripes_stop(gc, &dcs->remus_stripes);
+    remus_standby_failover(gc, dcs);
+
+    dcs->remus_acks = 0;
+    libxl__stream_write_abort(egc, &dcs->remus_ack_sws, ERROR_ABORTED);
+
+    /* Bring every disk up to the checkpoint the domain resumes from. */
+    for (i = 0; i < dcs->remus_num_disks; i++) {
+        rd = &dcs->remus_disks[i];
+
+        rc = 0;
+        while (!rc && rd->committed < dcs->remus_checkpoints) {
+            rc = libxl__remus_disk_recv_commit(gc, rd);
+            if (rc == ERROR_NOT_READY) {
+                LOGD(WARN, dcs->guest_domid, "Remus: end of epoch %"PRIu64
+                     " of %s missing, writing what arrived",
+                     rd->committed + 1, rd->path);
+                rc = libxl__remus_disk_recv_commit_open(gc, rd);
+                break;
+            }
+        }
+        if (rc)
+            LOGD(ERROR, dcs->guest_domid, "Remus: %s is left as of epoch"
+                 " %"PRIu64" rather than %"PRIu64, rd->path, rd->committed,
+                 dcs->remus_checkpoints);
+
+        libxl__remus_disk_recv_stop(gc, rd);
+    }
+    dcs->remus_num_disks = 0;
+
+    /* The device model has the state it resumes from in the usual file. */
+    for (i = 1; i <= dcs->restore_params.history_epochs; i++)
+        libxl__remove_file(gc, remus_emulator_file(gc, dcs, i));
 }
 
 /*
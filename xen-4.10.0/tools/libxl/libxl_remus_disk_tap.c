@@ -0,0 +1,676 @@
+/*
+ * Copyright (C) 2017
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#include "libxl_osdeps.h" /* must come before any other headers */
+
+#include "libxl_internal.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+/*
+ * The stream block-remus sends to the backup, see block-remus.c: a write
+ * is "wreq", a 32 bit count of sectors and a 64 bit first sector, both in
+ * the primary's byte order, followed by the data; "creq" closes the epoch.
+ * The backup never answers, since the acknowledgement of the memory
+ * checkpoint covers the disk as well.
+ */
+#define DISK_OP_LEN       4
+#define DISK_WRITE_HDR    (DISK_OP_LEN + sizeof(uint32_t) + sizeof(uint64_t))
+#define DISK_SECTOR_SIZE  512
+#define DISK_MAX_SECTORS  (1U << 20)   /* per write; anything more is bogus */
+#define DISK_READ_CHUNK   (64 * 1024)
+#define DISK_WRITE_IOVS   64
+
+/* Waiting for block-remus to have sent the end of an epoch */
+#define DISK_EPOCH_TIMEOUT_MS 10000
+
+/*
+ * The records of one epoch, as they arrived.  Only the first parsed bytes
+ * are whole write records; the rest is the beginning of the next one.
+ */
+struct libxl__remus_disk_epoch {
+    LIBXL_STAILQ_ENTRY(libxl__remus_disk_epoch) entry;
+    uint8_t *buf;
+    size_t len, size;
+    size_t parsed;
+};
+
+int libxl__remus_disk_port(const libxl_device_disk *disks, int num_disks,
+                           const libxl_device_disk *disk, int base)
+{
+    int devid = libxl__device_disk_dev_number(disk->vdev, NULL, NULL);
+    int i, nr = 0;
+
+    for (i = 0; i < num_disks; i++)
+        if (libxl__device_disk_dev_number(disks[i].vdev, NULL, NULL) < devid)
+            nr++;
+
+    return base + nr;
+}
+
+/*----- primary: block-remus stacked onto the tapdisk -----*/
+
+typedef struct libxl__remus_tap_disk {
+    libxl__checkpoint_device *dev;
+    const char *params;       /* the stack to go back to, "aio:/path" */
+    int tap_id, tap_minor;
+    bool inserted;
+    int ctl_fd, msg_fd;
+    libxl__ev_fd msg_efd;
+    libxl__ev_time timeout;
+} libxl__remus_tap_disk;
+
+static int tap_disk_params(libxl__gc *gc, libxl__checkpoint_device *dev,
+                           const char **params_r)
+{
+    const libxl_device_disk *disk = dev->backend_dev;
+    libxl__device device;
+
+    device.backend_devid = libxl__device_disk_dev_number(disk->vdev,
+                                                         NULL, NULL);
+    device.backend_domid = disk->backend_domid;
+    device.backend_kind = LIBXL__DEVICE_KIND_VBD;
+    device.devid = device.backend_devid;
+    device.domid = dev->cds->domid;
+    device.kind = LIBXL__DEVICE_KIND_VBD;
+
+    return libxl__xs_read_checked(gc, XBT_NULL,
+                                  GCSPRINTF("%s/tapdisk-params",
+                                    libxl__device_backend_path(gc, &device)),
+                                  params_r);
+}
+
+static void tap_disk_setup(libxl__egc *egc, libxl__checkpoint_device *dev)
+{
+    const libxl_device_disk *disk = dev->backend_dev;
+    libxl__checkpoint_devices_state *const cds = dev->cds;
+    libxl__remus_state *rs = cds->concrete_data;
+    libxl__domain_save_state *dss = CONTAINER_OF(rs, *dss, rs);
+    const libxl_domain_remus_info *const info = dss->remus;
+    libxl__remus_tap_disk *rtd;
+    const char *params = NULL, *name, *ctl_path;
+    char reply[4];
+    int rc;
+
+    STATE_AO_GC(cds->ao);
+
+    if (!info->disk_port || disk->backend != LIBXL_DISK_BACKEND_TAP ||
+        !libxl__blktap_enabled(gc)) {
+        rc = ERROR_CHECKPOINT_DEVOPS_DOES_NOT_MATCH;
+        goto out;
+    }
+
+    rc = tap_disk_params(gc, dev, &params);
+    if (rc) goto out;
+
+    /* block-remus can only sit on top of a raw image */
+    if (!params || strncmp(params, "aio:", 4)) {
+        rc = ERROR_CHECKPOINT_DEVOPS_DOES_NOT_MATCH;
+        goto out;
+    }
+
+    /* ops matched */
+    dev->matched = true;
+
+    GCNEW(rtd);
+    dev->concrete_data = rtd;
+    rtd->dev = dev;
+    rtd->params = params;
+    rtd->ctl_fd = -1;
+    rtd->msg_fd = -1;
+    libxl__ev_fd_init(&rtd->msg_efd);
+    libxl__ev_time_init(&rtd->timeout);
+
+    name = GCSPRINTF("%s:%d", info->disk_host,
+                     libxl__remus_disk_port(cds->disks, cds->num_disks,
+                                            disk, info->disk_port));
+    rc = libxl__blktap_remus_insert(gc, params, name, &rtd->tap_id,
+                                    &rtd->tap_minor, &ctl_path);
+    if (rc) goto out;
+    rtd->inserted = true;
+
+    /* block-remus holds both FIFOs open, so neither open can block */
+    rtd->ctl_fd = open(ctl_path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    rtd->msg_fd = open(GCSPRINTF("%s.msg", ctl_path),
+                       O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (rtd->ctl_fd < 0 || rtd->msg_fd < 0) {
+        LOGED(ERROR, cds->domid, "Remus: failed to open %s", ctl_path);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    /* drop anything left over from an earlier user of the FIFO */
+    while (read(rtd->msg_fd, reply, sizeof(reply)) > 0)
+        ;
+
+    LOGD(DEBUG, cds->domid, "Remus: replicating %s to %s",
+         params + 4, name);
+    rc = 0;
+
+out:
+    dev->aodev.rc = rc;
+    dev->aodev.callback(egc, &dev->aodev);
+}
+
+static void tap_disk_teardown(libxl__egc *egc, libxl__checkpoint_device *dev)
+{
+    libxl__remus_tap_disk *rtd = dev->concrete_data;
+    int rc = 0;
+
+    STATE_AO_GC(dev->cds->ao);
+
+    if (rtd) {
+        libxl__ev_fd_deregister(gc, &rtd->msg_efd);
+        libxl__ev_time_deregister(gc, &rtd->timeout);
+        if (rtd->ctl_fd >= 0)
+            close(rtd->ctl_fd);
+        if (rtd->msg_fd >= 0)
+            close(rtd->msg_fd);
+        rtd->ctl_fd = rtd->msg_fd = -1;
+
+        /* the guest carries on unprotected, writing to its image alone */
+        if (rtd->inserted)
+            rc = libxl__blktap_remus_remove(gc, rtd->tap_id, rtd->tap_minor,
+                                            rtd->params);
+        rtd->inserted = false;
+    }
+
+    dev->aodev.rc = rc;
+    dev->aodev.callback(egc, &dev->aodev);
+}
+
+/*----- checkpointing APIs -----*/
+
+static void tap_disk_epoch_done(libxl__egc *egc,
+                                libxl__checkpoint_device *dev, int rc)
+{
+    libxl__remus_tap_disk *rtd = dev->concrete_data;
+    STATE_AO_GC(dev->cds->ao);
+
+    libxl__ev_fd_deregister(gc, &rtd->msg_efd);
+    libxl__ev_time_deregister(gc, &rtd->timeout);
+
+    dev->aodev.rc = rc;
+    dev->aodev.callback(egc, &dev->aodev);
+}
+
+static void tap_disk_epoch_reply(libxl__egc *egc, libxl__ev_fd *ev,
+                                 int fd, short events, short revents)
+{
+    libxl__remus_tap_disk *rtd = CONTAINER_OF(ev, *rtd, msg_efd);
+    libxl__checkpoint_device *dev = rtd->dev;
+    char reply[4];
+    ssize_t r;
+
+    STATE_AO_GC(dev->cds->ao);
+
+    r = read(fd, reply, sizeof(reply));
+    if (r < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+
+    if (r != sizeof(reply) || memcmp(reply, "sent", sizeof(reply))) {
+        LOGD(ERROR, dev->cds->domid,
+             "Remus: block-remus failed to close the epoch of %s",
+             rtd->params + 4);
+        tap_disk_epoch_done(egc, dev, ERROR_FAIL);
+        return;
+    }
+
+    tap_disk_epoch_done(egc, dev, 0);
+}
+
+static void tap_disk_epoch_timeout(libxl__egc *egc, libxl__ev_time *ev,
+                                   const struct timeval *requested_abs,
+                                   int rc)
+{
+    libxl__remus_tap_disk *rtd = CONTAINER_OF(ev, *rtd, timeout);
+    libxl__checkpoint_device *dev = rtd->dev;
+
+    STATE_AO_GC(dev->cds->ao);
+
+    if (rc == ERROR_TIMEDOUT)
+        LOGD(ERROR, dev->cds->domid,
+             "Remus: no answer from block-remus for %s", rtd->params + 4);
+    tap_disk_epoch_done(egc, dev, rc);
+}
+
+/*
+ * Close the epoch on the backup.  block-remus answers as soon as the
+ * marker is on its way: the backup writes the epoch when it has the
+ * memory checkpoint as well, and acknowledges both together.
+ */
+static void tap_disk_postsuspend(libxl__egc *egc,
+                                 libxl__checkpoint_device *dev)
+{
+    libxl__remus_tap_disk *rtd = dev->concrete_data;
+    static const char cmd[] = "epoch";
+    int rc;
+
+    STATE_AO_GC(dev->cds->ao);
+
+    if (write(rtd->ctl_fd, cmd, sizeof(cmd) - 1) != sizeof(cmd) - 1) {
+        LOGED(ERROR, dev->cds->domid,
+              "Remus: failed to ask block-remus to close the epoch");
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    rc = libxl__ev_fd_register(gc, &rtd->msg_efd, tap_disk_epoch_reply,
+                               rtd->msg_fd, POLLIN);
+    if (rc) goto out;
+
+    rc = libxl__ev_time_register_rel(ao, &rtd->timeout,
+                                     tap_disk_epoch_timeout,
+                                     DISK_EPOCH_TIMEOUT_MS);
+    if (rc) goto out;
+
+    return;
+
+out:
+    tap_disk_epoch_done(egc, dev, rc);
+}
+
+const libxl__checkpoint_device_instance_ops remus_device_tap_disk = {
+    .kind = LIBXL__DEVICE_KIND_VBD,
+    .setup = tap_disk_setup,
+    .teardown = tap_disk_teardown,
+    .postsuspend = tap_disk_postsuspend,
+};
+
+/*----- backup: receiving the epochs -----*/
+
+static libxl__remus_disk_epoch *disk_epoch_new(libxl__gc *gc)
+{
+    libxl__remus_disk_epoch *e = libxl__zalloc(NOGC, sizeof(*e));
+
+    e->size = DISK_READ_CHUNK;
+    e->buf = libxl__malloc(NOGC, e->size);
+    return e;
+}
+
+static void disk_epoch_free(libxl__remus_disk_epoch *e)
+{
+    free(e->buf);
+    free(e);
+}
+
+static void disk_recv_failed(libxl__egc *egc, libxl__remus_disk_recv *rd,
+                             int rc)
+{
+    STATE_AO_GC(rd->ao);
+
+    libxl__ev_fd_deregister(gc, &rd->listen_efd);
+    libxl__ev_fd_deregister(gc, &rd->efd);
+    if (rd->listen_fd >= 0) {
+        close(rd->listen_fd);
+        rd->listen_fd = -1;
+    }
+    if (rd->fd >= 0) {
+        close(rd->fd);
+        rd->fd = -1;
+    }
+    rd->callback(egc, rd, rc);
+}
+
+/*
+ * Account for whole records at the end of the open epoch.  A marker moves
+ * what follows it into a new epoch and puts the open one on the queue.
+ */
+static int disk_recv_parse(libxl__gc *gc, libxl__remus_disk_recv *rd,
+                           int *closed_r)
+{
+    libxl__remus_disk_epoch *e, *next;
+    const uint8_t *p;
+    uint32_t secs;
+    size_t avail, need;
+
+    for (;;) {
+        e = rd->open;
+        p = e->buf + e->parsed;
+        avail = e->len - e->parsed;
+
+        if (avail < DISK_OP_LEN)
+            return 0;
+
+        if (!memcmp(p, "wreq", DISK_OP_LEN)) {
+            if (avail < DISK_WRITE_HDR)
+                return 0;
+            memcpy(&secs, p + DISK_OP_LEN, sizeof(secs));
+            if (!secs || secs > DISK_MAX_SECTORS) {
+                LOGD(ERROR, rd->domid, "Remus: bad write of %"PRIu32
+                     " sectors from the primary for %s", secs, rd->path);
+                return ERROR_FAIL;
+            }
+            need = DISK_WRITE_HDR + (size_t)secs * DISK_SECTOR_SIZE;
+            if (avail < need)
+                return 0;
+            e->parsed += need;
+        } else if (!memcmp(p, "creq", DISK_OP_LEN)) {
+            next = disk_epoch_new(gc);
+            avail -= DISK_OP_LEN;
+            if (avail > next->size) {
+                next->size = avail;
+                next->buf = libxl__realloc(NOGC, next->buf, next->size);
+            }
+            memcpy(next->buf, p + DISK_OP_LEN, avail);
+            next->len = avail;
+
+            e->len = e->parsed;
+            LIBXL_STAILQ_INSERT_TAIL(&rd->epochs, e, entry);
+            rd->open = next;
+            rd->closed++;
+            (*closed_r)++;
+        } else {
+            LOGD(ERROR, rd->domid, "Remus: unexpected request %.4s from the"
+                 " primary for %s", (const char *)p, rd->path);
+            return ERROR_FAIL;
+        }
+    }
+}
+
+static void disk_recv_readable(libxl__egc *egc, libxl__ev_fd *ev,
+                               int fd, short events, short revents)
+{
+    libxl__remus_disk_recv *rd = CONTAINER_OF(ev, *rd, efd);
+    libxl__remus_disk_epoch *e;
+    int closed = 0, rc;
+    ssize_t r;
+
+    STATE_AO_GC(rd->ao);
+
+    /* Read what is there, in chunks; the epoch grows as it needs to. */
+    for (;;) {
+        e = rd->open;
+        if (e->size - e->len < DISK_READ_CHUNK) {
+            e->size = e->size * 2 > e->len + DISK_READ_CHUNK ?
+                      e->size * 2 : e->len + DISK_READ_CHUNK;
+            e->buf = libxl__realloc(NOGC, e->buf, e->size);
+        }
+
+        r = read(fd, e->buf + e->len, e->size - e->len);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            LOGED(ERROR, rd->domid, "Remus: failed to read writes for %s",
+                  rd->path);
+            rc = ERROR_FAIL;
+            goto out;
+        }
+        if (!r) {
+            LOGD(DEBUG, rd->domid, "Remus: primary closed the stream for %s",
+                 rd->path);
+            rc = ERROR_FAIL;
+            goto out;
+        }
+
+        e->len += r;
+        rc = disk_recv_parse(gc, rd, &closed);
+        if (rc) goto out;
+    }
+
+    if (closed)
+        rd->callback(egc, rd, 0);
+    return;
+
+ out:
+    if (closed)
+        rd->callback(egc, rd, 0);
+    disk_recv_failed(egc, rd, rc);
+}
+
+static void disk_recv_accept(libxl__egc *egc, libxl__ev_fd *ev,
+                             int fd, short events, short revents)
+{
+    libxl__remus_disk_recv *rd = CONTAINER_OF(ev, *rd, listen_efd);
+    int rc;
+
+    STATE_AO_GC(rd->ao);
+
+    rd->fd = accept(fd, NULL, NULL);
+    if (rd->fd < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+            errno == ECONNABORTED)
+            return;
+        LOGED(ERROR, rd->domid, "Remus: failed to accept writes for %s",
+              rd->path);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    /* There is only ever the one primary. */
+    libxl__ev_fd_deregister(gc, &rd->listen_efd);
+    close(rd->listen_fd);
+    rd->listen_fd = -1;
+
+    rc = libxl_fd_set_cloexec(CTX, rd->fd, 1);
+    if (!rc) rc = libxl_fd_set_nonblock(CTX, rd->fd, 1);
+    if (!rc) rc = libxl__ev_fd_register(gc, &rd->efd, disk_recv_readable,
+                                        rd->fd, POLLIN);
+    if (rc) goto out;
+
+    LOGD(DEBUG, rd->domid, "Remus: receiving writes for %s", rd->path);
+    return;
+
+ out:
+    disk_recv_failed(egc, rd, rc);
+}
+
+void libxl__remus_disk_recv_init(libxl__remus_disk_recv *rd)
+{
+    rd->listen_fd = -1;
+    rd->fd = -1;
+    rd->image_fd = -1;
+    libxl__ev_fd_init(&rd->listen_efd);
+    libxl__ev_fd_init(&rd->efd);
+    rd->open = NULL;
+    LIBXL_STAILQ_INIT(&rd->epochs);
+    rd->closed = rd->committed = 0;
+}
+
+int libxl__remus_disk_recv_start(libxl__gc *gc, libxl__remus_disk_recv *rd)
+{
+    struct addrinfo hints, *res = NULL;
+    const char *port = GCSPRINTF("%d", rd->port);
+    int one = 1, r, rc;
+
+    if (rd->port <= 0 || rd->port > 65535) {
+        LOGD(ERROR, rd->domid, "Remus: bad disk port %d", rd->port);
+        return ERROR_INVAL;
+    }
+
+    rd->image_fd = open(rd->path, O_WRONLY | O_CLOEXEC);
+    if (rd->image_fd < 0) {
+        LOGED(ERROR, rd->domid, "Remus: failed to open %s", rd->path);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    /* block-remus only speaks IPv4 */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    r = getaddrinfo(NULL, port, &hints, &res);
+    if (r) {
+        LOGD(ERROR, rd->domid, "Remus: cannot resolve *:%s: %s",
+             port, gai_strerror(r));
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    rd->listen_fd = socket(res->ai_family, res->ai_socktype,
+                           res->ai_protocol);
+    if (rd->listen_fd < 0) {
+        LOGED(ERROR, rd->domid, "Remus: failed to create socket");
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    rc = libxl_fd_set_cloexec(CTX, rd->listen_fd, 1);
+    if (!rc) rc = libxl_fd_set_nonblock(CTX, rd->listen_fd, 1);
+    if (rc) goto out;
+
+    setsockopt(rd->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(rd->listen_fd, res->ai_addr, res->ai_addrlen) ||
+        listen(rd->listen_fd, 1)) {
+        LOGED(ERROR, rd->domid, "Remus: failed to listen on port %s", port);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    rc = libxl__ev_fd_register(gc, &rd->listen_efd, disk_recv_accept,
+                               rd->listen_fd, POLLIN);
+    if (rc) goto out;
+
+    rd->open = disk_epoch_new(gc);
+
+    LOGD(DEBUG, rd->domid, "Remus: listening on port %d for writes to %s",
+         rd->port, rd->path);
+    rc = 0;
+
+ out:
+    if (res)
+        freeaddrinfo(res);
+    if (rc)
+        libxl__remus_disk_recv_stop(gc, rd);
+    return rc;
+}
+
+/* Write out iov, picking up after short writes. */
+static int disk_write_run(libxl__gc *gc, libxl__remus_disk_recv *rd,
+                          struct iovec *iov, int n, off_t pos)
+{
+    ssize_t r;
+
+    while (n) {
+        r = pwritev(rd->image_fd, iov, n, pos);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            LOGED(ERROR, rd->domid, "Remus: failed to write to %s", rd->path);
+            return ERROR_FAIL;
+        }
+        pos += r;
+        for (; n && (size_t)r >= iov->iov_len; iov++, n--)
+            r -= iov->iov_len;
+        if (n) {
+            iov->iov_base = (uint8_t *)iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+
+    return 0;
+}
+
+/* Write the whole records of e to the image, adjacent ones together. */
+static int disk_epoch_write(libxl__gc *gc, libxl__remus_disk_recv *rd,
+                            const libxl__remus_disk_epoch *e)
+{
+    struct iovec iov[DISK_WRITE_IOVS];
+    uint64_t sector, end = 0;
+    uint32_t secs;
+    off_t start = 0;
+    size_t off, len;
+    int n = 0, rc;
+
+    for (off = 0; off < e->parsed; off += DISK_WRITE_HDR + len) {
+        memcpy(&secs, e->buf + off + DISK_OP_LEN, sizeof(secs));
+        memcpy(&sector, e->buf + off + DISK_OP_LEN + sizeof(secs),
+               sizeof(sector));
+        len = (size_t)secs * DISK_SECTOR_SIZE;
+
+        if (n && (sector != end || n == DISK_WRITE_IOVS)) {
+            rc = disk_write_run(gc, rd, iov, n, start);
+            if (rc) return rc;
+            n = 0;
+        }
+        if (!n)
+            start = (off_t)sector * DISK_SECTOR_SIZE;
+
+        iov[n].iov_base = e->buf + off + DISK_WRITE_HDR;
+        iov[n++].iov_len = len;
+        end = sector + secs;
+    }
+
+    return n ? disk_write_run(gc, rd, iov, n, start) : 0;
+}
+
+int libxl__remus_disk_recv_commit(libxl__gc *gc, libxl__remus_disk_recv *rd)
+{
+    libxl__remus_disk_epoch *e = LIBXL_STAILQ_FIRST(&rd->epochs);
+    int rc;
+
+    if (!e)
+        return ERROR_NOT_READY;
+
+    rc = disk_epoch_write(gc, rd, e);
+    if (rc) return rc;
+
+    LIBXL_STAILQ_REMOVE_HEAD(&rd->epochs, entry);
+    disk_epoch_free(e);
+    rd->committed++;
+    return 0;
+}
+
+int libxl__remus_disk_recv_commit_open(libxl__gc *gc,
+                                       libxl__remus_disk_recv *rd)
+{
+    int rc;
+
+    if (!rd->open)
+        return 0;
+
+    rc = disk_epoch_write(gc, rd, rd->open);
+    if (rc) return rc;
+
+    rd->open->len = rd->open->parsed = 0;
+    rd->committed++;
+    return 0;
+}
+
+void libxl__remus_disk_recv_stop(libxl__gc *gc, libxl__remus_disk_recv *rd)
+{
+    libxl__remus_disk_epoch *e;
+
+    libxl__ev_fd_deregister(gc, &rd->listen_efd);
+    libxl__ev_fd_deregister(gc, &rd->efd);
+    if (rd->listen_fd >= 0) {
+        close(rd->listen_fd);
+        rd->listen_fd = -1;
+    }
+    if (rd->fd >= 0) {
+        close(rd->fd);
+        rd->fd = -1;
+    }
+
+    if (rd->image_fd >= 0) {
+        if (fsync(rd->image_fd))
+            LOGED(WARN, rd->domid, "Remus: failed to sync %s", rd->path);
+        close(rd->image_fd);
+        rd->image_fd = -1;
+    }
+
+    while ((e = LIBXL_STAILQ_FIRST(&rd->epochs))) {
+        LIBXL_STAILQ_REMOVE_HEAD(&rd->epochs, entry);
+        disk_epoch_free(e);
+    }
+    if (rd->open) {
+        disk_epoch_free(rd->open);
+        rd->open = NULL;
+    }
+}
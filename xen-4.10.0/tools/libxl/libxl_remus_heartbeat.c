@@ -0,0 +1,528 @@
+/*
+ * Copyright (C) 2017
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#include "libxl_osdeps.h" /* must come before any other headers */
+
+#include "libxl_internal.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+/*
+ * Wire format of a beat, all in network byte order.  The nonce is chosen
+ * per session by the primary and given to the backup along with the other
+ * heartbeat parameters, over the channel which starts it.
+ *
+ * The receiver only takes a beat with the right nonce, a sequence number
+ * after the last one's, and from the primary's address: the one it was
+ * given, or else that of the first beat it took.  This keeps stray and
+ * off-path senders from holding off failover.  The beats are not secret
+ * though, so the heartbeat trusts the link between the two hosts, as the
+ * unencrypted migration stream already does.
+ */
+#define HEARTBEAT_MAGIC 0x43505348 /* "CPSH" */
+
+struct heartbeat_msg {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t nonce_hi;
+    uint32_t nonce_lo;
+};
+
+/* Bounds on the configuration, so that the failover deadline is sane. */
+#define HEARTBEAT_PERIOD_MAX_US 60000000 /* a minute */
+#define HEARTBEAT_MISSES_MAX    10000
+
+static void heartbeat_timer_fired(libxl__egc *egc,
+                                  libxl__remus_heartbeat_state *hbs);
+
+static void heartbeat_failed(libxl__egc *egc,
+                             libxl__remus_heartbeat_state *hbs, int rc)
+{
+    STATE_AO_GC(hbs->ao);
+
+    libxl__remus_heartbeat_stop(gc, hbs);
+    hbs->callback(egc, hbs, rc);
+}
+
+/*----- timer: timerfd where available, else libxl__ev_time -----*/
+
+#ifdef __linux__
+
+static void heartbeat_timerfd_readable(libxl__egc *egc, libxl__ev_fd *ev,
+                                       int fd, short events, short revents)
+{
+    libxl__remus_heartbeat_state *hbs = CONTAINER_OF(ev, *hbs, timer_efd);
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return; /* spurious, or rearmed since it became readable */
+
+    heartbeat_timer_fired(egc, hbs);
+}
+
+static int heartbeat_timer_setup(libxl__gc *gc,
+                                 libxl__remus_heartbeat_state *hbs)
+{
+    hbs->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (hbs->timerfd < 0) {
+        LOGED(ERROR, hbs->domid, "heartbeat: failed to create timerfd");
+        return ERROR_FAIL;
+    }
+
+    return libxl__ev_fd_register(gc, &hbs->timer_efd,
+                                 heartbeat_timerfd_readable,
+                                 hbs->timerfd, POLLIN);
+}
+
+/* Fire after us microseconds, and then every us if periodic. */
+static int heartbeat_timer_arm(libxl__gc *gc,
+                               libxl__remus_heartbeat_state *hbs,
+                               uint64_t us, bool periodic)
+{
+    struct itimerspec its;
+
+    its.it_value.tv_sec = us / 1000000;
+    its.it_value.tv_nsec = (us % 1000000) * 1000;
+    its.it_interval = periodic ? its.it_value : (struct timespec){ 0, 0 };
+
+    if (timerfd_settime(hbs->timerfd, 0, &its, NULL)) {
+        LOGED(ERROR, hbs->domid, "heartbeat: failed to arm timerfd");
+        return ERROR_FAIL;
+    }
+
+    return 0;
+}
+
+static void heartbeat_timer_rearm_periodic(libxl__egc *egc,
+                                           libxl__remus_heartbeat_state *hbs)
+{
+    /* The timerfd interval takes care of it. */
+}
+
+static void heartbeat_timer_teardown(libxl__gc *gc,
+                                     libxl__remus_heartbeat_state *hbs)
+{
+    libxl__ev_fd_deregister(gc, &hbs->timer_efd);
+    if (hbs->timerfd >= 0) {
+        close(hbs->timerfd);
+        hbs->timerfd = -1;
+    }
+}
+
+#else /* !__linux__ */
+
+static void heartbeat_timeout(libxl__egc *egc, libxl__ev_time *ev,
+                              const struct timeval *requested_abs, int rc)
+{
+    libxl__remus_heartbeat_state *hbs = CONTAINER_OF(ev, *hbs, timeout);
+
+    if (rc != ERROR_TIMEDOUT) {
+        heartbeat_failed(egc, hbs, rc);
+        return;
+    }
+
+    heartbeat_timer_fired(egc, hbs);
+}
+
+static int heartbeat_timer_setup(libxl__gc *gc,
+                                 libxl__remus_heartbeat_state *hbs)
+{
+    return 0;
+}
+
+/* Resolution is limited to that of the libxl timeout machinery (1ms). */
+static int heartbeat_timer_arm(libxl__gc *gc,
+                               libxl__remus_heartbeat_state *hbs,
+                               uint64_t us, bool periodic)
+{
+    struct timeval abs;
+    int rc;
+
+    rc = libxl__gettimeofday(gc, &abs);
+    if (rc) return rc;
+
+    abs.tv_sec += us / 1000000;
+    abs.tv_usec += us % 1000000;
+    if (abs.tv_usec >= 1000000) {
+        abs.tv_sec++;
+        abs.tv_usec -= 1000000;
+    }
+
+    libxl__ev_time_deregister(gc, &hbs->timeout);
+    return libxl__ev_time_register_abs(hbs->ao, &hbs->timeout,
+                                       heartbeat_timeout, abs);
+}
+
+static void heartbeat_timer_rearm_periodic(libxl__egc *egc,
+                                           libxl__remus_heartbeat_state *hbs)
+{
+    EGC_GC;
+    int rc;
+
+    rc = heartbeat_timer_arm(gc, hbs, hbs->period_us, true);
+    if (rc)
+        heartbeat_failed(egc, hbs, rc);
+}
+
+static void heartbeat_timer_teardown(libxl__gc *gc,
+                                     libxl__remus_heartbeat_state *hbs)
+{
+    libxl__ev_time_deregister(gc, &hbs->timeout);
+}
+
+#endif /* __linux__ */
+
+/*----- common -----*/
+
+void libxl__remus_heartbeat_init(libxl__remus_heartbeat_state *hbs)
+{
+    hbs->fd = -1;
+    hbs->timerfd = -1;
+    libxl__ev_fd_init(&hbs->efd);
+    libxl__ev_fd_init(&hbs->timer_efd);
+    libxl__ev_time_init(&hbs->timeout);
+}
+
+void libxl__remus_heartbeat_stop(libxl__gc *gc,
+                                 libxl__remus_heartbeat_state *hbs)
+{
+    heartbeat_timer_teardown(gc, hbs);
+    libxl__ev_fd_deregister(gc, &hbs->efd);
+    if (hbs->fd >= 0) {
+        close(hbs->fd);
+        hbs->fd = -1;
+    }
+}
+
+static int heartbeat_socket(libxl__gc *gc, libxl__remus_heartbeat_state *hbs,
+                            const char *host)
+{
+    struct addrinfo hints, *res = NULL;
+    const char *port = GCSPRINTF("%d", hbs->port);
+    int r, rc;
+
+    if (hbs->port <= 0 || hbs->port > 65535 || hbs->period_us <= 0 ||
+        hbs->period_us > HEARTBEAT_PERIOD_MAX_US) {
+        LOGD(ERROR, hbs->domid, "heartbeat: bad port %d or period %dus",
+             hbs->port, hbs->period_us);
+        return ERROR_INVAL;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = host ? AI_ADDRCONFIG : AI_PASSIVE;
+
+    r = getaddrinfo(host, port, &hints, &res);
+    if (r) {
+        LOGD(ERROR, hbs->domid, "heartbeat: cannot resolve %s:%s: %s",
+             host ? host : "*", port, gai_strerror(r));
+        return ERROR_FAIL;
+    }
+
+    hbs->fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (hbs->fd < 0) {
+        LOGED(ERROR, hbs->domid, "heartbeat: failed to create socket");
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    rc = libxl_fd_set_cloexec(CTX, hbs->fd, 1);
+    if (!rc) rc = libxl_fd_set_nonblock(CTX, hbs->fd, 1);
+    if (rc) goto out;
+
+    if (host)
+        r = connect(hbs->fd, res->ai_addr, res->ai_addrlen);
+    else
+        r = bind(hbs->fd, res->ai_addr, res->ai_addrlen);
+    if (r) {
+        LOGED(ERROR, hbs->domid, "heartbeat: failed to %s %s:%s",
+              host ? "connect to" : "bind", host ? host : "*", port);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    rc = 0;
+
+ out:
+    freeaddrinfo(res);
+    return rc;
+}
+
+/*----- sender -----*/
+
+static void heartbeat_send(libxl__egc *egc, libxl__remus_heartbeat_state *hbs)
+{
+    STATE_AO_GC(hbs->ao);
+    struct heartbeat_msg msg;
+
+    msg.magic = htonl(HEARTBEAT_MAGIC);
+    msg.seq = htonl(hbs->seq++);
+    msg.nonce_hi = htonl(hbs->nonce >> 32);
+    msg.nonce_lo = htonl(hbs->nonce);
+
+    /*
+     * A lost or refused beat is not an error: the receiver may not be
+     * listening yet, and the point of the exercise is that it notices
+     * when beats stop arriving.
+     */
+    if (send(hbs->fd, &msg, sizeof(msg), 0) < 0 &&
+        errno != EAGAIN && errno != EWOULDBLOCK &&
+        errno != ECONNREFUSED && errno != EINTR)
+        LOGED(DEBUG, hbs->domid, "heartbeat: send failed");
+}
+
+int libxl__remus_heartbeat_send_start(libxl__gc *gc,
+                                      libxl__remus_heartbeat_state *hbs)
+{
+    int rc;
+
+    hbs->seq = 0;
+
+    rc = heartbeat_socket(gc, hbs, hbs->host);
+    if (rc) goto out;
+
+    rc = heartbeat_timer_setup(gc, hbs);
+    if (rc) goto out;
+
+    rc = heartbeat_timer_arm(gc, hbs, hbs->period_us, true);
+    if (rc) goto out;
+
+    LOGD(DEBUG, hbs->domid, "heartbeat: sending to %s:%d every %dus",
+         hbs->host, hbs->port, hbs->period_us);
+    return 0;
+
+ out:
+    libxl__remus_heartbeat_stop(gc, hbs);
+    return rc;
+}
+
+/*----- receiver -----*/
+
+/* Whether two addresses are the same host, ports aside. */
+static bool heartbeat_same_host(const struct sockaddr *a,
+                                const struct sockaddr *b)
+{
+    const struct sockaddr_in *a4, *b4;
+    const struct sockaddr_in6 *a6, *b6;
+
+    if (a->sa_family != b->sa_family)
+        return false;
+
+    switch (a->sa_family) {
+    case AF_INET:
+        a4 = (const void *)a;
+        b4 = (const void *)b;
+        return a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+    case AF_INET6:
+        a6 = (const void *)a;
+        b6 = (const void *)b;
+        return !memcmp(&a6->sin6_addr, &b6->sin6_addr,
+                       sizeof(a6->sin6_addr));
+    default:
+        return false;
+    }
+}
+
+/* Whether a datagram is a beat we should believe. */
+static bool heartbeat_valid(libxl__gc *gc, libxl__remus_heartbeat_state *hbs,
+                            const struct heartbeat_msg *msg,
+                            const struct sockaddr_storage *from,
+                            socklen_t fromlen)
+{
+    uint32_t seq = ntohl(msg->seq);
+
+    if (ntohl(msg->magic) != HEARTBEAT_MAGIC ||
+        ntohl(msg->nonce_hi) != (uint32_t)(hbs->nonce >> 32) ||
+        ntohl(msg->nonce_lo) != (uint32_t)hbs->nonce)
+        return false;
+
+    if (hbs->peer_len) {
+        /* Only the primary's own socket, once we have heard from it. */
+        if (hbs->beats ? (fromlen != hbs->peer_len ||
+                          memcmp(from, &hbs->peer, fromlen))
+                       : !heartbeat_same_host((const void *)from,
+                                              (const void *)&hbs->peer))
+            return false;
+    }
+
+    /* Serial number arithmetic, so that it may wrap. */
+    if (hbs->beats && (int32_t)(seq - hbs->seq) <= 0)
+        return false;
+
+    if (!hbs->beats) {
+        memcpy(&hbs->peer, from, fromlen);
+        hbs->peer_len = fromlen;
+    }
+    hbs->seq = seq;
+    return true;
+}
+
+static void heartbeat_readable(libxl__egc *egc, libxl__ev_fd *ev,
+                               int fd, short events, short revents)
+{
+    libxl__remus_heartbeat_state *hbs = CONTAINER_OF(ev, *hbs, efd);
+    STATE_AO_GC(hbs->ao);
+    struct heartbeat_msg msg;
+    struct sockaddr_storage from;
+    socklen_t fromlen;
+    bool beat = false;
+    ssize_t r;
+    int rc;
+
+    /* Drain everything queued; one timer update covers the lot. */
+    for (;;) {
+        fromlen = sizeof(from);
+        r = recvfrom(fd, &msg, sizeof(msg), 0, (struct sockaddr *)&from,
+                     &fromlen);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            LOGED(ERROR, hbs->domid, "heartbeat: receive failed");
+            heartbeat_failed(egc, hbs, ERROR_FAIL);
+            return;
+        }
+
+        if (r != sizeof(msg) || fromlen > sizeof(from) ||
+            !heartbeat_valid(gc, hbs, &msg, &from, fromlen)) {
+            hbs->rejected++;
+            continue;
+        }
+
+        hbs->beats++;
+        beat = true;
+    }
+
+    if (!beat)
+        return;
+
+    rc = libxl__gettimeofday(gc, &hbs->last_beat);
+    if (!rc)
+        rc = heartbeat_timer_arm(gc, hbs,
+                                 (uint64_t)hbs->period_us * hbs->misses,
+                                 false);
+    if (rc)
+        heartbeat_failed(egc, hbs, rc);
+}
+
+/* The primary's address, if we have been told it. */
+static int heartbeat_peer(libxl__gc *gc, libxl__remus_heartbeat_state *hbs)
+{
+    struct addrinfo hints, *res = NULL;
+    int r;
+
+    hbs->peer_len = 0;
+    if (!hbs->host)
+        return 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICHOST;
+
+    r = getaddrinfo(hbs->host, NULL, &hints, &res);
+    if (r) {
+        LOGD(ERROR, hbs->domid, "heartbeat: bad primary address %s: %s",
+             hbs->host, gai_strerror(r));
+        return ERROR_INVAL;
+    }
+
+    memcpy(&hbs->peer, res->ai_addr, res->ai_addrlen);
+    hbs->peer_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+int libxl__remus_heartbeat_recv_start(libxl__gc *gc,
+                                      libxl__remus_heartbeat_state *hbs)
+{
+    int rc;
+
+    if (hbs->misses <= 0 || hbs->misses > HEARTBEAT_MISSES_MAX) {
+        LOGD(ERROR, hbs->domid, "heartbeat: bad miss threshold %d",
+             hbs->misses);
+        return ERROR_INVAL;
+    }
+
+    hbs->beats = 0;
+    hbs->rejected = 0;
+    hbs->seq = 0;
+
+    rc = heartbeat_peer(gc, hbs);
+    if (rc) return rc;
+
+    rc = heartbeat_socket(gc, hbs, NULL);
+    if (rc) goto out;
+
+    rc = heartbeat_timer_setup(gc, hbs);
+    if (rc) goto out;
+
+    /* The deadline is only armed once the first beat has arrived. */
+    rc = libxl__ev_fd_register(gc, &hbs->efd, heartbeat_readable,
+                               hbs->fd, POLLIN);
+    if (rc) goto out;
+
+    LOGD(DEBUG, hbs->domid, "heartbeat: listening on port %d for %s, "
+         "failing after %d missed beats of %dus",
+         hbs->port, hbs->host ?: "the first primary heard",
+         hbs->misses, hbs->period_us);
+    return 0;
+
+ out:
+    libxl__remus_heartbeat_stop(gc, hbs);
+    return rc;
+}
+
+/*----- timer expiry -----*/
+
+static void heartbeat_timer_fired(libxl__egc *egc,
+                                  libxl__remus_heartbeat_state *hbs)
+{
+    STATE_AO_GC(hbs->ao);
+    struct timeval now;
+
+    if (!libxl__ev_fd_isregistered(&hbs->efd)) {
+        /* Sender: time for the next beat. */
+        heartbeat_send(egc, hbs);
+        heartbeat_timer_rearm_periodic(egc, hbs);
+        return;
+    }
+
+    /* Receiver: the deadline passed without a beat. */
+    if (!libxl__gettimeofday(gc, &now))
+        LOGD(WARN, hbs->domid, "heartbeat: no beat from primary for %ldus "
+             "(last seq %u, %"PRIu64" received, %"PRIu64" rejected), "
+             "failing over",
+             (long)((now.tv_sec - hbs->last_beat.tv_sec) * 1000000L +
+                    (now.tv_usec - hbs->last_beat.tv_usec)),
+             hbs->seq, hbs->beats, hbs->rejected);
+
+    heartbeat_failed(egc, hbs, ERROR_TIMEDOUT);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2017
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#include "libxl_osdeps.h" /* must come before any other headers */
+
+#include "libxl_internal.h"
+
+/*
+ * Every checkpoint has a slot in rs->stats, indexed by its epoch, which is
+ * filled in phase by phase as the checkpoint goes through libxl, libxc and
+ * the devices; rs->stats_mark is the start of the phase being timed.  Once
+ * the checkpoint is committed, and acknowledged with output_ack, its slot
+ * is reported in the debug log and, with stats_path set, as a line in that
+ * file.  The file is written without blocking, and a line which does not
+ * fit is dropped and counted, as is a slot which is reused before it could
+ * be reported.  Everything here runs in the event loop, so the ring needs
+ * no locking.
+ */
+
+int libxl__remus_stats_setup(libxl__gc *gc, libxl__domain_save_state *dss)
+{
+    libxl__remus_state *const rs = &dss->rs;
+    const char *const path = dss->remus->stats_path;
+    int fd;
+
+    memset(rs->stats, 0, sizeof(rs->stats));
+    rs->stats_cons = dss->cpsremus_epoch + 1;
+    rs->stats_dropped = 0;
+    memset(&rs->stats_mark, 0, sizeof(rs->stats_mark));
+
+    if (!path)
+        return 0;
+
+    libxl__carefd_begin();
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK, 0644);
+    rs->stats_fd = libxl__carefd_opened(CTX, fd);
+    if (!rs->stats_fd) {
+        LOGED(ERROR, dss->domid, "Remus: failed to open %s", path);
+        return ERROR_FAIL;
+    }
+
+    return 0;
+}
+
+void libxl__remus_stats_teardown(libxl__domain_save_state *dss)
+{
+    libxl__carefd_close(dss->rs.stats_fd);
+    dss->rs.stats_fd = NULL;
+}
+
+uint32_t libxl__remus_stats_between(const struct timespec *from,
+                                    const struct timespec *to)
+{
+    int64_t us = (int64_t)(to->tv_sec - from->tv_sec) * 1000000 +
+                 (to->tv_nsec - from->tv_nsec) / 1000;
+
+    return us < 0 ? 0 : min(us, (int64_t)UINT32_MAX);
+}
+
+/* Microseconds since *since, which is moved on to now. */
+uint32_t libxl__remus_stats_lap(struct timespec *since)
+{
+    struct timespec now;
+    uint32_t us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = libxl__remus_stats_between(since, &now);
+    *since = now;
+    return us;
+}
+
+/* The slot of epoch, or NULL if it has been reused already. */
+libxl__remus_epoch_stats *libxl__remus_stats_epoch(libxl__remus_state *rs,
+                                                   uint64_t epoch)
+{
+    libxl__remus_epoch_stats *stats =
+        &rs->stats[epoch & (LIBXL__REMUS_STATS_RING - 1)];
+
+    return stats->epoch == epoch ? stats : NULL;
+}
+
+static void remus_stats_write(libxl__gc *gc, libxl__domain_save_state *dss,
+                              const libxl__remus_epoch_stats *stats)
+{
+    libxl__remus_state *const rs = &dss->rs;
+    char line[512];
+    int len;
+
+    len = snprintf(line, sizeof(line), "domid=%"PRIu32" epoch=%"PRIu64
+                   " trigger_us=%"PRIu32" suspend_us=%"PRIu32
+                   " postsuspend_us=%"PRIu32" bitmap_us=%"PRIu32
+                   " send_us=%"PRIu32" resume_us=%"PRIu32" commit_us=%"PRIu32
+                   " ack_us=%"PRIu32" pages=%"PRIu32" bytes=%"PRIu64
+                   " dropped=%"PRIu64"\n",
+                   dss->domid, stats->epoch, stats->trigger_us,
+                   stats->suspend_us, stats->postsuspend_us,
+                   stats->bitmap_us, stats->send_us, stats->resume_us,
+                   stats->commit_us, stats->ack_us, stats->pages,
+                   stats->bytes, rs->stats_dropped);
+
+    LOGD(DEBUG, dss->domid, "Remus: checkpoint %.*s", len - 1, line);
+
+    if (!rs->stats_fd)
+        return;
+
+    if (write(libxl__carefd_fd(rs->stats_fd), line, len) != len)
+        rs->stats_dropped++;
+}
+
+/* Reports every checkpoint which is complete, in order. */
+void libxl__remus_stats_report(libxl__gc *gc, libxl__domain_save_state *dss)
+{
+    libxl__remus_state *const rs = &dss->rs;
+    const uint64_t last = dss->cpsremus_epoch;
+    libxl__remus_epoch_stats *stats;
+
+    if (last >= rs->stats_cons + LIBXL__REMUS_STATS_RING) {
+        rs->stats_dropped += last + 1 - LIBXL__REMUS_STATS_RING -
+                             rs->stats_cons;
+        rs->stats_cons = last + 1 - LIBXL__REMUS_STATS_RING;
+    }
+
+    while (rs->stats_cons <= last) {
+        stats = libxl__remus_stats_epoch(rs, rs->stats_cons);
+        if (!stats || !stats->committed || !stats->acked)
+            break;
+        remus_stats_write(gc, dss, stats);
+        rs->stats_cons++;
+    }
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,385 @@
+/*
+ * Copyright (C) 2017
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#include "libxl_osdeps.h" /* must come before any other headers */
+
+#include "libxl_internal.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*
+ * The backup starts listening while it sets up its end of Remus, which
+ * may be a little after the primary has started, so a refused connection
+ * is retried for a while.
+ */
+#define STRIPES_RETRY_MS 100
+#define STRIPES_CONNECT_TIMEOUT_MS 30000
+
+void libxl__remus_stripes_init(libxl__remus_stripes_state *ss)
+{
+    ss->fds = NULL;
+    ss->listen_fd = -1;
+    ss->connected = 0;
+    libxl__ev_fd_init(&ss->efd);
+    libxl__ev_time_init(&ss->retry);
+    libxl__ev_time_init(&ss->timeout);
+}
+
+void libxl__remus_stripes_stop(libxl__gc *gc, libxl__remus_stripes_state *ss)
+{
+    int i;
+
+    libxl__ev_fd_deregister(gc, &ss->efd);
+    libxl__ev_time_deregister(gc, &ss->retry);
+    libxl__ev_time_deregister(gc, &ss->timeout);
+
+    if (ss->listen_fd >= 0) {
+        close(ss->listen_fd);
+        ss->listen_fd = -1;
+    }
+
+    for (i = 0; ss->fds && i < ss->nr; i++) {
+        if (ss->fds[i] >= 0) {
+            close(ss->fds[i]);
+            ss->fds[i] = -1;
+        }
+    }
+    ss->connected = 0;
+}
+
+/*
+ * The fds are used by the helper with blocking I/O.  Each carries the
+ * end of a checkpoint as a small record after the bulk of it, which must
+ * not wait for Nagle.
+ */
+static int stripe_ready(libxl__gc *gc, libxl__remus_stripes_state *ss,
+                        int fd)
+{
+    int one = 1, rc;
+
+    rc = libxl_fd_set_cloexec(CTX, fd, 1);
+    if (!rc) rc = libxl_fd_set_nonblock(CTX, fd, 0);
+    if (rc) return rc;
+
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)))
+        LOGED(WARN, ss->domid, "Remus: failed to set TCP_NODELAY on stripe");
+
+    return 0;
+}
+
+/*----- connecting, on the primary -----*/
+
+static void stripes_connect_next(libxl__egc *egc,
+                                 libxl__remus_stripes_state *ss);
+static void stripes_retry_fired(libxl__egc *egc, libxl__ev_time *ev,
+                                const struct timeval *requested_abs,
+                                int rc);
+
+static void stripes_connect_done(libxl__egc *egc,
+                                 libxl__remus_stripes_state *ss, int rc)
+{
+    STATE_AO_GC(ss->ao);
+
+    libxl__ev_fd_deregister(gc, &ss->efd);
+    libxl__ev_time_deregister(gc, &ss->retry);
+    libxl__ev_time_deregister(gc, &ss->timeout);
+
+    if (rc)
+        libxl__remus_stripes_stop(gc, ss);
+    else
+        LOGD(DEBUG, ss->domid, "Remus: %d stripes connected to %s:%d",
+             ss->nr, ss->host, ss->port);
+
+    ss->callback(egc, ss, rc);
+}
+
+static void stripes_retry(libxl__egc *egc, libxl__remus_stripes_state *ss)
+{
+    STATE_AO_GC(ss->ao);
+    int rc;
+
+    close(ss->fds[ss->connected]);
+    ss->fds[ss->connected] = -1;
+
+    rc = libxl__ev_time_register_rel(ao, &ss->retry, stripes_retry_fired,
+                                     STRIPES_RETRY_MS);
+    if (rc)
+        stripes_connect_done(egc, ss, rc);
+}
+
+static void stripes_writable(libxl__egc *egc, libxl__ev_fd *ev,
+                             int fd, short events, short revents)
+{
+    libxl__remus_stripes_state *ss = CONTAINER_OF(ev, *ss, efd);
+    STATE_AO_GC(ss->ao);
+    socklen_t len = sizeof(int);
+    int err = 0, rc;
+
+    libxl__ev_fd_deregister(gc, &ss->efd);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len))
+        err = errno;
+
+    if (err == ECONNREFUSED) {
+        stripes_retry(egc, ss);
+        return;
+    }
+
+    if (err) {
+        errno = err;
+        LOGED(ERROR, ss->domid, "Remus: failed to connect stripe %d to %s:%d",
+              ss->connected, ss->host, ss->port);
+        stripes_connect_done(egc, ss, ERROR_FAIL);
+        return;
+    }
+
+    rc = stripe_ready(gc, ss, fd);
+    if (rc) {
+        stripes_connect_done(egc, ss, rc);
+        return;
+    }
+
+    ss->connected++;
+    stripes_connect_next(egc, ss);
+}
+
+static void stripes_retry_fired(libxl__egc *egc, libxl__ev_time *ev,
+                                const struct timeval *requested_abs,
+                                int rc)
+{
+    libxl__remus_stripes_state *ss = CONTAINER_OF(ev, *ss, retry);
+
+    if (rc != ERROR_TIMEDOUT) {
+        stripes_connect_done(egc, ss, rc);
+        return;
+    }
+
+    stripes_connect_next(egc, ss);
+}
+
+static void stripes_timedout(libxl__egc *egc, libxl__ev_time *ev,
+                             const struct timeval *requested_abs, int rc)
+{
+    libxl__remus_stripes_state *ss = CONTAINER_OF(ev, *ss, timeout);
+    STATE_AO_GC(ss->ao);
+
+    if (rc == ERROR_TIMEDOUT)
+        LOGD(ERROR, ss->domid, "Remus: timed out connecting stripes to %s:%d"
+             " (%d of %d connected)", ss->host, ss->port, ss->connected,
+             ss->nr);
+
+    stripes_connect_done(egc, ss, rc);
+}
+
+static void stripes_connect_next(libxl__egc *egc,
+                                 libxl__remus_stripes_state *ss)
+{
+    STATE_AO_GC(ss->ao);
+    int fd, rc;
+
+    while (ss->connected < ss->nr) {
+        fd = socket(ss->addr.ss_family, SOCK_STREAM, 0);
+        if (fd < 0) {
+            LOGED(ERROR, ss->domid, "Remus: failed to create socket");
+            rc = ERROR_FAIL;
+            goto out;
+        }
+        ss->fds[ss->connected] = fd;
+
+        rc = libxl_fd_set_cloexec(CTX, fd, 1);
+        if (!rc) rc = libxl_fd_set_nonblock(CTX, fd, 1);
+        if (rc) goto out;
+
+        if (!connect(fd, (struct sockaddr *)&ss->addr, ss->addrlen)) {
+            rc = stripe_ready(gc, ss, fd);
+            if (rc) goto out;
+            ss->connected++;
+            continue;
+        }
+
+        if (errno == EINPROGRESS) {
+            rc = libxl__ev_fd_register(gc, &ss->efd, stripes_writable,
+                                       fd, POLLOUT);
+            if (rc) goto out;
+            return;
+        }
+
+        if (errno == ECONNREFUSED) {
+            stripes_retry(egc, ss);
+            return;
+        }
+
+        LOGED(ERROR, ss->domid, "Remus: failed to connect stripe %d to %s:%d",
+              ss->connected, ss->host, ss->port);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    rc = 0;
+
+ out:
+    stripes_connect_done(egc, ss, rc);
+}
+
+void libxl__remus_stripes_connect(libxl__egc *egc,
+                                  libxl__remus_stripes_state *ss)
+{
+    STATE_AO_GC(ss->ao);
+    struct addrinfo hints, *res = NULL;
+    const char *port = GCSPRINTF("%d", ss->port);
+    int i, r, rc;
+
+    if (ss->port <= 0 || ss->port > 65535 || ss->nr <= 0) {
+        LOGD(ERROR, ss->domid, "Remus: bad stripe port %d or count %d",
+             ss->port, ss->nr);
+        rc = ERROR_INVAL;
+        goto out;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    r = getaddrinfo(ss->host, port, &hints, &res);
+    if (r) {
+        LOGD(ERROR, ss->domid, "Remus: cannot resolve %s:%s: %s",
+             ss->host, port, gai_strerror(r));
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    assert(res->ai_addrlen <= sizeof(ss->addr));
+    memcpy(&ss->addr, res->ai_addr, res->ai_addrlen);
+    ss->addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    GCNEW_ARRAY(ss->fds, ss->nr);
+    for (i = 0; i < ss->nr; i++)
+        ss->fds[i] = -1;
+    ss->connected = 0;
+
+    rc = libxl__ev_time_register_rel(ao, &ss->timeout, stripes_timedout,
+                                     STRIPES_CONNECT_TIMEOUT_MS);
+    if (rc) goto out;
+
+    stripes_connect_next(egc, ss);
+    return;
+
+ out:
+    stripes_connect_done(egc, ss, rc);
+}
+
+/*----- listening and accepting, on the backup -----*/
+
+int libxl__remus_stripes_listen(libxl__gc *gc, libxl__remus_stripes_state *ss)
+{
+    struct addrinfo hints, *res = NULL;
+    const char *port = GCSPRINTF("%d", ss->port);
+    int one = 1, i, r, rc;
+
+    if (ss->port <= 0 || ss->port > 65535 || ss->nr <= 0) {
+        LOGD(ERROR, ss->domid, "Remus: bad stripe port %d or count %d",
+             ss->port, ss->nr);
+        return ERROR_INVAL;
+    }
+
+    GCNEW_ARRAY(ss->fds, ss->nr);
+    for (i = 0; i < ss->nr; i++)
+        ss->fds[i] = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    r = getaddrinfo(NULL, port, &hints, &res);
+    if (r) {
+        LOGD(ERROR, ss->domid, "Remus: cannot resolve *:%s: %s",
+             port, gai_strerror(r));
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    ss->listen_fd = socket(res->ai_family, res->ai_socktype,
+                           res->ai_protocol);
+    if (ss->listen_fd < 0) {
+        LOGED(ERROR, ss->domid, "Remus: failed to create socket");
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    rc = libxl_fd_set_cloexec(CTX, ss->listen_fd, 1);
+    if (!rc) rc = libxl_fd_set_nonblock(CTX, ss->listen_fd, 1);
+    if (rc) goto out;
+
+    setsockopt(ss->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(ss->listen_fd, res->ai_addr, res->ai_addrlen) ||
+        listen(ss->listen_fd, ss->nr)) {
+        LOGED(ERROR, ss->domid, "Remus: failed to listen on port %s", port);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    LOGD(DEBUG, ss->domid, "Remus: listening on port %d for %d stripes",
+         ss->port, ss->nr);
+    rc = 0;
+
+ out:
+    if (res)
+        freeaddrinfo(res);
+    if (rc)
+        libxl__remus_stripes_stop(gc, ss);
+    return rc;
+}
+
+int libxl__remus_stripes_accept(libxl__gc *gc, libxl__remus_stripes_state *ss)
+{
+    int fd, rc;
+
+    while (ss->connected < ss->nr) {
+        fd = accept(ss->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                LOGD(ERROR, ss->domid, "Remus: only %d of %d stripes"
+                     " connected", ss->connected, ss->nr);
+            else
+                LOGED(ERROR, ss->domid, "Remus: failed to accept stripe");
+            rc = ERROR_FAIL;
+            goto out;
+        }
+        ss->fds[ss->connected++] = fd;
+
+        rc = stripe_ready(gc, ss, fd);
+        if (rc) goto out;
+    }
+
+    close(ss->listen_fd);
+    ss->listen_fd = -1;
+    return 0;
+
+ out:
+    libxl__remus_stripes_stop(gc, ss);
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -12,12 +12,12 @@
  * GNU Lesser General Public License for more details.
  */
 
-#define _GNU_SOURCE
-#include <sys/stat.h>
-
 #include "libxl_osdeps.h"
 
 #include "libxl_internal.h"
+#include "libxl_save_shm.h"
+
+#include <sys/mman.h>
 
 /* stream_fd is as from the caller (eventually, the application).
  * It may be 0, 1 or 2, in which case we need to dup it elsewhere.
@@ -41,6 +41,10 @@ static void helper_stdout_readable(libxl__egc *egc, libxl__ev_fd *ev,
 static void helper_exited(libxl__egc *egc, libxl__ev_child *ch,
                           pid_t pid, int status);
 static void helper_done(libxl__egc *egc, libxl__save_helper_state *shs);
+static int helper_shm_setup(libxl__gc *gc, libxl__save_helper_state *shs,
+                            libxl__carefd **fd_r);
+static void helper_shm_readable(libxl__egc *egc,
+                                libxl__save_helper_state *shs, int fd);
 
 /*----- entrypoints -----*/
 
@@ -56,20 +60,35 @@ void libxl__xc_domain_restore(libxl__egc *egc, libxl__domain_create_state *dcs,
     const int send_back_fd = dcs->send_back_fd;
     libxl__domain_build_state *const state = &dcs->build_state;
 
+    const libxl__remus_stripes_state *const ss = &dcs->remus_stripes;
+    const int nr_stripes = ss->connected;
+
     unsigned cbflags =
         libxl__srm_callout_enumcallbacks_restore(&shs->callbacks.restore.a);
 
-    const unsigned long argnums[] = {
-        domid,
-        state->store_port,
-        state->store_domid, state->console_port,
-        state->console_domid,
-        hvm, pae,
-        cbflags, dcs->restore_params.checkpointed_stream,
-    };
+    unsigned long argnums[13 + nr_stripes];
+    int i, n = 0;
+
+    argnums[n++] = domid;
+    argnums[n++] = state->store_port;
+    argnums[n++] = state->store_domid;
+    argnums[n++] = state->console_port;
+    argnums[n++] = state->console_domid;
+    argnums[n++] = hvm;
+    argnums[n++] = pae;
+    argnums[n++] = cbflags;
+    argnums[n++] = dcs->restore_params.checkpointed_stream;
+    argnums[n++] = dcs->restore_params.liveness_timeout;
+    argnums[n++] = max(dcs->restore_params.history_epochs, 0);
+    argnums[n++] = max(dcs->restore_params.history_mb, 0);
+    argnums[n++] = nr_stripes;
+    for (i = 0; i < nr_stripes; i++)
+        argnums[n++] = ss->fds[i];
+    assert(n == ARRAY_SIZE(argnums));
 
     shs->ao = ao;
     shs->domid = domid;
+    shs->use_shm = false;
     shs->recv_callback = libxl__srm_callout_received_restore;
     if (dcs->restore_params.checkpointed_stream ==
         LIBXL_CHECKPOINTED_STREAM_COLO)
@@ -79,7 +98,8 @@ void libxl__xc_domain_restore(libxl__egc *egc, libxl__domain_create_state *dcs,
     shs->caller_state = dcs;
     shs->need_results = 1;
 
-    run_helper(egc, shs, "--restore-domain", restore_fd, send_back_fd, 0, 0,
+    run_helper(egc, shs, "--restore-domain", restore_fd, send_back_fd,
+               ss->fds, nr_stripes,
                argnums, ARRAY_SIZE(argnums));
 }
 
@@ -88,23 +108,40 @@ void libxl__xc_domain_save(libxl__egc *egc, libxl__domain_save_state *dss,
 {
     STATE_AO_GC(dss->ao);
 
+    const bool remus =
+        dss->checkpointed_stream == LIBXL_CHECKPOINTED_STREAM_REMUS;
+    /* Only Remus has dss->rs, see libxl__remus_setup */
+    const libxl__remus_stripes_state *const ss = remus ? &dss->rs.stripes
+                                                       : NULL;
+    const int nr_stripes = ss ? ss->connected : 0;
+
     unsigned cbflags =
         libxl__srm_callout_enumcallbacks_save(&shs->callbacks.save.a);
 
-    const unsigned long argnums[] = {
-        dss->domid, dss->xcflags, dss->hvm, cbflags,
-        dss->checkpointed_stream,
-    };
+    unsigned long argnums[7 + nr_stripes];
+    int i, n = 0;
+
+    argnums[n++] = dss->domid;
+    argnums[n++] = dss->xcflags;
+    argnums[n++] = dss->hvm;
+    argnums[n++] = cbflags;
+    argnums[n++] = dss->checkpointed_stream;
+    argnums[n++] = remus ? dss->cpsremus_skip_pfn : INVALID_MFN;
+    argnums[n++] = nr_stripes;
+    for (i = 0; i < nr_stripes; i++)
+        argnums[n++] = ss->fds[i];
+    assert(n == ARRAY_SIZE(argnums));
 
     shs->ao = ao;
     shs->domid = dss->domid;
+    shs->use_shm = dss->remus && libxl_defbool_val(dss->remus->fast_ipc);
     shs->recv_callback = libxl__srm_callout_received_save;
     shs->completion_callback = libxl__xc_domain_save_done;
     shs->caller_state = dss;
     shs->need_results = 0;
 
     run_helper(egc, shs, "--save-domain", dss->fd, dss->recv_fd,
-               NULL, 0,
+               nr_stripes ? ss->fds : NULL, nr_stripes,
                argnums, ARRAY_SIZE(argnums));
     return;
 }
@@ -123,6 +160,7 @@ void libxl__save_helper_init(libxl__save_helper_state *shs)
     libxl__ao_abortable_init(&shs->abrt);
     libxl__ev_fd_init(&shs->readable);
     libxl__ev_child_init(&shs->child);
+    shs->shm = NULL;
 }
 
 /*----- helper execution -----*/
@@ -145,15 +183,16 @@ static int dup_cloexec(libxl__gc *gc, int fd, const char *what)
 }
 
 /*
- * Both save and restore share four parameters:
+ * Both save and restore share five parameters:
  * 1) Path to libxl-save-helper.
  * 2) --[restore|save]-domain.
  * 3) stream file descriptor.
  * 4) back channel file descriptor.
+ * 5) control channel file descriptor, or 0 for none.
  * n) save/restore specific parameters.
- * 5) A \0 at the end.
+ * 6) A \0 at the end.
  */
-#define HELPER_NR_ARGS 5
+#define HELPER_NR_ARGS 6
 static void run_helper(libxl__egc *egc, libxl__save_helper_state *shs,
                        const char *mode_arg,
                        int stream_fd, int back_channel_fd,
@@ -167,6 +206,7 @@ static void run_helper(libxl__egc *egc, libxl__save_helper_state *shs,
 
     /* Resources we must free */
     libxl__carefd *childs_pipes[2] = { 0,0 };
+    libxl__carefd *shm_fd = 0;
 
     /* Convenience aliases */
     const uint32_t domid = shs->domid;
@@ -190,6 +230,7 @@ static void run_helper(libxl__egc *egc, libxl__save_helper_state *shs,
     *arg++ = mode_arg;
     const char **stream_fd_arg = arg++;
     const char **back_channel_fd_arg = arg++;
+    const char **shm_fd_arg = arg++;
     for (i=0; i<num_argnums; i++)
         *arg++ = GCSPRINTF("%lu", argnums[i]);
     *arg++ = 0;
@@ -212,6 +253,10 @@ static void run_helper(libxl__egc *egc, libxl__save_helper_state *shs,
     }
     libxl__carefd_unlock();
 
+    *shm_fd_arg = "0";
+    if (shs->use_shm && helper_shm_setup(gc, shs, &shm_fd))
+        LOGD(WARN, domid, "falling back to the pipe control channel");
+
     pid_t pid = libxl__ev_child_fork(gc, &shs->child, helper_exited);
     if (!pid) {
         stream_fd = dup_cloexec(gc, stream_fd, "migration stream fd");
@@ -228,6 +273,12 @@ static void run_helper(libxl__egc *egc, libxl__save_helper_state *shs,
                 libxl_fd_set_cloexec(CTX, preserve_fds[i], 0);
             }
 
+        if (shm_fd) {
+            assert(libxl__carefd_fd(shm_fd) > 2);
+            libxl_fd_set_cloexec(CTX, libxl__carefd_fd(shm_fd), 0);
+            *shm_fd_arg = GCSPRINTF("%d", libxl__carefd_fd(shm_fd));
+        }
+
         libxl__exec(gc,
                     libxl__carefd_fd(childs_pipes[0]),
                     libxl__carefd_fd(childs_pipes[1]),
@@ -235,33 +286,9 @@ static void run_helper(libxl__egc *egc, libxl__save_helper_state *shs,
                     args[0], (char**)args, 0);
     }
 
-    pid_t ppid = getppid();
-
-    struct stat stinfo;
-
-    if (stat("/tmp/cpsremus_fifo", &stinfo)) {
-      if (errno == ENOENT) {
-        int ret = mkfifo("/tmp/cpsremus_fifo", 0666);
-        LOGE(WARN, "created fifo with return code %i", ret);
-      }
-    } else {
-     if (!S_ISFIFO(stinfo.st_mode))
-        LOGE(WARN, "cspremus_fifo is not a named pipe.");
-    }
-
-    int fifo_fd = open("/tmp/cpsremus_fifo", O_WRONLY|O_NONBLOCK);
-    char *pid_s; 
-    int pid_s_len = asprintf(&pid_s,"%i#%i",ppid, shs->domid);
-
-    if (write(fifo_fd, (void*)pid_s, pid_s_len+1) != pid_s_len+1) {
-        LOGE(WARN, "unable to write pids to fifo file.");
-   }
-
-    close(fifo_fd);
-
-    LOGE(WARN,"PID of save_helper is %i\n", (int)pid);
     libxl__carefd_close(childs_pipes[0]);
     libxl__carefd_close(childs_pipes[1]);
+    libxl__carefd_close(shm_fd);
 
     rc = libxl__ev_fd_register(gc, &shs->readable, helper_stdout_readable,
                                libxl__carefd_fd(shs->pipes[1]), POLLIN|POLLPRI);
@@ -271,9 +298,121 @@ static void run_helper(libxl__egc *egc, libxl__save_helper_state *shs,
  out:
     libxl__carefd_close(childs_pipes[0]);
     libxl__carefd_close(childs_pipes[1]);
+    libxl__carefd_close(shm_fd);
     helper_failed(egc, shs, rc);;
 }
 
+/*
+ * The shared memory control channel, see libxl_save_shm.h.  It lives in
+ * an unlinked file, which the helper inherits and maps.
+ */
+static int helper_shm_setup(libxl__gc *gc, libxl__save_helper_state *shs,
+                            libxl__carefd **fd_r)
+{
+    char *path = GCSPRINTF("%s/save-helper-shm.XXXXXX", libxl__run_dir_path());
+    libxl__carefd *cfd;
+    void *p;
+    int fd;
+
+    libxl__carefd_begin();
+    fd = mkstemp(path);
+    cfd = libxl__carefd_opened(CTX, fd);
+    if (fd < 0) {
+        LOGED(ERROR, shs->domid, "mkstemp %s failed", path);
+        return ERROR_FAIL;
+    }
+
+    if (unlink(path)) {
+        LOGED(ERROR, shs->domid, "unlink %s failed", path);
+        goto err;
+    }
+
+    if (ftruncate(fd, sizeof(libxl__save_shm))) {
+        LOGED(ERROR, shs->domid, "ftruncate %s failed", path);
+        goto err;
+    }
+
+    p = mmap(0, sizeof(libxl__save_shm), PROT_READ|PROT_WRITE, MAP_SHARED,
+             fd, 0);
+    if (p == MAP_FAILED) {
+        LOGED(ERROR, shs->domid, "mmap %s failed", path);
+        goto err;
+    }
+
+    shs->shm = p;
+    shs->shm->msg_bell = 1; /* we start out waiting */
+    *fd_r = cfd;
+    return 0;
+
+ err:
+    libxl__carefd_close(cfd);
+    return ERROR_FAIL;
+}
+
+/*
+ * The helper has rung.  Take everything there is, and ask for a doorbell
+ * again only once the ring is empty: until then the helper adds to it
+ * without one.  A stale doorbell just finds the ring empty.
+ */
+static void helper_shm_readable(libxl__egc *egc,
+                                libxl__save_helper_state *shs, int fd)
+{
+    STATE_AO_GC(shs->ao);
+    libxl__save_shm *const shm = shs->shm;
+    unsigned char bells[64];
+    uint32_t prod, cons;
+    uint16_t msglen;
+    ssize_t r;
+
+    r = read(fd, bells, sizeof(bells));
+    if (r < 0 && errno == EINTR)
+        return;
+    if (r <= 0) {
+        if (r < 0)
+            LOGED(ERROR, shs->domid, "read %s", shs->stdout_what);
+        else
+            LOGD(ERROR, shs->domid, "%s: unexpected eof", shs->stdout_what);
+        helper_failed(egc, shs, ERROR_FAIL);
+        return;
+    }
+
+    for (;;) {
+        cons = shm->cons;
+        prod = LIBXL__SAVE_SHM_READ(shm->prod);
+        xen_rmb();
+
+        if (prod == cons) {
+            if (LIBXL__SAVE_SHM_READ(shm->msg_bell))
+                return;
+            shm->msg_bell = 1;
+            xen_mb();
+            continue; /* did a message slip in unannounced? */
+        }
+
+        libxl__save_shm_get(shm, cons, &msglen, sizeof(msglen));
+        if (prod - cons > LIBXL_SAVE_SHM_RING_SIZE ||
+            prod - cons < sizeof(msglen) + msglen) {
+            LOGD(ERROR, shs->domid, "%s: corrupt control channel ring",
+                 shs->stdout_what);
+            helper_failed(egc, shs, ERROR_FAIL);
+            return;
+        }
+
+        unsigned char msg[msglen];
+        libxl__save_shm_get(shm, cons + sizeof(msglen), msg, msglen);
+        xen_mb();
+        shm->cons = cons + sizeof(msglen) + msglen;
+
+        shs->egc = egc;
+        shs->recv_callback(msg, msglen, shs);
+        shs->egc = 0;
+
+        /* Completed, or failed: the ring may be gone. */
+        if (!libxl__ev_fd_isregistered(&shs->readable))
+            return;
+    }
+}
+
 static void helper_failed(libxl__egc *egc, libxl__save_helper_state *shs,
                           int rc)
 {
@@ -314,6 +453,17 @@ void libxl__save_helper_abort(libxl__egc *egc,
     helper_stop(egc, &shs->abrt, ERROR_FAIL);
 }
 
+void libxl__save_helper_failover(libxl__egc *egc,
+                                 libxl__save_helper_state *shs)
+{
+    STATE_AO_GC(shs->ao);
+
+    if (!libxl__save_helper_inuse(shs))
+        return;
+
+    libxl__kill(gc, shs->child.pid, SIGUSR1, "restore helper (failover)");
+}
+
 static void helper_stdout_readable(libxl__egc *egc, libxl__ev_fd *ev,
                                    int fd, short events, short revents)
 {
@@ -331,6 +481,11 @@ static void helper_stdout_readable(libxl__egc *egc, libxl__ev_fd *ev,
         return;
     }
 
+    if (shs->shm) {
+        helper_shm_readable(egc, shs, fd);
+        return;
+    }
+
     uint16_t msglen;
     errnoval = libxl_read_exactly(CTX, fd, &msglen, sizeof(msglen),
                                   shs->stdout_what, "ipc msg header");
@@ -391,6 +546,10 @@ static void helper_done(libxl__egc *egc, libxl__save_helper_state *shs)
     libxl__ev_fd_deregister(gc, &shs->readable);
     libxl__carefd_close(shs->pipes[0]);  shs->pipes[0] = 0;
     libxl__carefd_close(shs->pipes[1]);  shs->pipes[1] = 0;
+    if (shs->shm) {
+        munmap(shs->shm, sizeof(libxl__save_shm));
+        shs->shm = NULL;
+    }
     assert(!libxl__save_helper_inuse(shs));
 
     shs->egc = egc;
@@ -420,11 +579,24 @@ void libxl__srm_callout_sendreply(int r, void *user)
     libxl__save_helper_state *shs = user;
     libxl__egc *egc = shs->egc;
     STATE_AO_GC(shs->ao);
+    static const unsigned char bell;
     int errnoval;
 
-    errnoval = libxl_write_exactly(CTX, libxl__carefd_fd(shs->pipes[0]),
-                                   &r, sizeof(r), shs->stdin_what,
-                                   "callback return value");
+    if (shs->shm) {
+        shs->shm->reply = r;
+        xen_wmb();
+        shs->shm->reply_seq++;
+        xen_mb();
+        if (!LIBXL__SAVE_SHM_READ(shs->shm->reply_bell))
+            return; /* the helper is still polling */
+        shs->shm->reply_bell = 0;
+        errnoval = libxl_write_exactly(CTX, libxl__carefd_fd(shs->pipes[0]),
+                                       &bell, 1, shs->stdin_what,
+                                       "callback reply doorbell");
+    } else
+        errnoval = libxl_write_exactly(CTX, libxl__carefd_fd(shs->pipes[0]),
+                                       &r, sizeof(r), shs->stdin_what,
+                                       "callback return value");
     if (errnoval)
         helper_failed(egc, shs, ERROR_FAIL);
 }
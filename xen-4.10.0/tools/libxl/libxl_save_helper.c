@@ -32,6 +32,14 @@
  * autogenerated functions can be used/provided directly.
  *
  * The actual messages are in the array @msgs in libxl_save_msgs_gen.pl
+ *
+ * If libxl passes a shared memory control channel, the messages and the
+ * replies go through that instead, and stdin and stdout only carry
+ * doorbells; see libxl_save_shm.h.
+ *
+ * libxc may log, or report a Remus checkpoint applied, from threads of
+ * its own, so messages are sent whole under a lock.  Only one thread at a
+ * time waits for a reply.
  */
 
 #include "libxl_osdeps.h"
@@ -42,6 +50,10 @@
 #include <inttypes.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "libxl.h"
 #include "libxl_utils.h"
@@ -49,6 +61,7 @@
 #include "xenctrl.h"
 #include "xenguest.h"
 #include "_libxl_save_msgs_helper.h"
+#include "libxl_save_shm.h"
 
 /*----- logger -----*/
 
@@ -90,6 +103,8 @@ static xentoollog_logger logger = {
 };
 static xc_interface *xch;
 static int io_fd;
+static libxl__save_shm *shm;
+static uint32_t shm_replies;
 
 /*----- error handling -----*/
 
@@ -158,17 +173,6 @@ static void save_signal_handler(int num)
     errno = esave;
 }
 
-static void remus_failover_handler(int sig)
-{
-    char cmd[30];
-    
-   sprintf(cmd, "trigger_failover.sh %i", (int)getpid());
-
-   if (system(cmd) == -1) {
-        perror("system");
-    }
-}
-
 static void setup_signals(void (*handler)(int))
 {
     struct sigaction sa;
@@ -184,16 +188,23 @@ static void setup_signals(void (*handler)(int))
     r = sigaction(SIGTERM, &sa, 0);
     if (r) fail(errno,"sigaction SIGTERM failed");
 
-    sa.sa_handler = remus_failover_handler;
-    sa.sa_flags = 0;
-    //sigemptyset(&sa.sa_mask);
+    /*
+     * SIGUSR1 is Remus failover: libxl has lost the primary and wants
+     * libxc to give up on the stream.  The same dup2 trick makes the
+     * next read see EOF.  SA_RESTART so that a read of libxl's callback
+     * replies is not disturbed, while a read of io_fd is restarted on
+     * /dev/null.
+     */
+    sa.sa_handler = save_signal_handler;
+    sa.sa_flags = SA_RESTART;
     r = sigaction(SIGUSR1, &sa, 0);
     if (r) fail(errno, "sigaction SIGUSR1 failed");
 
     sigemptyset(&spmask);
     sigaddset(&spmask,SIGTERM);
+    sigaddset(&spmask,SIGUSR1);
     r = sigprocmask(SIG_UNBLOCK,&spmask,0);
-    if (r) fail(errno,"sigprocmask unblock SIGTERM failed");
+    if (r) fail(errno,"sigprocmask unblock SIGTERM/SIGUSR1 failed");
 }
 
 /*----- helper functions called by autogenerated stubs -----*/
@@ -215,18 +226,123 @@ static void transmit(const unsigned char *msg, int len, void *user)
     }
 }
 
+/*----- shared memory control channel -----*/
+
+static void shm_setup(int fd)
+{
+    void *p;
+    int r;
+
+    if (!fd) return;
+
+    p = mmap(0, sizeof(*shm), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) fail(errno,"mmap control channel");
+    close(fd);
+    shm = p;
+
+    /* Doorbells are drained without blocking, see shm_getreply. */
+    r = fcntl(0, F_GETFL);
+    if (r < 0 || fcntl(0, F_SETFL, r | O_NONBLOCK))
+        fail(errno,"set stdin non-blocking");
+}
+
+static void shm_doorbell(void)
+{
+    static const unsigned char bell;
+    transmit(&bell, 1, 0);
+}
+
+static void shm_transmitmsg(const unsigned char *msg, uint16_t len)
+{
+    uint32_t prod = shm->prod, total = sizeof(len) + len;
+
+    while (LIBXL_SAVE_SHM_RING_SIZE -
+           (prod - LIBXL__SAVE_SHM_READ(shm->cons)) < total) {
+        /* libxl is behind; it has been rung, or is draining the ring */
+        usleep(100);
+    }
+    xen_mb();
+
+    libxl__save_shm_put(shm, prod, &len, sizeof(len));
+    libxl__save_shm_put(shm, prod + sizeof(len), msg, len);
+    xen_wmb();
+    shm->prod = prod + total;
+    xen_mb();
+
+    if (LIBXL__SAVE_SHM_READ(shm->msg_bell)) {
+        shm->msg_bell = 0;
+        shm_doorbell();
+    }
+}
+
+static uint64_t shm_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void shm_drain_doorbells(void)
+{
+    unsigned char buf[64];
+
+    for (;;) {
+        ssize_t r = read(0, buf, sizeof(buf));
+        if (r > 0) continue;
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && errno == EAGAIN) return;
+        exit(-2); /* eof or error */
+    }
+}
+
+static int shm_getreply(void)
+{
+    uint64_t start = shm_now_us();
+    struct pollfd pfd = { .fd = 0, .events = POLLIN };
+
+    while (LIBXL__SAVE_SHM_READ(shm->reply_seq) == shm_replies) {
+        if (shm_now_us() - start < LIBXL_SAVE_SHM_SPIN_US)
+            continue;
+        shm->reply_bell = 1;
+        xen_mb();
+        if (LIBXL__SAVE_SHM_READ(shm->reply_seq) != shm_replies)
+            break;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            fail(errno,"poll for callback reply");
+        shm_drain_doorbells();
+    }
+    /* A bell libxl rings anyway is drained before we next sleep. */
+    shm->reply_bell = 0;
+    xen_rmb();
+
+    shm_replies++;
+    return shm->reply;
+}
+
+/*----- helper functions called by autogenerated stubs, continued -----*/
+
+static pthread_mutex_t transmit_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void helper_transmitmsg(unsigned char *msg_freed, int len_in, void *user)
 {
     assert(len_in < 64*1024);
     uint16_t len = len_in;
-    transmit((const void*)&len, sizeof(len), user);
-    transmit(msg_freed, len, user);
+    pthread_mutex_lock(&transmit_lock);
+    if (shm) {
+        shm_transmitmsg(msg_freed, len);
+    } else {
+        transmit((const void*)&len, sizeof(len), user);
+        transmit(msg_freed, len, user);
+    }
+    pthread_mutex_unlock(&transmit_lock);
     free(msg_freed);
 }
 
 int helper_getreply(void *user)
 {
     int v;
+    if (shm) return shm_getreply();
     int r = read_exactly(0, &v, sizeof(v));
     if (r<=0) exit(-2);
     return v;
@@ -255,7 +371,7 @@ static struct restore_callbacks helper_restore_callbacks;
 
 int main(int argc, char **argv)
 {
-    int r;
+    int r, i;
     int send_back_fd, recv_fd;
 
 #define NEXTARG (++argv, assert(*argv), *argv)
@@ -267,26 +383,35 @@ int main(int argc, char **argv)
 
         io_fd =                             atoi(NEXTARG);
         recv_fd =                           atoi(NEXTARG);
+        int shm_fd =                        atoi(NEXTARG);
         uint32_t dom =                      strtoul(NEXTARG,0,10);
         uint32_t flags =                    strtoul(NEXTARG,0,10);
         int hvm =                           atoi(NEXTARG);
         unsigned cbflags =                  strtoul(NEXTARG,0,10);
         xc_migration_stream_t stream_type = strtoul(NEXTARG,0,10);
+        xen_pfn_t skip_pfn =                strtoul(NEXTARG,0,10);
+        unsigned nr_stripes =               strtoul(NEXTARG,0,10);
+        int stripe_fds[nr_stripes + 1];
+        for (i = 0; i < nr_stripes; i++)
+            stripe_fds[i] =                 atoi(NEXTARG);
         assert(!*++argv);
 
         helper_setcallbacks_save(&helper_save_callbacks, cbflags);
+        shm_setup(shm_fd);
 
         startup("save");
         setup_signals(save_signal_handler);
 
         r = xc_domain_save(xch, io_fd, dom, flags, &helper_save_callbacks,
-                           hvm, stream_type, recv_fd);
+                           hvm, stream_type, recv_fd, skip_pfn,
+                           stripe_fds, nr_stripes);
         complete(r);
 
     } else if (!strcmp(mode,"--restore-domain")) {
 
         io_fd =                             atoi(NEXTARG);
         send_back_fd =                      atoi(NEXTARG);
+        int shm_fd =                        atoi(NEXTARG);
         uint32_t dom =                      strtoul(NEXTARG,0,10);
         unsigned store_evtchn =             strtoul(NEXTARG,0,10);
         domid_t store_domid =               strtoul(NEXTARG,0,10);
@@ -296,9 +421,17 @@ int main(int argc, char **argv)
         unsigned int pae =                  strtoul(NEXTARG,0,10);
         unsigned cbflags =                  strtoul(NEXTARG,0,10);
         xc_migration_stream_t stream_type = strtoul(NEXTARG,0,10);
+        unsigned liveness_timeout =         strtoul(NEXTARG,0,10);
+        unsigned history_epochs =           strtoul(NEXTARG,0,10);
+        unsigned history_mb =               strtoul(NEXTARG,0,10);
+        unsigned nr_stripes =               strtoul(NEXTARG,0,10);
+        int stripe_fds[nr_stripes + 1];
+        for (i = 0; i < nr_stripes; i++)
+            stripe_fds[i] =                 atoi(NEXTARG);
         assert(!*++argv);
 
         helper_setcallbacks_restore(&helper_restore_callbacks, cbflags);
+        shm_setup(shm_fd);
 
         unsigned long store_mfn = 0;
         unsigned long console_mfn = 0;
@@ -310,7 +443,9 @@ int main(int argc, char **argv)
                               store_domid, console_evtchn, &console_mfn,
                               console_domid, hvm, pae,
                               stream_type,
-                              &helper_restore_callbacks, send_back_fd);
+                              &helper_restore_callbacks, send_back_fd,
+                              liveness_timeout, stripe_fds, nr_stripes,
+                              history_epochs, history_mb);
         helper_stub_restore_results(store_mfn,console_mfn,0);
         complete(r);
 
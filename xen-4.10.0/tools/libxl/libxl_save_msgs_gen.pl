@@ -33,6 +33,13 @@ our @msgs = (
                                               'xen_pfn_t', 'console_gfn'] ],
     [  9, 'srW',    "complete",              [qw(int retval
                                                  int errnoval)] ],
+    [ 10, 'scx',    "checkpoint_stats",      [qw(uint32_t pages
+                                                 uint64_t bytes
+                                                 uint32_t bitmap_us
+                                                 uint32_t send_us)] ],
+    [ 11, 'scxA',   "precopy_done", [] ],
+    [ 12, 'rcxA',   "rollback",              [qw(uint32_t available)] ],
+    [ 13, 'rcx',    "checkpoint_applied", [] ],
 );
 
 #----------------------------------------
@@ -141,7 +148,7 @@ static void bytes_put(unsigned char *const buf, int *len,
 
 END
 
-foreach my $simpletype (qw(int uint16_t uint32_t unsigned), 'unsigned long', 'xen_pfn_t') {
+foreach my $simpletype (qw(int uint16_t uint32_t uint64_t unsigned), 'unsigned long', 'xen_pfn_t') {
     my $typeid = typeid($simpletype);
     $out_body{'callout'} .= <<END;
 static int ${typeid}_get(const unsigned char **msg,
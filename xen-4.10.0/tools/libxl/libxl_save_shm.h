@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2017
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+/*
+ * Shared memory control channel between libxl and libxl-save-helper.
+ *
+ * Optionally, the helper's callback messages go through a ring in a
+ * shared mapping rather than down its stdout, and libxl's replies into a
+ * slot next to it.  The pipes then only carry doorbell bytes, and only to
+ * a side which has said that it is about to sleep: libxl sets msg_bell
+ * once it has drained the ring, and the helper reply_bell once it has
+ * polled the reply slot for a little while without luck.  Whoever finds
+ * the flag set after publishing clears it and rings.  Both sides check
+ * for work again after setting their flag, so nothing is missed, and a
+ * quick reply, or a message which libxl picks up while it is still
+ * draining, costs no system call at all.
+ *
+ * Messages are framed in the ring as they are on the pipe, see
+ * libxl_save_helper.c, and wrap around at its end.
+ */
+
+#ifndef LIBXL_SAVE_SHM_H
+#define LIBXL_SAVE_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* A power of two, and larger than any framed message. */
+#define LIBXL_SAVE_SHM_RING_SIZE (128 * 1024)
+
+/* How long the helper polls for a reply before it sleeps. */
+#define LIBXL_SAVE_SHM_SPIN_US   50
+
+typedef struct libxl__save_shm {
+    uint32_t prod;       /* bytes written to ring[], by the helper */
+    uint32_t cons;       /* bytes consumed from ring[], by libxl */
+    uint32_t reply_seq;  /* replies written to reply, by libxl */
+    int32_t reply;
+    uint32_t msg_bell;   /* libxl sleeps: ring after the next message */
+    uint32_t reply_bell; /* the helper sleeps: ring after the next reply */
+    uint8_t ring[LIBXL_SAVE_SHM_RING_SIZE];
+} libxl__save_shm;
+
+#define LIBXL__SAVE_SHM_READ(x) (*(volatile typeof(x) *)&(x))
+
+static inline void libxl__save_shm_put(libxl__save_shm *shm, uint32_t pos,
+                                       const void *data, uint32_t len)
+{
+    uint32_t off = pos & (LIBXL_SAVE_SHM_RING_SIZE - 1);
+    uint32_t first = LIBXL_SAVE_SHM_RING_SIZE - off;
+
+    if (first > len)
+        first = len;
+    memcpy(shm->ring + off, data, first);
+    memcpy(shm->ring, (const uint8_t *)data + first, len - first);
+}
+
+static inline void libxl__save_shm_get(const libxl__save_shm *shm,
+                                       uint32_t pos, void *data, uint32_t len)
+{
+    uint32_t off = pos & (LIBXL_SAVE_SHM_RING_SIZE - 1);
+    uint32_t first = LIBXL_SAVE_SHM_RING_SIZE - off;
+
+    if (first > len)
+        first = len;
+    memcpy(data, shm->ring + off, first);
+    memcpy((uint8_t *)data + first, shm->ring, len - first);
+}
+
+#endif /* LIBXL_SAVE_SHM_H */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -822,6 +822,7 @@ static int sched_fp_domain_set(libxl__gc *gc, uint32_t domid, const libxl_domain
     sdom.slice = scinfo->slice;
     sdom.period = scinfo->period;
     sdom.deadline = scinfo->deadline;
+    sdom.boost = 0;
 
     rc = xc_sched_fp_domain_set(CTX->xch, domid, &sdom);
     if ( rc < 0 ) {
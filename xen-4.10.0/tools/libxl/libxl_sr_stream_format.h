@@ -37,6 +37,7 @@ typedef struct libxl__sr_rec_hdr
 #define REC_TYPE_EMULATOR_CONTEXT       0x00000003U
 #define REC_TYPE_CHECKPOINT_END         0x00000004U
 #define REC_TYPE_CHECKPOINT_STATE       0x00000005U
+#define REC_TYPE_EMULATOR_CONTEXT_DELTA 0x00000006U
 
 typedef struct libxl__sr_emulator_hdr
 {
@@ -44,6 +45,12 @@ typedef struct libxl__sr_emulator_hdr
     uint32_t index;
 } libxl__sr_emulator_hdr;
 
+typedef struct libxl__sr_emulator_delta_hdr
+{
+    uint32_t size;  /* of the emulator context it stands for */
+    uint32_t _res1;
+} libxl__sr_emulator_delta_hdr;
+
 #define EMULATOR_UNKNOWN             0x00000000U
 #define EMULATOR_QEMU_TRADITIONAL    0x00000001U
 #define EMULATOR_QEMU_UPSTREAM       0x00000002U
@@ -57,6 +64,7 @@ typedef struct libxl_sr_checkpoint_state
 #define CHECKPOINT_SVM_SUSPENDED     0x00000001U
 #define CHECKPOINT_SVM_READY         0x00000002U
 #define CHECKPOINT_SVM_RESUMED       0x00000003U
+#define CHECKPOINT_REMUS_ACK         0x00000004U
 
 #endif /* LIBXL__SR_STREAM_FORMAT_H */
 
@@ -220,6 +220,8 @@ void libxl__stream_read_init(libxl__stream_read_state *stream)
     stream->incoming_record = NULL;
     FILLZERO(stream->emu_dc);
     stream->emu_carefd = NULL;
+    stream->emu_base = NULL;
+    stream->emu_base_len = 0;
 }
 
 void libxl__stream_read_start(libxl__egc *egc,
@@ -318,6 +320,31 @@ void libxl__stream_read_abort(libxl__egc *egc,
         stream_complete(egc, stream, rc);
 }
 
+void libxl__stream_read_failover(libxl__egc *egc,
+                                 libxl__stream_read_state *stream)
+{
+    if (!stream->running)
+        return;
+
+    if (stream->in_checkpoint && stream->phase == SRS_PHASE_BUFFERING) {
+        /*
+         * We own the fd and are part way through the libxl records of a
+         * checkpoint which will never be completed.  Stop reading and
+         * tell libxc to fail over to the last complete checkpoint.
+         */
+        libxl__datacopier_kill(&stream->dc);
+        checkpoint_done(egc, stream, ERROR_FAIL);
+        return;
+    }
+
+    /*
+     * Libxc owns the fd, or we are applying a checkpoint which is already
+     * complete.  Either way, have the helper stop reading the stream, so
+     * libxc fails over as soon as it next needs more of it.
+     */
+    libxl__save_helper_failover(egc, &stream->shs);
+}
+
 /*----- Event logic -----*/
 
 static void stream_header_done(libxl__egc *egc,
@@ -580,6 +607,11 @@ static bool process_record(libxl__egc *egc,
         break;
 
     case REC_TYPE_LIBXC_CONTEXT:
+        /* The primary connected them before it started the stream. */
+        if (dcs->remus_stripes.listen_fd >= 0) {
+            rc = libxl__remus_stripes_accept(gc, &dcs->remus_stripes);
+            if (rc) goto err;
+        }
         libxl__xc_domain_restore(egc, dcs, &stream->shs, 0, 0);
         break;
 
@@ -612,6 +644,7 @@ static bool process_record(libxl__egc *egc,
         break;
 
     case REC_TYPE_EMULATOR_CONTEXT:
+    case REC_TYPE_EMULATOR_CONTEXT_DELTA:
         if (dcs->guest_config->b_info.type != LIBXL_DOMAIN_TYPE_HVM) {
             rc = ERROR_FAIL;
             LOG(ERROR,
@@ -666,8 +699,13 @@ static void write_emulator_blob(libxl__egc *egc,
     libxl__domain_create_state *dcs = stream->dcs;
     libxl__datacopier_state *dc = &stream->emu_dc;
     libxl__sr_emulator_hdr *emu_hdr;
+    libxl__sr_emulator_delta_hdr *delta_hdr;
     STATE_AO_GC(stream->ao);
+    const bool remus = dcs->restore_params.checkpointed_stream ==
+        LIBXL_CHECKPOINTED_STREAM_REMUS;
     char path[256];
+    void *blob;
+    uint32_t len;
     int rc = 0, writefd;
 
     if (rec->hdr.length < sizeof(*emu_hdr)) {
@@ -676,9 +714,42 @@ static void write_emulator_blob(libxl__egc *egc,
         goto err;
     }
     emu_hdr = rec->body;
+    blob = rec->body + sizeof(*emu_hdr);
+    len = rec->hdr.length - sizeof(*emu_hdr);
+
+    if (rec->hdr.type == REC_TYPE_EMULATOR_CONTEXT_DELTA) {
+        /* Remus: the changes since the previous checkpoint's context. */
+        delta_hdr = blob;
+        if (len < sizeof(*delta_hdr) || !stream->emu_base ||
+            delta_hdr->size != stream->emu_base_len) {
+            rc = ERROR_FAIL;
+            LOG(ERROR, "Emulator delta record does not match the last"
+                " emulator context");
+            goto err;
+        }
+
+        if (xc_stream_delta_apply(stream->emu_base, stream->emu_base_len,
+                                  delta_hdr + 1, len - sizeof(*delta_hdr))) {
+            rc = ERROR_FAIL;
+            LOGE(ERROR, "Malformed emulator delta record");
+            goto err;
+        }
+
+        blob = stream->emu_base;
+        len = stream->emu_base_len;
+    } else if (remus) {
+        /* Later checkpoints may send deltas against this one. */
+        free(stream->emu_base);
+        stream->emu_base = libxl__malloc(NOGC, len);
+        stream->emu_base_len = len;
+        memcpy(stream->emu_base, blob, len);
+    }
 
     sprintf(path, LIBXL_DEVICE_MODEL_RESTORE_FILE".%u", dcs->guest_domid);
 
+    if (remus && dcs->restore_params.history_epochs > 0)
+        libxl__remus_restore_keep_emulator(gc, dcs, path);
+
     assert(stream->emu_carefd == NULL);
     libxl__carefd_begin();
     writefd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
@@ -703,9 +774,7 @@ static void write_emulator_blob(libxl__egc *egc,
     if (rc)
         goto err;
 
-    libxl__datacopier_prefixdata(egc, dc,
-                                 rec->body + sizeof(*emu_hdr),
-                                 rec->hdr.length - sizeof(*emu_hdr));
+    libxl__datacopier_prefixdata(egc, dc, blob, len);
     return;
 
  err:
@@ -763,7 +832,10 @@ static void stream_complete(libxl__egc *egc,
          *    libxl__xc_domain_restore_done()
          * 2. back_channel stream
          *    libxl__stream_read_abort()
+         *
+         * The record may still be in flight when we are aborted.
          */
+        libxl__datacopier_kill(&stream->dc);
         checkpoint_state_done(egc, stream, rc);
         return;
     }
@@ -806,6 +878,7 @@ static void stream_done(libxl__egc *egc,
 
     if (stream->emu_carefd)
         libxl__carefd_close(stream->emu_carefd);
+    free(stream->emu_base);
 
     /* If we started a conversion helper, we took ownership of its carefd. */
     if (stream->chs.v2_carefd)
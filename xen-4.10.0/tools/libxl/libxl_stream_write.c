@@ -47,7 +47,8 @@
  * save-helper checkpoint callback.  It writes:
  *  - (optional) Emulator xenstore record
  *  - if (hvm)
- *      - Emulator context record
+ *      - Emulator context record, or with Remus, an emulator context delta
+ *        record against the previous checkpoint's where that is smaller
  *  - Checkpoint end record
  *
  * For back channel stream:
@@ -56,6 +57,10 @@
  *
  * - Use libxl__stream_write_checkpoint_state to write the record. When the
  *   record is written out, call stream->checkpoint_callback() to return.
+ *
+ * Between the checkpoints of a Remus stream, while libxc is waiting in its
+ * checkpoint callback, libxl__stream_write_liveness() writes a single libxc
+ * LIVENESS record and calls stream->liveness_callback() to return.
  */
 
 /* Success/error/cleanup handling. */
@@ -87,6 +92,8 @@ static void write_emulator_context_record(libxl__egc *egc,
 static void emulator_context_read_done(libxl__egc *egc,
                                        libxl__datacopier_state *dc,
                                        int rc, int onwrite, int errnoval);
+static bool write_emulator_context_delta(libxl__egc *egc,
+                                         libxl__stream_write_state *stream);
 static void emulator_context_record_done(libxl__egc *egc,
                                          libxl__stream_write_state *stream);
 static void write_end_record(libxl__egc *egc,
@@ -104,6 +111,13 @@ static void write_checkpoint_state_done(libxl__egc *egc,
 static void checkpoint_state_done(libxl__egc *egc,
                                   libxl__stream_write_state *stream, int rc);
 
+/* liveness */
+static void liveness_record_done(libxl__egc *egc,
+                                 libxl__datacopier_state *dc,
+                                 int rc, int onwrite, int errnoval);
+static void liveness_done(libxl__egc *egc,
+                          libxl__stream_write_state *stream, int rc);
+
 /*----- Helpers -----*/
 
 static void write_done(libxl__egc *egc,
@@ -214,6 +228,7 @@ void libxl__stream_write_init(libxl__stream_write_state *stream)
     stream->running = false;
     stream->in_checkpoint = false;
     stream->sync_teardown = false;
+    stream->in_liveness = false;
     FILLZERO(stream->dc);
     stream->record_done_callback = NULL;
     FILLZERO(stream->emu_dc);
@@ -221,6 +236,10 @@ void libxl__stream_write_init(libxl__stream_write_state *stream)
     FILLZERO(stream->emu_rec_hdr);
     FILLZERO(stream->emu_sub_hdr);
     stream->emu_body = NULL;
+    stream->emu_body_len = 0;
+    stream->emu_delta = NULL;
+    stream->emu_prev = NULL;
+    stream->emu_prev_len = 0;
     stream->device_model_version = LIBXL_DEVICE_MODEL_VERSION_UNKNOWN;
 }
 
@@ -476,6 +495,7 @@ static void write_emulator_context_record(libxl__egc *egc,
     rec->type = REC_TYPE_EMULATOR_CONTEXT;
     rec->length = st.st_size + sizeof(stream->emu_sub_hdr);
     stream->emu_body = libxl__malloc(NOGC, st.st_size);
+    stream->emu_body_len = st.st_size;
 
     FILLZERO(*dc);
     dc->ao            = stream->ao;
@@ -514,6 +534,9 @@ static void emulator_context_read_done(libxl__egc *egc,
     libxl__carefd_close(stream->emu_carefd);
     stream->emu_carefd = NULL;
 
+    if (write_emulator_context_delta(egc, stream))
+        return;
+
     setup_emulator_write(egc, stream, "emulator record",
                          &stream->emu_rec_hdr,
                          &stream->emu_sub_hdr,
@@ -521,11 +544,60 @@ static void emulator_context_read_done(libxl__egc *egc,
                          emulator_context_record_done);
 }
 
+/*
+ * After the first checkpoint of a Remus stream, the emulator context is
+ * sent as its changes since the previous checkpoint's, unless that would
+ * save less than half of it.  Returns whether the record is being written.
+ */
+static bool write_emulator_context_delta(libxl__egc *egc,
+                                         libxl__stream_write_state *stream)
+{
+    STATE_AO_GC(stream->ao);
+    struct libxl__sr_rec_hdr *rec = &stream->emu_rec_hdr;
+    libxl__sr_emulator_delta_hdr *hdr;
+    const uint32_t size = stream->emu_body_len;
+    int len;
+
+    if (stream->dss->checkpointed_stream != LIBXL_CHECKPOINTED_STREAM_REMUS ||
+        !stream->emu_prev || stream->emu_prev_len != size)
+        return false;
+
+    stream->emu_delta = libxl__malloc(NOGC, sizeof(*hdr) + size / 2);
+    len = xc_stream_delta_encode(stream->emu_prev, stream->emu_body, size,
+                                 (uint8_t *)stream->emu_delta + sizeof(*hdr),
+                                 size / 2);
+    if (len < 0) {
+        free(stream->emu_delta);
+        stream->emu_delta = NULL;
+        return false;
+    }
+
+    hdr = stream->emu_delta;
+    hdr->size = size;
+    hdr->_res1 = 0;
+
+    rec->type = REC_TYPE_EMULATOR_CONTEXT_DELTA;
+    rec->length = sizeof(stream->emu_sub_hdr) + sizeof(*hdr) + len;
+
+    setup_emulator_write(egc, stream, "emulator delta record",
+                         rec, &stream->emu_sub_hdr, stream->emu_delta,
+                         emulator_context_record_done);
+    return true;
+}
+
 static void emulator_context_record_done(libxl__egc *egc,
                                          libxl__stream_write_state *stream)
 {
-    free(stream->emu_body);
+    if (stream->dss->checkpointed_stream == LIBXL_CHECKPOINTED_STREAM_REMUS) {
+        /* The next checkpoint's is sent as a delta against this one. */
+        free(stream->emu_prev);
+        stream->emu_prev = stream->emu_body;
+        stream->emu_prev_len = stream->emu_body_len;
+    } else
+        free(stream->emu_body);
     stream->emu_body = NULL;
+    free(stream->emu_delta);
+    stream->emu_delta = NULL;
 
     if (stream->in_checkpoint)
         write_checkpoint_end_record(egc, stream);
@@ -597,11 +669,23 @@ static void stream_complete(libxl__egc *egc,
          *    libxl__xc_domain_save_done()
          * 2. back_channel stream
          *    libxl__stream_write_abort()
+         *
+         * The record may still be in flight when we are aborted.
          */
+        libxl__datacopier_kill(&stream->dc);
         checkpoint_state_done(egc, stream, rc);
         return;
     }
 
+    if (stream->in_liveness) {
+        assert(rc);
+
+        /* As for a checkpoint; libxc is blocked in its callback. */
+        libxl__datacopier_kill(&stream->dc);
+        liveness_done(egc, stream, rc);
+        return;
+    }
+
     stream_done(egc, stream, rc);
 }
 
@@ -615,6 +699,8 @@ static void stream_done(libxl__egc *egc,
     if (stream->emu_carefd)
         libxl__carefd_close(stream->emu_carefd);
     free(stream->emu_body);
+    free(stream->emu_delta);
+    free(stream->emu_prev);
 
     if (!stream->back_channel) {
         /*
@@ -718,6 +804,64 @@ static void checkpoint_state_done(libxl__egc *egc,
     stream->checkpoint_callback(egc, stream, rc);
 }
 
+/*----- liveness -----*/
+
+void libxl__stream_write_liveness(libxl__egc *egc,
+                                  libxl__stream_write_state *stream)
+{
+    STATE_AO_GC(stream->ao);
+    libxl__datacopier_state *dc = &stream->dc;
+    int len, rc;
+
+    assert(stream->running);
+    assert(!stream->in_checkpoint);
+    assert(!stream->in_checkpoint_state);
+    assert(!stream->in_liveness);
+    assert(!stream->back_channel);
+    stream->in_liveness = true;
+
+    len = xc_stream_liveness_record(stream->liveness_rec,
+                                    sizeof(stream->liveness_rec));
+    if (len < 0) {
+        LOGE(ERROR, "unable to format liveness record");
+        rc = ERROR_FAIL;
+        goto err;
+    }
+
+    dc->writewhat = "liveness record";
+    dc->used      = 0;
+    dc->callback  = liveness_record_done;
+    rc = libxl__datacopier_start(dc);
+    if (rc)
+        goto err;
+
+    libxl__datacopier_prefixdata(egc, dc, stream->liveness_rec, len);
+    return;
+
+ err:
+    liveness_done(egc, stream, rc);
+}
+
+static void liveness_record_done(libxl__egc *egc,
+                                 libxl__datacopier_state *dc,
+                                 int rc, int onwrite, int errnoval)
+{
+    libxl__stream_write_state *stream = CONTAINER_OF(dc, *stream, dc);
+
+    if (onwrite || errnoval)
+        rc = rc ?: ERROR_FAIL;
+
+    liveness_done(egc, stream, rc);
+}
+
+static void liveness_done(libxl__egc *egc,
+                          libxl__stream_write_state *stream, int rc)
+{
+    assert(stream->in_liveness);
+    stream->in_liveness = false;
+    stream->liveness_callback(egc, stream, rc);
+}
+
 /*
  * Local variables:
  * mode: C
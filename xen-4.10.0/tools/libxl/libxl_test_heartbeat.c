@@ -0,0 +1,112 @@
+/*
+ * heartbeat test case for the Remus heartbeat
+ *
+ * To run this test:
+ *    ./test_heartbeat
+ * Success:
+ *    program takes a fraction of a second, prints some debugging output
+ *    and exits 0
+ * Failure:
+ *    crash
+ *
+ * start a receiver on the loopback interface
+ * start a sender beating to it every PERIOD_US
+ * after SEND_MS stop the sender
+ * the receiver must report ERROR_TIMEDOUT, having seen some beats,
+ * within MAX_DETECT_MS of the sender stopping
+ */
+
+#include "libxl_internal.h"
+
+#include "libxl_test_heartbeat.h"
+
+#define PORT 18891
+#define PERIOD_US 500
+#define MISSES 10
+#define SEND_MS 50
+#define MAX_DETECT_MS 1000
+
+static libxl__remus_heartbeat_state sender, receiver;
+static libxl__ev_time stop_sending;
+static struct timeval stopped;
+static libxl__ao *tao;
+
+static void sender_failed(libxl__egc *egc,
+                          libxl__remus_heartbeat_state *hbs, int rc)
+{
+    EGC_GC;
+    LOG(ERROR, "sender failed rc=%d", rc);
+    abort();
+}
+
+static void sender_stop(libxl__egc *egc, libxl__ev_time *ev,
+                        const struct timeval *requested_abs, int rc)
+{
+    EGC_GC;
+
+    assert(rc == ERROR_TIMEDOUT);
+
+    LOG(DEBUG, "stopping sender, receiver has %"PRIu64" beats",
+        receiver.beats);
+    libxl__remus_heartbeat_stop(gc, &sender);
+    assert(!libxl__gettimeofday(gc, &stopped));
+}
+
+static void receiver_lost(libxl__egc *egc,
+                          libxl__remus_heartbeat_state *hbs, int rc)
+{
+    EGC_GC;
+    struct timeval now;
+    long detect_us;
+
+    assert(!libxl__gettimeofday(gc, &now));
+    detect_us = (now.tv_sec - stopped.tv_sec) * 1000000L +
+                (now.tv_usec - stopped.tv_usec);
+
+    LOG(DEBUG, "receiver lost primary rc=%d beats=%"PRIu64" after %ldus",
+        rc, hbs->beats, detect_us);
+
+    assert(hbs == &receiver);
+    assert(rc == ERROR_TIMEDOUT);
+    assert(hbs->beats > 0);
+    assert(stopped.tv_sec); /* not before the sender stopped */
+    assert(detect_us < MAX_DETECT_MS * 1000L);
+
+    libxl__remus_heartbeat_stop(gc, &sender);
+    libxl__ao_complete(egc, tao, 0);
+}
+
+int libxl_test_heartbeat(libxl_ctx *ctx, libxl_asyncop_how *ao_how)
+{
+    int rc;
+    AO_CREATE(ctx, 0, ao_how);
+
+    tao = ao;
+
+    libxl__remus_heartbeat_init(&sender);
+    libxl__remus_heartbeat_init(&receiver);
+    libxl__ev_time_init(&stop_sending);
+
+    receiver.ao = ao;
+    receiver.domid = INVALID_DOMID;
+    receiver.port = PORT;
+    receiver.period_us = PERIOD_US;
+    receiver.misses = MISSES;
+    receiver.callback = receiver_lost;
+    rc = libxl__remus_heartbeat_recv_start(gc, &receiver);
+    assert(!rc);
+
+    sender.ao = ao;
+    sender.domid = INVALID_DOMID;
+    sender.host = "127.0.0.1";
+    sender.port = PORT;
+    sender.period_us = PERIOD_US;
+    sender.callback = sender_failed;
+    rc = libxl__remus_heartbeat_send_start(gc, &sender);
+    assert(!rc);
+
+    rc = libxl__ev_time_register_rel(ao, &stop_sending, sender_stop, SEND_MS);
+    assert(!rc);
+
+    return AO_INPROGRESS;
+}
@@ -0,0 +1,7 @@
+#ifndef TEST_HEARTBEAT_H
+#define TEST_HEARTBEAT_H
+
+int libxl_test_heartbeat(libxl_ctx *ctx, libxl_asyncop_how *ao_how)
+    LIBXL_EXTERNAL_CALLERS_ONLY;
+
+#endif /*TEST_HEARTBEAT_H*/
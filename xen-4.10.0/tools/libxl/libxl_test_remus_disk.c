@@ -0,0 +1,224 @@
+/*
+ * test case for Remus disk replication without DRBD
+ *
+ * To run this test:
+ *    ./test_remus_disk
+ * Success:
+ *    program takes a fraction of a second, prints some debugging output
+ *    and exits 0
+ * Failure:
+ *    crash
+ *
+ * make two identical images, the primary's and the backup's
+ * start a receiver for the backup's image on the loopback interface
+ * play block-remus: write to the primary's image, sending each write
+ * down the stream, and close two epochs, and start a third
+ * send the rest of the third epoch in pieces, so that records are split
+ * the backup's image must be unchanged until an epoch is committed, and
+ * then be the same as the primary's was at the end of that epoch
+ */
+
+#include "libxl_internal.h"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "libxl_test_remus_disk.h"
+
+#define PORT 18892
+#define SECTOR 512
+#define IMAGE_SECTORS 256
+#define IMAGE_SIZE (IMAGE_SECTORS * SECTOR)
+#define WRITES 8     /* per epoch */
+#define MAX_SECS 4   /* per write */
+#define PAUSE_MS 20
+
+static libxl__remus_disk_recv rd;
+static libxl__ev_time pause_ev;
+static libxl__ao *tao;
+static char primary_path[] = "/tmp/test_remus_disk_p.XXXXXX";
+static char backup_path[] = "/tmp/test_remus_disk_b.XXXXXX";
+static int primary_fd, backup_fd, stream_fd;
+/* the primary's image as of the end of each epoch */
+static uint8_t snap[4][IMAGE_SIZE];
+/* the third epoch, sent in pieces */
+static uint8_t *tail;
+static size_t tail_len, tail_sent;
+
+static void check_backup(int epoch)
+{
+    static uint8_t buf[IMAGE_SIZE];
+
+    assert(pread(backup_fd, buf, IMAGE_SIZE, 0) == IMAGE_SIZE);
+    assert(!memcmp(buf, snap[epoch], IMAGE_SIZE));
+}
+
+static void append(uint8_t **buf, size_t *len, const void *data, size_t n)
+{
+    *buf = realloc(*buf, *len + n);
+    assert(*buf);
+    memcpy(*buf + *len, data, n);
+    *len += n;
+}
+
+/* Writes of one epoch to the primary's image, and as they go on the wire. */
+static void make_epoch(int epoch, uint8_t **wire, size_t *wire_len)
+{
+    uint8_t data[MAX_SECS * SECTOR];
+    uint64_t sector = 0, end = 0;
+    uint32_t secs;
+    int i, j;
+
+    for (i = 0; i < WRITES; i++) {
+        secs = 1 + rand() % MAX_SECS;
+        /* every other write follows on from the last, to be joined up */
+        if (i % 2 && end + secs <= IMAGE_SECTORS)
+            sector = end;
+        else
+            sector = rand() % (IMAGE_SECTORS - secs + 1);
+        end = sector + secs;
+
+        for (j = 0; j < secs * SECTOR; j++)
+            data[j] = rand();
+
+        assert(pwrite(primary_fd, data, secs * SECTOR, sector * SECTOR) ==
+               secs * SECTOR);
+
+        append(wire, wire_len, "wreq", 4);
+        append(wire, wire_len, &secs, sizeof(secs));
+        append(wire, wire_len, &sector, sizeof(sector));
+        append(wire, wire_len, data, secs * SECTOR);
+    }
+
+    assert(pread(primary_fd, snap[epoch], IMAGE_SIZE, 0) == IMAGE_SIZE);
+}
+
+static void send_all(const void *buf, size_t len)
+{
+    assert(write(stream_fd, buf, len) == len);
+}
+
+static void finish(libxl__egc *egc)
+{
+    EGC_GC;
+
+    /* nothing is written before its checkpoint is */
+    check_backup(0);
+
+    assert(!libxl__remus_disk_recv_commit(gc, &rd));
+    check_backup(1);
+    assert(!libxl__remus_disk_recv_commit(gc, &rd));
+    check_backup(2);
+
+    /* the third epoch has not been closed */
+    assert(libxl__remus_disk_recv_commit(gc, &rd) == ERROR_NOT_READY);
+    check_backup(2);
+
+    /* but on failover its whole records are written */
+    assert(!libxl__remus_disk_recv_commit_open(gc, &rd));
+    check_backup(3);
+    assert(rd.committed == 3);
+
+    libxl__remus_disk_recv_stop(gc, &rd);
+    close(stream_fd);
+    close(primary_fd);
+    close(backup_fd);
+    unlink(primary_path);
+    unlink(backup_path);
+    free(tail);
+
+    libxl__ao_complete(egc, tao, 0);
+}
+
+static void send_more(libxl__egc *egc, libxl__ev_time *ev,
+                      const struct timeval *requested_abs, int rc)
+{
+    EGC_GC;
+    size_t n;
+
+    assert(rc == ERROR_TIMEDOUT);
+
+    if (tail_sent == tail_len) {
+        assert(rd.closed == 2);
+        finish(egc);
+        return;
+    }
+
+    /* a bit over half of what is left, so that a record is cut short */
+    n = tail_len - tail_sent;
+    n = n > 16 ? n / 2 + 3 : n;
+    send_all(tail + tail_sent, n);
+    tail_sent += n;
+
+    LOG(DEBUG, "sent %zu of %zu bytes of the open epoch", tail_sent,
+        tail_len);
+    rc = libxl__ev_time_register_rel(tao, &pause_ev, send_more, PAUSE_MS);
+    assert(!rc);
+}
+
+static void epoch_closed(libxl__egc *egc, libxl__remus_disk_recv *r, int rc)
+{
+    EGC_GC;
+
+    LOG(DEBUG, "epoch closed rc=%d closed=%"PRIu64, rc, r->closed);
+
+    assert(r == &rd);
+    assert(!rc);
+    assert(r->closed <= 2);
+
+    if (r->closed == 2 && !libxl__ev_time_isregistered(&pause_ev)) {
+        rc = libxl__ev_time_register_rel(tao, &pause_ev, send_more,
+                                         PAUSE_MS);
+        assert(!rc);
+    }
+}
+
+int libxl_test_remus_disk(libxl_ctx *ctx, libxl_asyncop_how *ao_how)
+{
+    static uint8_t zero[IMAGE_SIZE];
+    struct sockaddr_in sa;
+    uint8_t *wire = NULL;
+    size_t wire_len = 0;
+    int rc;
+    AO_CREATE(ctx, 0, ao_how);
+
+    tao = ao;
+    srand(1);
+
+    primary_fd = mkstemp(primary_path);
+    backup_fd = mkstemp(backup_path);
+    assert(primary_fd >= 0 && backup_fd >= 0);
+    assert(write(primary_fd, zero, IMAGE_SIZE) == IMAGE_SIZE);
+    assert(write(backup_fd, zero, IMAGE_SIZE) == IMAGE_SIZE);
+
+    libxl__ev_time_init(&pause_ev);
+    libxl__remus_disk_recv_init(&rd);
+    rd.ao = ao;
+    rd.domid = INVALID_DOMID;
+    rd.path = backup_path;
+    rd.port = PORT;
+    rd.callback = epoch_closed;
+    rc = libxl__remus_disk_recv_start(gc, &rd);
+    assert(!rc);
+
+    /* block-remus connects with the receiver already listening */
+    stream_fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(stream_fd >= 0);
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(PORT);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(!connect(stream_fd, (struct sockaddr *)&sa, sizeof(sa)));
+
+    make_epoch(1, &wire, &wire_len);
+    append(&wire, &wire_len, "creq", 4);
+    make_epoch(2, &wire, &wire_len);
+    append(&wire, &wire_len, "creq", 4);
+    send_all(wire, wire_len);
+    free(wire);
+
+    make_epoch(3, &tail, &tail_len);
+    tail_sent = 0;
+
+    return AO_INPROGRESS;
+}
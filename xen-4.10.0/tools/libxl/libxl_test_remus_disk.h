@@ -0,0 +1,7 @@
+#ifndef TEST_REMUS_DISK_H
+#define TEST_REMUS_DISK_H
+
+int libxl_test_remus_disk(libxl_ctx *ctx, libxl_asyncop_how *ao_how)
+    LIBXL_EXTERNAL_CALLERS_ONLY;
+
+#endif /*TEST_REMUS_DISK_H*/
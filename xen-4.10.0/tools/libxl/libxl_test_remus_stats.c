@@ -0,0 +1,196 @@
+/*
+ * test case for the Remus per-checkpoint statistics (xl remus --stats)
+ *
+ * To run this test:
+ *    ./test_remus_stats
+ * Success:
+ *    program takes a fraction of a second, prints some debugging output
+ *    and exits 0
+ * Failure:
+ *    crash
+ *
+ * play the checkpoints of a Remus primary into the statistics ring, with
+ * stats_path pointing at a temporary file:
+ * one checkpoint which is committed and acknowledged straight away
+ * two checkpoints which are committed before either is acknowledged
+ * one checkpoint whose ack overtakes the device commit
+ * more checkpoints than the ring holds while the acks lag behind
+ * the file must then hold one line per reported checkpoint, in order,
+ * with the phase timings as recorded, and count the checkpoints which
+ * fell out of the ring as dropped
+ */
+
+#include "libxl_internal.h"
+
+#include "libxl_test_remus_stats.h"
+
+#define DOMID 7
+#define FIRST_LAG 5 /* first epoch of the lagging acks */
+#define LAST (FIRST_LAG + LIBXL__REMUS_STATS_RING + 1)
+#define DROPPED 2   /* epochs FIRST_LAG and FIRST_LAG + 1 */
+
+static libxl__domain_save_state dss;
+static libxl_domain_remus_info info;
+static char path[] = "/tmp/test_remus_stats.XXXXXX";
+
+/* Starts checkpoint epoch, with timings derived from its number. */
+static libxl__remus_epoch_stats *checkpoint(uint64_t epoch)
+{
+    libxl__remus_epoch_stats *stats =
+        &dss.rs.stats[epoch & (LIBXL__REMUS_STATS_RING - 1)];
+
+    dss.cpsremus_epoch = epoch;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->epoch = epoch;
+    stats->trigger_us = epoch * 100 + 1;
+    stats->suspend_us = epoch * 100 + 2;
+    stats->postsuspend_us = epoch * 100 + 3;
+    stats->bitmap_us = epoch * 100 + 4;
+    stats->send_us = epoch * 100 + 5;
+    stats->resume_us = epoch * 100 + 6;
+    stats->commit_us = epoch * 100 + 7;
+    stats->ack_us = epoch * 100 + 8;
+    stats->pages = epoch * 10;
+    stats->bytes = epoch * 10 * XC_PAGE_SIZE;
+
+    return stats;
+}
+
+static void committed(libxl__gc *gc, uint64_t epoch)
+{
+    libxl__remus_epoch_stats *stats =
+        libxl__remus_stats_epoch(&dss.rs, epoch);
+
+    assert(stats);
+    stats->committed = true;
+    libxl__remus_stats_report(gc, &dss);
+}
+
+static void acked(libxl__gc *gc, uint64_t epoch)
+{
+    libxl__remus_epoch_stats *stats =
+        libxl__remus_stats_epoch(&dss.rs, epoch);
+
+    assert(stats);
+    stats->acked = true;
+    libxl__remus_stats_report(gc, &dss);
+}
+
+/* The epochs of the lines written so far must be those in want[]. */
+static void check_file(libxl__gc *gc, const uint64_t *want, int nr_want)
+{
+    FILE *f;
+    char line[512];
+    uint32_t domid, t[8], pages;
+    uint64_t epoch, bytes, dropped;
+    int i, n = 0;
+
+    f = fopen(path, "r");
+    assert(f);
+
+    while (fgets(line, sizeof(line), f)) {
+        LOG(DEBUG, "stats: %.*s", (int)strcspn(line, "\n"), line);
+        assert(strchr(line, '\n'));
+        i = sscanf(line, "domid=%"SCNu32" epoch=%"SCNu64
+                   " trigger_us=%"SCNu32" suspend_us=%"SCNu32
+                   " postsuspend_us=%"SCNu32" bitmap_us=%"SCNu32
+                   " send_us=%"SCNu32" resume_us=%"SCNu32
+                   " commit_us=%"SCNu32" ack_us=%"SCNu32
+                   " pages=%"SCNu32" bytes=%"SCNu64" dropped=%"SCNu64,
+                   &domid, &epoch, &t[0], &t[1], &t[2], &t[3], &t[4],
+                   &t[5], &t[6], &t[7], &pages, &bytes, &dropped);
+        assert(i == 13);
+
+        assert(n < nr_want);
+        assert(domid == DOMID);
+        assert(epoch == want[n]);
+        for (i = 0; i < 8; i++)
+            assert(t[i] == epoch * 100 + i + 1);
+        assert(pages == epoch * 10);
+        assert(bytes == epoch * 10 * XC_PAGE_SIZE);
+        assert(dropped == (epoch > FIRST_LAG ? DROPPED : 0));
+        n++;
+    }
+
+    assert(n == nr_want);
+    fclose(f);
+}
+
+int libxl_test_remus_stats(libxl_ctx *ctx)
+{
+    GC_INIT(ctx);
+    struct timespec a = { 10, 500000 }, b = { 10, 1500000 }, c = { 9999, 0 };
+    uint64_t want[LAST];
+    uint64_t epoch;
+    int fd, nr_want = 0, rc;
+
+    assert(libxl__remus_stats_between(&a, &b) == 1000);
+    assert(libxl__remus_stats_between(&b, &a) == 0);
+    a.tv_sec = 0;
+    assert(libxl__remus_stats_between(&a, &c) == UINT32_MAX);
+
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    libxl_domain_remus_info_init(&info);
+    info.stats_path = path;
+    dss.remus = &info;
+    dss.domid = DOMID;
+    dss.cpsremus_epoch = 0; /* the initial image */
+
+    rc = libxl__remus_stats_setup(gc, &dss);
+    assert(!rc);
+
+    /* committed and acknowledged straight away */
+    checkpoint(1);
+    committed(gc, 1);
+    acked(gc, 1);
+    want[nr_want++] = 1;
+    check_file(gc, want, nr_want);
+
+    /* two checkpoints in flight */
+    checkpoint(2);
+    committed(gc, 2);
+    checkpoint(3);
+    committed(gc, 3);
+    check_file(gc, want, nr_want);
+    acked(gc, 2);
+    want[nr_want++] = 2;
+    check_file(gc, want, nr_want);
+    acked(gc, 3);
+    want[nr_want++] = 3;
+    check_file(gc, want, nr_want);
+
+    /* the ack overtakes the commit */
+    checkpoint(4);
+    acked(gc, 4);
+    check_file(gc, want, nr_want);
+    committed(gc, 4);
+    want[nr_want++] = 4;
+    check_file(gc, want, nr_want);
+
+    /* the acks fall behind by more than the ring holds */
+    for (epoch = FIRST_LAG; epoch <= LAST; epoch++) {
+        checkpoint(epoch);
+        committed(gc, epoch);
+    }
+    check_file(gc, want, nr_want);
+    assert(dss.rs.stats_dropped == DROPPED);
+    assert(!libxl__remus_stats_epoch(&dss.rs, FIRST_LAG));
+
+    for (epoch = FIRST_LAG + DROPPED; epoch <= LAST; epoch++) {
+        acked(gc, epoch);
+        want[nr_want++] = epoch;
+    }
+    check_file(gc, want, nr_want);
+    assert(dss.rs.stats_cons == LAST + 1);
+
+    libxl__remus_stats_teardown(&dss);
+    assert(!dss.rs.stats_fd);
+    unlink(path);
+
+    GC_FREE;
+    return 0;
+}
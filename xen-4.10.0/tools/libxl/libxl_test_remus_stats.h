@@ -0,0 +1,7 @@
+#ifndef TEST_REMUS_STATS_H
+#define TEST_REMUS_STATS_H
+
+int libxl_test_remus_stats(libxl_ctx *ctx)
+    LIBXL_EXTERNAL_CALLERS_ONLY;
+
+#endif /*TEST_REMUS_STATS_H*/
@@ -0,0 +1,11 @@
+#include "test_common.h"
+#include "libxl_test_heartbeat.h"
+
+int main(int argc, char **argv) {
+    int rc;
+
+    test_common_setup(XTL_DEBUG);
+
+    rc = libxl_test_heartbeat(ctx, 0);
+    assert(!rc);
+}
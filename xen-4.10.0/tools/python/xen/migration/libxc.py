@@ -65,6 +65,8 @@ REC_TYPE_x86_pv_vcpu_msrs           = 0x0000000c
 REC_TYPE_verify                     = 0x0000000d
 REC_TYPE_checkpoint                 = 0x0000000e
 REC_TYPE_checkpoint_dirty_pfn_list  = 0x0000000f
+REC_TYPE_hvm_context_delta          = 0x00000012
+REC_TYPE_liveness                   = 0x80000010
 
 rec_type_to_str = {
     REC_TYPE_end                        : "End",
@@ -82,7 +84,9 @@ rec_type_to_str = {
     REC_TYPE_x86_pv_vcpu_msrs           : "x86 PV vcpu msrs",
     REC_TYPE_verify                     : "Verify",
     REC_TYPE_checkpoint                 : "Checkpoint",
-    REC_TYPE_checkpoint_dirty_pfn_list  : "Checkpoint dirty pfn list"
+    REC_TYPE_checkpoint_dirty_pfn_list  : "Checkpoint dirty pfn list",
+    REC_TYPE_hvm_context_delta          : "HVM context delta",
+    REC_TYPE_liveness                   : "Liveness",
 }
 
 # page_data
@@ -120,6 +124,35 @@ TSC_INFO_FORMAT           = "IIQII"
 HVM_PARAMS_ENTRY_FORMAT   = "QQ"
 HVM_PARAMS_FORMAT         = "II"
 
+# hvm_context_delta
+HVM_CONTEXT_DELTA_FORMAT  = "II"
+DELTA_RUN_FORMAT          = "II"
+
+# liveness
+LIVENESS_FORMAT           = "Q"
+
+def verify_delta_runs(content, size):
+    """ Runs of a delta against a blob of size bytes """
+
+    runsz = calcsize(DELTA_RUN_FORMAT)
+    pos = 0
+
+    while pos < len(content):
+        if len(content) - pos < runsz:
+            raise RecordError("Delta run header truncated at %d" % (pos, ))
+
+        offset, length = unpack(DELTA_RUN_FORMAT, content[pos:pos + runsz])
+        pos += runsz
+
+        if offset + length > size:
+            raise RecordError("Delta run %#x+%#x beyond size %#x"
+                              % (offset, length, size))
+
+        pos += (length + 7) & ~7
+        if pos > len(content):
+            raise RecordError("Delta run %#x+%#x truncated"
+                              % (offset, length))
+
 class VerifyLibxc(VerifyBase):
     """ Verify a Libxc v2 stream """
 
@@ -380,6 +413,22 @@ class VerifyLibxc(VerifyBase):
             raise RecordError("Zero length HVM context")
 
 
+    def verify_record_hvm_context_delta(self, content):
+        """ hvm context delta record """
+
+        sz = calcsize(HVM_CONTEXT_DELTA_FORMAT)
+
+        if len(content) < sz:
+            raise RecordError("Length should be at least %u bytes" % (sz, ))
+
+        size, rsvd = unpack(HVM_CONTEXT_DELTA_FORMAT, content[:sz])
+
+        if rsvd != 0:
+            raise RecordError("Reserved field not zero (0x%04x)" % (rsvd, ))
+
+        verify_delta_runs(content[sz:], size)
+
+
     def verify_record_hvm_params(self, content):
         """ hvm params record """
 
@@ -424,6 +473,14 @@ class VerifyLibxc(VerifyBase):
         """ checkpoint dirty pfn list """
         raise RecordError("Found checkpoint dirty pfn list record in stream")
 
+    def verify_record_liveness(self, content):
+        """ liveness record """
+
+        expectedsz = calcsize(LIVENESS_FORMAT)
+        if len(content) != expectedsz:
+            raise RecordError("liveness: expected length of %d, got %d"
+                              % (expectedsz, len(content)))
+
 
 record_verifiers = {
     REC_TYPE_end:
@@ -456,6 +513,8 @@ record_verifiers = {
 
     REC_TYPE_hvm_context:
         VerifyLibxc.verify_record_hvm_context,
+    REC_TYPE_hvm_context_delta:
+        VerifyLibxc.verify_record_hvm_context_delta,
     REC_TYPE_hvm_params:
         VerifyLibxc.verify_record_hvm_params,
     REC_TYPE_toolstack:
@@ -466,4 +525,6 @@ record_verifiers = {
         VerifyLibxc.verify_record_checkpoint,
     REC_TYPE_checkpoint_dirty_pfn_list:
         VerifyLibxc.verify_record_checkpoint_dirty_pfn_list,
+    REC_TYPE_liveness:
+        VerifyLibxc.verify_record_liveness,
     }
@@ -12,7 +12,7 @@ import sys
 
 from struct import calcsize, unpack, unpack_from
 from xen.migration.verify import StreamError, RecordError, VerifyBase
-from xen.migration.libxc import VerifyLibxc
+from xen.migration.libxc import VerifyLibxc, verify_delta_runs
 
 # Header
 HDR_FORMAT = "!QII"
@@ -38,6 +38,7 @@ REC_TYPE_emulator_xenstore_data = 0x00000002
 REC_TYPE_emulator_context       = 0x00000003
 REC_TYPE_checkpoint_end         = 0x00000004
 REC_TYPE_checkpoint_state       = 0x00000005
+REC_TYPE_emulator_context_delta = 0x00000006
 
 rec_type_to_str = {
     REC_TYPE_end                    : "End",
@@ -45,12 +46,16 @@ rec_type_to_str = {
     REC_TYPE_emulator_xenstore_data : "Emulator xenstore data",
     REC_TYPE_emulator_context       : "Emulator context",
     REC_TYPE_checkpoint_end         : "Checkpoint end",
-    REC_TYPE_checkpoint_state       : "Checkpoint state"
+    REC_TYPE_checkpoint_state       : "Checkpoint state",
+    REC_TYPE_emulator_context_delta : "Emulator context delta",
 }
 
 # emulator_* header
 EMULATOR_HEADER_FORMAT = "II"
 
+# emulator_context_delta, after the emulator header
+EMULATOR_DELTA_FORMAT  = "II"
+
 EMULATOR_ID_unknown       = 0x00000000
 EMULATOR_ID_qemu_trad     = 0x00000001
 EMULATOR_ID_qemu_upstream = 0x00000002
@@ -208,6 +213,25 @@ class VerifyLibxl(VerifyBase):
         self.info("  Index %d, type %s" % (emu_idx, emulator_id_to_str[emu_id]))
 
 
+    def verify_record_emulator_context_delta(self, content):
+        """ Emulator Context delta record """
+        emusz = calcsize(EMULATOR_HEADER_FORMAT)
+        minsz = emusz + calcsize(EMULATOR_DELTA_FORMAT)
+
+        if len(content) < minsz:
+            raise RecordError("Length must be at least %d bytes, got %d"
+                              % (minsz, len(content)))
+
+        self.verify_record_emulator_context(content[:emusz])
+
+        size, rsvd = unpack(EMULATOR_DELTA_FORMAT, content[emusz:minsz])
+
+        if rsvd != 0:
+            raise RecordError("Reserved field not zero (0x%04x)" % (rsvd, ))
+
+        verify_delta_runs(content[minsz:], size)
+
+
     def verify_record_checkpoint_end(self, content):
         """ Checkpoint end record """
 
@@ -233,4 +257,6 @@ record_verifiers = {
         VerifyLibxl.verify_record_checkpoint_end,
     REC_TYPE_checkpoint_state:
         VerifyLibxl.verify_record_checkpoint_state,
+    REC_TYPE_emulator_context_delta:
+        VerifyLibxl.verify_record_emulator_context_delta,
 }
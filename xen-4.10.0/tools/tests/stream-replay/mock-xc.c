@@ -0,0 +1,433 @@
+/*
+ * mock-xc.c
+ *
+ * See mock-xc.h.  The guest's memory is an unlinked file in /dev/shm,
+ * grown as pages are populated, and a foreign mapping maps its pages
+ * straight into the caller, so the restore code copies into guest pages
+ * just as it would under Xen.  Hypercalls which only matter to a real
+ * guest succeed without doing anything.
+ *
+ * Copyright (C) 2017
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "xc_sr_common.h"
+#include "xc_dom.h"
+
+#include "mock-xc.h"
+
+/* The file is grown in steps of this many pages, 1GB. */
+#define MOCK_GROW_PAGES (1UL << 18)
+
+struct xenforeignmemory_handle {
+    int unused;
+};
+
+static struct xenforeignmemory_handle mock_fmem;
+
+static struct {
+    pthread_mutex_t lock;
+    int fd;                     /* the guest's memory, by gfn */
+    xen_pfn_t nr_pfns;          /* as reported by xc_domain_nr_gpfns() */
+    xen_pfn_t file_pages;       /* size of fd */
+    unsigned long *populated;   /* bitmap of file_pages bits */
+    uint64_t nr_populated;
+} mock = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .fd = -1,
+};
+
+/* Called with mock.lock held. */
+static int mock_grow(xen_pfn_t gfn)
+{
+    xen_pfn_t pages = (gfn / MOCK_GROW_PAGES + 1) * MOCK_GROW_PAGES;
+    unsigned long *populated;
+
+    if ( gfn < mock.file_pages )
+        return 0;
+
+    populated = realloc(mock.populated, bitmap_size(pages));
+    if ( !populated )
+        return -1;
+    memset((uint8_t *)populated + bitmap_size(mock.file_pages), 0,
+           bitmap_size(pages) - bitmap_size(mock.file_pages));
+    mock.populated = populated;
+
+    if ( ftruncate(mock.fd, (off_t)pages << PAGE_SHIFT) )
+        return -1;
+    mock.file_pages = pages;
+
+    return 0;
+}
+
+static bool mock_is_populated(xen_pfn_t gfn)
+{
+    return gfn < mock.file_pages && test_bit(gfn, mock.populated);
+}
+
+xc_interface *mock_open(xen_pfn_t nr_pfns, xentoollog_level level)
+{
+    char path[] = "/dev/shm/stream-replay.XXXXXX";
+    xc_interface *xch = calloc(1, sizeof(*xch));
+
+    if ( !xch )
+        return NULL;
+
+    xch->flags = XC_OPENFLAG_NON_REENTRANT;
+    xch->fmem = &mock_fmem;
+    xch->error_handler = xch->error_handler_tofree =
+        (xentoollog_logger *)xtl_createlogger_stdiostream(stderr, level, 0);
+    if ( !xch->error_handler )
+        goto err;
+
+    mock.fd = mkstemp(path);
+    if ( mock.fd < 0 )
+        goto err;
+    unlink(path);
+    mock.nr_pfns = nr_pfns;
+
+    return xch;
+
+ err:
+    mock_close(xch);
+    return NULL;
+}
+
+void mock_close(xc_interface *xch)
+{
+    if ( mock.fd >= 0 )
+        close(mock.fd);
+    mock.fd = -1;
+    free(mock.populated);
+    mock.populated = NULL;
+    mock.file_pages = mock.nr_populated = 0;
+
+    xtl_logger_destroy(xch->error_handler_tofree);
+    free(xch);
+}
+
+uint64_t mock_populated(void)
+{
+    return mock.nr_populated;
+}
+
+/*----- libxenctrl -----*/
+
+void xc_report(xc_interface *xch, xentoollog_logger *lg,
+               xentoollog_level level, int code, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    xtl_logv(lg, level, -1, "xc", fmt, args);
+    va_end(args);
+}
+
+void xc_report_error(xc_interface *xch, int code, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    xtl_logv(xch->error_handler, XTL_ERROR, -1, "xc", fmt, args);
+    va_end(args);
+}
+
+const char *xc_strerror(xc_interface *xch, int errcode)
+{
+    return strerror(errcode);
+}
+
+int read_exact(int fd, void *data, size_t size)
+{
+    size_t offset = 0;
+    ssize_t len;
+
+    while ( offset < size )
+    {
+        len = read(fd, (char *)data + offset, size - offset);
+        if ( (len == -1) && (errno == EINTR) )
+            continue;
+        if ( len == 0 )
+            errno = 0;
+        if ( len <= 0 )
+            return -1;
+        offset += len;
+    }
+
+    return 0;
+}
+
+int writev_exact(int fd, const struct iovec *iov, int iovcnt)
+{
+    size_t offset;
+    ssize_t len;
+    int i;
+
+    for ( i = 0; i < iovcnt; ++i )
+    {
+        for ( offset = 0; offset < iov[i].iov_len; offset += len )
+        {
+            len = write(fd, (char *)iov[i].iov_base + offset,
+                        iov[i].iov_len - offset);
+            if ( (len == -1) && (errno == EINTR) )
+            {
+                len = 0;
+                continue;
+            }
+            if ( len <= 0 )
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+void *xc__hypercall_buffer_alloc_pages(xc_interface *xch,
+                                       xc_hypercall_buffer_t *b, int nr_pages)
+{
+    void *p = mmap(NULL, (size_t)nr_pages << PAGE_SHIFT,
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if ( p == MAP_FAILED )
+        return NULL;
+
+    b->hbuf = p;
+
+    return b->hbuf;
+}
+
+void xc__hypercall_buffer_free_pages(xc_interface *xch,
+                                     xc_hypercall_buffer_t *b, int nr_pages)
+{
+    munmap(b->hbuf, (size_t)nr_pages << PAGE_SHIFT);
+}
+
+int xc_domain_getinfo(xc_interface *xch, uint32_t first_domid,
+                      unsigned int max_doms, xc_dominfo_t *info)
+{
+    if ( first_domid > MOCK_DOMID || !max_doms )
+        return 0;
+
+    memset(info, 0, sizeof(*info));
+    info->domid = MOCK_DOMID;
+    info->hvm = 1;
+    info->paused = 1;
+    info->nr_pages = mock.nr_populated;
+    info->max_memkb = mock.nr_pfns << (PAGE_SHIFT - 10);
+    info->nr_online_vcpus = info->max_vcpu_id = 1;
+
+    return 1;
+}
+
+int xc_domain_nr_gpfns(xc_interface *xch, uint32_t domid, xen_pfn_t *gpfns)
+{
+    *gpfns = mock.nr_pfns;
+
+    return 0;
+}
+
+int xc_domain_populate_physmap_exact(xc_interface *xch, uint32_t domid,
+                                     unsigned long nr_extents,
+                                     unsigned int extent_order,
+                                     unsigned int mem_flags,
+                                     xen_pfn_t *extent_start)
+{
+    unsigned long i, j;
+    int rc = 0;
+
+    pthread_mutex_lock(&mock.lock);
+    for ( i = 0; i < nr_extents && !rc; ++i )
+    {
+        xen_pfn_t gfn = extent_start[i];
+
+        rc = mock_grow(gfn + (1UL << extent_order) - 1);
+        for ( j = 0; !rc && j < (1UL << extent_order); ++j )
+        {
+            if ( !test_and_set_bit(gfn + j, mock.populated) )
+                mock.nr_populated++;
+        }
+    }
+    pthread_mutex_unlock(&mock.lock);
+
+    return rc;
+}
+
+int xc_clear_domain_pages(xc_interface *xch, uint32_t domid,
+                          unsigned long dst_pfn, int num)
+{
+    int rc;
+
+    /* Punch the pages out, which reads back as zeroes. */
+    pthread_mutex_lock(&mock.lock);
+    rc = mock_grow(dst_pfn + num - 1) ?:
+        fallocate(mock.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)dst_pfn << PAGE_SHIFT, (off_t)num << PAGE_SHIFT);
+    pthread_mutex_unlock(&mock.lock);
+
+    return rc;
+}
+
+int xc_hvm_param_set(xc_interface *handle, uint32_t dom, uint32_t param,
+                     uint64_t value)
+{
+    return 0;
+}
+
+int xc_domain_hvm_setcontext(xc_interface *xch, uint32_t domid,
+                             uint8_t *hvm_ctxt, uint32_t size)
+{
+    return 0;
+}
+
+int xc_dom_gnttab_hvm_seed(xc_interface *xch, uint32_t domid,
+                           xen_pfn_t console_gmfn, xen_pfn_t xenstore_gmfn,
+                           uint32_t console_domid, uint32_t xenstore_domid)
+{
+    return 0;
+}
+
+int xc_domain_set_tsc_info(xc_interface *xch, uint32_t domid,
+                           uint32_t tsc_mode, uint64_t elapsed_nsec,
+                           uint32_t gtsc_khz, uint32_t incarnation)
+{
+    return 0;
+}
+
+int xc_domain_get_tsc_info(xc_interface *xch, uint32_t domid,
+                           uint32_t *tsc_mode, uint64_t *elapsed_nsec,
+                           uint32_t *gtsc_khz, uint32_t *incarnation)
+{
+    *tsc_mode = *gtsc_khz = *incarnation = 0;
+    *elapsed_nsec = 0;
+
+    return 0;
+}
+
+/* COLO only, which is not replayed. */
+int xc_shadow_control(xc_interface *xch, uint32_t domid, unsigned int sop,
+                      xc_hypercall_buffer_t *dirty_bitmap,
+                      unsigned long pages, unsigned long *mb,
+                      uint32_t mode, xc_shadow_op_stats_t *stats)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+/*----- libxenforeignmemory -----*/
+
+void *xenforeignmemory_map(xenforeignmemory_handle *fmem, uint32_t dom,
+                           int prot, size_t pages,
+                           const xen_pfn_t arr[/*pages*/],
+                           int err[/*pages*/])
+{
+    uint8_t *addr;
+    size_t i, run;
+    int first_err = 0;
+
+    if ( dom != MOCK_DOMID )
+    {
+        errno = ESRCH;
+        return NULL;
+    }
+
+    addr = mmap(NULL, pages << PAGE_SHIFT, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if ( addr == MAP_FAILED )
+        return NULL;
+
+    /* Map each run of consecutive populated gfns in one go. */
+    pthread_mutex_lock(&mock.lock);
+    for ( i = 0; i < pages; i += run )
+    {
+        if ( !mock_is_populated(arr[i]) )
+        {
+            if ( err )
+                err[i] = -EINVAL;
+            first_err = first_err ?: EINVAL;
+            run = 1;
+            continue;
+        }
+
+        for ( run = 1; i + run < pages; ++run )
+            if ( arr[i + run] != arr[i] + run ||
+                 !mock_is_populated(arr[i + run]) )
+                break;
+
+        if ( mmap(addr + (i << PAGE_SHIFT), run << PAGE_SHIFT, prot,
+                  MAP_SHARED | MAP_FIXED, mock.fd,
+                  (off_t)arr[i] << PAGE_SHIFT) == MAP_FAILED )
+        {
+            first_err = errno;
+            pthread_mutex_unlock(&mock.lock);
+            munmap(addr, pages << PAGE_SHIFT);
+            errno = first_err;
+            return NULL;
+        }
+
+        if ( err )
+            memset(&err[i], 0, run * sizeof(*err));
+    }
+    pthread_mutex_unlock(&mock.lock);
+
+    if ( first_err && !err )
+    {
+        munmap(addr, pages << PAGE_SHIFT);
+        errno = first_err;
+        return NULL;
+    }
+
+    return addr;
+}
+
+int xenforeignmemory_unmap(xenforeignmemory_handle *fmem,
+                           void *addr, size_t pages)
+{
+    return munmap(addr, pages << PAGE_SHIFT);
+}
+
+/*----- libxc's PV restore, which the mock has no use for -----*/
+
+static int mock_pv_setup(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+
+    ERROR("PV streams cannot be replayed");
+    return -1;
+}
+
+static int mock_pv_cleanup(struct xc_sr_context *ctx)
+{
+    return 0;
+}
+
+struct xc_sr_restore_ops restore_ops_x86_pv =
+{
+    .setup   = mock_pv_setup,
+    .cleanup = mock_pv_cleanup,
+};
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
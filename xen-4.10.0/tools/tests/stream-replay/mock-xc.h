@@ -0,0 +1,52 @@
+/*
+ * mock-xc.h
+ *
+ * The parts of libxenctrl and libxenforeignmemory which libxc's restore
+ * code uses, implemented for one HVM domain whose memory is a file in
+ * /dev/shm instead of a Xen guest, so that stream-replay can run
+ * xc_domain_restore() itself on a plain Linux box.
+ *
+ * Copyright (C) 2017
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef MOCK_XC_H
+#define MOCK_XC_H
+
+#include <stdint.h>
+
+#include <xenctrl.h>
+
+/* The only domain there is. */
+#define MOCK_DOMID 1
+
+/*
+ * Sets up the domain, which reports nr_pfns as its p2m size and starts
+ * without any memory, and returns the handle to restore it with.  libxc
+ * logs at level and above to stderr.  Returns NULL on failure.
+ */
+xc_interface *mock_open(xen_pfn_t nr_pfns, xentoollog_level level);
+void mock_close(xc_interface *xch);
+
+/* Pages populated so far. */
+uint64_t mock_populated(void);
+
+#endif /* MOCK_XC_H */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,849 @@
+/*
+ * stream-replay.c
+ *
+ * Records migration streams, and replays them against a mock domain, so
+ * that the restore side of migration and Remus can be benchmarked on a
+ * plain Linux box, without a second host or a running guest.
+ *
+ *   stream-replay record FILE COMMAND [ARG...]
+ *
+ *     Runs COMMAND with its stdin fed from ours, copying everything to
+ *     FILE on the way.  Its stdout is our own, so a back channel passes
+ *     straight through.  It fits in front of the receiver through xl's -s
+ *     option, for instance
+ *
+ *         xl remus -s "stream-replay record /tmp/vm.sr ssh" vm backup
+ *
+ *     The stream's own CHECKPOINT records mark the epochs in FILE.
+ *
+ *   stream-replay synth [-p PAGES] [-e EPOCHS] [-d DIRTY] [-s SEED] FILE
+ *
+ *     Writes a Remus stream of an HVM guest of PAGES pages, followed by
+ *     EPOCHS checkpoints of DIRTY randomly chosen pages each.
+ *
+ *   stream-replay replay [-v] FILE
+ *
+ *     Restores the stream as a Remus backup with libxc's own
+ *     xc_domain_restore(), built in against mock-xc.c, whose domain is
+ *     a file in /dev/shm rather than a Xen guest: the live copy is
+ *     applied as it arrives, and every later epoch is staged until its
+ *     CHECKPOINT and applied in the background while the next one is
+ *     received.  The stream is read through once first, untimed, for the
+ *     size of the guest and so that it is in the page cache.  Reports
+ *     records/s and pages/s, the time from each CHECKPOINT to the epoch
+ *     having been applied, and the memory high-water mark.
+ *
+ * FILE may be an xl save file or migration stream, a bare libxl stream or
+ * a bare libxc stream, of an x86 HVM guest.  Striped Remus connections are
+ * not recorded.
+ *
+ * Copyright (C) 2017
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <xenctrl.h>
+#include <xenguest.h>
+
+#include "xc_sr_stream_format.h"
+#include "mock-xc.h"
+
+#define ERROR(a, b...) fprintf(stderr, a "\n", ## b)
+#define PERROR(a, b...) fprintf(stderr, a ": %s\n", ## b, strerror(errno))
+
+#define PAGE_SHIFT_4K 12
+#define PAGE_SIZE_4K  (1UL << PAGE_SHIFT_4K)
+#define BATCH_PAGES   1024          /* MAX_BATCH_SIZE of the sender */
+
+#define ROUNDUP(_x,_w) (((unsigned long)(_x)+(1UL<<(_w))-1) & ~((1UL<<(_w))-1))
+
+/* xl's header, see tools/xl/xl.h */
+static const char xl_magic[32] = "Xen saved domain, xl format\n \0 \r";
+
+struct xl_hdr {
+    char magic[32];
+    uint32_t byteorder;
+    uint32_t mandatory_flags;
+    uint32_t optional_flags;
+    uint32_t optional_data_len;
+};
+
+/*
+ * libxl's framing, see tools/libxl/libxl_sr_stream_format.h, whose names
+ * clash with libxc's.  The header is big endian.
+ */
+#define LIBXL_STREAM_IDENT      0x4c6962786c466d74ULL
+#define LIBXL_STREAM_VERSION    2
+#define LIBXL_REC_END           0x00000000U
+#define LIBXL_REC_LIBXC_CONTEXT 0x00000001U
+#define LIBXL_REC_CHECKPOINT_END 0x00000004U
+
+struct libxl_hdr {
+    uint64_t ident;
+    uint32_t version;
+    uint32_t options;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int write_exact(int fd, const void *data, size_t size)
+{
+    const char *p = data;
+    ssize_t r;
+
+    while ( size )
+    {
+        r = write(fd, p, size);
+        if ( r < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            return -1;
+        }
+        p += r;
+        size -= r;
+    }
+
+    return 0;
+}
+
+/*----- record -----*/
+
+static int do_record(int argc, char **argv)
+{
+    static char buf[1 << 16];
+    uint64_t bytes = 0;
+    int fd, p[2], status;
+    bool forwarding = true;
+    ssize_t r;
+    pid_t pid;
+
+    if ( argc < 3 )
+    {
+        ERROR("usage: stream-replay record FILE COMMAND [ARG...]");
+        return 2;
+    }
+
+    fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ( fd < 0 )
+    {
+        PERROR("Unable to open %s", argv[1]);
+        return 1;
+    }
+
+    if ( pipe(p) )
+    {
+        PERROR("Unable to create pipe");
+        return 1;
+    }
+
+    pid = fork();
+    if ( pid < 0 )
+    {
+        PERROR("Unable to fork");
+        return 1;
+    }
+    if ( !pid )
+    {
+        close(fd);
+        close(p[1]);
+        if ( dup2(p[0], STDIN_FILENO) < 0 )
+            _exit(127);
+        close(p[0]);
+        execvp(argv[2], &argv[2]);
+        PERROR("Unable to exec %s", argv[2]);
+        _exit(127);
+    }
+
+    close(p[0]);
+    signal(SIGPIPE, SIG_IGN);
+
+    for ( ;; )
+    {
+        r = read(STDIN_FILENO, buf, sizeof(buf));
+        if ( r < 0 && errno == EINTR )
+            continue;
+        if ( r < 0 )
+        {
+            PERROR("Unable to read the stream");
+            break;
+        }
+        if ( r == 0 )
+            break;
+
+        /* Keep recording what the sender had to say if the receiver goes. */
+        if ( forwarding && write_exact(p[1], buf, r) )
+        {
+            PERROR("Unable to forward the stream to %s", argv[2]);
+            forwarding = false;
+        }
+        if ( write_exact(fd, buf, r) )
+        {
+            PERROR("Unable to write %s", argv[1]);
+            break;
+        }
+        bytes += r;
+    }
+
+    close(p[1]);
+    if ( fsync(fd) || close(fd) )
+        PERROR("Unable to write %s", argv[1]);
+
+    fprintf(stderr, "stream-replay: recorded %"PRIu64" bytes to %s\n",
+            bytes, argv[1]);
+
+    while ( waitpid(pid, &status, 0) < 0 )
+        if ( errno != EINTR )
+            return 1;
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+/*----- synth -----*/
+
+struct synth {
+    FILE *f;
+    uint64_t pfns[BATCH_PAGES];
+    unsigned nr;
+    uint8_t *pages;
+    uint64_t tag;
+};
+
+static void synth_write(struct synth *s, const void *data, size_t len)
+{
+    static const uint8_t pad[8];
+
+    if ( fwrite(data, 1, len, s->f) != len ||
+         (len & 7 && fwrite(pad, 1, 8 - (len & 7), s->f) != 8 - (len & 7)) )
+    {
+        PERROR("Unable to write the stream");
+        exit(1);
+    }
+}
+
+static void synth_rec(struct synth *s, uint32_t type, const void *body,
+                      uint32_t len)
+{
+    struct xc_sr_rhdr rhdr = { type, len };
+
+    synth_write(s, &rhdr, sizeof(rhdr));
+    if ( len )
+        synth_write(s, body, len);
+}
+
+static void synth_flush(struct synth *s)
+{
+    struct xc_sr_rec_page_data_header hdr = { s->nr, 0 };
+    struct xc_sr_rhdr rhdr;
+    unsigned i;
+
+    if ( !s->nr )
+        return;
+
+    rhdr.type = REC_TYPE_PAGE_DATA;
+    rhdr.length = sizeof(hdr) + s->nr * (sizeof(uint64_t) + PAGE_SIZE_4K);
+
+    /* Something other than zeroes, and different every time. */
+    for ( i = 0; i < s->nr; ++i )
+        memset(s->pages + i * PAGE_SIZE_4K, (uint8_t)(s->pfns[i] + s->tag),
+               PAGE_SIZE_4K);
+    s->tag++;
+
+    if ( fwrite(&rhdr, sizeof(rhdr), 1, s->f) != 1 ||
+         fwrite(&hdr, sizeof(hdr), 1, s->f) != 1 ||
+         fwrite(s->pfns, sizeof(uint64_t), s->nr, s->f) != s->nr ||
+         fwrite(s->pages, PAGE_SIZE_4K, s->nr, s->f) != s->nr )
+    {
+        PERROR("Unable to write the stream");
+        exit(1);
+    }
+
+    s->nr = 0;
+}
+
+static void synth_page(struct synth *s, uint64_t pfn)
+{
+    /* XEN_DOMCTL_PFINFO_NOTAB: a page of data, no type in the upper bits */
+    s->pfns[s->nr++] = pfn;
+    if ( s->nr == BATCH_PAGES )
+        synth_flush(s);
+}
+
+static void synth_checkpoint(struct synth *s)
+{
+    synth_flush(s);
+    synth_rec(s, REC_TYPE_CHECKPOINT, NULL, 0);
+    synth_rec(s, LIBXL_REC_CHECKPOINT_END, NULL, 0);
+}
+
+static int do_synth(int argc, char **argv)
+{
+    unsigned long pages = 65536, epochs = 100, dirty = 1024, e, i;
+    unsigned int seed = 1;
+    struct libxl_hdr lhdr = {
+        .ident = htobe64(LIBXL_STREAM_IDENT),
+        .version = htobe32(LIBXL_STREAM_VERSION),
+    };
+    struct xc_sr_ihdr ihdr = {
+        .marker = IHDR_MARKER,
+        .id = htonl(IHDR_ID),
+        .version = htonl(IHDR_VERSION),
+        .options = htons(IHDR_OPT_LITTLE_ENDIAN),
+    };
+    struct xc_sr_dhdr dhdr = {
+        .type = DHDR_TYPE_X86_HVM,
+        .page_shift = PAGE_SHIFT_4K,
+        .xen_major = 4,
+        .xen_minor = 10,
+    };
+    struct synth s = { 0 };
+    uint8_t *bitmap;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "p:e:d:s:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'p': pages = strtoul(optarg, NULL, 0); break;
+        case 'e': epochs = strtoul(optarg, NULL, 0); break;
+        case 'd': dirty = strtoul(optarg, NULL, 0); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        default: goto usage;
+        }
+    }
+    if ( optind != argc - 1 || !pages || dirty > pages )
+        goto usage;
+
+    s.f = fopen(argv[optind], "w");
+    s.pages = malloc(BATCH_PAGES * PAGE_SIZE_4K);
+    bitmap = malloc(pages);
+    if ( !s.f || !s.pages || !bitmap )
+    {
+        PERROR("Unable to set up %s", argv[optind]);
+        return 1;
+    }
+    srand(seed);
+
+    synth_write(&s, &lhdr, sizeof(lhdr));
+    synth_rec(&s, LIBXL_REC_LIBXC_CONTEXT, NULL, 0);
+    synth_write(&s, &ihdr, sizeof(ihdr));
+    synth_write(&s, &dhdr, sizeof(dhdr));
+
+    /* The live copy, then the checkpoints in dirty bitmap order. */
+    for ( i = 0; i < pages; ++i )
+        synth_page(&s, i);
+    synth_checkpoint(&s);
+
+    for ( e = 0; e < epochs; ++e )
+    {
+        unsigned long n = 0;
+
+        memset(bitmap, 0, pages);
+        while ( n < dirty )
+        {
+            i = ((unsigned long)rand() * (RAND_MAX + 1UL) + rand()) % pages;
+            if ( !bitmap[i] )
+            {
+                bitmap[i] = 1;
+                n++;
+            }
+        }
+        for ( i = 0; i < pages; ++i )
+            if ( bitmap[i] )
+                synth_page(&s, i);
+        synth_checkpoint(&s);
+    }
+
+    synth_rec(&s, REC_TYPE_END, NULL, 0);
+    synth_rec(&s, LIBXL_REC_END, NULL, 0);
+
+    if ( fclose(s.f) )
+    {
+        PERROR("Unable to write %s", argv[optind]);
+        return 1;
+    }
+
+    free(bitmap);
+    free(s.pages);
+    return 0;
+
+ usage:
+    ERROR("usage: stream-replay synth [-p PAGES] [-e EPOCHS] [-d DIRTY]"
+          " [-s SEED] FILE");
+    return 2;
+}
+
+/*----- replay: scanning the stream -----*/
+
+struct replay {
+    FILE *f;
+    size_t pos;
+    bool verbose;
+    void *body;
+    size_t body_size;
+
+    /* Found by the scan. */
+    bool libxl;             /* libxc's stream is within libxl's framing */
+    size_t libxc_pos;       /* where libxc's stream starts */
+    uint64_t max_pfn;
+    unsigned long records, libxl_records, pages, live_pages, epochs;
+
+    /* Kept by the callbacks during the replay. */
+    int fd;
+    unsigned long applied;
+    uint64_t handover_ns;
+    uint64_t *apply_ns;
+    unsigned long nr_apply, allocated_apply;
+};
+
+static int scan_read(struct replay *r, void *data, size_t len)
+{
+    if ( len && fread(data, len, 1, r->f) != 1 )
+    {
+        ERROR("Stream truncated at offset %zu, wanted %zu bytes", r->pos, len);
+        return -1;
+    }
+    r->pos += len;
+
+    return 0;
+}
+
+/* A record with an xc_sr_rhdr style header, libxc's or libxl's. */
+static const void *scan_rec(struct replay *r, uint32_t *type, uint32_t *len)
+{
+    struct xc_sr_rhdr rhdr;
+    size_t size;
+
+    if ( scan_read(r, &rhdr, sizeof(rhdr)) )
+        return NULL;
+
+    *type = rhdr.type;
+    *len = rhdr.length;
+    if ( *len > REC_LENGTH_MAX )
+    {
+        ERROR("Record of type %#x at offset %zu too long (%u bytes)",
+              *type, r->pos - sizeof(rhdr), *len);
+        return NULL;
+    }
+
+    /* Even an empty record has a body to return. */
+    size = ROUNDUP(*len, REC_ALIGN_ORDER);
+    if ( !r->body || size > r->body_size )
+    {
+        void *body = realloc(r->body, size ?: 1);
+
+        if ( !body )
+        {
+            PERROR("Unable to allocate %zu bytes", size);
+            return NULL;
+        }
+        r->body = body;
+        r->body_size = size;
+    }
+
+    if ( scan_read(r, r->body, size) )
+        return NULL;
+    r->records++;
+
+    return r->body;
+}
+
+static int scan_page_data(struct replay *r, const void *body, uint32_t len)
+{
+    const struct xc_sr_rec_page_data_header *hdr = body;
+    uint64_t pfn;
+    unsigned i;
+
+    if ( len < sizeof(*hdr) ||
+         len < sizeof(*hdr) + (uint64_t)hdr->count * sizeof(uint64_t) )
+    {
+        ERROR("Bad PAGE_DATA record at offset %zu", r->pos);
+        return -1;
+    }
+
+    for ( i = 0; i < hdr->count; ++i )
+    {
+        pfn = hdr->pfn[i] & PAGE_DATA_PFN_MASK;
+        if ( pfn > r->max_pfn )
+            r->max_pfn = pfn;
+    }
+
+    r->pages += hdr->count;
+    if ( !r->epochs )
+        r->live_pages += hdr->count;
+
+    return 0;
+}
+
+/* The libxc part of the stream, up to a CHECKPOINT or END. */
+static int scan_libxc(struct replay *r, bool *end)
+{
+    uint32_t type, len;
+    const void *body;
+
+    for ( ;; )
+    {
+        body = scan_rec(r, &type, &len);
+        if ( !body )
+            return -1;
+
+        switch ( type )
+        {
+        case REC_TYPE_END:
+            *end = true;
+            return 0;
+
+        case REC_TYPE_PAGE_DATA:
+            if ( scan_page_data(r, body, len) )
+                return -1;
+            break;
+
+        case REC_TYPE_CHECKPOINT:
+            r->epochs++;
+            return 0;
+        }
+    }
+}
+
+static int scan_libxc_headers(struct replay *r)
+{
+    struct xc_sr_ihdr ihdr;
+    struct xc_sr_dhdr dhdr;
+
+    r->libxc_pos = r->pos;
+    if ( scan_read(r, &ihdr, sizeof(ihdr)) ||
+         scan_read(r, &dhdr, sizeof(dhdr)) )
+        return -1;
+
+    if ( ihdr.marker != IHDR_MARKER || ntohl(ihdr.id) != IHDR_ID ||
+         ntohl(ihdr.version) != IHDR_VERSION ||
+         ntohs(ihdr.options) & IHDR_OPT_BIG_ENDIAN )
+    {
+        ERROR("Not a little endian libxc v%u stream", IHDR_VERSION);
+        return -1;
+    }
+
+    if ( dhdr.type != DHDR_TYPE_X86_HVM )
+    {
+        ERROR("Only x86 HVM streams can be replayed");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Reads the stream through once, untimed, for the size of the guest and
+ * the counts to report, and to have it in the page cache for the replay.
+ */
+static int scan_stream(struct replay *r)
+{
+    struct xl_hdr xhdr;
+    struct libxl_hdr lhdr;
+    uint64_t marker;
+    uint32_t type, len;
+    bool end = false, in_libxc = false;
+
+    if ( fread(&xhdr, sizeof(xhdr), 1, r->f) == 1 &&
+         !memcmp(xhdr.magic, xl_magic, sizeof(xl_magic)) )
+        r->pos = sizeof(xhdr) + xhdr.optional_data_len;
+
+    if ( fseeko(r->f, r->pos, SEEK_SET) )
+    {
+        PERROR("Unable to seek to offset %zu", r->pos);
+        return -1;
+    }
+
+    /* A bare libxc stream starts with the marker. */
+    if ( fread(&marker, sizeof(marker), 1, r->f) == 1 &&
+         marker == IHDR_MARKER )
+    {
+        if ( fseeko(r->f, r->pos, SEEK_SET) || scan_libxc_headers(r) )
+            return -1;
+        while ( !end )
+            if ( scan_libxc(r, &end) )
+                return -1;
+        return 0;
+    }
+
+    if ( fseeko(r->f, r->pos, SEEK_SET) ||
+         scan_read(r, &lhdr, sizeof(lhdr)) )
+        return -1;
+    if ( be64toh(lhdr.ident) != LIBXL_STREAM_IDENT ||
+         be32toh(lhdr.version) != LIBXL_STREAM_VERSION )
+    {
+        ERROR("Not an xl, libxl or libxc stream");
+        return -1;
+    }
+    r->libxl = true;
+
+    /*
+     * libxl hands the stream to libxc at LIBXC_CONTEXT, libxc hands it
+     * back at each CHECKPOINT (and at END), and libxl hands it back to
+     * libxc again at CHECKPOINT_END.
+     */
+    for ( ;; )
+    {
+        if ( in_libxc )
+        {
+            if ( scan_libxc(r, &end) )
+                return -1;
+            in_libxc = false;
+            continue;
+        }
+
+        if ( !scan_rec(r, &type, &len) )
+            return -1;
+        r->libxl_records++;
+
+        switch ( type )
+        {
+        case LIBXL_REC_END:
+            return 0;
+
+        case LIBXL_REC_LIBXC_CONTEXT:
+            if ( scan_libxc_headers(r) )
+                return -1;
+            in_libxc = true;
+            break;
+
+        case LIBXL_REC_CHECKPOINT_END:
+            in_libxc = !end;
+            break;
+        }
+    }
+}
+
+/*----- replay: through xc_domain_restore() -----*/
+
+/*
+ * The checkpoint callback, standing in for libxl: its records follow each
+ * CHECKPOINT, up to CHECKPOINT_END.  The end of the stream is a failover.
+ */
+static int replay_checkpoint(void *data)
+{
+    struct replay *r = data;
+    struct xc_sr_rhdr rhdr;
+
+    while ( r->libxl )
+    {
+        if ( read(r->fd, &rhdr, sizeof(rhdr)) != sizeof(rhdr) ||
+             lseek(r->fd, ROUNDUP(rhdr.length, REC_ALIGN_ORDER),
+                   SEEK_CUR) < 0 ||
+             rhdr.type == LIBXL_REC_END )
+            return XGR_CHECKPOINT_FAILOVER;
+
+        if ( rhdr.type == LIBXL_REC_CHECKPOINT_END )
+            break;
+    }
+
+    r->handover_ns = now_ns();
+
+    return XGR_CHECKPOINT_SUCCESS;
+}
+
+/*
+ * Called, on the restore code's applier thread, once each checkpoint which
+ * replay_checkpoint() accepted has been applied to the domain.
+ */
+static void replay_checkpoint_applied(void *data)
+{
+    struct replay *r = data;
+    uint64_t t = now_ns() - r->handover_ns;
+
+    /* The first ends the live copy, which was applied as it arrived. */
+    if ( !r->applied++ )
+        return;
+
+    if ( r->nr_apply == r->allocated_apply )
+    {
+        unsigned long n = r->allocated_apply * 2 ?: 256;
+        uint64_t *a = realloc(r->apply_ns, n * sizeof(*a));
+
+        if ( !a )
+            return;
+        r->apply_ns = a;
+        r->allocated_apply = n;
+    }
+    r->apply_ns[r->nr_apply++] = t;
+
+    if ( r->verbose )
+        printf("epoch %lu: applied %"PRIu64" us after its CHECKPOINT\n",
+               r->applied - 1, t / 1000);
+}
+
+static int replay_stream(struct replay *r, xc_interface *xch)
+{
+    struct restore_callbacks callbacks = {
+        .checkpoint = replay_checkpoint,
+        .checkpoint_applied = replay_checkpoint_applied,
+        .data = r,
+    };
+    unsigned long store_gfn, console_gfn;
+
+    if ( lseek(r->fd, r->libxc_pos, SEEK_SET) < 0 )
+    {
+        PERROR("Unable to seek to offset %zu", r->libxc_pos);
+        return -1;
+    }
+
+    return xc_domain_restore(xch, r->fd, MOCK_DOMID, 0, &store_gfn, 0,
+                             0, &console_gfn, 0, 1, 0, XC_MIG_STREAM_REMUS,
+                             &callbacks, -1, 0, NULL, 0, 0, 0);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report(struct replay *r, uint64_t ns)
+{
+    double secs = ns / 1e9;
+    struct rusage ru;
+    uint64_t sum = 0;
+    unsigned long i, n = r->nr_apply;
+
+    printf("stream:  %zu bytes, %lu records (%lu libxl), %lu checkpoints\n",
+           r->pos, r->records, r->libxl_records, r->epochs);
+    printf("replay:  %.3f s, %.0f records/s, %.0f pages/s, %.1f MB/s\n",
+           secs, r->records / secs, r->pages / secs,
+           r->pos / secs / (1 << 20));
+    printf("pages:   %lu in the live copy, %lu in checkpoints\n",
+           r->live_pages, r->pages - r->live_pages);
+
+    if ( n )
+    {
+        qsort(r->apply_ns, n, sizeof(*r->apply_ns), cmp_u64);
+        for ( i = 0; i < n; ++i )
+            sum += r->apply_ns[i];
+        printf("apply:   %lu epochs, min %"PRIu64" us, avg %"PRIu64" us,"
+               " p50 %"PRIu64" us, p99 %"PRIu64" us, max %"PRIu64" us\n",
+               n, r->apply_ns[0] / 1000, sum / n / 1000,
+               r->apply_ns[n / 2] / 1000, r->apply_ns[n * 99 / 100] / 1000,
+               r->apply_ns[n - 1] / 1000);
+    }
+
+    getrusage(RUSAGE_SELF, &ru);
+    printf("memory:  %"PRIu64" MB of guest populated, %ld MB peak RSS"
+           " (with the guest)\n",
+           mock_populated() * PAGE_SIZE_4K >> 20, ru.ru_maxrss >> 10);
+}
+
+static int do_replay(int argc, char **argv)
+{
+    struct replay r = { .fd = -1 };
+    xc_interface *xch = NULL;
+    uint64_t t = 0;
+    int opt, rc = -1;
+
+    while ( (opt = getopt(argc, argv, "v")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'v': r.verbose = true; break;
+        default: goto usage;
+        }
+    }
+    if ( optind != argc - 1 )
+        goto usage;
+
+    r.f = fopen(argv[optind], "r");
+    r.fd = open(argv[optind], O_RDONLY);
+    if ( !r.f || r.fd < 0 )
+    {
+        PERROR("Unable to open %s", argv[optind]);
+        goto out;
+    }
+
+    if ( scan_stream(&r) )
+    {
+        ERROR("Unable to scan %s", argv[optind]);
+        goto out;
+    }
+
+    xch = mock_open(r.max_pfn + 1, r.verbose ? XTL_INFO : XTL_WARN);
+    if ( !xch )
+    {
+        PERROR("Unable to set up the mock domain");
+        goto out;
+    }
+
+    t = now_ns();
+    rc = replay_stream(&r, xch);
+    t = now_ns() - t;
+
+    if ( rc )
+        ERROR("Replay failed");
+    report(&r, t);
+
+ out:
+    if ( xch )
+        mock_close(xch);
+    if ( r.fd >= 0 )
+        close(r.fd);
+    if ( r.f )
+        fclose(r.f);
+    free(r.apply_ns);
+    free(r.body);
+
+    return rc ? 1 : 0;
+
+ usage:
+    ERROR("usage: stream-replay replay [-v] FILE");
+    return 2;
+}
+
+int main(int argc, char **argv)
+{
+    if ( argc >= 2 && !strcmp(argv[1], "record") )
+        return do_record(argc - 1, argv + 1);
+    if ( argc >= 2 && !strcmp(argv[1], "synth") )
+        return do_synth(argc - 1, argv + 1);
+    if ( argc >= 2 && !strcmp(argv[1], "replay") )
+        return do_replay(argc - 1, argv + 1);
+
+    ERROR("usage: stream-replay record|synth|replay ...");
+    return 2;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -46,6 +46,19 @@ struct domain_create {
     const char *restore_file;
     char *colo_proxy_script;
     bool userspace_colo_proxy;
+    int heartbeat_port; /* Remus backup: 0 means no heartbeat */
+    int heartbeat_period; /* us */
+    int heartbeat_misses;
+    uint64_t heartbeat_nonce;
+    char *heartbeat_peer; /* numeric address of the primary, or NULL */
+    int liveness_timeout; /* Remus backup: ms, 0 means wait forever */
+    bool checkpoint_ack; /* Remus backup: acknowledge checkpoints */
+    int disk_port; /* Remus backup: 0 means no disk replication */
+    int stream_port; /* Remus backup: with streams, for striped memory */
+    int streams; /* Remus backup: 0 means no striped streams */
+    int history_epochs; /* Remus backup: 0 means no checkpoint history */
+    int history_mb;
+    int rollback; /* Remus backup: checkpoints to go back on failover */
     int migrate_fd; /* -1 means none */
     int send_back_fd; /* -1 means none */
     char **migration_domname_r; /* from malloc */
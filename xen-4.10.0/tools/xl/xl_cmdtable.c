@@ -527,7 +527,8 @@ struct cmd_spec cmd_table[] = {
     { "remus",
       &main_remus, 0, 1,
       "Enable Remus HA for domain",
-      "[options] <Domain> [<host>]",
+      "[options] <Domain>[,<Domain>...] [<host>]",
+      "Several comma separated domains are checkpointed together as a group.\n"
       "-i MS                   Checkpoint domain memory every MS milliseconds (def. 200ms).\n"
       "-u                      Disable memory checkpoint compression.\n"
       "-s <sshcommand>         Use <sshcommand> instead of ssh.  String will be passed\n"
@@ -547,7 +548,34 @@ struct cmd_spec cmd_table[] = {
       "                        checkpoint must be disabled.\n"
       "-p                      Use COLO userspace proxy.\n"
       "-E                      Use event-driven instead of periodic checkpointing. Needs DomU support.\n"
-      "-t                      Timeout for heartbeat after which failover shall be triggered.\n"
+      "-t MS                   Fail over once the backup has received nothing from the\n"
+      "                        primary for MS milliseconds.\n"
+      "--heartbeat-port=PORT   With -t, also send a UDP heartbeat to PORT on <host>.\n"
+      "--heartbeat-period=US   Send the UDP heartbeat every US microseconds (def. a third\n"
+      "                        of -t).\n"
+      "--no-output-ack         Release network output once a checkpoint has been sent,\n"
+      "                        without waiting for the backup to acknowledge it.\n"
+      "--interval-max=MS       Adapt the checkpoint interval to the guest's dirty rate\n"
+      "                        and network output, up to MS milliseconds.\n"
+      "--interval-min=MS       With --interval-max, never checkpoint more often than\n"
+      "                        every MS milliseconds (def. a quarter of -i).\n"
+      "--max-bandwidth=KIBPS   With --interval-max, lengthen the interval while a\n"
+      "                        checkpoint would need more than KIBPS KiB/s.\n"
+      "--precopy=MS            Between checkpoints, send dirty memory every MS\n"
+      "                        milliseconds while the domain keeps running.\n"
+      "--fast-ipc              Exchange checkpoint callbacks with the save helper\n"
+      "                        through shared memory.\n"
+      "--stats=FILE            Append per-phase timings of every checkpoint to\n"
+      "                        FILE.\n"
+      "--disk-port=PORT        Replicate raw images served by tapdisk to <host> over\n"
+      "                        TCP ports from PORT on, without DRBD.\n"
+      "--streams=N             Spread the memory of each checkpoint over N extra\n"
+      "--stream-port=PORT      TCP connections to PORT on <host>.\n"
+      "--history=N             Have the backup keep the N checkpoints before the last.\n"
+      "--history-mb=MB         Keep no more of them than fit in MB MiB (def. 256).\n"
+      "--rollback=N            Fail over to N checkpoints before the last (def. 0).\n"
+      "--boost=PRIO            Run the save helper and netback SCHED_FIFO at PRIO\n"
+      "                        while a checkpoint is taken.\n"
     },
 #endif
     { "devd",
@@ -323,7 +323,13 @@ static void migrate_receive(int debug, int daemonize, int monitor,
                             int send_fd, int recv_fd,
                             libxl_checkpointed_stream checkpointed,
                             char *colo_proxy_script,
-                            bool userspace_colo_proxy)
+                            bool userspace_colo_proxy,
+                            int heartbeat_port, int heartbeat_period,
+                            int heartbeat_misses, uint64_t heartbeat_nonce,
+                            char *heartbeat_peer, int liveness_timeout,
+                            bool checkpoint_ack, int disk_port,
+                            int stream_port, int streams,
+                            int history_epochs, int history_mb, int rollback)
 {
     uint32_t domid;
     int rc, rc2;
@@ -331,10 +337,8 @@ static void migrate_receive(int debug, int daemonize, int monitor,
     char *migration_domname;
     struct domain_create dom_info;
     libxl_device_nic *nics;
-    struct timeval tv;
     int nb, i;
-
-    FILE *log;
+    struct timespec restored, unpaused, resumed;
 
     signal(SIGPIPE, SIG_IGN);
     /* if we get SIGPIPE we'd rather just have it as an error */
@@ -357,6 +361,19 @@ static void migrate_receive(int debug, int daemonize, int monitor,
     dom_info.checkpointed_stream = checkpointed;
     dom_info.colo_proxy_script = colo_proxy_script;
     dom_info.userspace_colo_proxy = userspace_colo_proxy;
+    dom_info.heartbeat_port = heartbeat_port;
+    dom_info.heartbeat_period = heartbeat_period;
+    dom_info.heartbeat_misses = heartbeat_misses;
+    dom_info.heartbeat_nonce = heartbeat_nonce;
+    dom_info.heartbeat_peer = heartbeat_peer;
+    dom_info.liveness_timeout = liveness_timeout;
+    dom_info.checkpoint_ack = checkpoint_ack;
+    dom_info.disk_port = disk_port;
+    dom_info.stream_port = stream_port;
+    dom_info.streams = streams;
+    dom_info.history_epochs = history_epochs;
+    dom_info.history_mb = history_mb;
+    dom_info.rollback = rollback;
 
     rc = create_domain(&dom_info);
     if (rc < 0) {
@@ -373,6 +390,8 @@ static void migrate_receive(int debug, int daemonize, int monitor,
     {
         const char *ha = checkpointed == LIBXL_CHECKPOINTED_STREAM_COLO ?
                          "COLO" : "Remus";
+
+        clock_gettime(CLOCK_MONOTONIC, &restored);
         /* If we are here, it means that the sender (primary) has crashed.
          * TODO: Split-Brain Check.
          */
@@ -408,10 +427,12 @@ static void migrate_receive(int debug, int daemonize, int monitor,
             fprintf(stderr, "migration target (%s): "
                     "Failed to unpause domain %s (id: %u):%d\n",
                     ha, common_domname, domid, rc);
+        clock_gettime(CLOCK_MONOTONIC, &unpaused);
 
         /*
          * For a fast network failover we need to send a gratuitous
-         * arp request for all nics used by the restored domain.
+         * arp request for all nics used by the restored domain.  Their
+         * vifs were plugged in ahead of time, and are already up.
          */
         nics = libxl_device_nic_list(ctx, domid, &nb);
         if (nics && nb) {
@@ -419,11 +440,22 @@ static void migrate_receive(int debug, int daemonize, int monitor,
                 libxl_device_nic_send_gratuitous_arp(ctx, &nics[i]);
             }
         }
-        log = fopen("/tmp/remus_trace.log", "a");
-        gettimeofday(&tv, NULL);
-        fprintf(log, "Domain resumed at backup. Time: %lu\n", tv.tv_sec*1000000+tv.tv_usec);
 
-        fclose(log);
+        /*
+         * The restore helper has already logged how long it took to bring
+         * the domain to a consistent state once the stream was lost; this
+         * covers the remainder, up to the guest running and announced.
+         */
+        clock_gettime(CLOCK_MONOTONIC, &resumed);
+        fprintf(stderr, "migration target (%s): domain %u running, "
+                "%ld us after restore completed (unpause %ld us, "
+                "announce %ld us)\n", ha, domid,
+                (long)((resumed.tv_sec - restored.tv_sec) * 1000000L +
+                       (resumed.tv_nsec - restored.tv_nsec) / 1000),
+                (long)((unpaused.tv_sec - restored.tv_sec) * 1000000L +
+                       (unpaused.tv_nsec - restored.tv_nsec) / 1000),
+                (long)((resumed.tv_sec - unpaused.tv_sec) * 1000000L +
+                       (resumed.tv_nsec - unpaused.tv_nsec) / 1000));
 
         exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
     }
@@ -507,11 +539,31 @@ int main_migrate_receive(int argc, char **argv)
     int opt;
     bool userspace_colo_proxy = false;
     char *script = NULL;
+    int heartbeat_port = 0, heartbeat_period = 0, heartbeat_misses = 0;
+    uint64_t heartbeat_nonce = 0;
+    char *heartbeat_peer = NULL, *ssh_conn;
+    int liveness_timeout = 0;
+    bool checkpoint_ack = false;
+    int disk_port = 0, stream_port = 0, streams = 0;
+    int history_epochs = 0, history_mb = 0, rollback = 0;
     static struct option opts[] = {
         {"colo", 0, 0, 0x100},
         /* It is a shame that the management code for disk is not here. */
         {"coloft-script", 1, 0, 0x200},
         {"userspace-colo-proxy", 0, 0, 0x300},
+        {"heartbeat-port", 1, 0, 0x400},
+        {"heartbeat-period", 1, 0, 0x500},
+        {"heartbeat-misses", 1, 0, 0x600},
+        {"liveness-timeout", 1, 0, 0x700},
+        {"checkpoint-ack", 0, 0, 0x800},
+        {"disk-port", 1, 0, 0x900},
+        {"stream-port", 1, 0, 0xa00},
+        {"streams", 1, 0, 0xb00},
+        {"history", 1, 0, 0xc00},
+        {"history-mb", 1, 0, 0xd00},
+        {"rollback", 1, 0, 0xe00},
+        {"heartbeat-nonce", 1, 0, 0xf00},
+        {"heartbeat-peer", 1, 0, 0x1000},
         COMMON_LONG_OPTS
     };
 
@@ -538,6 +590,45 @@ int main_migrate_receive(int argc, char **argv)
     case 0x300:
         userspace_colo_proxy = true;
         break;
+    case 0x400:
+        heartbeat_port = atoi(optarg);
+        break;
+    case 0x500:
+        heartbeat_period = atoi(optarg);
+        break;
+    case 0x600:
+        heartbeat_misses = atoi(optarg);
+        break;
+    case 0x700:
+        liveness_timeout = atoi(optarg);
+        break;
+    case 0x800:
+        checkpoint_ack = true;
+        break;
+    case 0x900:
+        disk_port = atoi(optarg);
+        break;
+    case 0xa00:
+        stream_port = atoi(optarg);
+        break;
+    case 0xb00:
+        streams = atoi(optarg);
+        break;
+    case 0xc00:
+        history_epochs = atoi(optarg);
+        break;
+    case 0xd00:
+        history_mb = atoi(optarg);
+        break;
+    case 0xe00:
+        rollback = atoi(optarg);
+        break;
+    case 0xf00:
+        heartbeat_nonce = strtoull(optarg, NULL, 0);
+        break;
+    case 0x1000:
+        heartbeat_peer = optarg;
+        break;
     case 'p':
         pause_after_migration = 1;
         break;
@@ -547,9 +638,19 @@ int main_migrate_receive(int argc, char **argv)
         help("migrate-receive");
         return EXIT_FAILURE;
     }
+
+    /* Started by the primary through ssh: the beats come from that host. */
+    ssh_conn = getenv("SSH_CONNECTION");
+    if (heartbeat_port && !heartbeat_peer && ssh_conn && *ssh_conn)
+        heartbeat_peer = strndup(ssh_conn, strcspn(ssh_conn, " "));
+
     migrate_receive(debug, daemonize, monitor, pause_after_migration,
                     STDOUT_FILENO, STDIN_FILENO,
-                    checkpointed, script, userspace_colo_proxy);
+                    checkpointed, script, userspace_colo_proxy,
+                    heartbeat_port, heartbeat_period, heartbeat_misses,
+                    heartbeat_nonce, heartbeat_peer, liveness_timeout, checkpoint_ack, disk_port,
+                    stream_port, streams, history_epochs, history_mb,
+                    rollback);
 
     return EXIT_SUCCESS;
 }
@@ -626,25 +727,66 @@ int main_migrate(int argc, char **argv)
     return EXIT_SUCCESS;
 }
 
+/* The limits libxl puts on the heartbeat. */
+#define HEARTBEAT_PERIOD_MAX 60000000
+#define HEARTBEAT_MISSES_MAX 10000
+
+/* Tells this session's beats apart from any others the backup hears. */
+static uint64_t heartbeat_nonce(void)
+{
+    uint64_t nonce;
+    int fd;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || libxl_read_exactly(ctx, fd, &nonce, sizeof(nonce),
+                                     "/dev/urandom", "heartbeat nonce")) {
+        fprintf(stderr, "Remus: cannot pick a heartbeat nonce\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    return nonce;
+}
+
 int main_remus(int argc, char **argv)
 {
-    uint32_t domid;
+    uint32_t *domids;
     int opt, rc, daemonize = 1;
     const char *ssh_command = "ssh";
     char *host = NULL, *rune = NULL;
-    char *new_domname;
+    char *new_domname, *doms, *dom, *saveptr = NULL;
+    const char **domnames;
     libxl_domain_remus_info r_info;
-    int send_fd = -1, recv_fd = -1;
+    int *send_fds, *recv_fds;
+    int i, nr = 1, nr_alive = 0;
     pid_t child = -1;
-    pid_t hb_child = -1;
-    pid_t hb_child_pgid;
     uint8_t *config_data;
     int config_len;
-    char *runhb;
+    char *receive_args = NULL;
+    int history_epochs = 0, history_mb = 0, rollback = 0;
+    static struct option opts[] = {
+        {"heartbeat-port", 1, 0, 0x100},
+        {"heartbeat-period", 1, 0, 0x200},
+        {"no-output-ack", 0, 0, 0x300},
+        {"interval-min", 1, 0, 0x400},
+        {"interval-max", 1, 0, 0x500},
+        {"max-bandwidth", 1, 0, 0x600},
+        {"precopy", 1, 0, 0x700},
+        {"fast-ipc", 0, 0, 0x800},
+        {"stats", 1, 0, 0x900},
+        {"disk-port", 1, 0, 0xa00},
+        {"streams", 1, 0, 0xb00},
+        {"stream-port", 1, 0, 0xc00},
+        {"history", 1, 0, 0xd00},
+        {"history-mb", 1, 0, 0xe00},
+        {"rollback", 1, 0, 0xf00},
+        {"boost", 1, 0, 0x1000},
+        COMMON_LONG_OPTS
+    };
 
     memset(&r_info, 0, sizeof(libxl_domain_remus_info));
 
-    SWITCH_FOREACH_OPT(opt, "Fbundi:s:N:ecEpt:", NULL, "remus", 2) {
+    SWITCH_FOREACH_OPT(opt, "Fbundi:s:N:ecEpt:", opts, "remus", 2) {
     case 'i':
         r_info.interval = atoi(optarg);
         break;
@@ -683,9 +825,76 @@ int main_remus(int argc, char **argv)
         break;
     case 'p':
         libxl_defbool_set(&r_info.userspace_colo_proxy, true);
+        break;
+    case 0x100:
+        r_info.heartbeat_port = atoi(optarg);
+        break;
+    case 0x200:
+        r_info.heartbeat_period = atoi(optarg);
+        break;
+    case 0x300:
+        libxl_defbool_set(&r_info.output_ack, false);
+        break;
+    case 0x400:
+        r_info.interval_min = atoi(optarg);
+        break;
+    case 0x500:
+        r_info.interval_max = atoi(optarg);
+        break;
+    case 0x600:
+        r_info.max_bandwidth = atoi(optarg);
+        break;
+    case 0x700:
+        r_info.precopy_period = atoi(optarg);
+        break;
+    case 0x800:
+        libxl_defbool_set(&r_info.fast_ipc, true);
+        break;
+    case 0x900:
+        r_info.stats_path = optarg;
+        break;
+    case 0xa00:
+        r_info.disk_port = atoi(optarg);
+        break;
+    case 0xb00:
+        r_info.streams = atoi(optarg);
+        break;
+    case 0xc00:
+        r_info.stream_port = atoi(optarg);
+        break;
+    case 0xd00:
+        history_epochs = atoi(optarg);
+        break;
+    case 0xe00:
+        history_mb = atoi(optarg);
+        break;
+    case 0xf00:
+        rollback = atoi(optarg);
+        break;
+    case 0x1000:
+        r_info.boost = atoi(optarg);
+        break;
     }
 
-    domid = find_domain(argv[optind]);
+    /* A comma separated list of domains is checkpointed as a group. */
+    doms = xstrdup(argv[optind]);
+    for (i = 0; doms[i]; i++)
+        if (doms[i] == ',')
+            nr++;
+    domids = xcalloc(nr, sizeof(*domids));
+    domnames = xcalloc(nr, sizeof(*domnames));
+    send_fds = xcalloc(nr, sizeof(*send_fds));
+    recv_fds = xcalloc(nr, sizeof(*recv_fds));
+    for (i = 0, dom = strtok_r(doms, ",", &saveptr); dom;
+         i++, dom = strtok_r(NULL, ",", &saveptr)) {
+        domids[i] = find_domain(dom);
+        domnames[i] = common_domname;
+        send_fds[i] = recv_fds[i] = -1;
+    }
+    if (i != nr) {
+        fprintf(stderr, "Empty domain name in %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
     host = argv[optind + 1];
 
     /* Defaults */
@@ -696,6 +905,13 @@ int main_remus(int argc, char **argv)
     if (!libxl_defbool_val(r_info.colo) && !r_info.interval)
         r_info.interval = 200;
 
+    if ((r_info.interval_min || r_info.max_bandwidth) &&
+        !r_info.interval_max) {
+        fprintf(stderr, "--interval-min and --max-bandwidth need"
+                " --interval-max\n");
+        exit(-1);
+    }
+
     if (libxl_defbool_val(r_info.userspace_colo_proxy) &&
         !libxl_defbool_val(r_info.colo)) {
         fprintf(stderr, "Option -p must be used in conjunction with -c");
@@ -717,6 +933,69 @@ int main_remus(int argc, char **argv)
         }
     }
 
+    /*
+     * -t is in ms.  By default the checkpoint stream itself is the
+     * heartbeat: the backup fails over once it has been silent for that
+     * long, and the primary fills idle periods with liveness records three
+     * times as often.  A separate UDP heartbeat straight to the backup host
+     * may be added with --heartbeat-port; it needs a real host name rather
+     * than an arbitrary rune.
+     */
+    if (r_info.timeout > 0 && !libxl_defbool_val(r_info.colo) &&
+        !libxl_defbool_val(r_info.blackhole) && ssh_command[0]) {
+        uint64_t timeout_us = (uint64_t)r_info.timeout * 1000, misses;
+
+        r_info.liveness_period = r_info.timeout / 3 ? : 1;
+        xasprintf(&receive_args, " --liveness-timeout %d", r_info.timeout);
+
+        if (r_info.heartbeat_port) {
+            const char *at = strrchr(host, '@');
+            char *args;
+
+            if (r_info.heartbeat_period <= 0)
+                r_info.heartbeat_period = timeout_us / 3 > HEARTBEAT_PERIOD_MAX
+                    ? HEARTBEAT_PERIOD_MAX : timeout_us / 3 ? : 1;
+            misses = (timeout_us + r_info.heartbeat_period - 1) /
+                     r_info.heartbeat_period;
+            if (r_info.heartbeat_period > HEARTBEAT_PERIOD_MAX ||
+                misses > HEARTBEAT_MISSES_MAX) {
+                fprintf(stderr, "Remus: --heartbeat-period must be at most"
+                        " %dus, and -t at most %d periods.\n",
+                        HEARTBEAT_PERIOD_MAX, HEARTBEAT_MISSES_MAX);
+                exit(EXIT_FAILURE);
+            }
+            r_info.heartbeat_host = at ? (char *)at + 1 : host;
+            r_info.heartbeat_nonce = heartbeat_nonce();
+
+            xasprintf(&args, "%s --heartbeat-port %d --heartbeat-period %d"
+                      " --heartbeat-misses %"PRIu64
+                      " --heartbeat-nonce %#"PRIx64, receive_args,
+                      r_info.heartbeat_port, r_info.heartbeat_period,
+                      misses, r_info.heartbeat_nonce);
+            free(receive_args);
+            receive_args = args;
+        }
+    } else {
+        r_info.heartbeat_port = 0;
+    }
+
+    /*
+     * Have the backup acknowledge checkpoints on the back channel, so
+     * that output is only released once it really has them.  We can only
+     * ask for that when we start migrate-receive ourselves.
+     */
+    if (!libxl_defbool_val(r_info.colo) &&
+        !libxl_defbool_val(r_info.blackhole) && ssh_command[0] &&
+        libxl_defbool_is_default(r_info.output_ack)) {
+        char *args;
+
+        libxl_defbool_set(&r_info.output_ack, true);
+        xasprintf(&args, "%s --checkpoint-ack",
+                  receive_args ? receive_args : "");
+        free(receive_args);
+        receive_args = args;
+    }
+
     if (!r_info.netbufscript) {
         if (libxl_defbool_val(r_info.colo))
             r_info.netbufscript = default_colo_proxy_script;
@@ -724,115 +1003,214 @@ int main_remus(int argc, char **argv)
             r_info.netbufscript = default_remus_netbufscript;
     }
 
-    if (libxl_defbool_val(r_info.blackhole)) {
-        send_fd = open("/dev/null", O_RDWR, 0644);
-        if (send_fd < 0) {
-            perror("failed to open /dev/null");
+    if (nr > 1 && !libxl_defbool_val(r_info.output_ack)) {
+        fprintf(stderr, "Checkpointing a group of domains needs the backup's"
+                " acknowledgements, which -b, -c, -s '' and --no-output-ack"
+                " do without.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * Replicate tapdisk's raw images ourselves rather than relying on DRBD.
+     * Like the heartbeat, this needs the backup's real host name, and the
+     * backup's migrate-receive to listen for the writes.
+     */
+    if (r_info.disk_port) {
+        const char *at = strrchr(host, '@');
+        char *args;
+
+        if (libxl_defbool_val(r_info.colo) ||
+            libxl_defbool_val(r_info.blackhole) || !ssh_command[0]) {
+            fprintf(stderr, "--disk-port cannot be used with -b, -c or"
+                    " -s ''.\n");
             exit(EXIT_FAILURE);
         }
-    } else {
-
-        if (!ssh_command[0]) {
-            rune = host;
-        } else {
-            if (!libxl_defbool_val(r_info.colo)) {
-                xasprintf(&rune, "exec %s %s xl migrate-receive %s %s",
-                          ssh_command, host,
-                          "-r",
-                          daemonize ? "" : " -e");
-                xasprintf(&runhb, "exec %s/heartbeat_launcher %s %i", LIBEXEC_BIN, host, r_info.timeout);
-            } else {
-                xasprintf(&rune, "exec %s %s xl migrate-receive %s %s %s %s %s",
-                          ssh_command, host,
-                          "--colo",
-                          r_info.netbufscript ? "--coloft-script" : "",
-                          r_info.netbufscript ? r_info.netbufscript : "",
-                          libxl_defbool_val(r_info.userspace_colo_proxy) ?
-                          "--userspace-colo-proxy" : "",
-                          daemonize ? "" : " -e");
-            }
+        if (nr > 1) {
+            /* every member's migrate-receive would listen on the ports */
+            fprintf(stderr, "--disk-port cannot be used with a group of"
+                    " domains.\n");
+            exit(EXIT_FAILURE);
         }
 
-        save_domain_core_begin(domid, NULL, &config_data, &config_len);
+        r_info.disk_host = at ? (char *)at + 1 : host;
+        xasprintf(&args, "%s --disk-port %d",
+                  receive_args ? receive_args : "", r_info.disk_port);
+        free(receive_args);
+        receive_args = args;
+    }
 
-        hb_child = fork();
-        if (!hb_child) {
+    /*
+     * Spread the memory of each checkpoint over extra connections straight
+     * to the backup host, which its migrate-receive listens for.
+     */
+    if (r_info.streams || r_info.stream_port) {
+        const char *at = strrchr(host, '@');
+        char *args;
 
-            if (system(runhb) != 0) {
-                fprintf(stderr, "Could not initiate heartbeat. Aborting");
-                exit(1);
-            }
-            exit(0);
+        if (r_info.streams <= 0 || r_info.stream_port <= 0) {
+            fprintf(stderr, "--streams and --stream-port go together.\n");
+            exit(EXIT_FAILURE);
         }
-
-        if (!config_len) {
-            fprintf(stderr, "No config file stored for running domain and "
-                    "none supplied - cannot start remus.\n");
+        if (libxl_defbool_val(r_info.colo) ||
+            libxl_defbool_val(r_info.blackhole) || !ssh_command[0]) {
+            fprintf(stderr, "--streams cannot be used with -b, -c or"
+                    " -s ''.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (nr > 1) {
+            /* every member's migrate-receive would listen on the port */
+            fprintf(stderr, "--streams cannot be used with a group of"
+                    " domains.\n");
             exit(EXIT_FAILURE);
         }
 
-        child = create_migration_child(rune, &send_fd, &recv_fd);
+        r_info.stream_host = at ? (char *)at + 1 : host;
+        xasprintf(&args, "%s --streams %d --stream-port %d",
+                  receive_args ? receive_args : "", r_info.streams,
+                  r_info.stream_port);
+        free(receive_args);
+        receive_args = args;
+    }
 
-        migrate_do_preamble(send_fd, recv_fd, child, config_data, config_len,
-                            rune);
+    /*
+     * Have the backup keep earlier checkpoints too, and fail over to one
+     * of them rather than the last.
+     */
+    if (history_epochs || history_mb || rollback) {
+        char *args;
 
-        if (ssh_command[0])
-            free(rune);
-    }
+        if (history_epochs <= 0 || history_mb < 0 || rollback < 0 ||
+            rollback > history_epochs) {
+            fprintf(stderr, "--history=N is needed, with --history-mb and"
+                    " --rollback no more than N.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (libxl_defbool_val(r_info.colo) ||
+            libxl_defbool_val(r_info.blackhole) || !ssh_command[0]) {
+            fprintf(stderr, "--history cannot be used with -b, -c or"
+                    " -s ''.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (nr > 1) {
+            /* the members' backups would go back independently */
+            fprintf(stderr, "--history cannot be used with a group of"
+                    " domains.\n");
+            exit(EXIT_FAILURE);
+        }
 
-    if (common_domname) {
-        xasprintf(&new_domname, "%s--remus-outgoing", common_domname);
+        xasprintf(&args, "%s --history %d --history-mb %d --rollback %d",
+                  receive_args ? receive_args : "", history_epochs,
+                  history_mb, rollback);
+        free(receive_args);
+        receive_args = args;
+    }
 
-        rc = libxl_domain_rename(ctx, domid, NULL, new_domname);
-        if (rc) fprintf(stderr, "renaming domain failed"
-                " (rc=%d)\n", rc);
+    if (nr > 1 && r_info.heartbeat_port) {
+        /* every member's migrate-receive would listen on the port */
+        fprintf(stderr, "--heartbeat-port cannot be used with a group of"
+                " domains.\n");
+        exit(EXIT_FAILURE);
     }
 
+    for (i = 0; i < nr; i++) {
+        if (libxl_defbool_val(r_info.blackhole)) {
+            send_fds[i] = open("/dev/null", O_RDWR, 0644);
+            if (send_fds[i] < 0) {
+                perror("failed to open /dev/null");
+                exit(EXIT_FAILURE);
+            }
+        } else {
+
+            if (!ssh_command[0]) {
+                rune = host;
+            } else {
+                if (!libxl_defbool_val(r_info.colo)) {
+                    xasprintf(&rune, "exec %s %s xl migrate-receive %s %s%s",
+                              ssh_command, host,
+                              "-r",
+                              daemonize ? "" : " -e",
+                              receive_args ? receive_args : "");
+                } else {
+                    xasprintf(&rune, "exec %s %s xl migrate-receive %s %s %s %s %s",
+                              ssh_command, host,
+                              "--colo",
+                              r_info.netbufscript ? "--coloft-script" : "",
+                              r_info.netbufscript ? r_info.netbufscript : "",
+                              libxl_defbool_val(r_info.userspace_colo_proxy) ?
+                              "--userspace-colo-proxy" : "",
+                              daemonize ? "" : " -e");
+                }
+            }
 
-    /* Point of no return */
-    rc = libxl_domain_remus_start(ctx, &r_info, domid, send_fd, recv_fd, 0);
+            save_domain_core_begin(domids[i], NULL, &config_data, &config_len);
 
-    /* check if the domain exists. User may have xl destroyed the
-     * domain to force failover
-     */
-    if (libxl_domain_info(ctx, 0, domid)) {
-        fprintf(stderr, "%s: Primary domain has been destroyed.\n",
-                libxl_defbool_val(r_info.colo) ? "COLO" : "Remus");
-        close(send_fd);
-        return EXIT_SUCCESS;
-    }
+            if (!config_len) {
+                fprintf(stderr, "No config file stored for running domain and "
+                        "none supplied - cannot start remus.\n");
+                exit(EXIT_FAILURE);
+            }
 
-    /* If we are here, it means remus setup/domain suspend/backup has
-     * failed. Try to resume the domain and exit gracefully.
-     * TODO: Split-Brain check.
-     */
-    if (common_domname) {
-        rc = libxl_domain_rename(ctx, domid, NULL, common_domname);
-        if (rc) fprintf(stderr, "renaming domain failed"
-                " (rc=%d)\n", rc);
-    }
+            child = create_migration_child(rune, &send_fds[i], &recv_fds[i]);
 
-    if (rc == ERROR_GUEST_TIMEDOUT)
-        fprintf(stderr, "Failed to suspend domain at primary.\n");
-    else {
-        fprintf(stderr, "%s: Backup failed? resuming domain at primary.\n",
-                libxl_defbool_val(r_info.colo) ? "COLO" : "Remus");
-        libxl_domain_resume(ctx, domid, 1, 0);
-    }
+            migrate_do_preamble(send_fds[i], recv_fds[i], child, config_data,
+                                config_len, rune);
 
-    hb_child_pgid = getpgid(hb_child);
-    if (hb_child == -1) {
-        fprintf(stderr, "Something ist wrong here. Cannot kill child processes\n");
-        close(send_fd);
-        return EXIT_FAILURE;
+            if (ssh_command[0])
+                free(rune);
+        }
+
+        if (domnames[i]) {
+            xasprintf(&new_domname, "%s--remus-outgoing", domnames[i]);
+
+            rc = libxl_domain_rename(ctx, domids[i], NULL, new_domname);
+            if (rc) fprintf(stderr, "renaming domain failed"
+                    " (rc=%d)\n", rc);
+        }
     }
-    if (kill(-hb_child_pgid, SIGTERM)) {
-        fprintf(stderr, "Unable to terminate heartbeat child processes. Killing them.\n");
-        kill(-hb_child_pgid, SIGKILL);
+
+
+    /* Point of no return */
+    if (nr == 1)
+        rc = libxl_domain_remus_start(ctx, &r_info, domids[0], send_fds[0],
+                                      recv_fds[0], 0);
+    else
+        rc = libxl_domain_remus_group_start(ctx, &r_info, domids, send_fds,
+                                            recv_fds, nr, 0);
+
+    for (i = 0; i < nr; i++) {
+        /* check if the domain exists. User may have xl destroyed the
+         * domain to force failover
+         */
+        if (libxl_domain_info(ctx, 0, domids[i])) {
+            fprintf(stderr, "%s: Primary domain has been destroyed.\n",
+                    libxl_defbool_val(r_info.colo) ? "COLO" : "Remus");
+            close(send_fds[i]);
+            continue;
+        }
+        nr_alive++;
+
+        /* If we are here, it means remus setup/domain suspend/backup has
+         * failed. Try to resume the domain and exit gracefully.
+         * TODO: Split-Brain check.
+         */
+        if (domnames[i]) {
+            int rrc = libxl_domain_rename(ctx, domids[i], NULL, domnames[i]);
+            if (rrc) fprintf(stderr, "renaming domain failed"
+                    " (rc=%d)\n", rrc);
+        }
+
+        if (rc == ERROR_GUEST_TIMEDOUT)
+            fprintf(stderr, "Failed to suspend domain at primary.\n");
+        else {
+            fprintf(stderr, "%s: Backup failed? resuming domain at primary.\n",
+                    libxl_defbool_val(r_info.colo) ? "COLO" : "Remus");
+            libxl_domain_resume(ctx, domids[i], 1, 0);
+        }
+
+        close(send_fds[i]);
     }
 
-    close(send_fd);
-    return EXIT_FAILURE;
+    return nr_alive ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 #endif
 
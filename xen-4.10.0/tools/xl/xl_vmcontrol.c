@@ -880,6 +880,19 @@ start:
         params.colo_proxy_script = dom_info->colo_proxy_script;
         libxl_defbool_set(&params.userspace_colo_proxy,
                           dom_info->userspace_colo_proxy);
+        params.heartbeat_port = dom_info->heartbeat_port;
+        params.heartbeat_period = dom_info->heartbeat_period;
+        params.heartbeat_misses = dom_info->heartbeat_misses;
+        params.heartbeat_nonce = dom_info->heartbeat_nonce;
+        params.heartbeat_peer = dom_info->heartbeat_peer;
+        params.liveness_timeout = dom_info->liveness_timeout;
+        libxl_defbool_set(&params.checkpoint_ack, dom_info->checkpoint_ack);
+        params.disk_port = dom_info->disk_port;
+        params.stream_port = dom_info->stream_port;
+        params.streams = dom_info->streams;
+        params.history_epochs = dom_info->history_epochs;
+        params.history_mb = dom_info->history_mb;
+        params.rollback = dom_info->rollback;
 
         ret = libxl_domain_create_restore(ctx, &d_config,
                                           &domid, restore_fd,
@@ -98,6 +98,7 @@ struct fp_vcpu {
     s_time_t period;   /*=(relative deadline)*/
     s_time_t slice;   /*=worst case execution time*/
     s_time_t deadline;  /*=deadline*/
+    s_time_t boost_until;  /* may use the whole period until then */
 
     /*
      * Bookkeeping
@@ -123,6 +124,7 @@ struct fp_dom {
     s_time_t period;
     s_time_t slice;
     s_time_t deadline;
+    s_time_t boost_until;
 };
 
 /*
@@ -231,6 +233,15 @@ __runq_insert (unsigned int cpu, struct fp_vcpu *fpv,
 //    print_queue(runq);
 }
 
+/*
+ * The cpu time a vcpu may use in its current period: its slice, or the
+ * whole period while the domain is boosted (see fp_boost).
+ */
+static inline s_time_t fp_budget (const struct fp_vcpu *fpv, s_time_t now)
+{
+    return now < fpv->boost_until ? fpv->period : fpv->slice;
+}
+
 /* Compare functions for the three scheduling strategies. */
 static int __runq_rm_compare (struct fp_vcpu *left, struct fp_vcpu *right)
 {
@@ -667,6 +678,7 @@ static void *fp_alloc_vdata (const struct scheduler *ops, struct vcpu *vc,
         fpv->period = fp_dom->period;
         fpv->priority = fp_dom->priority;
         fpv->deadline = fp_dom->deadline;
+        fpv->boost_until = fp_dom->boost_until;
     }
     else
     {
@@ -838,6 +850,38 @@ static void fp_vcpu_remove (const struct scheduler *ops, struct vcpu *vc)
     __remove_from_queue (fpv, runq);
 }
 
+/*
+ * Temporarily let a domain use its whole period rather than its slice, for
+ * instance dom0 while it takes a Remus checkpoint of a paused guest.  The
+ * boost is bounded, so it lapses even if nobody ends it.
+ */
+static int fp_boost (struct domain *d, uint32_t boost)
+{
+    struct fp_dom *const fp_dom = FPSCHED_DOM (d);
+    struct vcpu *v;
+    s_time_t until;
+
+    if (boost == XEN_DOMCTL_SCHEDFP_BOOST_END)
+        until = 0;
+    else if (boost <= XEN_DOMCTL_SCHEDFP_BOOST_MAX)
+        until = NOW () + MICROSECS (boost);
+    else
+        return -EINVAL;
+
+    PRINT (1, "in fp_boost, domain %d, boost %u\n", d->domain_id, boost);
+
+    fp_dom->boost_until = until;
+    for_each_vcpu (d, v)
+    {
+        FPSCHED_VCPU (v)->boost_until = until;
+        /* Let a vcpu which ran out of slice have another go at once. */
+        if (until)
+            cpu_raise_softirq (v->processor, SCHEDULE_SOFTIRQ);
+    }
+
+    return 0;
+}
+
 static int
 fp_adjust (const struct scheduler *ops, struct domain *d,
            struct xen_domctl_scheduler_op *op)
@@ -845,9 +889,12 @@ fp_adjust (const struct scheduler *ops, struct domain *d,
     struct fp_dom *const fp_dom = FPSCHED_DOM (d);
     struct vcpu *v;
     struct domain *dom;
-    struct cpupool *c = xzalloc(struct cpupool);
+    struct cpupool *c;
     struct cpupool **q;
 
+    /* Once per checkpoint with Remus: quietly, and leave the rest be. */
+    if (op->cmd == XEN_DOMCTL_SCHEDOP_putinfo && op->u.fp.boost)
+        return fp_boost (d, op->u.fp.boost);
 
     PRINT (1, "in fp_adjust\n");
     PRINT (2, "in fp_adjust, cpupool id: %d, cpupool->n_dom %d\n", d->cpupool->cpupool_id, d->cpupool->n_dom);
@@ -857,6 +904,8 @@ fp_adjust (const struct scheduler *ops, struct domain *d,
         op->u.fp.slice = fp_dom->slice;
         op->u.fp.period = fp_dom->period;
         op->u.fp.deadline = fp_dom->deadline;
+        op->u.fp.boost = fp_dom->boost_until > NOW () ?
+            (fp_dom->boost_until - NOW ()) / MICROSECS (1) : 0;
     }
     else
     {
@@ -973,7 +1022,7 @@ fp_do_schedule (const struct scheduler *ops, s_time_t now,
             const struct fp_vcpu *const iter_fpv = __runq_elem (iter);
 
             if (vcpu_runnable (iter_fpv->vcpu) 
-                && (iter_fpv->cputime < iter_fpv->slice))
+                && (iter_fpv->cputime < fp_budget (iter_fpv, now)))
 
             {
                 snext = __runq_elem (iter);
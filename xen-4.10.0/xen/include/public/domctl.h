@@ -38,7 +38,7 @@
 #include "hvm/save.h"
 #include "memory.h"
 
-#define XEN_DOMCTL_INTERFACE_VERSION 0x0000000e
+#define XEN_DOMCTL_INTERFACE_VERSION 0x0000000f
 
 /*
  * NB. xen_domctl.domain is an IN/OUT parameter for this operation.
@@ -354,6 +354,16 @@ typedef struct xen_domctl_sched_fp {
     uint64_aligned_t period;
     uint64_aligned_t deadline;
     int32_t priority;
+    /*
+     * IN (putinfo): if non-zero, let the domain's vcpus run for their whole
+     * period rather than just their slice for the next boost microseconds,
+     * at most XEN_DOMCTL_SCHEDFP_BOOST_MAX; XEN_DOMCTL_SCHEDFP_BOOST_END
+     * ends a boost early.  The other fields are ignored then.
+     * OUT (getinfo): microseconds of boost left.
+     */
+#define XEN_DOMCTL_SCHEDFP_BOOST_MAX 1000000U
+#define XEN_DOMCTL_SCHEDFP_BOOST_END (~0U)
+    uint32_t boost;
 } xen_domctl_sched_fp_t;
 
 typedef struct xen_domctl_schedparam_vcpu {
@@ -0,0 +1,101 @@
+/******************************************************************************
+ * cpsremus.h
+ *
+ * Guest interface for event-driven CPS-Remus checkpointing.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __XEN_PUBLIC_IO_CPSREMUS_H__
+#define __XEN_PUBLIC_IO_CPSREMUS_H__
+
+/*
+ * Xenstore keys, relative to the guest's home path.
+ *
+ * data/ha-evtchn: an unbound event channel port allocated by the guest
+ *     for the toolstack domain.  The guest notifies it to request a
+ *     checkpoint; the toolstack notifies it back each time a checkpoint
+ *     has been committed at the backup.
+ *
+ * data/ha-page: frame number (MFN for PV guests, GFN for HVM guests) of a
+ *     page holding a struct cpsremus_page, through which the toolstack
+ *     reports checkpoint progress.
+ */
+#define CPSREMUS_EVTCHN_KEY     "data/ha-evtchn"
+#define CPSREMUS_PAGE_KEY       "data/ha-page"
+
+/*
+ * data/ha-skip-page: PFN of a page holding a struct cpsremus_skip, through
+ * which the guest lists memory which need not survive a failover.  Read
+ * when replication starts, so it must be written before then.
+ */
+#define CPSREMUS_SKIP_KEY       "data/ha-skip-page"
+
+/*
+ * Checkpoint progress, written only by the toolstack.  Both counters start
+ * at zero and number checkpoints from 1.
+ *
+ * 'started' is updated while the guest is suspended for a checkpoint, so a
+ * value read by the running guest names a checkpoint which was taken before
+ * the read.  Everything the guest did after reading started == N is
+ * therefore safe on the backup once committed > N.
+ */
+struct cpsremus_page {
+    uint64_t started;   /* last checkpoint taken */
+    uint64_t committed; /* last checkpoint committed at the backup */
+};
+
+/*
+ * PFN ranges which are not replicated, written only by the guest.  The
+ * list in force at each checkpoint applies to that checkpoint: pages in it
+ * are no longer sent, and a range which is dropped from the list is sent
+ * in full with the next checkpoint.
+ *
+ * The ranges must lie within the guest's memory and must not overlap; a
+ * list which breaks this, or has more than CPSREMUS_SKIP_MAX_RANGES
+ * entries, is ignored from then on and all memory replicated again.
+ *
+ * After a failover the listed ranges are zeroed on the backup before the
+ * guest runs, and 'lost' is incremented, so a guest which remembers the
+ * value it saw last can tell that it has to rebuild their contents.
+ */
+struct cpsremus_skip_range {
+    uint64_t pfn;
+    uint64_t count;
+};
+
+#define CPSREMUS_SKIP_MAX_RANGES 255
+
+struct cpsremus_skip {
+    uint32_t nr_ranges; /* valid entries in range[] */
+    uint32_t lost;      /* failovers which zeroed the ranges */
+    struct cpsremus_skip_range range[CPSREMUS_SKIP_MAX_RANGES];
+};
+
+#endif /* __XEN_PUBLIC_IO_CPSREMUS_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */